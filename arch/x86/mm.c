@@ -92,15 +92,158 @@ long guk_pfn_alloc_alloc(pfn_alloc_env_t *env, unsigned long addr) {
 }
 
 
-static void new_pt_frame(unsigned long pt_mfn_for_pfn, unsigned long prev_l_mfn,
-                                unsigned long offset, unsigned long level)
+/* Page table construction is batched. Each new page table frame queues the
+ * entry that maps it read-only, its pin and the entry that links it into its
+ * parent; ordinary entries queue behind the links. A flush zeroes the new
+ * frames a contiguous run at a time, while they are still writable, and then
+ * issues everything as one multicall of (at most) an mmu_update for the
+ * read-only entries, an mmuext_op for the pins and an mmu_update for the rest.
+ * Previously each new frame cost three hypercalls of its own.
+ * The batch lives on the caller's stack, which may be a 16K thread stack (e.g.
+ * growing the grant table), and build_pagetable can nest through the frame
+ * allocator growing memory, so it is kept to about 2.5K rather than made static
+ * under a lock.
+ */
+#define PT_BATCH_FRAMES  8
+#define PT_BATCH_UPDATES 128
+
+struct pt_batch {
+    int nr_frames;
+    int nr_updates;
+    unsigned long frame_pfn[PT_BATCH_FRAMES];
+    mmu_update_t ro[PT_BATCH_FRAMES];
+    struct mmuext_op pin[PT_BATCH_FRAMES];
+    mmu_update_t updates[PT_BATCH_UPDATES];
+    /* the latest frame queued at each level, which its parent does not show yet */
+    struct {
+        unsigned long mfn;
+        unsigned long parent_mfn;
+        unsigned long offset;
+        pgentry_t entry;
+    } pending[L3_FRAME + 1];
+};
+
+static struct pagetable_stats pt_stats;
+
+void guk_pagetable_stats(struct pagetable_stats *stats) {
+    *stats = pt_stats;
+}
+
+static void pt_batch_reset(struct pt_batch *b)
+{
+    int level;
+    b->nr_frames = b->nr_updates = 0;
+    for (level = 0; level <= L3_FRAME; level++) {
+        b->pending[level].mfn = b->pending[level].parent_mfn = ~0UL;
+    }
+}
+
+static void pt_batch_call(multicall_entry_t *call, unsigned long op, void *req, int count)
+{
+    call->op = op;
+    call->args[0] = (unsigned long)req;
+    call->args[1] = count;
+    call->args[2] = 0;
+    call->args[3] = DOMID_SELF;
+}
+
+static void pt_batch_flush(struct pt_batch *b)
+{
+    multicall_entry_t call[3];
+    int i, j, n = 0;
+
+    for (i = 0; i < b->nr_frames; i = j) {
+        for (j = i + 1; j < b->nr_frames && b->frame_pfn[j] == b->frame_pfn[j - 1] + 1; j++)
+            ;
+        memset(pfn_to_virt(b->frame_pfn[i]), 0, (j - i) * PAGE_SIZE);
+    }
+
+    if (b->nr_frames) {
+        pt_batch_call(&call[n++], __HYPERVISOR_mmu_update, b->ro, b->nr_frames);
+        pt_batch_call(&call[n++], __HYPERVISOR_mmuext_op, b->pin, b->nr_frames);
+    }
+    if (b->nr_updates) {
+        pt_batch_call(&call[n++], __HYPERVISOR_mmu_update, b->updates, b->nr_updates);
+    }
+    if (n == 0)
+        return;
+
+    if (HYPERVISOR_multicall(call, n)) {
+        crash_exit_msg("page table multicall failed");
+    }
+    for (i = 0; i < n; i++) {
+        if ((long)call[i].result < 0) {
+            xprintk("ERROR: page table update %d failed (%ld), %d frames, %d updates\n",
+                    i, (long)call[i].result, b->nr_frames, b->nr_updates);
+            crash_exit();
+        }
+    }
+
+    __sync_add_and_fetch(&pt_stats.hypercalls, 1);
+    __sync_add_and_fetch(&pt_stats.frames, b->nr_frames);
+    __sync_add_and_fetch(&pt_stats.updates, b->nr_updates);
+    pt_batch_reset(b);
+}
+
+static void pt_batch_update(struct pt_batch *b, unsigned long ptr, pgentry_t val)
+{
+    if (b->nr_updates == PT_BATCH_UPDATES)
+        pt_batch_flush(b);
+    b->updates[b->nr_updates].ptr = ptr;
+    b->updates[b->nr_updates].val = val;
+    b->nr_updates++;
+}
+
+/* Returns the machine frame of the L1 table that maps va, or 0 if there is none */
+static unsigned long pt_l1_mfn(unsigned long va)
 {
     pgentry_t *tab = (pgentry_t *)start_info.pt_base;
+    pgentry_t page;
+
+#if defined(__x86_64__)
+    page = tab[l4_table_offset(va)];
+    if (!(page & _PAGE_PRESENT))
+        return 0;
+    tab = pte_to_virt(page);
+#endif
+#if defined(__x86_64__) || defined(CONFIG_X86_PAE)
+    page = tab[l3_table_offset(va)];
+    if (!(page & _PAGE_PRESENT))
+        return 0;
+    tab = pte_to_virt(page);
+#endif
+    page = tab[l2_table_offset(va)];
+    if (!(page & _PAGE_PRESENT) || (page & _PAGE_PSE))
+        return 0;
+    return pte_to_mfn(page);
+}
+
+/* Returns entry offset of the table tab, machine frame mfn, in which a missing
+ * entry would be filled by a new frame of the given level. Frames queued in the
+ * batch are taken into account; a queued frame has not been zeroed yet, so all
+ * its entries other than a queued child read as empty.
+ */
+static pgentry_t pt_batch_entry(struct pt_batch *b, pgentry_t *tab, unsigned long mfn,
+                                unsigned long offset, int level)
+{
+    if (b->pending[level].parent_mfn == mfn && b->pending[level].offset == offset)
+        return b->pending[level].entry;
+    if (level < L3_FRAME && b->pending[level + 1].mfn == mfn)
+        return 0;
+    return tab[offset];
+}
+
+/* Queues the new page table frame pt_mfn_for_pfn at the given level, to be linked
+ * at offset in the table prev_l_mfn, and returns the entry that will link it.
+ */
+static pgentry_t pt_batch_frame(struct pt_batch *b, unsigned long pt_mfn_for_pfn,
+                                unsigned long prev_l_mfn, unsigned long offset, int level)
+{
     unsigned long pt_pfn = mfn_to_pfn(pt_mfn_for_pfn);
     unsigned long pt_page = (unsigned long)pfn_to_virt(pt_pfn);
-    unsigned long prot_e, prot_t, pincmd;
-    mmu_update_t mmu_updates[1];
-    struct mmuext_op pin_request;
+    unsigned long prot_e, prot_t, pincmd, l1_mfn;
+    pgentry_t entry;
+    int n;
 
     prot_e = prot_t = pincmd = 0;
     if (trace_mmpt()) {
@@ -108,10 +251,6 @@ static void new_pt_frame(unsigned long pt_mfn_for_pfn, unsigned long prev_l_mfn,
            level, pt_pfn, offset);
     }
 
-    /* We need to clear the page, otherwise we might fail to map it
-       as a page table page. Have to do it now before we make it RO. */
-    memset((unsigned long*)pfn_to_virt(pt_pfn), 0, PAGE_SIZE);
-
     switch ( level )
     {
     case L1_FRAME:
@@ -139,47 +278,43 @@ static void new_pt_frame(unsigned long pt_mfn_for_pfn, unsigned long prev_l_mfn,
          break;
     }
 
-    /* Update the entry */
-#if defined(__x86_64__)
-    tab = pte_to_virt(tab[l4_table_offset(pt_page)]);
-    tab = pte_to_virt(tab[l3_table_offset(pt_page)]);
-#endif
-#if defined(CONFIG_X86_PAE)
-    tab = pte_to_virt(tab[l3_table_offset(pt_page)]);
-#endif
-
-    /* pt_pfn is currently mapped RW in the 1-1 virtual address space. To be used
-       as a page table page, it must be mapped read-only, which is what we do here */
-    mmu_updates[0].ptr = ((pgentry_t)tab[l2_table_offset(pt_page)] & PAGE_MASK) +
-                         sizeof(pgentry_t) * l1_table_offset(pt_page);
-    mmu_updates[0].val = (pgentry_t)pfn_to_mfn(pt_pfn) << PAGE_SHIFT |
-                         (prot_e & ~_PAGE_RW);
-    if(HYPERVISOR_mmu_update(mmu_updates, 1, NULL, DOMID_SELF) < 0)
-    {
-         xprintk("PTE for new page table page could not be updated\n");
-         crash_exit();
-    }
-
-    /* Pin the page to provide correct protection */
-    pin_request.cmd = pincmd;
-    pin_request.arg1.mfn = pfn_to_mfn(pt_pfn);
-    if(HYPERVISOR_mmuext_op(&pin_request, 1, NULL, DOMID_SELF) < 0)
-    {
-        xprintk("ERROR: pinning failed\n");
-        crash_exit();
-    }
-
-    /* Here we actually update the referencing page table entry. */
-    mmu_updates[0].ptr = ((pgentry_t)prev_l_mfn << PAGE_SHIFT) + sizeof(pgentry_t) * offset;
-    mmu_updates[0].val = (pgentry_t)pfn_to_mfn(pt_pfn) << PAGE_SHIFT | prot_t;
-    if(HYPERVISOR_mmu_update(mmu_updates, 1, NULL, DOMID_SELF) < 0)
-    {
-       xprintk("ERROR: mmu_update failed\n");
-       crash_exit();
+    if (b->nr_frames == PT_BATCH_FRAMES || b->nr_updates == PT_BATCH_UPDATES)
+        pt_batch_flush(b);
+
+    /* The frame is mapped RW in the 1-1 virtual address space and, to be used
+       as a page table page, must be mapped read-only. The L1 table mapping it
+       may itself still be queued, in which case flush first. */
+    l1_mfn = pt_l1_mfn(pt_page);
+    if (l1_mfn == 0) {
+        pt_batch_flush(b);
+        l1_mfn = pt_l1_mfn(pt_page);
+        if (l1_mfn == 0) {
+            xprintk("ERROR: new page table page %lx is not mapped\n", pt_page);
+            crash_exit();
+        }
     }
 
-    /* On return the new page table is zero'ed out, from earlier memset when it was still RW */
+    n = b->nr_frames++;
+    b->frame_pfn[n] = pt_pfn;
+    b->ro[n].ptr = ((pgentry_t)l1_mfn << PAGE_SHIFT) +
+                   sizeof(pgentry_t) * l1_table_offset(pt_page);
+    b->ro[n].val = (pgentry_t)pt_mfn_for_pfn << PAGE_SHIFT | (prot_e & ~_PAGE_RW);
 
+    /* Pin the page to provide correct protection */
+    b->pin[n].cmd = pincmd;
+    b->pin[n].arg1.mfn = pt_mfn_for_pfn;
+
+    /* Link it into the referencing page table */
+    entry = (pgentry_t)pt_mfn_for_pfn << PAGE_SHIFT | prot_t;
+    b->updates[b->nr_updates].ptr = ((pgentry_t)prev_l_mfn << PAGE_SHIFT) + sizeof(pgentry_t) * offset;
+    b->updates[b->nr_updates].val = entry;
+    b->nr_updates++;
+
+    b->pending[level].mfn = pt_mfn_for_pfn;
+    b->pending[level].parent_mfn = prev_l_mfn;
+    b->pending[level].offset = offset;
+    b->pending[level].entry = entry;
+    return entry;
 }
 
 /* Build the pagetables for the virtual address range start_address .. end_address-1,
@@ -197,14 +332,15 @@ static void new_pt_frame(unsigned long pt_mfn_for_pfn, unsigned long prev_l_mfn,
 static int build_pagetable_vs(unsigned long start_address, unsigned long end_address,
 		     int page_size, pfn_alloc_env_t *env_pfn, pfn_alloc_env_t *env_npf)
 {
-    mmu_update_t mmu_updates[L1_PAGETABLE_ENTRIES + 1];
+    struct pt_batch batch;
     pgentry_t *tab = (pgentry_t *)start_info.pt_base, page;
     unsigned long mfn;
     unsigned long offset;
-    int count = 0;
+    int result = 1;
 
     if (trace_mmpt()) ttprintk("MM: mapping memory range 0x%lx - 0x%lx\n", start_address, end_address);
 
+    pt_batch_reset(&batch);
     while(start_address < end_address)
     {
         tab = (pgentry_t *)start_info.pt_base;
@@ -212,82 +348,77 @@ static int build_pagetable_vs(unsigned long start_address, unsigned long end_add
 
 #if defined(__x86_64__)
         offset = l4_table_offset(start_address);
-        if(!(tab[offset] & _PAGE_PRESENT)) {
+        page = pt_batch_entry(&batch, tab, mfn, offset, L3_FRAME);
+        if(!(page & _PAGE_PRESENT)) {
 	        /* Need new L3 pt frame */
         	long npf_pfn = env_npf->pfn_alloc(env_npf, start_address);
         	if (npf_pfn < 0) {
-        		return 0;
-        	} else {
-        		new_pt_frame(npf_pfn, mfn, offset, L3_FRAME);
+        		result = 0;
+        		break;
         	}
+        	page = pt_batch_frame(&batch, npf_pfn, mfn, offset, L3_FRAME);
         }
 
-        page = tab[offset];
         mfn = pte_to_mfn(page);
         tab = to_virt(mfn_to_pfn(mfn) << PAGE_SHIFT);
 #endif
 #if defined(__x86_64__) || defined(CONFIG_X86_PAE)
         offset = l3_table_offset(start_address);
-        if(!(tab[offset] & _PAGE_PRESENT)) {
+        page = pt_batch_entry(&batch, tab, mfn, offset, L2_FRAME);
+        if(!(page & _PAGE_PRESENT)) {
             /* Need new L2 pt frame */
         	long npf_pfn = env_npf->pfn_alloc(env_npf, start_address);
         	if (npf_pfn < 0) {
-        		return 0;
-        	} else {
-        		new_pt_frame(npf_pfn, mfn, offset, L2_FRAME);
+        		result = 0;
+        		break;
         	}
+        	page = pt_batch_frame(&batch, npf_pfn, mfn, offset, L2_FRAME);
         }
 
-        page = tab[offset];
         mfn = pte_to_mfn(page);
         tab = to_virt(mfn_to_pfn(mfn) << PAGE_SHIFT);
 #endif
         offset = l2_table_offset(start_address);
 
 	if (page_size == PAGE_SIZE) {
-	  if(!(tab[offset] & _PAGE_PRESENT)) {
+	  page = pt_batch_entry(&batch, tab, mfn, offset, L1_FRAME);
+	  if(!(page & _PAGE_PRESENT)) {
 	      /* Need new L1 pt frame */
       	  long npf_pfn = env_npf->pfn_alloc(env_npf, start_address);
       	  if (npf_pfn < 0) {
-      		  return 0;
-      	  } else {
-      		  new_pt_frame(npf_pfn, mfn, offset, L1_FRAME);
+      		  result = 0;
+      		  break;
       	  }
+      	  page = pt_batch_frame(&batch, npf_pfn, mfn, offset, L1_FRAME);
 	  }
 
-	  page = tab[offset];
 	  mfn = pte_to_mfn(page);
 	  offset = l1_table_offset(start_address);
 	}
 
 	long mfn_for_pfn = env_pfn->pfn_alloc(env_pfn, start_address);
 	if (mfn_for_pfn < 0) {
-		return 0;
+		result = 0;
+		break;
 	}
 
 	if (mfn_for_pfn > 0) {
-	  mmu_updates[count].ptr = ((pgentry_t)mfn << PAGE_SHIFT) + sizeof(pgentry_t) * offset;
+	  unsigned long ptr = ((pgentry_t)mfn << PAGE_SHIFT) + sizeof(pgentry_t) * offset;
 	  if (page_size == PAGE_SIZE) {
-	    mmu_updates[count].val = (pgentry_t)mfn_for_pfn << L1_PAGETABLE_SHIFT | L1_PROT;
+	    pt_batch_update(&batch, ptr, (pgentry_t)mfn_for_pfn << L1_PAGETABLE_SHIFT | L1_PROT);
 	  } else {
-	    mmu_updates[count].val = (pgentry_t)mfn_for_pfn << L2_PAGETABLE_SHIFT | L1_PROT | _PAGE_PSE;
+	    pt_batch_update(&batch, ptr, (pgentry_t)mfn_for_pfn << L2_PAGETABLE_SHIFT | L1_PROT | _PAGE_PSE);
 	  }
-	  count++;
 	}
         start_address += page_size;
-        if (count == L1_PAGETABLE_ENTRIES || start_address == end_address)
-        {
-            if(HYPERVISOR_mmu_update(mmu_updates, count, NULL, DOMID_SELF) < 0)
-            {
-                xprintk("PTE could not be updated\n");
-                crash_exit();
-            }
-            count = 0;
-        }
     }
 
+    /* On allocation failure, what has been queued so far is still applied,
+       as it was when each update was issued immediately. */
+    pt_batch_flush(&batch);
+
     if (trace_mmpt()) ttprintk("MM: page tables setup\n");
-    return 1;
+    return result;
 }
 
 int guk_build_pagetable(unsigned long start_address, unsigned long end_address,
@@ -321,13 +452,14 @@ static void demolish_pagetable_vs(unsigned long start_address, unsigned long end
         start_address += page_size;
 
 	if (i == 1023 || start_address == end_address) {
-	  int ret = HYPERVISOR_multicall(call, i);
+	  int ret = HYPERVISOR_multicall(call, i + 1);
 	  if (ret) {
 	    crash_exit_msg("update_va_mapping hypercall failed");
 	  }
 	  i = 0;
+	} else {
+	  i++;
 	}
-	i++;
     }
 
     if (trace_mmpt()) ttprintk("MM: page tables demolished\n");
@@ -359,13 +491,14 @@ static void write_protect_vs(unsigned long start_address, unsigned long end_addr
         start_address += page_size;
 
 	if (i == 1023 || start_address == end_address) {
-	  int ret = HYPERVISOR_multicall(call, i);
+	  int ret = HYPERVISOR_multicall(call, i + 1);
 	  if (ret) {
 	    crash_exit_msg("update_va_mapping hypercall failed");
 	  }
 	  i = 0;
+	} else {
+	  i++;
 	}
-	i++;
     }
 
     if (trace_mmpt()) ttprintk("MM: page tables demolished\n");
@@ -380,6 +513,65 @@ void guk_write_protect_2mb(unsigned long start_address, unsigned long end_addres
   write_protect_vs(start_address, end_address, PAGE_SIZE * 512);
 }
 
+/* Returns the L2 table that maps va, or NULL if there is none */
+static pgentry_t *l2_table(unsigned long va)
+{
+    pgentry_t *tab = (pgentry_t *)start_info.pt_base;
+#if defined(__x86_64__)
+    if (!(tab[l4_table_offset(va)] & _PAGE_PRESENT))
+        return NULL;
+    tab = pte_to_virt(tab[l4_table_offset(va)]);
+#endif
+#if defined(__x86_64__) || defined(CONFIG_X86_PAE)
+    if (!(tab[l3_table_offset(va)] & _PAGE_PRESENT))
+        return NULL;
+    tab = pte_to_virt(tab[l3_table_offset(va)]);
+#endif
+    return tab;
+}
+
+int arch_map_2mb(unsigned long va, unsigned long mfn, unsigned long *l1_mfn)
+{
+    pgentry_t *tab = l2_table(va);
+    mmu_update_t mmu_update;
+    pgentry_t page;
+
+    if (tab == NULL)
+        return 1;
+    page = tab[l2_table_offset(va)];
+    if (!(page & _PAGE_PRESENT) || (page & _PAGE_PSE))
+        return 1;
+
+    /* The L1 table stays pinned, so it can simply be linked back in later */
+    mmu_update.ptr = ((pgentry_t)pfn_to_mfn(virt_to_pfn(tab)) << PAGE_SHIFT) +
+                     sizeof(pgentry_t) * l2_table_offset(va);
+    mmu_update.val = (pgentry_t)mfn << PAGE_SHIFT | L1_PROT | _PAGE_PSE;
+    if (HYPERVISOR_mmu_update(&mmu_update, 1, NULL, DOMID_SELF) < 0)
+        return -1;
+    *l1_mfn = pte_to_mfn(page);
+    return 0;
+}
+
+void arch_unmap_2mb(unsigned long va, unsigned long l1_mfn)
+{
+    pgentry_t *tab = l2_table(va);
+    mmu_update_t mmu_update;
+    struct mmuext_op flush;
+
+    mmu_update.ptr = ((pgentry_t)pfn_to_mfn(virt_to_pfn(tab)) << PAGE_SHIFT) +
+                     sizeof(pgentry_t) * l2_table_offset(va);
+    mmu_update.val = (pgentry_t)l1_mfn << PAGE_SHIFT | L2_PROT;
+    if (HYPERVISOR_mmu_update(&mmu_update, 1, NULL, DOMID_SELF) < 0) {
+        xprintk("ERROR: restoring L1 table for %lx failed\n", va);
+        crash_exit();
+    }
+    /* no other cpu may keep using the 2MB translation */
+    flush.cmd = MMUEXT_TLB_FLUSH_ALL;
+    if (HYPERVISOR_mmuext_op(&flush, 1, NULL, DOMID_SELF) < 0) {
+        crash_exit_msg("TLB flush failed");
+    }
+}
+
 void arch_init_mm(unsigned long* free_pfn_ptr, unsigned long* max_pfn_ptr)
 {
     unsigned long start_pfn;
@@ -444,8 +636,11 @@ void arch_init_mm(unsigned long* free_pfn_ptr, unsigned long* max_pfn_ptr)
         tprintk("MM: next_pfn %x (%d)\n", *free_pfn_ptr, *free_pfn_ptr);
 }
 
+/* update_va_mapping fails on a 2MB entry, so the single page operations
+   below first split any that covers addr */
 int guk_unmap_page_pfn(unsigned long addr, unsigned long pfn) {
     pte_t val = __pte(pfn_to_mfn(pfn) << PAGE_SHIFT);
+    guk_split_huge_page(PAGE_ALIGN(addr));
     return HYPERVISOR_update_va_mapping(PAGE_ALIGN(addr),
 	    val,
 	    (unsigned long)UVMF_ALL | UVMF_INVLPG);
@@ -457,6 +652,7 @@ int guk_unmap_page(unsigned long addr)
 }
 
 int guk_clear_pte(unsigned long addr) {
+    guk_split_huge_page(PAGE_ALIGN(addr));
     return HYPERVISOR_update_va_mapping(PAGE_ALIGN(addr),
 	    __pte(0),
 	    (unsigned long)UVMF_ALL | UVMF_INVLPG);
@@ -465,6 +661,7 @@ int guk_clear_pte(unsigned long addr) {
 
 int guk_remap_page_pfn(unsigned long addr, unsigned long pfn) {
     pte_t val = __pte( (pfn_to_mfn(pfn) << PAGE_SHIFT) | L1_PROT );
+    guk_split_huge_page(PAGE_ALIGN(addr));
     return HYPERVISOR_update_va_mapping(PAGE_ALIGN(addr),
 	    val,
 	    (unsigned long)UVMF_ALL | UVMF_INVLPG);
@@ -493,6 +690,11 @@ long guk_not11_virt_to_pfn(unsigned long addr, unsigned long *pte_ptr) {
     	xprintk("guk_not11_virt_to_pfn NOT PRESENT addr %lx, level %d, offset %d, pte %lx\n", addr, level, offset, pte);
     	return -1;
     }
+    if (level == 2 && (pte & _PAGE_PSE)) {
+      /* 2MB page, machine contiguous */
+      pfn = mfn_to_pfn(pte_to_mfn(pte) + l1_table_offset(addr));
+      break;
+    }
     pfn = mfn_to_pfn(pte_to_mfn(pte));
     tab = to_virt(pfn << PAGE_SHIFT);
     level--;
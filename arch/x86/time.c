@@ -63,6 +63,7 @@
 #include <guk/trace.h>
 #include <guk/sched.h>
 #include <guk/spinlock.h>
+#include <guk/seqlock.h>
 #include <x86/arch_sched.h>
 
 #include <xen/vcpu.h>
@@ -78,7 +79,7 @@ static u32 shadow_ts_version;
 static u64 suspend_time;
 int suspended = 0;
 s64 time_addend = 0;
-DEFINE_SPINLOCK(wallclock_lock);
+DEFINE_SEQLOCK(wallclock_lock);
 
 #define HANDLE_USEC_OVERFLOW(_tv)          \
     do {                                   \
@@ -147,6 +148,27 @@ static unsigned long get_nsec_offset(void)
 }
 
 
+/* Refresh the fast clock snapshot of cpu from its shadow time. Only ever
+ * called on cpu itself; interrupts are off so that a reader in an interrupt
+ * handler never spins on a half written snapshot. */
+static void update_fast_clock(int cpu)
+{
+    struct shadow_time_info *shadow = &per_cpu(cpu, shadow_time);
+    struct fast_clock *fc = &per_cpu(cpu, fast_clock);
+    unsigned long flags;
+
+    local_irq_save(flags);
+    fc->seq++;
+    wmb();
+    fc->tsc_base = shadow->tsc_timestamp;
+    fc->ns_base  = shadow->system_timestamp + time_addend;
+    fc->mul      = shadow->tsc_to_nsec_mul;
+    fc->shift    = shadow->tsc_shift;
+    wmb();
+    fc->seq++;
+    local_irq_restore(flags);
+}
+
 static void get_time_values_from_xen(void)
 {
     int cpu = smp_processor_id();
@@ -165,6 +187,7 @@ static void get_time_values_from_xen(void)
     while ((src->version & 1) | (shadow->version ^ src->version));
 
     shadow->tsc_to_usec_mul = shadow->tsc_to_nsec_mul / 1000;
+    update_fast_clock(cpu);
 }
 
 /* monotonic_clock(): returns # of nanoseconds passed since time_init()
@@ -193,13 +216,47 @@ u64 guk_monotonic_clock(void)
     return time;
 }
 
+/*
+ * Lock-free NOW(): extrapolates this cpu's fast clock snapshot with the
+ * tsc. It does not look at the Xen shared time info, so it is a few
+ * instructions, and never goes backwards on a cpu.
+ */
+s_time_t guk_fast_now(void)
+{
+    struct fast_clock *fc;
+    u64 tsc, ns;
+    u32 seq;
+
+    preempt_disable();
+    fc = &this_cpu(fast_clock);
+    if (unlikely(fc->mul == 0)) {
+	/* no snapshot on this cpu yet */
+	preempt_enable();
+	return NOW();
+    }
+    do {
+	seq = fc->seq;
+	rmb();
+	rdtscll(tsc);
+	ns = fc->ns_base + scale_delta(tsc - fc->tsc_base, fc->mul, fc->shift);
+	rmb();
+    } while ((seq & 1) || seq != fc->seq);
+    if ((s64)(ns - fc->last) < 0)
+	ns = fc->last;
+    else
+	fc->last = ns;
+    preempt_enable();
+
+    return ns;
+}
+
 static void update_wallclock(void)
 {
     shared_info_t *s = HYPERVISOR_shared_info;
 
-    /* There is no need to use irq save with the spinlock, since this function
+    /* There is no need to use irq save with the seqlock, since this function
      * is only called from VIRQ_TIMER handler */
-    spin_lock(&wallclock_lock);
+    write_seqlock(&wallclock_lock);
     /* This should only be called from IRQ handler. However, there is an initial
      * call during initialisation, before interrupts are enabled. */
     BUG_ON(!in_irq() && smp_init_completed && !suspended);
@@ -211,32 +268,55 @@ static void update_wallclock(void)
 	rmb();
     }
     while ((s->wc_version & 1) | (shadow_ts_version ^ s->wc_version));
-    spin_unlock(&wallclock_lock);
+    write_sequnlock(&wallclock_lock);
 }
 
 void guk_gettimeofday(struct timeval *tv)
 {
     u64 nsec;
-    unsigned long flags;
-
-    /* IRQs need to be switched off to avoid races with timer interrupt */
-    spin_lock_irqsave(&wallclock_lock, flags);
-    nsec = monotonic_clock();
-    nsec += shadow_ts.ts_nsec;
+    unsigned long sec;
+    unsigned int seq;
 
-    BUG_ON(shadow_ts_version == 0);
-    tv->tv_sec = shadow_ts.ts_sec;
+    /* Lock-free read; retried if the timer interrupt updated the wallclock
+     * concurrently */
+    do {
+	seq = read_seqbegin(&wallclock_lock);
+	BUG_ON(shadow_ts_version == 0);
+	sec = shadow_ts.ts_sec;
+	nsec = shadow_ts.ts_nsec;
+    } while (read_seqretry(&wallclock_lock, seq));
+    nsec += monotonic_clock();
+
+    tv->tv_sec = sec;
     tv->tv_sec += NSEC_TO_SEC(nsec);
     tv->tv_usec = NSEC_TO_USEC(nsec % 1000000000UL);
-    spin_unlock_irqrestore(&wallclock_lock, flags);
 }
 
+/*
+ * Timer interrupts are never programmed closer than timer_min_delta.
+ * That is 1ms, unless high resolution timers are enabled with
+ * -XX:GUKHRT[=<min delta in us>].
+ */
+#define HRT_OPTION "-XX:GUKHRT"
+#define HRT_DEFAULT_MIN_DELTA MICROSECS(20)
+static s_time_t timer_min_delta = MILLISECS(1);
+
+/*
+ * Program this cpu's one timer for delta ns from now, or for the next
+ * sleeper of this cpu if that is due earlier.
+ */
 void set_timer_interrupt(u64 delta)
 {
+    s_time_t now = NOW();
+    s_time_t deadline = now + delta;
+    s_time_t sleeper = blocking_time(smp_processor_id());
+
+    if (sleeper < deadline)
+        deadline = sleeper;
     /* Don't allow the delta to be too small */
-    if(delta < MILLISECS(1))
-        delta = MILLISECS(1);
-    BUG_ON(HYPERVISOR_set_timer_op(monotonic_clock() + delta));
+    if (deadline < now + timer_min_delta)
+        deadline = now + timer_min_delta;
+    BUG_ON(HYPERVISOR_set_timer_op(deadline - time_addend));
 }
 
 
@@ -282,7 +362,9 @@ void check_need_resched(void)
             return;
         }
         running_time = get_running_time();
-        if (running_time >= resched_time) {
+        /* also reschedule if a sleeper is due, the scheduler wakes it */
+        if (running_time >= resched_time ||
+            blocking_time(smp_processor_id()) < 0) {
 	    set_need_resched(current_thread);
         }
         else
@@ -307,9 +389,18 @@ void timer_handler(evtchn_port_t ev, void *ign)
     check_need_resched();
 }
 
-void init_time(void)
+extern int num_option(char *cmd_line, char *option);
+void init_time(char *cmd_line)
 {
+    int hrt_us;
+
     if (trace_startup()) tprintk("Initialising timer interface\n");
+    if (strstr(cmd_line, HRT_OPTION) != NULL) {
+	hrt_us = num_option(cmd_line, HRT_OPTION);
+	timer_min_delta = hrt_us > 0 ? MICROSECS(hrt_us) : HRT_DEFAULT_MIN_DELTA;
+	if (trace_startup()) tprintk("High resolution timers, min delta %ld ns\n",
+				    timer_min_delta);
+    }
     memset(&shadow_ts, 0, sizeof(struct timespec));
     time_addend = 0;
     shadow_ts_version = 0;
@@ -335,6 +426,7 @@ void time_resume(void)
     if (delta < 0) {
       time_addend -= delta;
       if (trace_startup()) tprintk("time_addend changed to %ld\n", time_addend);
+      update_fast_clock(smp_processor_id());
     }
     --suspended;
 }
@@ -238,6 +238,8 @@ static int blk_get_evtchn(struct blk_dev *dev)
 
     dev->local_port = bind_evtchn(op.port, ANY_CPU, __blk_front_handler, dev);
     dev->evtchn = op.port;
+    /* the handler drains the whole ring */
+    evtchn_set_batch(op.port, 1);
 
     return 0;
 }
@@ -371,72 +373,79 @@ int guk_blk_get_sectors(int device)
     return blk_devices[device].device.sectors;
 }
 
+/* warn every DEVICE_READY_WARN seconds while waiting for a device */
+#define DEVICE_READY_WARN 10
+
 /* returns with device lock held */
 static inline long wait_for_device_ready(struct blk_dev *dev)
 {
     long flags;
+    s_time_t start = NOW();
     spin_lock_irqsave(&dev->lock, flags);
     while (dev->state != ST_READY) {
 	spin_unlock_irqrestore(&dev->lock, flags);
-	wait_for_completion(&ready_completion);
+	if (!wait_for_completion_timeout(&ready_completion, SECONDS(DEVICE_READY_WARN)))
+	    printk("blk_front: device %d not ready after %ld ms\n",
+		   dev->device.id, (NOW() - start) / 1000000);
 	spin_lock_irqsave(&dev->lock, flags);
     }
     return flags;
 }
 
 /*
- * submit an async request
+ * I/O statistics; bytes that went directly from/to the caller's pages
+ * and bytes that had to be copied through a bounce buffer
  */
-int guk_blk_do_io(struct blk_request *io_req)
+static struct blk_stats stats;
+
+void guk_blk_get_stats(struct blk_stats *s)
+{
+    *s = stats;
+}
+
+/*
+ * put a request on the ring without notifying the backend, granting its
+ * pages with refs, taken beforehand as the device lock is held with
+ * interrupts off; on failure the refs are not used
+ */
+static int blk_queue_request(struct blk_dev *dev, struct blk_request *io_req,
+	grant_ref_t *refs)
 {
     struct blkif_request *xen_req;
     struct blk_shadow *shadow;
-    int notify;
     int id;
-    int err = 0;
+    int i;
     RING_IDX prod;
-    struct blk_dev *dev;
 
     BUG_ON(io_req->state != BLK_EMPTY);
-    BUG_ON(io_req->device >= MAX_DEVICES);
-
-    dev = &blk_devices[io_req->device];
     BUG_ON(dev->state != ST_READY);
+    BUG_ON(io_req->num_pages < 1 || io_req->num_pages > MAX_PAGES_PER_REQUEST);
     BUG_ON((io_req->address >> SECTOR_BITS) + io_req->end_sector > dev->device.sectors);
 
-    prod = dev->ring.req_prod_pvt;
-    xen_req = RING_GET_REQUEST(&dev->ring, prod);
-
     id = get_freelist_id();
     if (!id) {
 	DEBUG("run out of IO requests\n");
-	err = ENOMEM;
-	goto out;
+	return ENOMEM;
     }
+
+    prod = dev->ring.req_prod_pvt;
+    xen_req = RING_GET_REQUEST(&dev->ring, prod);
+
     shadow = &shadows[id];
     shadow->request = io_req;
     xen_req->id = id;
 
-    /* data to write/read */
-    /* first segment */
-    xen_req->seg[0].gref = gnttab_grant_access(0, virt_to_mfn(io_req->pages[0]), 0);
-    shadow->gref[0] = xen_req->seg[0].gref;
-    xen_req->seg[0].first_sect = io_req->start_sector;
-    if (io_req->num_pages == 1) /* only one segment; first and last segment at once */
-	xen_req->seg[0].last_sect = io_req->end_sector;
-    else {
-	int i;
-	xen_req->seg[0].last_sect = SECTORS_PER_PAGE - 1;
-	/* the middle segments */
-	for(i = 1; i < io_req->num_pages; ++i) {
-	    xen_req->seg[i].gref = gnttab_grant_access(0, virt_to_mfn(io_req->pages[i]), 0);;
-	    shadow->gref[i] = xen_req->seg[i].gref;
-	    xen_req->seg[i].first_sect = 0;
-	    xen_req->seg[i].last_sect = SECTORS_PER_PAGE - 1;
-	}
-	/* last segment */
-	xen_req->seg[i].last_sect = io_req->end_sector;
+    /* data to write/read; the first segment may start and the last
+     * segment may end in the middle of a page */
+    for (i = 0; i < io_req->num_pages; ++i) {
+	gnttab_grant_access_ref(refs[i], 0, virt_to_mfn(io_req->pages[i]), 0);
+	xen_req->seg[i].gref = refs[i];
+	shadow->gref[i] = xen_req->seg[i].gref;
+	xen_req->seg[i].first_sect = 0;
+	xen_req->seg[i].last_sect = SECTORS_PER_PAGE - 1;
     }
+    xen_req->seg[0].first_sect = io_req->start_sector;
+    xen_req->seg[io_req->num_pages - 1].last_sect = io_req->end_sector;
 
     shadow->num_refs = io_req->num_pages;
     xen_req->nr_segments = io_req->num_pages;
@@ -446,29 +455,176 @@ int guk_blk_do_io(struct blk_request *io_req)
     xen_req->handle = 0x12;/* FIXME: what is the correct handle? */
     xen_req->operation = io_req->operation; /* read or write */
     io_req->state = BLK_SUBMITTED;
-    notify = 0;
     dev->ring.req_prod_pvt = prod + 1;
 
+    return 0;
+}
+
+/*
+ * make queued requests visible to the backend and notify it if necessary;
+ * called with the device lock held
+ */
+static void blk_push_requests(struct blk_dev *dev)
+{
+    int notify;
+
     wmb();
     RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&dev->ring, notify);
     if (notify) {
 	notify_remote_via_evtchn(dev->evtchn);
     }
-out:
+}
+
+/*
+ * submit an async request
+ */
+int guk_blk_do_io(struct blk_request *io_req)
+{
+    struct blk_dev *dev;
+    grant_ref_t refs[MAX_PAGES_PER_REQUEST];
+    int err;
+
+    BUG_ON(io_req->device >= MAX_DEVICES);
+
+    dev = &blk_devices[io_req->device];
+    gnttab_alloc_refs(refs, io_req->num_pages);
+    err = blk_queue_request(dev, io_req, refs);
+    if (!err)
+	blk_push_requests(dev);
+    else
+	gnttab_free_refs(refs, io_req->num_pages);
     return err;
 }
 
-static void complete_callback(struct blk_request *req)
+/*
+ * I/O buffers: page aligned and 1-1 mapped, so they can be granted to the
+ * backend as they are and never need a bounce buffer
+ */
+void *guk_blk_alloc_buf(int size)
 {
-    struct completion *comp = (struct completion *)req->callback_data;
-    complete(comp);
+    return (void *)allocate_pages(PFN_UP(size), DATA_VM);
+}
 
+void guk_blk_free_buf(void *buf, int size)
+{
+    deallocate_pages(buf, PFN_UP(size), DATA_VM);
 }
 
-static inline void set_default_callback(struct blk_request *req, struct completion *comp)
+/*
+ * a vector request is split into ring requests of at most
+ * MAX_PAGES_PER_REQUEST pages; up to MAX_BATCH_REQUESTS of those are
+ * pushed to the backend with a single notification
+ */
+#define MAX_BATCH_REQUESTS 8
+
+struct blk_batch {
+    struct blk_request reqs[MAX_BATCH_REQUESTS];
+    int pending; /* outstanding requests; updated with the device lock held */
+    int errors;
+    struct completion comp;
+};
+
+static void batch_callback(struct blk_request *req)
+{
+    struct blk_batch *batch = (struct blk_batch *)req->callback_data;
+
+    if (req->state != BLK_DONE_SUCCESS)
+	batch->errors++;
+    /* the handler holds the device lock, so pending needs no atomics */
+    if (--batch->pending == 0)
+	complete(&batch->comp);
+}
+
+/*
+ * read or write size bytes at address; page i of the transfer is pages[i],
+ * or base + i * PAGE_SIZE if pages is NULL; all pages must be page aligned.
+ * Blocks the caller until the transfer is done.
+ */
+static int blk_io_vec(int device, long address, void **pages, uint8_t *base,
+	int size, int operation)
+{
+    struct blk_batch batch;
+    struct blk_dev *dev;
+    struct blk_request *req;
+    grant_ref_t refs[MAX_BATCH_REQUESTS * MAX_PAGES_PER_REQUEST];
+    int num_pages, page, n, i, j, nr_refs, used;
+    long flags;
+
+    BUG_ON(device >= MAX_DEVICES);
+    BUG_ON(address & (SECTOR_SIZE-1));
+    BUG_ON(size <= 0 || (size & (SECTOR_SIZE - 1)));
+
+    dev = &blk_devices[device];
+    num_pages = PFN_UP(size);
+    batch.errors = 0;
+
+    for (page = 0; page < num_pages; ) {
+	init_completion(&batch.comp);
+	batch.pending = 0;
+
+	/* granting happens with the device lock held, so take the refs now */
+	nr_refs = num_pages - page;
+	if (nr_refs > MAX_BATCH_REQUESTS * MAX_PAGES_PER_REQUEST)
+	    nr_refs = MAX_BATCH_REQUESTS * MAX_PAGES_PER_REQUEST;
+	gnttab_alloc_refs(refs, nr_refs);
+	used = 0;
+
+	/* on return keep the lock of the device */
+	flags = wait_for_device_ready(dev);
+
+	for (i = 0; i < MAX_BATCH_REQUESTS && page < num_pages; ++i) {
+	    req = &batch.reqs[i];
+	    n = num_pages - page;
+	    if (n > MAX_PAGES_PER_REQUEST)
+		n = MAX_PAGES_PER_REQUEST;
+	    for (j = 0; j < n; ++j) {
+		req->pages[j] = pages ? pages[page + j] : base + (page + j) * PAGE_SIZE;
+		BUG_ON((unsigned long)req->pages[j] & (PAGE_SIZE - 1));
+	    }
+	    req->num_pages = n;
+	    req->start_sector = 0;
+	    if (page + n == num_pages && (size & (PAGE_SIZE - 1)))
+		req->end_sector = ((size & (PAGE_SIZE - 1)) >> SECTOR_BITS) - 1;
+	    else
+		req->end_sector = SECTORS_PER_PAGE - 1;
+	    req->device = device;
+	    req->address = address + (long)page * PAGE_SIZE;
+	    req->state = BLK_EMPTY;
+	    req->operation = operation;
+	    req->callback = batch_callback;
+	    req->callback_data = (unsigned long)&batch;
+
+	    if (blk_queue_request(dev, req, refs + used))
+		break;
+	    used += n;
+	    batch.pending++;
+	    page += n;
+	}
+
+	if (batch.pending == 0) {
+	    /* no request slot at all, nothing we can wait for */
+	    spin_unlock_irqrestore(&dev->lock, flags);
+	    gnttab_free_refs(refs, nr_refs);
+	    return -1;
+	}
+	blk_push_requests(dev);
+	spin_unlock_irqrestore(&dev->lock, flags);
+	gnttab_free_refs(refs + used, nr_refs - used);
+	wait_for_completion(&batch.comp);
+    }
+
+    if (batch.errors)
+	return -1;
+    if (operation == BLK_REQ_READ)
+	stats.read_requests++;
+    else
+	stats.write_requests++;
+    return size >> SECTOR_BITS;
+}
+
+static inline int is_aligned_buf(void *buf)
 {
-    req->callback = complete_callback;
-    req->callback_data = (unsigned long)comp;
+    return ((unsigned long)buf & (PAGE_SIZE - 1)) == 0;
 }
 
 /*
@@ -479,63 +635,21 @@ int guk_blk_write(int device, long address, void *buf, int size)
 {
     uint8_t *pages;
     int sectors;
-    int free_buf, order;
-    struct blk_request req;
-    struct completion comp;
-    int i;
 
-    BUG_ON(address & (SECTOR_SIZE-1));
-    BUG_ON(size & (SECTOR_SIZE - 1));
-
-    sectors = size >> SECTOR_BITS;
-    if (((unsigned long)buf & (PAGE_SIZE - 1)) 
-	    || ((unsigned long)size & (SECTOR_SIZE -1)) ) {
-	DEBUG("buffer not page aligned! buffer does not end at a sector boundary\n");
-	order = get_order(size);
-	pages = (uint8_t *)alloc_pages(order);
-	memcpy(pages, buf, size);
-	free_buf = 1;
-    } else {
-	pages = buf;
-	free_buf = order = 0;
-    }
-
-    i = 0;
-    while (size > PAGE_SIZE) {
-	req.pages[i] = pages + i*PAGE_SIZE;
-	size -= PAGE_SIZE;
-	++i;
-    }
-    req.pages[i] = pages + i*PAGE_SIZE;
-    req.num_pages = i+1;
-    req.start_sector = 0;
-    req.end_sector = (size >> SECTOR_BITS) - 1;
-    req.device = device;
-    req.address = address;
-    req.state = BLK_EMPTY;
-    req.operation = BLK_REQ_WRITE;
-
-    /* on return keep the lock of the device */
-    long flags = wait_for_device_ready(&blk_devices[device]);
-
-    init_completion(&comp);
-    set_default_callback(&req, &comp);
-
-    if (blk_do_io(&req)) {
-	sectors = -1;
-	spin_unlock_irqrestore(&blk_devices[device].lock, flags);
-    } else {
-	spin_unlock_irqrestore(&blk_devices[device].lock, flags);
-	wait_for_completion(&comp);
+    if (is_aligned_buf(buf)) {
+	stats.direct_bytes += size;
+	return blk_io_vec(device, address, NULL, buf, size, BLK_REQ_WRITE);
     }
 
-    if(free_buf)
-	free_pages(pages, order);
-
-    if (req.state == BLK_DONE_SUCCESS)
-	return sectors;
-    else
+    DEBUG("buffer not page aligned!\n");
+    pages = guk_blk_alloc_buf(size);
+    if (pages == NULL)
 	return -1;
+    memcpy(pages, buf, size);
+    stats.bounced_bytes += size;
+    sectors = blk_io_vec(device, address, NULL, pages, size, BLK_REQ_WRITE);
+    guk_blk_free_buf(pages, size);
+    return sectors;
 }
 
 /*
@@ -546,61 +660,40 @@ int guk_blk_read(int device, long address, void *buf, int size)
 {
     uint8_t *pages;
     int sectors;
-    int free_buf, order;
-    struct blk_request req;
-    struct completion comp;
-    int i;
 
-    BUG_ON(address & (SECTOR_SIZE-1));
-    BUG_ON(size & (SECTOR_SIZE - 1));
-
-    sectors = size >> SECTOR_BITS;
-    if (((unsigned long)buf & (PAGE_SIZE - 1))
-	    | ((unsigned long)size & (SECTOR_SIZE -1)) ) {
-	DEBUG("buffer not page aligned! buffer does not end at a sector boundary\n");
-	order = get_order(size);
-	pages = (uint8_t *)alloc_pages(order);
-	free_buf = 1;
-    } else {
-	pages = buf;
-	free_buf = order = 0;
+    if (is_aligned_buf(buf)) {
+	stats.direct_bytes += size;
+	return blk_io_vec(device, address, NULL, buf, size, BLK_REQ_READ);
     }
 
-    i = 0;
-    while (size > PAGE_SIZE) {
-	req.pages[i] = pages + i*PAGE_SIZE;
-	size -= PAGE_SIZE;
-	++i;
-    }
-    req.pages[i] = pages + i*PAGE_SIZE;
-    req.num_pages = i+1;
-    req.start_sector = 0;
-    req.end_sector = (size >> SECTOR_BITS) - 1;
-    req.device = device;
-    req.address = address;
-    req.state = BLK_EMPTY;
-    req.operation = BLK_REQ_READ;
-
-    long flags = wait_for_device_ready(&blk_devices[device]);
-    init_completion(&comp);
-    set_default_callback(&req, &comp);
-
-    if (blk_do_io(&req)) {
-	spin_unlock_irqrestore(&blk_devices[device].lock, flags);
+    DEBUG("buffer not page aligned!\n");
+    pages = guk_blk_alloc_buf(size);
+    if (pages == NULL)
 	return -1;
-    } else {
-	spin_unlock_irqrestore(&blk_devices[device].lock, flags);
-	wait_for_completion(&comp);
-    }
-    if (free_buf) {
+    sectors = blk_io_vec(device, address, NULL, pages, size, BLK_REQ_READ);
+    if (sectors > 0) {
 	memcpy(buf, pages, size);
-	free_pages(pages, order);
+	stats.bounced_bytes += size;
     }
+    guk_blk_free_buf(pages, size);
+    return sectors;
+}
 
-    if (req.state == BLK_DONE_SUCCESS)
-	return sectors;
-    else
-	return -1;
+/*
+ * scatter-gather interface; pages is a vector of page aligned buffers
+ * that together hold size bytes. The pages are granted to the backend
+ * directly, nothing is copied.
+ */
+int guk_blk_write_pages(int device, long address, void **pages, int size)
+{
+    stats.direct_bytes += size;
+    return blk_io_vec(device, address, pages, NULL, size, BLK_REQ_WRITE);
+}
+
+int guk_blk_read_pages(int device, long address, void **pages, int size)
+{
+    stats.direct_bytes += size;
+    return blk_io_vec(device, address, pages, NULL, size, BLK_REQ_READ);
 }
 
 static int blk_shutdown(void)
@@ -650,8 +743,8 @@ again:
     num_devices = blk_explore(&devices);
     if(num_devices < 0) {
 	char *msg;
-	msg = xenbus_read_watch("blk_xenbus");
-	free(msg);
+	msg = xenbus_get_watch_event("blk_xenbus", -1);
+	xenbus_put_watch_event(msg);
 	DEBUG("blk_front no block devices found\n");
 	complete_all(&ready_completion);
 	goto again;
@@ -672,6 +765,9 @@ again:
 	    free(err);
 	    continue;
 	}
+	err = xenbus_cache_subtree(blk_devices[i].backend);
+	if (err)
+	    free(err);
 
 	snprintf(xenbus_path, MAX_PATH, "%s/%s", DEVICE_STRING, devices[i]);
 
@@ -802,6 +898,8 @@ static int blk_resume(void)
 	if (err) {
 	    printk("%s %d ERROR reading xenbus: %s\n", __FILE__, __LINE__, err);
 	    free(err);
+	} else if ((err = xenbus_cache_subtree(dev->backend)) != NULL) {
+	    free(err);
 	}
 
 	if (blk_init_ring(dev->ring.sring, dev)) {
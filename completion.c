@@ -66,6 +66,55 @@ void guk_wait_for_completion(struct completion *comp)
     spin_unlock_irqrestore(&comp->wait.lock, flags);
 }
 
+/*
+ * block current thread until comp is posted or timeout ns have passed;
+ * returns 0 on timeout, else the time left (at least 1)
+ */
+s_time_t guk_wait_for_completion_timeout(struct completion *comp, s_time_t timeout)
+{
+    unsigned long flags;
+    s_time_t deadline = NOW() + timeout, left;
+    DEFINE_SLEEP_QUEUE(sq);
+
+    spin_lock_irqsave(&comp->wait.lock, flags);
+    rmb();
+    if(!comp->done) {
+	DEFINE_WAIT(wait);
+	int armed = 0;
+	add_wait_queue(&comp->wait, &wait);
+	for (;;) {
+	    block(current);
+	    /* the timer is armed and checked after blocking, so that its
+	     * wake up cannot be lost */
+	    if (!armed) {
+		sq.wakeup_time = deadline;
+		guk_sleep_queue_add(&sq);
+		armed = 1;
+	    } else if (is_expired(&sq)) {
+		wake(current);
+		break;
+	    }
+	    spin_unlock_irqrestore(&comp->wait.lock, flags);
+	    schedule();
+	    spin_lock_irqsave(&comp->wait.lock, flags);
+	    rmb();
+	    if (comp->done)
+		break;
+	}
+	remove_wait_queue(&wait);
+	guk_sleep_queue_del(&sq);
+	if (!comp->done) {
+	    spin_unlock_irqrestore(&comp->wait.lock, flags);
+	    return 0;
+	}
+    }
+    comp->done--;
+    spin_unlock_irqrestore(&comp->wait.lock, flags);
+
+    left = deadline - NOW();
+    return left > 0 ? left : 1;
+}
+
 /*
  * post completion comp; release all threads waiting on comp
  */
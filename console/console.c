@@ -65,12 +65,17 @@
 #include <guk/blk_front.h>
 #include <guk/sched.h>
 #include <guk/arch_sched.h>
+#include <guk/smp.h>
+#include <guk/init.h>
+#include <guk/xmalloc.h>
 
 #include <xen/io/console.h>
 
 #include <lib.h>
 #include <types.h>
 
+extern int num_option(char *cmd_line, char *option);
+
 /* Low level functions defined in xencons_ring.c */
 extern int xencons_ring_init(void);
 extern int xencons_ring_send(const char *data, unsigned len);
@@ -89,6 +94,60 @@ static DEFINE_SPINLOCK(xencons_lock);
 static char *init_overflow =
     "[BUG: too much printout before console is initialised!]\r\n";
 
+/*
+ * Asynchronous logging, enabled with -XX:GUKACON=<policy>.  printk
+ * formats into a record reserved with cmpxchg in a buffer of the current
+ * CPU, so that no lock is taken and interrupts stay enabled.  Records
+ * are committed by setting a flag in their header and are taken out in
+ * order by the console_flusher thread, which converts \n to \r\n and
+ * writes them to the console ring in batches, notifying the daemon once
+ * per batch.  Each record carries a global sequence number taken when it
+ * is reserved, and the flusher merges the buffers on it, so messages
+ * come out in the order they were started, also for a thread that moved
+ * to another CPU.  When a buffer is full, CONSOLE_DROP (0) drops the message
+ * and counts it, CONSOLE_BLOCK (1) waits for the flusher, unless called
+ * in interrupt context or with interrupts or preemption disabled.  Until
+ * the flusher runs output is written directly, and on exit, crash and
+ * suspend the buffers are flushed from the caller.
+ */
+#define ASYNC_CONSOLE_OPTION "-XX:GUKACON"
+#define CONSOLE_DROP         0
+#define CONSOLE_BLOCK        1
+
+#define CONSOLE_BUF_ORDER    2
+#define CONSOLE_BUF_SIZE     (PAGE_SIZE << CONSOLE_BUF_ORDER)
+#define CONSOLE_LINE_MAX     1024   /* longest message, as the sync path */
+#define CONSOLE_BATCH        2048
+/* the flusher looks again after this long, for wakeups it had to miss */
+#define CONSOLE_IDLE_WAIT    MILLISECS(100)
+
+#define REC_LEN_MASK         0xffff
+#define REC_COMMIT           (1 << 16)
+#define REC_PAD              (1 << 17)
+/* header, sequence number, text and room for vsnprintf's NUL, rounded
+   for the next header */
+#define REC_SIZE(_len)       (((_len) + 8 + 1 + 3) & ~3)
+#define REC_TEXT(_rec)       ((char *)((_rec) + 2))
+
+struct console_buf
+{
+    u32 head;                       /* reserved up to */
+    u32 tail;                       /* consumed up to */
+    unsigned long dropped;
+    char *data;
+};
+
+static struct console_buf *console_bufs[MAX_VIRT_CPUS];
+static int console_async = 0;
+static int console_policy = CONSOLE_DROP;
+static struct thread *console_flusher;
+static volatile int console_flusher_idle = 0;
+static u32 console_seq;
+static DECLARE_WAIT_QUEUE_HEAD(console_space_wq);
+static int console_draining = 0;        /* one drainer at a time */
+static struct console_stats console_stats;
+static unsigned long console_dropped_reported;
+
 /* We really don't want to lost any console output, so we busy wait
    if the ring is full. No doubt we could, with more effort, arrange to
    wait for an event indicating that the ring had space, but does it matter?
@@ -158,10 +217,319 @@ static void console_print(char *data, int length)
 
 }
 
+static struct console_buf *this_console_buf(void)
+{
+    struct console_buf *b = console_bufs[smp_processor_id()];
+
+    /* CPUs that came up after the buffers were allocated share CPU 0's */
+    return b != NULL ? b : console_bufs[0];
+}
+
+static int console_fits(struct console_buf *b, u32 need)
+{
+    u32 head = b->head, off = head & (CONSOLE_BUF_SIZE - 1);
+    u32 pad = off + need > CONSOLE_BUF_SIZE ? CONSOLE_BUF_SIZE - off : 0;
+
+    return head + pad + need - b->tail <= CONSOLE_BUF_SIZE;
+}
+
+/* Reserves a record for len bytes, returns a pointer to its header or
+   NULL if the message was dropped. */
+static u32 *console_reserve(struct console_buf *b, int len)
+{
+    u32 head, off, pad, need = REC_SIZE(len);
+
+    for (;;) {
+        head = b->head;
+        rmb();
+        off = head & (CONSOLE_BUF_SIZE - 1);
+        pad = off + need > CONSOLE_BUF_SIZE ? CONSOLE_BUF_SIZE - off : 0;
+        if (head + pad + need - b->tail > CONSOLE_BUF_SIZE) {
+            if (console_policy == CONSOLE_BLOCK && !in_irq() && !irqs_disabled()
+                && current->preempt_count == 0 && current != console_flusher) {
+                wait_event(console_space_wq, console_fits(b, need));
+                continue;
+            }
+            __sync_fetch_and_add(&b->dropped, 1);
+            return NULL;
+        }
+        if (cmpxchg(&b->head, head, head + pad + need) == head)
+            break;
+    }
+    if (pad) {
+        wmb();
+        *(volatile u32 *)(b->data + off) = pad | REC_PAD | REC_COMMIT;
+        off = 0;
+    }
+    ((u32 *)(b->data + off))[1] = __sync_fetch_and_add(&console_seq, 1);
+    return (u32 *)(b->data + off);
+}
+
+static void console_commit(u32 *rec, int len)
+{
+    wmb();
+    *(volatile u32 *)rec = len | REC_COMMIT;
+    mb();
+    /* wake takes the run queue lock, which is always held with interrupts
+       off, e.g. by the run queue dump while it prints; with interrupts off
+       leave the record to the flusher's next look, CONSOLE_IDLE_WAIT away */
+    if (console_flusher_idle && !irqs_disabled()) {
+        console_flusher_idle = 0;
+        wake(console_flusher);
+    }
+}
+
+/* Writes to the ring, waiting for space if it is full */
+static void console_send(char *data, int length, int can_sleep)
+{
+    unsigned long flags;
+    int sent;
+
+    while (length > 0) {
+        spin_lock_irqsave(&xencons_lock, flags);
+        sent = xencons_ring_send_no_notify(data, length);
+        spin_unlock_irqrestore(&xencons_lock, flags);
+        data += sent;
+        length -= sent;
+        if (length > 0) {
+            xencons_notify_daemon();
+            console_stats.notifications++;
+            if (can_sleep)
+                nanosleep(MILLISECS(1));
+        }
+    }
+}
+
+static char console_batch[CONSOLE_BATCH];
+static int console_batch_len;
+
+static void console_batch_add(char *data, int length, int can_sleep)
+{
+    int i;
+
+    for (i = 0; i < length; i++) {
+        if (console_batch_len + 2 > CONSOLE_BATCH) {
+            console_send(console_batch, console_batch_len, can_sleep);
+            console_batch_len = 0;
+        }
+        if (data[i] == '\n')
+            console_batch[console_batch_len++] = '\r';
+        console_batch[console_batch_len++] = data[i];
+    }
+}
+
+/* Returns the oldest record of b, past any padding, and its position
+   in *pos, or NULL if b is empty. */
+static u32 *console_next(struct console_buf *b, u32 *pos)
+{
+    u32 tail = b->tail, hdr;
+
+    while (tail != b->head) {
+        hdr = *(volatile u32 *)(b->data + (tail & (CONSOLE_BUF_SIZE - 1)));
+        if ((hdr & (REC_COMMIT | REC_PAD)) != (REC_COMMIT | REC_PAD)) {
+            *pos = tail;
+            return (u32 *)(b->data + (tail & (CONSOLE_BUF_SIZE - 1)));
+        }
+        tail += hdr & REC_LEN_MASK;
+    }
+    return NULL;
+}
+
+/* Picks the buffer whose oldest record has the lowest sequence number.
+   An uncommitted record may be older than all the committed ones, so
+   nothing is picked while there is one, unless the caller cannot wait
+   for it to be committed (forced). */
+static struct console_buf *console_oldest(int forced)
+{
+    struct console_buf *b, *oldest = NULL;
+    u32 *rec, pos, seq, oldest_seq = 0;
+    int cpu;
+
+    for (cpu = 0; cpu < MAX_VIRT_CPUS; cpu++) {
+        b = console_bufs[cpu];
+        if (b == NULL || (rec = console_next(b, &pos)) == NULL)
+            continue;
+        if (!(*(volatile u32 *)rec & REC_COMMIT)) {
+            if (forced)
+                continue;
+            return NULL;
+        }
+        rmb();
+        seq = rec[1];
+        if (oldest == NULL || (s32)(seq - oldest_seq) < 0) {
+            oldest = b;
+            oldest_seq = seq;
+        }
+    }
+    return oldest;
+}
+
+/* Moves the committed records of all buffers to the ring in sequence
+   order, returns the number of records.  Called with console_draining
+   set. */
+static int console_drain(int can_sleep)
+{
+    struct console_buf *b;
+    unsigned long dropped = 0;
+    u32 *rec, pos, len;
+    int cpu, records = 0;
+
+    while ((b = console_oldest(!can_sleep)) != NULL) {
+        rec = console_next(b, &pos);
+        len = *rec & REC_LEN_MASK;
+        console_batch_add(REC_TEXT(rec), len, can_sleep);
+        console_stats.messages++;
+        console_stats.bytes += len;
+        records++;
+        /* a later record may start anywhere in this one or the padding */
+        if (pos != b->tail)
+            memset(b->data + (b->tail & (CONSOLE_BUF_SIZE - 1)), 0, pos - b->tail);
+        memset(rec, 0, REC_SIZE(len));
+        wmb();
+        b->tail = pos + REC_SIZE(len);
+    }
+    for (cpu = 0; cpu < MAX_VIRT_CPUS; cpu++) {
+        if (console_bufs[cpu] != NULL)
+            dropped += console_bufs[cpu]->dropped;
+    }
+    if (dropped != console_dropped_reported) {
+        char msg[64];
+        int n = snprintf(msg, sizeof(msg), "[console: %lu messages dropped]\n",
+                         dropped - console_dropped_reported);
+        console_batch_add(msg, n, can_sleep);
+        console_dropped_reported = dropped;
+        console_stats.dropped = dropped;
+    }
+    if (console_batch_len > 0) {
+        console_send(console_batch, console_batch_len, can_sleep);
+        console_batch_len = 0;
+        xencons_notify_daemon();
+        console_stats.notifications++;
+    }
+    if (records > 0)
+        wake_up(&console_space_wq);
+    return records;
+}
+
+/* true if the flusher can make progress */
+static int console_pending(void)
+{
+    return console_oldest(0) != NULL;
+}
+
+static void console_flusher_func(void *ign)
+{
+    int records;
+
+    for (;;) {
+        records = 0;
+        /* the drainer may sleep, so this is not a spin lock */
+        if (cmpxchg(&console_draining, 0, 1) == 0) {
+            records = console_drain(1);
+            console_draining = 0;
+        }
+        if (records == 0) {
+            DEFINE_SLEEP_QUEUE(sq);
+
+            sq.wakeup_time = NOW() + CONSOLE_IDLE_WAIT;
+            guk_sleep_queue_add(&sq);
+            block(current);
+            console_flusher_idle = 1;
+            mb();
+            if (console_pending() || is_expired(&sq)) {
+                console_flusher_idle = 0;
+                wake(current);
+            }
+            schedule();
+            console_flusher_idle = 0;
+            guk_sleep_queue_del(&sq);
+        }
+    }
+}
+
+/* Writes out everything that was logged, from the caller's context. */
+void guk_flush_console(void)
+{
+    s_time_t deadline = NOW() + MILLISECS(100);
+
+    if (!console_async)
+        return;
+    /* give up on the flusher if it is stuck, as it may be when crashing */
+    while (cmpxchg(&console_draining, 0, 1) != 0) {
+        if (NOW() > deadline)
+            return;
+        cpu_relax();
+    }
+    console_drain(0);
+    console_draining = 0;
+}
+
+void guk_console_stats(struct console_stats *stats)
+{
+    int cpu;
+
+    *stats = console_stats;
+    stats->dropped = 0;
+    for (cpu = 0; cpu < MAX_VIRT_CPUS; cpu++) {
+        if (console_bufs[cpu] != NULL)
+            stats->dropped += console_bufs[cpu]->dropped;
+    }
+}
+
+static void console_log(const char *fmt, va_list args)
+{
+    struct console_buf *b = this_console_buf();
+    char line[256];
+    va_list copy;
+    u32 *rec;
+    int len;
+
+    va_copy(copy, args);
+    len = vsnprintf(line, sizeof(line), fmt, copy);
+    va_end(copy);
+    if (len >= CONSOLE_LINE_MAX)
+        len = CONSOLE_LINE_MAX - 1;
+    rec = console_reserve(b, len);
+    if (rec == NULL)
+        return;
+    if (len < sizeof(line))
+        memcpy(REC_TEXT(rec), line, len);
+    else
+        vsnprintf(REC_TEXT(rec), len + 1, fmt, args);
+    console_commit(rec, len);
+}
+
 /* Atomic print to dom0 console. */
 void guk_printbytes(char *buf, int length)
 {
     unsigned long flags;
+
+    if (console_async) {
+        u32 *rec;
+
+        while (length > 0) {
+            int len = length < CONSOLE_LINE_MAX ? length : CONSOLE_LINE_MAX;
+            rec = console_reserve(this_console_buf(), len);
+            if (rec == NULL)
+                return;
+            memcpy(REC_TEXT(rec), buf, len);
+            console_commit(rec, len);
+            buf += len;
+            length -= len;
+        }
+        return;
+    }
+    spin_lock_irqsave(&xencons_lock, flags);
+    console_print(buf, length);
+    spin_unlock_irqrestore(&xencons_lock, flags);
+}
+
+/* As printbytes, but always writes to the ring from the caller.  For bulk
+   output, such as the trace dump, that would overrun the buffers. */
+void guk_printbytes_direct(char *buf, int length)
+{
+    unsigned long flags;
+
     spin_lock_irqsave(&xencons_lock, flags);
     console_print(buf, length);
     spin_unlock_irqrestore(&xencons_lock, flags);
@@ -176,6 +544,10 @@ void guk_cprintk(int tohyp, const char *fmt, va_list args)
     unsigned long flags;
     int err;
 
+    if (!tohyp && console_async) {
+        console_log(fmt, args);
+        return;
+    }
     flags = 0;
     if (!tohyp) {
         spin_lock_irqsave(&xencons_lock, flags);
@@ -242,22 +614,50 @@ int guk_console_readbytes(char *buf, unsigned len) {
     return result;
 }
 
-void init_console(void)
+void init_console(char *cmd_line)
 {
     if (trace_startup()) tprintk("Initialising console ... ");
     xencons_ring_init();
     console_initialised = 1;
     /* switch over to notifying send */
     xencons_ring_send_fn = xencons_ring_send;
+    console_policy = num_option(cmd_line, ASYNC_CONSOLE_OPTION);
     if (trace_startup()) tprintk("done.\n");
 }
 
+/* Runs once the scheduler and the other CPUs are up */
+static int init_async_console(void)
+{
+    int cpu, ncpus;
+
+    if (console_policy < 0)
+        return 0;
+    ncpus = smp_num_active();
+    for (cpu = 0; cpu < ncpus && cpu < MAX_VIRT_CPUS; cpu++) {
+        struct console_buf *b = xmalloc(struct console_buf);
+        b->head = b->tail = 0;
+        b->dropped = 0;
+        b->data = (char *)alloc_pages(CONSOLE_BUF_ORDER);
+        memset(b->data, 0, CONSOLE_BUF_SIZE);
+        console_bufs[cpu] = b;
+    }
+    console_flusher = create_thread("console_flusher", console_flusher_func,
+                                    UKERNEL_FLAG, NULL);
+    wmb();
+    console_async = 1;
+    if (trace_startup()) tprintk("Asynchronous console, %s when full\n",
+                                 console_policy == CONSOLE_BLOCK ? "blocking" : "dropping");
+    return 0;
+}
+DECLARE_INIT(init_async_console);
+
 extern void xencons_resume(void);
 extern void xencons_suspend(void);
 
 
 void console_suspend(void)
 {
+    guk_flush_console();
     xencons_suspend();
 }
 void console_resume(void)
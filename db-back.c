@@ -255,7 +255,7 @@ static void dispatch_gather_threads(struct dbif_request *req)
     struct db_thread *db_thread = (struct db_thread *)data_page;
 
     DEBUG(1, "Gather threads request.");
-    spin_lock(&thread_list_lock);
+    read_lock(&thread_list_lock);
     list_for_each(list_head, &thread_list) {
         thread = list_entry(list_head, struct thread, thread_list);
         if (is_app_thread(thread)) {
@@ -267,7 +267,7 @@ static void dispatch_gather_threads(struct dbif_request *req)
 	    numThreads++; /* TODO: handle overflow */
         }
     }
-    spin_unlock(&thread_list_lock);
+    read_unlock(&thread_list_lock);
     rsp = get_response();
     rsp->id = req->id;
     if (db_exit == DB_EXIT_SET) {
@@ -283,7 +283,7 @@ static void clear_all_req_debug_suspend(void) {
     struct thread *thread;
     struct list_head *list_head;
 
-    spin_lock(&thread_list_lock);
+    read_lock(&thread_list_lock);
     list_for_each(list_head, &thread_list)
     {
         thread = list_entry(list_head, struct thread, thread_list);
@@ -292,7 +292,7 @@ static void clear_all_req_debug_suspend(void) {
 	  clear_req_debug_suspend(thread);
         }
     }
-    spin_unlock(&thread_list_lock);
+    read_unlock(&thread_list_lock);
 }
 
 static void activate_watchpoints(void);
@@ -314,7 +314,7 @@ static void dispatch_resume_all(struct dbif_request *req) {
     /* Can't hold the lock while calling suspend_thread as it may have to sleep */
     while (1) {
       sthread = NULL;
-      spin_lock(&thread_list_lock);
+      read_lock(&thread_list_lock);
       list_for_each(list_head, &thread_list) {
 	  thread = list_entry(list_head, struct thread, thread_list);
 	  if (is_app_thread(thread) && is_watchpoint(thread)) {
@@ -322,7 +322,7 @@ static void dispatch_resume_all(struct dbif_request *req) {
 	    break;
 	  }
       }
-      spin_unlock(&thread_list_lock);
+      read_unlock(&thread_list_lock);
       if (sthread != NULL) {
 	DEBUG(1, "Stepping watchpoint thread %d.", sthread->id);
 	single_step_thread(sthread);
@@ -334,7 +334,7 @@ static void dispatch_resume_all(struct dbif_request *req) {
     }
     
     activate_watchpoints();
-    spin_lock(&thread_list_lock);
+    read_lock(&thread_list_lock);
     list_for_each(list_head, &thread_list) {
         thread = list_entry(list_head, struct thread, thread_list);
 	if (is_app_thread(thread)) {
@@ -345,7 +345,7 @@ static void dispatch_resume_all(struct dbif_request *req) {
 	  }
 	}
     }
-    spin_unlock(&thread_list_lock);
+    read_unlock(&thread_list_lock);
 }
 
 static void suspend_thread(struct thread *thread) {
@@ -392,7 +392,7 @@ static void dispatch_suspend_all(struct dbif_request *req) {
     /* Can't hold the lock while calling suspend_thread as it may have to sleep */
     while (1) {
       sthread = NULL;
-      spin_lock(&thread_list_lock);
+      read_lock(&thread_list_lock);
       list_for_each(list_head, &thread_list) {
 	thread = list_entry(list_head, struct thread, thread_list);
 	if (is_app_thread(thread) && !(is_debug_suspend(thread) || is_req_debug_suspend(thread))) {
@@ -400,7 +400,7 @@ static void dispatch_suspend_all(struct dbif_request *req) {
 	  break;
 	}
       }
-      spin_unlock(&thread_list_lock);
+      read_unlock(&thread_list_lock);
       if (sthread != NULL) {
 	DEBUG(1, "Suspending thread %d.", sthread->id);
 	suspend_thread(sthread);
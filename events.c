@@ -56,6 +56,7 @@ typedef struct _ev_action_t {
     evtchn_handler_t handler;
     void *data;
     u32 count;
+    int batch;
 #ifdef EVTCHN_DEBUG
     u32 ignored;
 #endif
@@ -66,6 +67,10 @@ static void default_handler(evtchn_port_t port, void *data);
 
 static unsigned long bound_ports[NR_EVS/(8*sizeof(unsigned long))];
 
+/* batch ports that fired during the current upcall, per cpu */
+#define EV_WORD_BITS (8*sizeof(unsigned long))
+static unsigned long batched_ports[MAX_VIRT_CPUS][NR_EVS/EV_WORD_BITS];
+
 struct virq_info {
     int used;
     uint32_t cpu;
@@ -94,20 +99,10 @@ void unbind_all_ports(void)
 /*
  * Demux events to different handlers.
  */
-void do_event(evtchn_port_t port)
+static void dispatch_event(evtchn_port_t port, int cpu)
 {
-    ev_action_t  *action;
-    int cpu = smp_processor_id();
-
-    add_preempt_count(current, IRQ_ACTIVE);
-    mask_evtchn(port);
-    clear_evtchn(port);
-    if (port >= NR_EVS) {
-	printk("Port number too large: %d\n", port);
-	goto out;
-    }
+    ev_action_t  *action = &ev_actions[port];
 
-    action = &ev_actions[port];
     action->count++;
     if((action->cpu != ANY_CPU) && (action->cpu != cpu)) {
 #ifdef EVTCHN_DEBUG
@@ -117,18 +112,71 @@ void do_event(evtchn_port_t port)
 		    action->count, port, action->ignored);
 	}
 #endif
-	goto out;
+	return;
     }
-    //xprintk("DEe %d %x %d\n", this_cpu(current_thread)->id, this_cpu(current_thread)->preempt_count, port);
-    //print_backtrace(current);
     /* call the handler */
     if(action->handler)
 	action->handler(port, action->data);
+}
+
+void do_event(evtchn_port_t port)
+{
+    add_preempt_count(current, IRQ_ACTIVE);
+    mask_evtchn(port);
+    clear_evtchn(port);
+    if (port >= NR_EVS) {
+	printk("Port number too large: %d\n", port);
+	goto out;
+    }
+    dispatch_event(port, smp_processor_id());
 
 out:
     unmask_evtchn(port);
     sub_preempt_count(current, IRQ_ACTIVE);
-    //xprintk("DEx %d %x %d\n", this_cpu(current_thread)->id, this_cpu(current_thread)->preempt_count, port);
+}
+
+/*
+ * Upcall path: the pending bit has already been cleared and the port is
+ * left unmasked. A batch port is only noted here; its handler runs once
+ * from do_batched_events when the scan is over.
+ */
+void do_pending_event(evtchn_port_t port)
+{
+    int cpu = smp_processor_id();
+
+    if (port >= NR_EVS) {
+	printk("Port number too large: %d\n", port);
+	return;
+    }
+    if (ev_actions[port].batch) {
+	batched_ports[cpu][port / EV_WORD_BITS] |= 1UL << (port % EV_WORD_BITS);
+	return;
+    }
+    dispatch_event(port, cpu);
+}
+
+void do_batched_events(void)
+{
+    int cpu = smp_processor_id();
+    unsigned long *words = batched_ports[cpu];
+    unsigned long w, bit;
+    int i;
+
+    for (i = 0; i < NR_EVS/EV_WORD_BITS; i++) {
+	while ((w = words[i]) != 0) {
+	    words[i] = 0;
+	    do {
+		bit = __ffs(w);
+		w &= w - 1;
+		dispatch_event(i * EV_WORD_BITS + bit, cpu);
+	    } while (w != 0);
+	}
+    }
+}
+
+void evtchn_set_batch(evtchn_port_t port, int batch)
+{
+    ev_actions[port].batch = batch;
 }
 
 evtchn_port_t bind_evtchn(evtchn_port_t port,
@@ -142,6 +190,7 @@ evtchn_port_t bind_evtchn(evtchn_port_t port,
     ev_actions[port].data = data;
     ev_actions[port].cpu = cpu;
     ev_actions[port].count = 0;
+    ev_actions[port].batch = 0;
 #ifdef EVTCHN_DEBUG
     ev_actions[port].ignored = 0;
     printk("Binding port=%d, cpu=%d, handler %p\n", port, cpu, handler);
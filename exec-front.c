@@ -38,7 +38,12 @@
 #include <guk/gnttab.h>
 #include <guk/events.h>
 #include <guk/trace.h>
+#include <guk/spinlock.h>
+#include <guk/wait.h>
+#include <guk/mm.h>
+#include <list.h>
 #include <errno.h>
+#include <execif.h>
 
 
 #ifdef EXEC_DEBUG
@@ -51,6 +56,37 @@
 static int exec_init = 0;
 static domid_t self_id = 0;
 static int exec_id = 0;
+static int exec_data_ring = 0;   /* backend supports the data channel */
+
+/*
+ * Shared data channel of an exec request (see execif.h). Channels stay on
+ * exec_channels until the process has been waited for and its output
+ * streams closed or read to EOF, or until the process is destroyed. The
+ * list holds one reference and every lookup another, so a channel is only
+ * torn down once the last user is done with it; if the backend still has
+ * the pages mapped at that point they move to exec_zombie_channels and are
+ * released later.
+ */
+struct exec_channel {
+    struct list_head list;
+    int exec_id;
+    struct execif_data_ctrl *ctrl;
+    char *data[EXECIF_STREAMS];
+    grant_ref_t ctrl_ref;
+    evtchn_port_t port;
+    struct wait_queue_head wq;
+    int refs;
+    int closed;                  /* bit per stream closed by the guest */
+    int drained;                 /* bit per stream read to EOF */
+    int waited;
+    int retired;                 /* off exec_channels */
+};
+
+static LIST_HEAD(exec_channels);
+static LIST_HEAD(exec_zombie_channels);
+static DEFINE_SPINLOCK(exec_channel_lock);
+
+#define EXEC_DISCONNECT_TIMEOUT SECONDS(1)  /* how long to wait for the backend to unmap */
 
 static int check(char *err) {
   if (err) {
@@ -68,32 +104,52 @@ static int check(char *err) {
 #define WRITE_STATUS 3
 #define CLOSE_STATUS 4
 #define DESTROY_STATUS 5
-#define WAIT_PERIOD 10   /* Wait period in ms */
-#define MAX_WAIT    50   /* Max number of WAIT_PERIODs */
+#define EXEC_STATUS_TIMEOUT MILLISECS(500)  /* how long to wait for exec status */
 
 static char* status_strings[] = {"execstatus", "waitstatus", "readstatus", "writestatus",
                                  "closestatus", "destroystatus"};
 
+/* Waits for the backend to write the status node, woken by a watch on it
+ * rather than by polling. Only the exec status wait is bounded. */
 static int wait_for_status(int this_exec_id, int statuskind) {
-  char *err, *status;
+  char *err, *status, *path;
   char nodename[1024];
+  char token[64];
   int result = -EAGAIN;
-  int retry = MAX_WAIT;
+  int found = 0;
   char *statuskindname = status_strings[statuskind];
+  s_time_t deadline = NOW() + EXEC_STATUS_TIMEOUT;
   /* This string must be unique to this operation */
   sprintf(nodename, "/local/domain/%d/device/exec/%d/%s", self_id, this_exec_id, statuskindname);
-  while (retry > 0) {
+  sprintf(token, "exec-%d-%s", this_exec_id, statuskindname);
+  err = xenbus_watch_path(XBT_NIL, nodename, token);
+  if (err) {
+    printk("couldn't watch %s: %s\n", nodename, err);
+    free(err);
+    return -EIO;
+  }
+  for (;;) {
     err = xenbus_read(XBT_NIL, nodename, &status);
-    if (err) {
-      free(err);
-      sleep(WAIT_PERIOD);
-      if (statuskind == EXEC_STATUS) retry--;
-      continue;
+    if (!err) {
+      sscanf(status, "%d", &result);
+      free(status);
+      found = 1;
+      break;
+    }
+    free(err);
+    if (statuskind == EXEC_STATUS) {
+      s_time_t left = deadline - NOW();
+      if (left <= 0)
+        break;
+      path = xenbus_get_watch_event(token, left);
+    } else {
+      path = xenbus_get_watch_event(token, -1);
     }
-    sscanf(status, "%d", &result);
-    break;
+    if (path != NULL)
+      xenbus_put_watch_event(path);
   }
-  if (retry == 0) {
+  xenbus_rm_watch(token);
+  if (!found) {
     printk("failed to xenbus_read %s\n", nodename);
   }
   err = xenbus_rm(XBT_NIL, nodename);
@@ -101,6 +157,245 @@ static int wait_for_status(int this_exec_id, int statuskind) {
   return result;
 }
 
+static void exec_channel_handler(evtchn_port_t port, void *data)
+{
+    struct exec_channel *ch = (struct exec_channel *)data;
+    wake_up(&ch->wq);
+}
+
+static struct exec_channel *exec_channel_alloc(int this_exec_id)
+{
+    struct exec_channel *ch;
+    int i;
+
+    ch = (struct exec_channel *)xmalloc(struct exec_channel);
+    if (ch == NULL)
+        return NULL;
+    memset(ch, 0, sizeof(*ch));
+    ch->exec_id = this_exec_id;
+    init_waitqueue_head(&ch->wq);
+    ch->ctrl = (struct execif_data_ctrl *)alloc_page();
+    if (ch->ctrl == NULL)
+        goto free_channel;
+    memset(ch->ctrl, 0, PAGE_SIZE);
+    for (i = 0; i < EXECIF_STREAMS; i++) {
+        ch->data[i] = (char *)alloc_page();
+        if (ch->data[i] == NULL)
+            goto free_pages;
+    }
+    for (i = 0; i < EXECIF_STREAMS; i++)
+        ch->ctrl->data_ref[i] = gnttab_grant_access(0, virt_to_mfn(ch->data[i]), 0);
+    ch->ctrl_ref = gnttab_grant_access(0, virt_to_mfn(ch->ctrl), 0);
+    if (evtchn_alloc_unbound(0, exec_channel_handler, ANY_CPU, ch, &ch->port))
+        goto end_grants;
+    unmask_evtchn(ch->port);
+    return ch;
+
+end_grants:
+    /* the backend has not been told about the grants yet */
+    for (i = 0; i < EXECIF_STREAMS; i++)
+        gnttab_end_access(ch->ctrl->data_ref[i]);
+    gnttab_end_access(ch->ctrl_ref);
+free_pages:
+    for (i = 0; i < EXECIF_STREAMS; i++) {
+        if (ch->data[i] != NULL)
+            free_page(ch->data[i]);
+    }
+    free_page(ch->ctrl);
+free_channel:
+    free(ch);
+    return NULL;
+}
+
+/* Ends the grants of a channel and frees it; fails if the backend still has
+ * any of its pages mapped. The control page goes last as it holds the refs. */
+static int exec_channel_release(struct exec_channel *ch)
+{
+    int i;
+
+    for (i = 0; i < EXECIF_STREAMS; i++) {
+        if (ch->data[i] == NULL)
+            continue;
+        if (!gnttab_end_access(ch->ctrl->data_ref[i]))
+            return 0;
+        free_page(ch->data[i]);
+        ch->data[i] = NULL;
+    }
+    if (!gnttab_end_access(ch->ctrl_ref))
+        return 0;
+    free_page(ch->ctrl);
+    free(ch);
+    return 1;
+}
+
+static void exec_reap_zombie_channels(void)
+{
+    struct exec_channel *ch, *tmp;
+    unsigned long flags;
+    LIST_HEAD(zombies);
+
+    spin_lock_irqsave(&exec_channel_lock, flags);
+    list_splice(&exec_zombie_channels, &zombies);
+    INIT_LIST_HEAD(&exec_zombie_channels);
+    spin_unlock_irqrestore(&exec_channel_lock, flags);
+
+    list_for_each_entry_safe(ch, tmp, &zombies, list) {
+        list_del(&ch->list);
+        if (!exec_channel_release(ch)) {
+            spin_lock_irqsave(&exec_channel_lock, flags);
+            list_add_tail(&ch->list, &exec_zombie_channels);
+            spin_unlock_irqrestore(&exec_channel_lock, flags);
+        }
+    }
+}
+
+/* Returns the channel with a reference held; drop it with exec_channel_put. */
+static struct exec_channel *exec_channel_find(int this_exec_id)
+{
+    struct exec_channel *ch;
+    unsigned long flags;
+
+    spin_lock_irqsave(&exec_channel_lock, flags);
+    list_for_each_entry(ch, &exec_channels, list) {
+        if (ch->exec_id == this_exec_id) {
+            ch->refs++;
+            spin_unlock_irqrestore(&exec_channel_lock, flags);
+            return ch;
+        }
+    }
+    spin_unlock_irqrestore(&exec_channel_lock, flags);
+    return NULL;
+}
+
+/* Tears the channel down once the last reference goes; it is already off
+ * exec_channels by then. */
+static void exec_channel_put(struct exec_channel *ch)
+{
+    unsigned long flags;
+    int last;
+
+    spin_lock_irqsave(&exec_channel_lock, flags);
+    last = --ch->refs == 0;
+    spin_unlock_irqrestore(&exec_channel_lock, flags);
+    if (!last)
+        return;
+
+    wait_event_timeout(ch->wq, ch->ctrl->disconnected, EXEC_DISCONNECT_TIMEOUT);
+    unbind_evtchn(ch->port);
+    if (!exec_channel_release(ch)) {
+        spin_lock_irqsave(&exec_channel_lock, flags);
+        list_add_tail(&ch->list, &exec_zombie_channels);
+        spin_unlock_irqrestore(&exec_channel_lock, flags);
+    }
+}
+
+/* Called after wait, destroy, each close and each read that hits EOF. Once
+ * the process is gone and nothing is left to read on stdout and stderr, or
+ * on destroy, the channel leaves exec_channels and drops the list's
+ * reference; stdin does not keep it around after the process has exited. */
+static void exec_channel_retire(struct exec_channel *ch, int closed, int drained,
+                                int waited, int force)
+{
+    unsigned long flags;
+    int done;
+
+    spin_lock_irqsave(&exec_channel_lock, flags);
+    ch->closed |= closed;
+    ch->drained |= drained;
+    ch->waited |= waited;
+    done = !ch->retired &&
+        (force || (ch->waited &&
+                   ((ch->closed | ch->drained | (1 << EXECIF_STDIN)) ==
+                    (1 << EXECIF_STREAMS) - 1)));
+    if (done) {
+        ch->retired = 1;
+        list_del(&ch->list);
+    }
+    spin_unlock_irqrestore(&exec_channel_lock, flags);
+    if (done)
+        exec_channel_put(ch);
+}
+
+static int exec_channel_read(struct exec_channel *ch, int fd, char *buffer, int length)
+{
+    struct execif_stream *s = &ch->ctrl->streams[fd];
+    uint32_t cons, avail, idx, chunk;
+    int n;
+
+    if (ch->closed & (1 << fd))
+        return -EBADF;
+    if (length <= 0)
+        return 0;
+    wait_event(ch->wq, s->prod != s->cons || s->eof);
+    rmb();
+    cons = s->cons;
+    avail = s->prod - cons;
+    n = avail < (uint32_t)length ? avail : (uint32_t)length;
+    idx = EXECIF_STREAM_IDX(cons);
+    chunk = EXECIF_STREAM_SIZE - idx;
+    if (chunk > (uint32_t)n)
+        chunk = n;
+    memcpy(buffer, ch->data[fd] + idx, chunk);
+    memcpy(buffer + chunk, ch->data[fd], n - chunk);
+    mb();        /* finish reading the data before releasing the space */
+    s->cons = cons + n;
+    mb();
+    /* the backend only stops filling the stream when it is full */
+    if (s->prod - cons == EXECIF_STREAM_SIZE)
+        notify_remote_via_evtchn(ch->port);
+    return n;
+}
+
+static int exec_channel_write(struct exec_channel *ch, int fd, char *buffer, int length)
+{
+    struct execif_stream *s = &ch->ctrl->streams[fd];
+    uint32_t prod, space, idx, chunk;
+    int done = 0;
+
+    if (ch->closed & (1 << fd))
+        return -EBADF;
+    while (done < length) {
+        wait_event(ch->wq, s->prod - s->cons < EXECIF_STREAM_SIZE || s->reader_closed);
+        if (s->reader_closed)
+            return done > 0 ? done : -EPIPE;
+        mb();    /* the backend has finished with the space before we reuse it */
+        prod = s->prod;
+        space = EXECIF_STREAM_SIZE - (prod - s->cons);
+        if (space > (uint32_t)(length - done))
+            space = length - done;
+        idx = EXECIF_STREAM_IDX(prod);
+        chunk = EXECIF_STREAM_SIZE - idx;
+        if (chunk > space)
+            chunk = space;
+        memcpy(ch->data[fd] + idx, buffer + done, chunk);
+        memcpy(ch->data[fd], buffer + done + chunk, space - chunk);
+        wmb();   /* data before index */
+        s->prod = prod + space;
+        mb();
+        /* the backend only waits for data when the stream was empty */
+        if (s->cons == prod)
+            notify_remote_via_evtchn(ch->port);
+        done += space;
+    }
+    return done;
+}
+
+static int exec_channel_close(struct exec_channel *ch, int fd)
+{
+    struct execif_stream *s = &ch->ctrl->streams[fd];
+
+    if (ch->closed & (1 << fd))
+        return -EBADF;
+    if (fd == EXECIF_STDIN)
+        s->eof = 1;
+    else
+        s->reader_closed = 1;
+    wmb();
+    notify_remote_via_evtchn(ch->port);
+    exec_channel_retire(ch, 1 << fd, 0, 0, 0);
+    return 0;
+}
+
 /* Asks exec-backend to execute "prog" with given args in directory "dir".
    Return exec_id if exec succeeded, -errno otherwise.
    Remote file descriptors written to fds[0..2]
@@ -116,6 +411,8 @@ int guk_exec_create(char *prog, char *arg_block, int argc, char *dir, int *fds)
     int i;
     int result;
     int this_exec_id = exec_id;
+    struct exec_channel *ch = NULL;
+    unsigned long flags;
      
     if (!exec_init) {
       return -ENODEV;
@@ -131,6 +428,11 @@ int guk_exec_create(char *prog, char *arg_block, int argc, char *dir, int *fds)
     sprintf(nodename, "/local/domain/%d/device/exec/%d", self_id, this_exec_id);
     sprintf(a_nodename, "/local/domain/%d/device/exec/%d/args", self_id, this_exec_id);
 
+    if (exec_data_ring) {
+      exec_reap_zombie_channels();
+      ch = exec_channel_alloc(this_exec_id);
+    }
+
 again:
     err = xenbus_transaction_start(&xbt);
     if (check(err)) goto abort_transaction;
@@ -141,6 +443,13 @@ again:
     err = xenbus_printf(xbt, nodename, "argc", "%u", argc);
     if (check(err)) goto abort_transaction;
 
+    if (ch != NULL) {
+      err = xenbus_printf(xbt, nodename, "ring-ref", "%u", ch->ctrl_ref);
+      if (check(err)) goto abort_transaction;
+      err = xenbus_printf(xbt, nodename, "event-channel", "%u", ch->port);
+      if (check(err)) goto abort_transaction;
+    }
+
     err = xenbus_printf(xbt, a_nodename, "0", "%s", prog);
     if (check(err)) goto abort_transaction;
 
@@ -163,18 +472,38 @@ again:
     err = xenbus_write(XBT_NIL, r_nodename, nodename);
     if (err) {
       free(err);
-      return -EIO;
+      result = -EIO;
+      goto fail;
     }
     goto done;
 
 abort_transaction:
     check(xenbus_transaction_end(xbt, 1, &retry));
-    return -EIO;
+    result = -EIO;
+    goto fail;
 
 done:
     /* now wait for exec status */
     result = wait_for_status(this_exec_id, EXEC_STATUS);
-    return result >= 0 ? this_exec_id : result;
+    if (result < 0)
+      goto fail;
+    if (ch != NULL) {
+      ch->refs = 1;
+      spin_lock_irqsave(&exec_channel_lock, flags);
+      list_add_tail(&ch->list, &exec_channels);
+      spin_unlock_irqrestore(&exec_channel_lock, flags);
+    }
+    return this_exec_id;
+
+fail:
+    if (ch != NULL) {
+      /* the backend may have mapped the pages before failing */
+      unbind_evtchn(ch->port);
+      spin_lock_irqsave(&exec_channel_lock, flags);
+      list_add_tail(&ch->list, &exec_zombie_channels);
+      spin_unlock_irqrestore(&exec_channel_lock, flags);
+    }
+    return result;
 }
 
 int guk_exec_wait(int this_exec_id) {
@@ -188,6 +517,13 @@ int guk_exec_wait(int this_exec_id) {
     return -EIO;
   }
   result = wait_for_status(this_exec_id, WAIT_STATUS);
+  if (exec_data_ring) {
+    struct exec_channel *ch = exec_channel_find(this_exec_id);
+    if (ch != NULL) {
+      exec_channel_retire(ch, 0, 0, 1, 0);
+      exec_channel_put(ch);
+    }
+  }
   return result;
 }
 
@@ -200,6 +536,13 @@ void guk_exec_destroy(int this_exec_id) {
     free(err);
   }
   wait_for_status(this_exec_id, DESTROY_STATUS);
+  if (exec_data_ring) {
+    struct exec_channel *ch = exec_channel_find(this_exec_id);
+    if (ch != NULL) {
+      exec_channel_retire(ch, 0, 0, 0, 1);
+      exec_channel_put(ch);
+    }
+  }
 }
 
 /* this_exec_id_fd encodes both the exec_id and the file descriptor we are reading on.
@@ -208,6 +551,19 @@ int guk_exec_read_bytes(int this_exec_id_fd, char *buffer, int length, long file
   char nodename[1024];
   char *err, *bytes;
   int status, result;
+  struct exec_channel *ch;
+  if (exec_data_ring && (ch = exec_channel_find(this_exec_id_fd - this_exec_id_fd % 3)) != NULL) {
+    int fd = this_exec_id_fd % 3;
+    if (fd == EXECIF_STDIN) {
+      result = -EBADF;
+    } else {
+      result = exec_channel_read(ch, fd, buffer, length);
+      if (result == 0 && length > 0)
+        exec_channel_retire(ch, 0, 1 << fd, 0, 0);
+    }
+    exec_channel_put(ch);
+    return result;
+  }
   sprintf(nodename, "/local/domain/0/backend/exec/requests/%d/%d", self_id, this_exec_id_fd);
   err = xenbus_printf(XBT_NIL, nodename, "read", "%u,%u", length, file_offset);
   if (err) {
@@ -239,6 +595,15 @@ int guk_exec_write_bytes(int this_exec_id_fd, char *buffer, int length, long fil
   char *err;
   int status;
   char zbuffer[1024];
+  struct exec_channel *ch;
+  if (exec_data_ring && (ch = exec_channel_find(this_exec_id_fd - this_exec_id_fd % 3)) != NULL) {
+    if (this_exec_id_fd % 3 != EXECIF_STDIN)
+      status = -EBADF;
+    else
+      status = exec_channel_write(ch, EXECIF_STDIN, buffer, length);
+    exec_channel_put(ch);
+    return status;
+  }
   BUG_ON(length > 1023);
   strncpy(zbuffer, buffer, length);
   zbuffer[length] = 0;
@@ -261,6 +626,12 @@ int guk_exec_close(int this_exec_id_fd) {
   char nodename[1024];
   char *err;
   int result;
+  struct exec_channel *ch;
+  if (exec_data_ring && (ch = exec_channel_find(this_exec_id_fd - this_exec_id_fd % 3)) != NULL) {
+    result = exec_channel_close(ch, this_exec_id_fd % 3);
+    exec_channel_put(ch);
+    return result;
+  }
   sprintf(nodename, "/local/domain/0/backend/exec/requests/%d/%d/close", self_id, this_exec_id_fd);
   err = xenbus_write(XBT_NIL, nodename, "");
   if (err) {
@@ -305,6 +676,14 @@ static void exec_thread(void *cmd_line)
     if (!value) {
       printk("no exec backend found: %s\n", ret);
     } else {
+      free(value);
+      ret = xenbus_read(XBT_NIL, "/local/domain/0/backend/exec/feature-data-ring", &value);
+      if (ret) {
+        free(ret);
+      } else {
+        exec_data_ring = simple_strtol(value, NULL, 10) != 0;
+        free(value);
+      }
       self_id = xenbus_get_self_id();
       exec_init = 1;
     }
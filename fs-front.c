@@ -948,6 +948,7 @@ static int init_fs_import(struct fs_import *import, int test)
     char nodename[1024], r_nodename[1024], token[128], *message = NULL;
     struct fsif_sring *sring;
     int retry = 0;
+    s_time_t deadline;
     domid_t self_id;
 
     if (trace_fs_front()) tprintk("Initialising FS frontend to backend dom %d\n", import->dom_id);
@@ -1008,6 +1009,13 @@ again:
         goto abort_transaction;
     }
 
+    /* the backend may copy our pages rather than map them */
+    err = xenbus_printf(xbt, nodename, "feature-grant-copy", "%u", 1);
+    if (err) {
+        message = "writing feature-grant-copy";
+        goto abort_transaction;
+    }
+
     err = xenbus_printf(xbt, nodename, "state", STATE_READY, 0xdeadbeef);
 
 
@@ -1035,27 +1043,45 @@ abort_transaction:
 
 done:
 
-#define WAIT_PERIOD 10   /* Wait period in ms */
-#define MAX_WAIT    50   /* Max number of WAIT_PERIODs */
+#define BACKEND_TIMEOUT MILLISECS(500)  /* how long to wait for the backend */
     import->backend = NULL;
     sprintf(r_nodename, "%s/backend", nodename);
+    sprintf(token, "fs-front-backend-%d", import->import_id);
+    err = xenbus_watch_path(XBT_NIL, r_nodename, token);
+    if (err) {
+        printk("couldn't watch %s: %s\n", r_nodename, err);
+        free(err);
+        return 1;
+    }
 
-    for(retry = MAX_WAIT; retry > 0; retry--)
+    /* woken by the watch as soon as the backend writes its path */
+    deadline = NOW() + BACKEND_TIMEOUT;
+    for(;;)
     {
+        s_time_t left;
+        char *path;
+
         err = xenbus_read(XBT_NIL, r_nodename, &import->backend);
 		if (err) {
 			if (trace_fs_front()) 
 				tprintk("%s %d ERROR reading xenbus: %s\n", __FILE__, __LINE__, err);
 			free(err);
-			sleep(WAIT_PERIOD);
+			left = deadline - NOW();
+			if (left <= 0)
+			    break;
+			path = xenbus_get_watch_event(token, left);
+			if (path != NULL)
+			    xenbus_put_watch_event(path);
 			continue;
 		}
         if(import->backend) {
             if (trace_fs_front()) 
-		printk("Backend found at %s\n", import->backend);
+		printk("Backend found at %s, after %ld us\n", import->backend,
+		       (NOW() - deadline + BACKEND_TIMEOUT) / 1000);
             break;
         }
     }
+    xenbus_rm_watch(token);
 
     if(!import->backend)
     {
@@ -1067,8 +1093,20 @@ done:
     sprintf(r_nodename, "%s/state", import->backend);
     sprintf(token, "fs-front-%d", import->import_id);
     /* The token will not be unique if multiple imports are inited */
-    xenbus_watch_path(XBT_NIL, r_nodename, token);
-    xenbus_wait_for_value(token, r_nodename, STATE_READY);
+    err = xenbus_watch_path(XBT_NIL, r_nodename, token);
+    if (err) {
+        printk("couldn't watch %s: %s\n", r_nodename, err);
+        free(err);
+        return 1;
+    }
+    err = xenbus_wait_for_value(token, r_nodename, STATE_READY);
+    /* the token lives on our stack */
+    xenbus_rm_watch(token);
+    if (err) {
+        printk("couldn't read %s: %s\n", r_nodename, err);
+        free(err);
+        return 1;
+    }
     if (trace_fs_front()) tprintk("fs-backend ready.\n");
 
     // if (test) create_thread("fs-tester", test_fs_import, 0, import);
@@ -1079,13 +1117,19 @@ done:
 
 static void add_export(struct list_head *exports, unsigned int domid)
 {
-    char node[1024], path[1024], **exports_list = NULL, *ret_msg;
+    char node[1024], path[1024], names[256], *exports_buf[32], *ret_msg;
+    char **exports_list = exports_buf;
     char *msg = NULL;
-    int j = 0;
+    int j = 0, n = ARRAY_SIZE(exports_buf);
     static int import_id = 0;
 
     sprintf(node, "/local/domain/%d/backend/vfs/exports", domid);
-    ret_msg = xenbus_ls(XBT_NIL, node, &exports_list);
+    ret_msg = xenbus_ls_buf(XBT_NIL, node, names, sizeof(names), exports_buf, &n);
+    if (ret_msg && !strcmp(ret_msg, "E2BIG")) {
+        /* more exports than fit on the stack */
+        free(ret_msg);
+        ret_msg = xenbus_ls(XBT_NIL, node, &exports_list);
+    }
     if (ret_msg && strcmp(ret_msg, "ENOENT"))
         printk("couldn't read %s: %s\n", node, ret_msg);
     while(exports_list && exports_list[j])
@@ -1113,14 +1157,16 @@ static void add_export(struct list_head *exports, unsigned int domid)
             list_add(&import->list, exports);
 
         }
-        free(exports_list[j]);
         j++;
     }
 exit:
-    if(exports_list)
-        free(exports_list);
     if(ret_msg)
         free(ret_msg);
+    if (exports_list != exports_buf && exports_list != NULL) {
+        for (j = 0; exports_list[j]; j++)
+            free(exports_list[j]);
+        free(exports_list);
+    }
 }
 
 #if 0
@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+
+/*
+ * Futex wait/wake: waiters are kept in a hash table of buckets keyed by
+ * the address they wait on.  Timeouts use a sleep queue entry, and
+ * guk_interrupt wakes a futex waiter like any other blocked thread.
+ */
+
+#include <guk/os.h>
+#include <guk/sched.h>
+#include <guk/arch_sched.h>
+#include <guk/spinlock.h>
+#include <guk/time.h>
+#include <guk/futex.h>
+#include <guk/trace.h>
+
+#include <list.h>
+#include <errno.h>
+
+#define FUTEX_HASH_BITS 8
+#define FUTEX_HASH_SIZE (1 << FUTEX_HASH_BITS)
+
+struct futex_bucket {
+    spinlock_t lock;
+    volatile int waiters;       /* lets wake skip the lock when idle */
+    struct list_head list;
+};
+
+struct futex_waiter {
+    struct list_head list;
+    volatile int *addr;
+    struct thread *thread;
+    int woken;
+};
+
+static struct futex_bucket futex_table[FUTEX_HASH_SIZE];
+
+static inline struct futex_bucket *futex_bucket(volatile int *addr)
+{
+    unsigned long key = (unsigned long)addr >> 2;
+
+    key *= 0x9e3779b97f4a7c15UL;
+    return &futex_table[key >> (64 - FUTEX_HASH_BITS)];
+}
+
+int guk_futex_wait(volatile int *addr, int expected, s_time_t timeout)
+{
+    struct futex_bucket *b = futex_bucket(addr);
+    struct thread *thread = current;
+    struct futex_waiter w;
+    DEFINE_SLEEP_QUEUE(sq);
+    unsigned long flags;
+    int expired = 0;
+
+    BUG_ON(in_irq());
+    w.addr = addr;
+    w.thread = thread;
+    w.woken = 0;
+
+    spin_lock_irqsave(&b->lock, flags);
+    b->waiters++;
+    mb();
+    if (*addr != expected) {
+        b->waiters--;
+        spin_unlock_irqrestore(&b->lock, flags);
+        return -EWOULDBLOCK;
+    }
+    list_add_tail(&w.list, &b->list);
+    block(thread);
+    if (timeout > 0) {
+        sq.wakeup_time = NOW() + timeout;
+        guk_sleep_queue_add(&sq);
+    }
+    spin_unlock_irqrestore(&b->lock, flags);
+
+    schedule();
+
+    if (timeout > 0) {
+        guk_sleep_queue_del(&sq);
+        expired = is_expired(&sq);
+    }
+    spin_lock_irqsave(&b->lock, flags);
+    if (!w.woken) {
+        list_del(&w.list);
+        b->waiters--;
+    }
+    spin_unlock_irqrestore(&b->lock, flags);
+
+    if (w.woken)
+        return 0;
+    if (is_interrupted(thread)) {
+        clear_interrupted(thread);
+        return -EINTR;
+    }
+    return expired ? -ETIMEDOUT : 0;
+}
+
+int guk_futex_wake(volatile int *addr, int n)
+{
+    struct futex_bucket *b = futex_bucket(addr);
+    struct list_head *l, *next;
+    struct futex_waiter *w;
+    unsigned long flags;
+    int woken = 0;
+
+    /* pairs with the mb() in guk_futex_wait: the caller changed *addr
+     * before calling us */
+    mb();
+    if (b->waiters == 0)
+        return 0;
+
+    spin_lock_irqsave(&b->lock, flags);
+    list_for_each_safe(l, next, &b->list) {
+        if (woken >= n)
+            break;
+        w = list_entry(l, struct futex_waiter, list);
+        if (w->addr != addr)
+            continue;
+        list_del(&w->list);
+        b->waiters--;
+        w->woken = 1;
+        wake(w->thread);
+        woken++;
+    }
+    spin_unlock_irqrestore(&b->lock, flags);
+    return woken;
+}
+
+void init_futex(void)
+{
+    int i;
+
+    for (i = 0; i < FUTEX_HASH_SIZE; i++) {
+        spin_lock_init(&futex_table[i].lock);
+        futex_table[i].waiters = 0;
+        INIT_LIST_HEAD(&futex_table[i].list);
+    }
+}
@@ -46,63 +46,304 @@
 #include <guk/sched.h>
 #include <guk/arch_sched.h>
 #include <guk/spinlock.h>
+#include <guk/mutex.h>
+#include <guk/wait.h>
+#include <guk/smp.h>
 
 #define NR_RESERVED_ENTRIES 8
 
-/* NR_GRANT_FRAMES must be less than or equal to that configured in Xen */
+/*
+ * The table starts with NR_GRANT_FRAMES frames and is grown on demand,
+ * doubling each time, up to the lesser of what Xen allows and
+ * GNTTAB_MAX_FRAMES.
+ */
 #define NR_GRANT_FRAMES 4
-#define NR_GRANT_ENTRIES (NR_GRANT_FRAMES * PAGE_SIZE / sizeof(grant_entry_t))
+#define GNTTAB_MAX_FRAMES 64
+#define ENTRIES_PER_FRAME (PAGE_SIZE / sizeof(grant_entry_t))
+#define GNTTAB_MAX_ENTRIES (GNTTAB_MAX_FRAMES * ENTRIES_PER_FRAME)
 
-/* synchronize access to the free list to prevent races between
- * get_free_entry and put_free_entry
- */
-static DEFINE_SPINLOCK(gnttab_lock);
 static grant_entry_t *gnttab_table;
-static grant_ref_t gnttab_list[NR_GRANT_ENTRIES];
+static int nr_grant_frames = NR_GRANT_FRAMES;
+static int max_grant_frames = NR_GRANT_FRAMES;
+
+/*
+ * Free refs live in a global lock-free stack, linked through gnttab_list.
+ * The head word holds the first free ref in its low 32 bits and a
+ * generation count, bumped on every update, in the high ones so that a
+ * pop racing with a pop and push of the same ref fails its cmpxchg.
+ * In front of it each cpu keeps a small cache, touched with interrupts off
+ * and under a lock of its own that is only contended when another cpu
+ * steals the cache's refs because it is out of them.
+ */
+#define GNTTAB_LIST_END 0xffffffff
+static grant_ref_t gnttab_list[GNTTAB_MAX_ENTRIES];
+static volatile unsigned long gnttab_head = GNTTAB_LIST_END;
+
+#define GNTTAB_CACHE_SIZE  32
+#define GNTTAB_CACHE_BATCH 16   /* refs moved between a cache and the pool at once */
+struct gnttab_cache {
+    spinlock_t lock;
+    int count;
+    grant_ref_t refs[GNTTAB_CACHE_SIZE];
+};
+static struct gnttab_cache gnttab_caches[MAX_VIRT_CPUS];
+
+/* serializes growing the table, which allocates and may sleep */
+static DEFINE_MUTEX(gnttab_grow_mutex);
+/* threads waiting for a free ref */
+static DECLARE_WAIT_QUEUE_HEAD(gnttab_wq);
 
-/* count the number of free grant refs */
-static int num_free = 0;
 /* keep track of suspend/resume */
 static int gnttab_suspended = 0;
 
+#define pool_empty() ((grant_ref_t)gnttab_head == GNTTAB_LIST_END)
+
+/* push the chain first..last, already linked through gnttab_list */
+static void pool_push(grant_ref_t first, grant_ref_t last)
+{
+    unsigned long old, new;
+
+    do {
+	old = gnttab_head;
+	gnttab_list[last] = (grant_ref_t)old;
+	new = (((old >> 32) + 1) << 32) | first;
+    } while (cmpxchg(&gnttab_head, old, new) != old);
+}
+
+static grant_ref_t pool_pop(void)
+{
+    unsigned long old, new;
+    grant_ref_t ref;
+
+    do {
+	old = gnttab_head;
+	ref = (grant_ref_t)old;
+	if (ref == GNTTAB_LIST_END)
+	    return ref;
+	new = (((old >> 32) + 1) << 32) | gnttab_list[ref];
+    } while (cmpxchg(&gnttab_head, old, new) != old);
+    return ref;
+}
+
+/* push the consecutive refs from..to-1 */
+static void pool_push_range(grant_ref_t from, grant_ref_t to)
+{
+    grant_ref_t ref;
+
+    for (ref = from; ref < to - 1; ref++)
+	gnttab_list[ref] = ref + 1;
+    pool_push(from, to - 1);
+}
+
+/* move n refs from the top of the cache to the pool; cache locked */
+static void cache_drain(struct gnttab_cache *cache, int n)
+{
+    int i, top = cache->count - 1;
+
+    for (i = 0; i < n - 1; i++)
+	gnttab_list[cache->refs[top - i]] = cache->refs[top - i - 1];
+    pool_push(cache->refs[top], cache->refs[top - n + 1]);
+    cache->count -= n;
+}
+
+/*
+ * move the refs of every cpu's cache to the pool;
+ * returns nonzero if the pool then has a free ref
+ */
+static int steal_caches(void)
+{
+    struct gnttab_cache *cache;
+    unsigned long flags;
+    int i;
+
+    for (i = 0; i < MAX_VIRT_CPUS; i++) {
+	cache = &gnttab_caches[i];
+	if (cache->count == 0)
+	    continue;
+	spin_lock_irqsave(&cache->lock, flags);
+	if (cache->count > 0)
+	    cache_drain(cache, cache->count);
+	spin_unlock_irqrestore(&cache->lock, flags);
+    }
+    return !pool_empty();
+}
+
+static int setup_frames(unsigned long *frames, int num_frames)
+{
+    struct gnttab_setup_table setup;
+    int i;
+    int r;
+
+    setup.dom = DOMID_SELF;
+    setup.nr_frames = num_frames;
+    set_xen_guest_handle(setup.frame_list, frames);
+
+    r = HYPERVISOR_grant_table_op(GNTTABOP_setup_table, &setup, 1);
+    if (r == 0 && setup.status != GNTST_okay)
+	r = setup.status;
+    if (trace_gnttab()) {
+      for (i = 0; i < num_frames; i++) {
+	tprintk("GT: gnttab_frame[%d] = %x\n", i, frames[i]);
+      }
+    }
+    return r;
+}
+
+long pfn_gntframe_alloc(pfn_alloc_env_t *env, unsigned long addr) {
+  unsigned long *frames = (unsigned long *)env->data;
+  return frames[env->pfn++];;
+}
+
+/* map table frames from..to-1 */
+static int map_frames(unsigned long *frames, int from, int to)
+{
+    struct pfn_alloc_env pfn_pageframe_env = {
+      .pfn_alloc = pfn_alloc_alloc
+    };
+    struct pfn_alloc_env pfn_gntframe_env = {
+      .pfn_alloc = pfn_gntframe_alloc
+    };
+    pfn_gntframe_env.pfn = from; /* index into frames */
+    pfn_gntframe_env.data = (void*)frames;
+    return build_pagetable((unsigned long) gnttab_table + from * PAGE_SIZE,
+		    (unsigned long) gnttab_table + to * PAGE_SIZE,
+		    &pfn_gntframe_env, &pfn_pageframe_env);
+}
+
+/*
+ * double the table, unless the pool has been refilled meanwhile;
+ * returns 0 if there is no free ref and the table cannot grow.
+ * The new refs are published with a single push to the lock-free pool.
+ */
+static int gnttab_grow(void)
+{
+    unsigned long frames[GNTTAB_MAX_FRAMES];
+    int old, new;
+    int result = 0;
+
+    mutex_lock(&gnttab_grow_mutex);
+    if (!pool_empty()) {
+	result = 1;
+	goto out;
+    }
+    old = nr_grant_frames;
+    if (old == max_grant_frames)
+	goto out;
+    new = old * 2 > max_grant_frames ? max_grant_frames : old * 2;
+    if (setup_frames(frames, new) != 0) {
+	xprintk("GT: growing grant table to %d frames failed\n", new);
+	max_grant_frames = old;
+	goto out;
+    }
+    if (!map_frames(frames, old, new))
+	goto out;
+    nr_grant_frames = new;
+    pool_push_range(old * ENTRIES_PER_FRAME, new * ENTRIES_PER_FRAME);
+    if (trace_gnttab())
+	tprintk("GT: grant table grown to %d frames\n", new);
+    result = 1;
+out:
+    mutex_unlock(&gnttab_grow_mutex);
+    return result;
+}
+
 static void
 put_free_entry(grant_ref_t ref)
 {
-    int flags;
-    spin_lock_irqsave(&gnttab_lock, flags);
-    gnttab_list[ref] = gnttab_list[0];
-    gnttab_list[0]  = ref;
-    num_free++;
-    spin_unlock_irqrestore(&gnttab_lock, flags);
-
+    struct gnttab_cache *cache;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    cache = &gnttab_caches[smp_processor_id()];
+    spin_lock(&cache->lock);
+    cache->refs[cache->count++] = ref;
+    if (cache->count == GNTTAB_CACHE_SIZE)
+	cache_drain(cache, GNTTAB_CACHE_BATCH);
+    spin_unlock(&cache->lock);
+    local_irq_restore(flags);
+
+    /* a waiter steals the ref from the cache; wake_up checks for waiters
+       under the lock they queue with, so none can be missed */
+    wake_up(&gnttab_wq);
 }
 
+/*
+ * Take a ref from this cpu's cache, refilling it from the pool, from other
+ * cpus' caches and by growing the table as needed. When the table is at its
+ * maximum, threads wait for a ref to be freed. A caller with interrupts off
+ * can do none of that; drivers that grant under an irqsave lock take their
+ * refs beforehand with gnttab_alloc_refs.
+ */
 static grant_ref_t
 get_free_entry(void)
 {
-    unsigned int ref;
-    int flags;
-    spin_lock_irqsave(&gnttab_lock, flags);
-    ref = gnttab_list[0];
-    gnttab_list[0] = gnttab_list[ref];
-    num_free--;
-    spin_unlock_irqrestore(&gnttab_lock, flags);
-
-    BUG_ON(num_free < 0); /* FIXME: we should be able to recover from this */
-    return ref;
+    struct gnttab_cache *cache;
+    grant_ref_t ref;
+    unsigned long flags;
+
+    for (;;) {
+	local_irq_save(flags);
+	cache = &gnttab_caches[smp_processor_id()];
+	spin_lock(&cache->lock);
+	while (cache->count < GNTTAB_CACHE_BATCH &&
+		(ref = pool_pop()) != GNTTAB_LIST_END)
+	    cache->refs[cache->count++] = ref;
+	ref = cache->count > 0 ? cache->refs[--cache->count] : GNTTAB_LIST_END;
+	spin_unlock(&cache->lock);
+	local_irq_restore(flags);
+
+	if (ref != GNTTAB_LIST_END)
+	    return ref;
+	if (steal_caches())
+	    continue;
+	if (in_irq() || irqs_disabled()) {
+	    xprintk("GT: out of grant references with interrupts off\n");
+	    BUG();
+	}
+	if (gnttab_grow())
+	    continue;
+	if (trace_gnttab())
+	    tprintk("GT: waiting for a grant reference\n");
+	wait_event(gnttab_wq, steal_caches());
+    }
 }
 
-grant_ref_t
-gnttab_grant_access(domid_t domid, unsigned long frame, int readonly)
+void
+gnttab_alloc_refs(grant_ref_t *refs, int n)
 {
-    grant_ref_t ref;
+    int i;
 
-    ref = get_free_entry();
+    for (i = 0; i < n; i++)
+	refs[i] = get_free_entry();
+}
+
+void
+gnttab_free_refs(grant_ref_t *refs, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+	put_free_entry(refs[i]);
+}
+
+void
+gnttab_grant_access_ref(grant_ref_t ref, domid_t domid, unsigned long frame,
+			int readonly)
+{
     gnttab_table[ref].frame = frame;
     gnttab_table[ref].domid = domid;
     wmb();
     readonly *= GTF_readonly;
     gnttab_table[ref].flags = GTF_permit_access | readonly;
+}
+
+grant_ref_t
+gnttab_grant_access(domid_t domid, unsigned long frame, int readonly)
+{
+    grant_ref_t ref;
+
+    ref = get_free_entry();
+    gnttab_grant_access_ref(ref, domid, frame, readonly);
 
     return ref;
 }
@@ -122,7 +363,7 @@ gnttab_grant_transfer(domid_t domid, unsigned long pfn)
 }
 
 int
-gnttab_end_access(grant_ref_t ref)
+gnttab_end_access_ref(grant_ref_t ref)
 {
     u16 flags, nflags;
 
@@ -135,6 +376,14 @@ gnttab_end_access(grant_ref_t ref)
     } while ((nflags = cmpxchg(&gnttab_table[ref].flags, flags, 0)) !=
             flags);
 
+    return 1;
+}
+
+int
+gnttab_end_access(grant_ref_t ref)
+{
+    if (!gnttab_end_access_ref(ref))
+        return 0;
     put_free_entry(ref);
     return 1;
 }
@@ -190,42 +439,33 @@ gnttabop_error(int16_t status)
         return gnttabop_error_msgs[status];
 }
 
-void gnttab_suspend(void)
+/* all refs are free again, e.g. after a resume */
+static void reset_free_list(void)
 {
     int i;
 
-    for (i=0; i < NR_GRANT_FRAMES; i++)
-	HYPERVISOR_update_va_mapping((unsigned long)(((char *)gnttab_table) + PAGE_SIZE*i),
-		(pte_t){0x0<<PAGE_SHIFT}, UVMF_INVLPG);
-
-    ++gnttab_suspended;
+    for (i = 0; i < MAX_VIRT_CPUS; i++) {
+	spin_lock_init(&gnttab_caches[i].lock);
+	gnttab_caches[i].count = 0;
+    }
+    gnttab_head = GNTTAB_LIST_END;
+    pool_push_range(NR_RESERVED_ENTRIES, nr_grant_frames * ENTRIES_PER_FRAME);
 }
 
-static int init_frames(unsigned long *frames, int num_frames)
+void gnttab_suspend(void)
 {
-    struct gnttab_setup_table setup;
     int i;
-    int r;
-
-    for (i = NR_RESERVED_ENTRIES; i < NR_GRANT_ENTRIES; i++)
-        put_free_entry(i);
 
-    setup.dom = DOMID_SELF;
-    setup.nr_frames = num_frames;
-    set_xen_guest_handle(setup.frame_list, frames);
+    for (i=0; i < nr_grant_frames; i++)
+	HYPERVISOR_update_va_mapping((unsigned long)(((char *)gnttab_table) + PAGE_SIZE*i),
+		(pte_t){0x0<<PAGE_SHIFT}, UVMF_INVLPG);
 
-    r = HYPERVISOR_grant_table_op(GNTTABOP_setup_table, &setup, 1);
-    if (trace_gnttab()) {
-      for (i = 0; i < num_frames; i++) {
-	tprintk("GT: gnttab_frame[%d] = %x\n", i, frames[i]);
-      }
-    }
-    return r;
+    ++gnttab_suspended;
 }
 
 void gnttab_resume(void)
 {
-    unsigned long frames[NR_GRANT_FRAMES];
+    unsigned long frames[GNTTAB_MAX_FRAMES];
     int i;
 
     if (trace_gnttab())
@@ -234,9 +474,10 @@ void gnttab_resume(void)
     BUG_ON(gnttab_suspended != 1);
 
 
-    init_frames(frames, NR_GRANT_FRAMES);
+    reset_free_list();
+    BUG_ON(setup_frames(frames, nr_grant_frames));
 
-    for(i=0; i < NR_GRANT_FRAMES; ++i) {
+    for(i=0; i < nr_grant_frames; ++i) {
 	HYPERVISOR_update_va_mapping((unsigned long)(((char *)gnttab_table) + PAGE_SIZE*i),
 		(pte_t){(frames[i] << PAGE_SHIFT) | L1_PROT}, UVMF_INVLPG);
 
@@ -244,34 +485,31 @@ void gnttab_resume(void)
     --gnttab_suspended;
 }
 
-long pfn_gntframe_alloc(pfn_alloc_env_t *env, unsigned long addr) {
-  unsigned long *frames = (unsigned long *)env->data;
-  return frames[env->pfn++];;
-}
-
 void init_gnttab(void)
 {
     unsigned long frames[NR_GRANT_FRAMES];
+    struct gnttab_query_size query;
 
     if (trace_gnttab()) tprintk("GT: initialising gnttab on startup\n");
 
+    query.dom = DOMID_SELF;
+    if (HYPERVISOR_grant_table_op(GNTTABOP_query_size, &query, 1) == 0 &&
+	    query.status == GNTST_okay)
+	max_grant_frames = query.max_nr_frames;
+    if (max_grant_frames > GNTTAB_MAX_FRAMES)
+	max_grant_frames = GNTTAB_MAX_FRAMES;
+    if (max_grant_frames < NR_GRANT_FRAMES)
+	max_grant_frames = NR_GRANT_FRAMES;
+
     /* The following call populates frames with mfns (from Xen) for the shared grant table. */
-    init_frames(frames, NR_GRANT_FRAMES);
-    /* We map the grant table at the first virtual address after the maximum machine ram  */
+    BUG_ON(setup_frames(frames, NR_GRANT_FRAMES));
+    reset_free_list();
+    /* We map the grant table at the first virtual address after the maximum machine ram,
+       leaving room to grow to max_grant_frames */
     gnttab_table = pfn_to_virt(maximum_ram_page());
-
-    struct pfn_alloc_env pfn_pageframe_env = {
-      .pfn_alloc = pfn_alloc_alloc
-    };
-    struct pfn_alloc_env pfn_gntframe_env = {
-      .pfn_alloc = pfn_gntframe_alloc
-    };
-    pfn_gntframe_env.pfn = 0; /* index into frames */
-    pfn_gntframe_env.data = (void*)frames;
-    build_pagetable((unsigned long) gnttab_table,
-		    (unsigned long) (gnttab_table) + NR_GRANT_FRAMES * PAGE_SIZE,
-		    &pfn_gntframe_env, &pfn_pageframe_env);
+    map_frames(frames, 0, NR_GRANT_FRAMES);
 
     if (trace_gnttab())
-	tprintk("GT: gnttab_table mapped at %p\n", gnttab_table);
+	tprintk("GT: gnttab_table mapped at %p, %d frames, at most %d\n",
+		gnttab_table, nr_grant_frames, max_grant_frames);
 }
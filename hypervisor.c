@@ -51,49 +51,78 @@
 #include <guk/hypervisor.h>
 #include <guk/events.h>
 #include <guk/sched.h>
+#include <guk/arch_sched.h>
 #include <guk/smp.h>
 
-#define active_evtchns(idx)              \
-    (HYPERVISOR_shared_info->evtchn_pending[idx] &                \
-     ~HYPERVISOR_shared_info->evtchn_mask[idx])
+/* the selector and the pending and mask words are unsigned longs */
+#define EVTCHN_WORD_BITS (sizeof(unsigned long) * 8)
+
+/* atomically clear the set bits of bits in *addr */
+static inline void synch_clear_bits(unsigned long bits, volatile unsigned long *addr)
+{
+    __asm__ __volatile__ ("lock; and %1,%0"
+	    : "+m" (*addr)
+	    : "r" (~bits)
+	    : "memory");
+}
+
+/*
+ * Scan the words flagged in sel for unmasked pending ports. All pending
+ * bits of a word are claimed with one atomic and before their handlers
+ * run, and the word is looked at again afterwards for ports that fired
+ * in the meantime. Returns the number of ports handled.
+ */
+int evtchn_scan(unsigned long sel, unsigned long *pending, unsigned long *mask,
+	void (*fn)(evtchn_port_t))
+{
+    unsigned long l1i, l2i, l2;
+    int count = 0;
+
+    while (sel != 0) {
+	l1i = __ffs(sel);
+	sel &= sel - 1;
+
+	while ((l2 = pending[l1i] & ~mask[l1i]) != 0) {
+	    synch_clear_bits(l2, &pending[l1i]);
+	    do {
+		l2i = __ffs(l2);
+		l2 &= l2 - 1;
+		fn(l1i * EVTCHN_WORD_BITS + l2i);
+		count++;
+	    } while (l2 != 0);
+	}
+    }
+    return count;
+}
 
 void do_hypervisor_callback(void)
 {
-    u32 	       l1, l2;
-    unsigned int   l1i, l2i, port;
+    shared_info_t *s = HYPERVISOR_shared_info;
+    unsigned long  l1;
     int            cpu, count;
     vcpu_info_t   *vcpu_info;
 
     cpu = smp_processor_id();
-    vcpu_info = &HYPERVISOR_shared_info->vcpu_info[cpu];
+    vcpu_info = &s->vcpu_info[cpu];
 //    BUG_ON(vcpu_info->evtchn_upcall_mask == 0);
 //    BUG_ON(current->tmp == 1);
+    add_preempt_count(current, IRQ_ACTIVE);
     do {
         vcpu_info->evtchn_upcall_pending = 0;
         /* Nested invocations bail immediately. */
         if (unlikely(this_cpu(upcall_count)++))
-                return;
+                break;
         /* NB. No need for a barrier here -- XCHG is a barrier on x86. */
         l1 = xchg(&vcpu_info->evtchn_pending_sel, 0);
-        while ( l1 != 0 )
-        {
-            l1i = __ffs(l1);
-            l1 &= ~(1 << l1i);
-
-            while ( (l2 = active_evtchns(l1i)) != 0 )
-            {
-                l2i = __ffs(l2);
-                l2 &= ~(1 << l2i);
+        evtchn_scan(l1, s->evtchn_pending, s->evtchn_mask, do_pending_event);
+        do_batched_events();
 
-                port = (l1i << 5) + l2i;
-		do_event(port);
-            }
-        }
+        /* ports are not masked while their handlers run, so an event
+           that fires again during a handler lands here */
         count = this_cpu(upcall_count);
         this_cpu(upcall_count) = 0;
-        if(count != 1)
-            printk("=========> WARN: untested: event set during IRQ.\n");
     } while (count != 1);
+    sub_preempt_count(current, IRQ_ACTIVE);
 }
 
 
@@ -115,7 +144,7 @@ inline void unmask_evtchn(u32 port)
      * a real IO-APIC we 'lose the interrupt edge' if the channel is masked.
      */
     if (  synch_test_bit        (port,    &s->evtchn_pending[0]) &&
-         !synch_test_and_set_bit(port>>5, &vcpu_info->evtchn_pending_sel) )
+         !synch_test_and_set_bit(port / EVTCHN_WORD_BITS, &vcpu_info->evtchn_pending_sel) )
     {
         vcpu_info->evtchn_upcall_pending = 1;
         if ( !vcpu_info->evtchn_upcall_mask )
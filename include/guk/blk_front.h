@@ -94,9 +94,39 @@ extern int guk_blk_do_io(struct blk_request *req);
 extern int guk_blk_write(int device, long address, void *buf, int size);
 extern int guk_blk_read(int device, long address, void *buf, int size);
 
+/*
+ * page aligned I/O buffers; the blocking calls above use them
+ * without copying through a bounce buffer
+ */
+extern void *guk_blk_alloc_buf(int size);
+extern void guk_blk_free_buf(void *buf, int size);
+
+/*
+ * scatter-gather variants of the blocking calls; pages is a vector of
+ * page aligned buffers holding size bytes, which are never copied
+ */
+extern int guk_blk_write_pages(int device, long address, void **pages, int size);
+extern int guk_blk_read_pages(int device, long address, void **pages, int size);
+
+/*
+ * I/O statistics, not synchronized
+ */
+struct blk_stats {
+    unsigned long direct_bytes;  /* bytes transferred from/to the caller's pages */
+    unsigned long bounced_bytes; /* bytes copied through a bounce buffer */
+    unsigned long read_requests;
+    unsigned long write_requests;
+};
+extern void guk_blk_get_stats(struct blk_stats *stats);
+
 #define blk_write guk_blk_write
 #define blk_read guk_blk_read
 #define blk_do_io guk_blk_do_io
+#define blk_alloc_buf guk_blk_alloc_buf
+#define blk_free_buf guk_blk_free_buf
+#define blk_write_pages guk_blk_write_pages
+#define blk_read_pages guk_blk_read_pages
+#define blk_get_stats guk_blk_get_stats
 #define blk_get_devices guk_blk_get_devices
 #define blk_get_sectors guk_blk_get_sectors
 
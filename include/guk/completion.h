@@ -55,6 +55,10 @@ static inline void init_completion(struct completion *x)
 /* block current thread until completion is signaled */
 extern void guk_wait_for_completion(struct completion *);
 
+/* as above, but give up after timeout ns; returns 0 on timeout, else the
+ * time left */
+extern s_time_t guk_wait_for_completion_timeout(struct completion *, s_time_t timeout);
+
 /* release all waiting thread */
 extern void guk_complete_all(struct completion *);
 
@@ -67,5 +71,6 @@ extern void guk_delete_completion(struct completion *c);
 #define INIT_COMPLETION(x)	((x).done = 0)
 
 #define wait_for_completion guk_wait_for_completion
+#define wait_for_completion_timeout guk_wait_for_completion_timeout
 #define complete_all guk_complete_all
 #define complete guk_complete
@@ -64,14 +64,29 @@ void guk_printk(const char *fmt, ...);
 void guk_xprintk(const char *fmt, ...);
 void guk_cprintk(int direct, const char *fmt, va_list args);
 void guk_printbytes(char *buf, int length);
+/* as printbytes, bypassing the asynchronous console buffers */
+void guk_printbytes_direct(char *buf, int length);
 int guk_console_readbytes(char *data, unsigned len);
 
+struct console_stats {
+    unsigned long messages;         /* written by the flusher */
+    unsigned long bytes;
+    unsigned long dropped;          /* buffer was full */
+    unsigned long notifications;    /* of the console daemon */
+};
+
+/* writes out everything logged asynchronously */
+void guk_flush_console(void);
+void guk_console_stats(struct console_stats *stats);
+
 #define printk guk_printk
 #define xprintk guk_xprintk
 #define cprintk guk_cprintk
 #define printbytes guk_printbytes
+#define printbytes_direct guk_printbytes_direct
+#define flush_console guk_flush_console
 
-void init_console(void);
+void init_console(char *cmd_line);
 void console_suspend(void);
 void console_resume(void);
 
@@ -52,6 +52,17 @@ typedef void (*evtchn_handler_t)(evtchn_port_t, void *);
 
 /* prototypes */
 void do_event(evtchn_port_t port);
+void do_pending_event(evtchn_port_t port);
+void do_batched_events(void);
+int evtchn_scan(unsigned long sel, unsigned long *pending, unsigned long *mask,
+		void (*fn)(evtchn_port_t));
+
+/*
+ * a batch port's handler is called once per upcall, after all other
+ * pending ports have been handled, however often the port fired in
+ * between; it must drain all work it finds. Reset by bind_evtchn.
+ */
+void evtchn_set_batch(evtchn_port_t port, int batch);
 
 int bind_virq(uint32_t virq, 
               int cpu, 
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Wait on an address
+ *
+ * A runtime keeps its lock or monitor state in a word of its own and
+ * only calls in here on contention: guk_futex_wait blocks the caller if
+ * *addr still equals expected, guk_futex_wake wakes up to n threads
+ * blocked on addr.  The check of *addr and the enqueue are atomic with
+ * respect to guk_futex_wake, so a wake issued after the word was changed
+ * is never missed.
+ */
+#ifndef _FUTEX_H_
+#define _FUTEX_H_
+
+#include <types.h>
+#include <guk/time.h>
+
+/*
+ * Block until woken by guk_futex_wake, interrupted by guk_interrupt or,
+ * if timeout (ns) is non-zero, the timeout expires.
+ * Returns 0 when woken, -EWOULDBLOCK if *addr != expected on entry,
+ * -ETIMEDOUT or -EINTR.  Spurious returns of 0 are possible.
+ */
+extern int guk_futex_wait(volatile int *addr, int expected, s_time_t timeout);
+
+/* wake up to n threads waiting on addr, returns the number woken */
+extern int guk_futex_wake(volatile int *addr, int n);
+
+void init_futex(void);
+
+#define futex_wait guk_futex_wait
+#define futex_wake guk_futex_wake
+
+#endif /* _FUTEX_H_ */
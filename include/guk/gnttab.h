@@ -31,8 +31,16 @@ grant_ref_t gnttab_alloc_and_grant(void **map);
 grant_ref_t gnttab_grant_access(domid_t domid, unsigned long frame,
 				int readonly);
 grant_ref_t gnttab_grant_transfer(domid_t domid, unsigned long pfn);
+/* Take n free refs, waiting for them if need be, for a caller that grants
+ * later with interrupts off; gnttab_free_refs returns any left unused */
+void gnttab_alloc_refs(grant_ref_t *refs, int n);
+void gnttab_free_refs(grant_ref_t *refs, int n);
+void gnttab_grant_access_ref(grant_ref_t ref, domid_t domid, unsigned long frame,
+			     int readonly);
 unsigned long gnttab_end_transfer(grant_ref_t gref);
 int gnttab_end_access(grant_ref_t ref);
+/* As gnttab_end_access, but the caller keeps the ref to grant it again */
+int gnttab_end_access_ref(grant_ref_t ref);
 const char *gnttabop_error(int16_t status);
 
 void gnttab_suspend(void);
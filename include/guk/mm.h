@@ -144,6 +144,37 @@ int guk_build_pagetable(unsigned long start_address, unsigned long end_address,
   */
 int guk_build_pagetable_2mb(unsigned long start_address, unsigned long end_address,
 		     pfn_alloc_env_t *env_pfn, pfn_alloc_env_t *env_npf);
+
+struct pagetable_stats {
+    unsigned long hypercalls;   /* multicalls issued by build_pagetable */
+    unsigned long frames;       /* new page table frames */
+    unsigned long updates;      /* page table entries written, including links */
+};
+
+void guk_pagetable_stats(struct pagetable_stats *stats);
+
+/* Map the 2MB aligned region at va, mapped 1-1, onto the contiguous machine frames
+ * starting at mfn with a single 2MB entry, and set *l1_mfn to the displaced L1
+ * table frame. Returns 0 on success, 1 if the region is not mapped by an L1 table,
+ * or -1 if the hypervisor refused, e.g., the domain may not use superpages.
+ */
+int arch_map_2mb(unsigned long va, unsigned long mfn, unsigned long *l1_mfn);
+/* Reverse arch_map_2mb, linking the L1 table frame l1_mfn back in */
+void arch_unmap_2mb(unsigned long va, unsigned long l1_mfn);
+/* Put the 4K mappings of the 2MB region around va back, if it is mapped by a
+ * 2MB entry; needed before a 4K page table operation on va. */
+void guk_split_huge_page(unsigned long va);
+
+/* Large HEAP_VM allocations are mapped with 2MB pages where memory allows */
+struct heap_page_stats {
+    unsigned long huge_pages;       /* HEAP_VM pages mapped by 2MB entries */
+    unsigned long small_pages;      /* HEAP_VM pages mapped by 4K entries */
+    unsigned long huge_allocations; /* large allocations with some 2MB coverage */
+    unsigned long fallbacks;        /* large allocations left entirely on 4K pages */
+};
+
+void guk_heap_page_stats(struct heap_page_stats *stats);
+
 /* Reverse operations, tear down existing tables for given address range */
 void guk_demolish_pagetable(unsigned long start_address, unsigned long end_address);
 void guk_demolish_pagetable_2mb(unsigned long start_address, unsigned long end_address);
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Sleeping mutex
+ *
+ * The owner word holds the owning thread plus two flag bits.  Locking
+ * is a single cmpxchg when uncontended.  A contended locker first spins
+ * while the owner is running on another cpu, and only then parks on the
+ * wait queue.  Unlock releases the mutex and wakes the first waiter.  A
+ * woken waiter that loses the race to a spinner sets MUTEX_FLAG_HANDOFF,
+ * and the next unlock passes ownership straight to it, so parked
+ * waiters cannot be starved.
+ *
+ * A mutex may only be taken from thread context with interrupts
+ * enabled and no spinlock held.
+ */
+#ifndef _MUTEX_H_
+#define _MUTEX_H_
+
+#include <guk/wait.h>
+
+struct mutex {
+    volatile unsigned long owner;
+    struct wait_queue_head wait;
+};
+
+#define MUTEX_FLAG_WAITERS  0x01UL   /* wait queue is not empty */
+#define MUTEX_FLAG_HANDOFF  0x02UL   /* unlock must hand over to first waiter */
+#define MUTEX_FLAGS         0x03UL
+
+#define __MUTEX_INITIALIZER(name) \
+	{ .owner = 0, .wait = __WAIT_QUEUE_HEAD_INITIALIZER((name).wait) }
+
+#define DEFINE_MUTEX(name) \
+	struct mutex name = __MUTEX_INITIALIZER(name)
+
+static inline void mutex_init(struct mutex *m)
+{
+    m->owner = 0;
+    init_waitqueue_head(&m->wait);
+}
+
+static inline struct thread *mutex_owner(struct mutex *m)
+{
+    return (struct thread *)(m->owner & ~MUTEX_FLAGS);
+}
+
+static inline int mutex_is_locked(struct mutex *m)
+{
+    return mutex_owner(m) != NULL;
+}
+
+extern void guk_mutex_lock(struct mutex *m);
+extern int guk_mutex_trylock(struct mutex *m);
+extern void guk_mutex_unlock(struct mutex *m);
+extern struct mutex *guk_create_mutex(void);
+extern void guk_delete_mutex(struct mutex *m);
+
+#define mutex_lock(m)       guk_mutex_lock(m)
+#define mutex_trylock(m)    guk_mutex_trylock(m)
+#define mutex_unlock(m)     guk_mutex_unlock(m)
+
+#endif /* _MUTEX_H_ */
@@ -24,6 +24,83 @@
 #define NETFRONT_H
 
 extern void guk_netfront_xmit(unsigned char *data, int len);
+
+/*
+ * transmit n packets with one ring push and notification;
+ * packets larger than a page use several ring slots.
+ * Returns the number of packets consumed, which is less than n
+ * if the tx ring is full.
+ */
+extern int guk_netfront_xmit_batch(unsigned char **data, int *len, int n);
+
+/*
+ * offloads, as negotiated with the backend; NETFRONT_F_SG allows
+ * packets larger than a page
+ */
+#define NETFRONT_F_SG        1
+#define NETFRONT_F_CSUM      2
+#define NETFRONT_F_GSO_TCPV4 4
+extern int guk_netfront_features(void);
+
+/*
+ * a packet for guk_netfront_xmit_packets. With NETFRONT_TX_CSUM_BLANK the
+ * TCP/UDP checksum field holds only the pseudo-header sum and the backend
+ * completes it. NETFRONT_TX_GSO_TCPV4 sends a TCP segment of up to 64k
+ * that the backend cuts into gso_size (MSS) pieces; it implies
+ * NETFRONT_TX_CSUM_BLANK. Packets asking for an offload that was not
+ * negotiated are dropped.
+ */
+struct netfront_packet {
+    unsigned char *data;
+    int len;
+    int flags;
+    int gso_size;
+};
+#define NETFRONT_TX_CSUM_BLANK 1
+#define NETFRONT_TX_GSO_TCPV4  2
+
+extern int guk_netfront_xmit_packets(struct netfront_packet *pkts, int n);
+
+/*
+ * receive buffer; a page from the netfront pool that holds one packet
+ */
+struct netbuf {
+    unsigned char *data; /* start of the packet */
+    int len;
+    int flags;           /* NETBUF_xxx */
+    int gso_size;        /* MSS of a GSO packet, else 0 */
+    /* private to netfront */
+    void *page;
+    int gref;
+    struct netbuf *next;
+};
+
+/*
+ * set only with -XX:GUKNetRxCsum=1: the checksum was not filled in (the
+ * packet comes from another domain on this host), or it has been checked
+ */
+#define NETBUF_CSUM_BLANK     1
+#define NETBUF_DATA_VALIDATED 2
+
+/* return a buffer received through guk_netif_rx_netbufs to the pool */
+extern void guk_netbuf_free(struct netbuf *nb);
+
+/*
+ * receive hooks, overridden by the network stack.
+ * guk_netif_rx_netbufs hands over the buffers without copying; the stack
+ * must give each back with guk_netbuf_free. The default calls
+ * guk_netif_rx_batch and frees the buffers when it returns, so for that
+ * hook and guk_netif_rx the data is only valid during the call. The
+ * default batch hook calls guk_netif_rx for each packet.
+ */
+extern void guk_netif_rx_netbufs(struct netbuf **bufs, int n);
+extern void guk_netif_rx_batch(unsigned char **data, int *len, int n);
+extern void guk_netif_rx(unsigned char *data, int len);
+
 #define netfront_xmit guk_netfront_xmit
+#define netfront_xmit_batch guk_netfront_xmit_batch
+#define netfront_xmit_packets guk_netfront_xmit_packets
+#define netfront_features guk_netfront_features
+#define netbuf_free guk_netbuf_free
 
 #endif /* NETFRONT_H */
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+#ifndef _RWLOCK_H_
+#define _RWLOCK_H_
+
+#include <guk/spinlock.h>
+
+/*
+ * Reader-writer spinlocks for read-mostly data.
+ * Readers run concurrently; a writer first serialises against other
+ * writers on wlock, then sets RW_WRITER so that no new reader enters,
+ * and waits for the readers already inside to leave.  Pending writers
+ * therefore cannot be starved by a stream of readers.
+ */
+typedef struct rwlock {
+	volatile unsigned int cnt;	/* readers inside, plus RW_WRITER */
+	spinlock_t wlock;
+} rwlock_t;
+
+#define RW_WRITER 0x80000000U
+
+#define __RW_LOCK_UNLOCKED(lockname) \
+	(rwlock_t) { .cnt = 0, .wlock = __SPIN_LOCK_INITIALIZER(lockname) }
+
+#define RW_LOCK_UNLOCKED __RW_LOCK_UNLOCKED(0)
+
+#define rwlock_init(x)	do { *(x) = RW_LOCK_UNLOCKED; } while(0)
+
+#define DEFINE_RWLOCK(x) rwlock_t x = __RW_LOCK_UNLOCKED(#x)
+
+extern void guk_read_lock(rwlock_t *lock);
+extern void guk_read_unlock(rwlock_t *lock);
+extern unsigned long guk_read_lock_irqsave(rwlock_t *lock);
+extern void guk_read_unlock_irqrestore(rwlock_t *lock, unsigned long flags);
+extern void guk_write_lock(rwlock_t *lock);
+extern void guk_write_unlock(rwlock_t *lock);
+extern unsigned long guk_write_lock_irqsave(rwlock_t *lock);
+extern void guk_write_unlock_irqrestore(rwlock_t *lock, unsigned long flags);
+
+#define read_lock(lock)     guk_read_lock(lock)
+#define read_unlock(lock)   guk_read_unlock(lock)
+#define write_lock(lock)    guk_write_lock(lock)
+#define write_unlock(lock)  guk_write_unlock(lock)
+
+#define read_lock_irqsave(lock, flags)  flags = guk_read_lock_irqsave(lock)
+#define read_unlock_irqrestore(lock, flags) guk_read_unlock_irqrestore(lock, flags)
+#define write_lock_irqsave(lock, flags)  flags = guk_write_lock_irqsave(lock)
+#define write_unlock_irqrestore(lock, flags) guk_write_unlock_irqrestore(lock, flags)
+
+#endif /* _RWLOCK_H_ */
@@ -27,6 +27,7 @@
 #include <list.h>
 
 #include <guk/spinlock.h>
+#include <guk/rwlock.h>
 #include <guk/traps.h>
 #include <guk/time.h>
 #include <guk/bug.h>
@@ -122,7 +123,7 @@ struct thread {
 };
 
 extern struct list_head thread_list; /* a list of threads in the system */
-extern spinlock_t thread_list_lock;  /* the lock to the thread list */
+extern rwlock_t thread_list_lock;    /* the lock to the thread list */
 
 void idle_thread_fn(void *data);
 
@@ -240,6 +241,8 @@ struct thread *guk_not_idle_or_stepped(void);
 void guk_print_runqueue(void);
 /* prints runqueue using given print function. Include ukernel threads iff "all" */
 void print_runqueue_specific(int all, printk_function_ptr printk_function);
+/* earliest sleeper wake up time for cpu; -1 if one is already due */
+s_time_t blocking_time(int cpu);
 /* prints sleep queue using given print function. Include ukernel threads iff "all" */
 void print_sleep_queue_specific(int all, printk_function_ptr printk_function);
 
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Counting semaphore
+ *
+ * up() never loses a signal: with no waiter the count is incremented,
+ * otherwise the unit is handed directly to the longest waiting thread,
+ * which is woken already owning it.  up() may be called from interrupt
+ * context; down() may only be called from thread context.
+ */
+#ifndef _SEMAPHORE_H_
+#define _SEMAPHORE_H_
+
+#include <guk/wait.h>
+
+struct semaphore {
+    unsigned int count;
+    struct wait_queue_head wait;
+};
+
+#define __SEMAPHORE_INITIALIZER(name, n) \
+	{ .count = (n), .wait = __WAIT_QUEUE_HEAD_INITIALIZER((name).wait) }
+
+#define DEFINE_SEMAPHORE(name, n) \
+	struct semaphore name = __SEMAPHORE_INITIALIZER(name, n)
+
+static inline void sema_init(struct semaphore *sem, unsigned int n)
+{
+    sem->count = n;
+    init_waitqueue_head(&sem->wait);
+}
+
+extern void guk_down(struct semaphore *sem);
+extern int guk_down_trylock(struct semaphore *sem);
+extern void guk_up(struct semaphore *sem);
+extern struct semaphore *guk_create_semaphore(unsigned int n);
+extern void guk_delete_semaphore(struct semaphore *sem);
+
+#define down(sem)           guk_down(sem)
+#define down_trylock(sem)   guk_down_trylock(sem)
+#define up(sem)             guk_up(sem)
+
+#endif /* _SEMAPHORE_H_ */
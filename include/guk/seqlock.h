@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+#ifndef _SEQLOCK_H_
+#define _SEQLOCK_H_
+
+#include <guk/os.h>
+#include <guk/spinlock.h>
+
+/*
+ * Sequence locks: writers serialise on a spinlock and make the sequence
+ * odd while they update; readers take no lock at all and retry if the
+ * sequence was odd or changed while they read.  Readers must only copy
+ * the protected data, never follow pointers into it.
+ *
+ *	do {
+ *	    seq = read_seqbegin(&lock);
+ *	    ... copy the data ...
+ *	} while (read_seqretry(&lock, seq));
+ */
+typedef struct seqlock {
+	volatile unsigned int sequence;
+	spinlock_t lock;
+} seqlock_t;
+
+#define __SEQLOCK_UNLOCKED(lockname) \
+	(seqlock_t) { .sequence = 0, .lock = __SPIN_LOCK_INITIALIZER(lockname) }
+
+#define SEQLOCK_UNLOCKED __SEQLOCK_UNLOCKED(0)
+
+#define seqlock_init(x)	do { *(x) = SEQLOCK_UNLOCKED; } while(0)
+
+#define DEFINE_SEQLOCK(x) seqlock_t x = __SEQLOCK_UNLOCKED(#x)
+
+static inline void write_seqlock(seqlock_t *sl)
+{
+	spin_lock(&sl->lock);
+	sl->sequence++;
+	wmb();
+}
+
+static inline void write_sequnlock(seqlock_t *sl)
+{
+	wmb();
+	sl->sequence++;
+	spin_unlock(&sl->lock);
+}
+
+static inline unsigned long __write_seqlock_irqsave(seqlock_t *sl)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&sl->lock, flags);
+	sl->sequence++;
+	wmb();
+	return flags;
+}
+
+static inline void write_sequnlock_irqrestore(seqlock_t *sl, unsigned long flags)
+{
+	wmb();
+	sl->sequence++;
+	spin_unlock_irqrestore(&sl->lock, flags);
+}
+
+#define write_seqlock_irqsave(lock, flags) flags = __write_seqlock_irqsave(lock)
+
+static inline unsigned int read_seqbegin(const seqlock_t *sl)
+{
+	unsigned int ret;
+
+	while ((ret = sl->sequence) & 1)
+		cpu_relax();
+	rmb();
+	return ret;
+}
+
+static inline int read_seqretry(const seqlock_t *sl, unsigned int start)
+{
+	rmb();
+	return sl->sequence != start;
+}
+
+#endif /* _SEQLOCK_H_ */
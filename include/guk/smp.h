@@ -46,6 +46,7 @@ struct cpu_private
     int    cpu_state;
     evtchn_port_t ipi_port;
     void *db_support;
+    struct fast_clock fast_clock;
 };
 /* per cpu private data */
 extern struct cpu_private percpu[];
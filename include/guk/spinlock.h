@@ -30,21 +30,52 @@
  */
 #define DEBUG_LOCKS
 
+/*
+ * lock statistics:
+ * per lock acquisitions, contended acquisitions, cycles spent waiting
+ * and the longest hold time; see guk_spin_lock_stat_dump.
+ * overhead: two rdtsc per contended lock and two per unlock
+ */
+/* #define CONFIG_LOCK_STAT */
+
 /*
  * Your basic SMP spinlocks, allowing only a single CPU anywhere
  */
 typedef struct spinlock {
-	volatile unsigned int slock;
-#if defined(CONFIG_PREEMPT) && defined(CONFIG_SMP)
-	unsigned int break_lock;
-        unsigned long spin_count;
-        struct thread *owner;
+	union {
+		volatile unsigned int head_tail;
+		struct {
+			volatile unsigned short owner;	/* ticket being served */
+			volatile unsigned short next;	/* next ticket to hand out */
+		} tickets;
+	} slock;
+	struct thread *owner;
+#ifdef CONFIG_LOCK_STAT
+	const char *name;
+	struct spinlock *stat_next;
+	int stat_registered;
+	unsigned long acquisitions;
+	unsigned long contended;
+	unsigned long long wait_cycles;
+	unsigned long long max_hold_cycles;
+	unsigned long long hold_start;
 #endif
 } spinlock_t;
 
 #include <guk/arch_spinlock.h>
 
-#define SPIN_LOCK_UNLOCKED ARCH_SPIN_LOCK_UNLOCKED
+#ifdef CONFIG_LOCK_STAT
+#define __SPIN_LOCK_INITIALIZER(lockname) \
+	{ ARCH_SPIN_LOCK_UNLOCKED_INIT, .name = lockname }
+#else
+#define __SPIN_LOCK_INITIALIZER(lockname) \
+	{ ARCH_SPIN_LOCK_UNLOCKED_INIT }
+#endif
+
+#define __SPIN_LOCK_UNLOCKED(lockname) \
+	(spinlock_t) __SPIN_LOCK_INITIALIZER(lockname)
+
+#define SPIN_LOCK_UNLOCKED __SPIN_LOCK_UNLOCKED(0)
 
 #define spin_lock_init(x)	do { *(x) = SPIN_LOCK_UNLOCKED; } while(0)
 
@@ -52,7 +83,8 @@ typedef struct spinlock {
  * Simple spin lock operations.  There are two variants, one clears IRQ's
  * on the local processor, one does not.
  *
- * We make no fairness assumptions. They have a cost.
+ * Waiters are served in FIFO order (ticket locks), and spin with
+ * preemption (and for the irqsave variant, interrupts) disabled.
  */
 
 #define spin_is_locked(x)	arch_spin_is_locked(x)
@@ -71,6 +103,13 @@ extern void guk_spin_unlock_irqrestore(spinlock_t *lock, unsigned long flags);
 #define spin_lock_irqsave(lock, flags)  flags = guk_spin_lock_irqsave(lock)
 #define spin_unlock_irqrestore(lock, flags) guk_spin_unlock_irqrestore(lock, flags)
 
-#define DEFINE_SPINLOCK(x) spinlock_t x = SPIN_LOCK_UNLOCKED
+#define DEFINE_SPINLOCK(x) spinlock_t x = __SPIN_LOCK_UNLOCKED(#x)
+
+/* Prints the statistics of every lock taken so far (CONFIG_LOCK_STAT) */
+extern void guk_spin_lock_stat_dump(void);
+extern void guk_spin_lock_stat_reset(void);
+
+#define spin_lock_stat_dump()   guk_spin_lock_stat_dump()
+#define spin_lock_stat_reset()  guk_spin_lock_stat_reset()
 
 #endif /* _SPINLOCK_H_ */
@@ -53,6 +53,20 @@ struct shadow_time_info {
 	u32 version;
 };
 
+/*
+ * Per-cpu snapshot for guk_fast_now: system time (including the time
+ * addend) at tsc_base and the tsc scaling factors.  Refreshed from the
+ * shadow time on the timer VIRQ; seq is odd while it is updated.
+ */
+struct fast_clock {
+	volatile u32 seq;
+	int shift;
+	u32 mul;
+	u64 tsc_base;
+	u64 ns_base;
+	u64 last;              /* last value returned on this cpu */
+};
+
 /*
  * System Time
  * 64 bit value containing the nanoseconds elapsed since boot time.
@@ -95,8 +109,9 @@ struct timespec {
 typedef int clockid_t;
 
 /* prototypes */
-void     init_time(void);
+void     init_time(char *cmd_line);
 u64      guk_monotonic_clock(void);
+s_time_t guk_fast_now(void);
 void     guk_gettimeofday(struct timeval *tv);
 void     block_domain(s_time_t until);
 void     check_need_resched(void);
@@ -107,6 +122,7 @@ void     time_suspend(void);
 void     time_resume(void);
 
 #define monotonic_clock guk_monotonic_clock
+#define fast_now guk_fast_now
 #define time_addend guk_time_addend
 #define gettimeofday guk_gettimeofday
 #define get_running_time() guk_get_cpu_running_time(smp_processor_id())
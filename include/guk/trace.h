@@ -86,7 +86,56 @@ void guk_tprintk(const char *fmt, ...);
 #define tprintk guk_tprintk
 #define ttprintk guk_ttprintk
 
-/* If the trace is buffered, this call will flush it out
+/* tlog is used as ttprintk, but when the trace is buffered it only
+ * records its arguments, which must be integers or pointers (at most
+ * TLOG_MAX_ARGS), and the format is applied when the trace is flushed.
+ * Strings printed with %s are copied into the record, truncated if
+ * long.  The format is parsed once per call site, to find the %s
+ * arguments.
+ */
+#define TLOG_MAX_ARGS 8
+
+struct trace_site {
+  const char *fmt;
+  int str_mask;         /* bit i set if argument i is a %s, -1 until parsed */
+};
+
+void guk_tlog(struct trace_site *site, int nargs, const unsigned long *args);
+
+/* a floating point value would not survive the conversion, so refuse to
+   compile it */
+#define tlog_is_float(_x) \
+  (__builtin_types_compatible_p(typeof(_x), float) || \
+   __builtin_types_compatible_p(typeof(_x), double) || \
+   __builtin_types_compatible_p(typeof(_x), long double))
+#define tlog_arg(_x) \
+  ((unsigned long)(_x) + 0 * sizeof(char[1 - 2 * tlog_is_float(_x)]))
+
+#define tlog_nargs(_a...) tlog_nargs_(, ## _a, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define tlog_nargs_(_0, _1, _2, _3, _4, _5, _6, _7, _8, _n, _r...) _n
+#define tlog_map(_a...) tlog_map__(tlog_nargs(_a), ## _a)
+#define tlog_map__(_n, _a...) tlog_map_(_n, ## _a)
+#define tlog_map_(_n, _a...) tlog_map_##_n(_a)
+#define tlog_map_0()
+#define tlog_map_1(_x) tlog_arg(_x)
+#define tlog_map_2(_x, _a...) tlog_arg(_x), tlog_map_1(_a)
+#define tlog_map_3(_x, _a...) tlog_arg(_x), tlog_map_2(_a)
+#define tlog_map_4(_x, _a...) tlog_arg(_x), tlog_map_3(_a)
+#define tlog_map_5(_x, _a...) tlog_arg(_x), tlog_map_4(_a)
+#define tlog_map_6(_x, _a...) tlog_arg(_x), tlog_map_5(_a)
+#define tlog_map_7(_x, _a...) tlog_arg(_x), tlog_map_6(_a)
+#define tlog_map_8(_x, _a...) tlog_arg(_x), tlog_map_7(_a)
+
+#define guk_tlog_(_f, _a...) do { \
+  static struct trace_site __tlog_site = { _f, -1 }; \
+  unsigned long __tlog_args[] = { 0, tlog_map(_a) }; \
+  guk_tlog(&__tlog_site, tlog_nargs(_a), __tlog_args + 1); \
+} while (0)
+
+#define tlog guk_tlog_
+
+/* If the trace is buffered, this call will flush it out, tlog records
+ * after the rest.
  */
 void flush_trace(void);
 
@@ -43,7 +43,7 @@ struct wait_queue_head
 };
 
 #define __WAIT_QUEUE_HEAD_INITIALIZER(name) {                           \
-    .lock             = SPIN_LOCK_UNLOCKED,                             \
+    .lock             = __SPIN_LOCK_INITIALIZER(#name),                   \
     .thread_list      = { &(name).thread_list, &(name).thread_list } }
 
 #define DECLARE_WAIT_QUEUE_HEAD(name)                                   \
@@ -141,4 +141,41 @@ static inline void wake_up(struct wait_queue_head *head)
     spin_unlock_irqrestore(&wq.lock, flags);      \
 } while(0)
 
+/*
+ * As wait_event, but give up after timeout ns.  Evaluates to 0 if the
+ * condition is still false after the timeout, else to the time left
+ * (at least 1).
+ */
+#define wait_event_timeout(wq, condition, timeout) ({ \
+    s_time_t __deadline = NOW() + (timeout);      \
+    s_time_t __left;                              \
+    unsigned long __flags;                        \
+    if(!(condition)) {                            \
+        DEFINE_WAIT(__wait);                      \
+        DEFINE_SLEEP_QUEUE(__sq);                 \
+        __sq.wakeup_time = __deadline;            \
+        guk_sleep_queue_add(&__sq);               \
+        for(;;)                                   \
+        {                                         \
+            spin_lock_irqsave(&wq.lock, __flags); \
+            if(list_empty(&__wait.thread_list))   \
+                add_wait_queue(&wq, &__wait);     \
+            block(current);                       \
+            spin_unlock_irqrestore(&wq.lock, __flags); \
+            if((condition) || is_expired(&__sq)) {\
+                wake(current);                    \
+                break;                            \
+            }                                     \
+            schedule();                           \
+        }                                         \
+        spin_lock_irqsave(&wq.lock, __flags);     \
+        if(!list_empty(&__wait.thread_list))      \
+            remove_wait_queue(&__wait);           \
+        spin_unlock_irqrestore(&wq.lock, __flags);\
+        guk_sleep_queue_del(&__sq);               \
+    }                                             \
+    __left = __deadline - NOW();                  \
+    (condition) ? (__left > 0 ? __left : 1) : 0;  \
+})
+
 #endif /* __WAIT_H__ */
@@ -24,12 +24,14 @@
 #define XENBUS_H__
 
 #include <xen/xen.h>
+#include <guk/time.h>
 
 typedef unsigned long xenbus_transaction_t;
 #define XBT_NIL ((xenbus_transaction_t)0)
 
-/* Initialize the XenBus system. */
-void init_xenbus(void);
+/* Initialize the XenBus system. -XX:GUKXSC in cmd_line enables the
+   read cache. */
+void init_xenbus(char *cmd_line);
 
 void xenbus_suspend(void);
 void xenbus_resume(void);
@@ -40,9 +42,45 @@ void xenbus_resume(void);
 char *guk_xenbus_read(xenbus_transaction_t xbt, const char *path, char **value);
 #define xenbus_read guk_xenbus_read
 
+/* As xenbus_read, but copies the value into buf, which holds len bytes
+   including the terminating NUL, so nothing is allocated on success.
+   Fails with "E2BIG" if the value does not fit. */
+char *xenbus_read_buf(xenbus_transaction_t xbt, const char *path, char *buf, int len);
+
+/* As xenbus_read, but always goes to the store. */
+char *xenbus_read_uncached(xenbus_transaction_t xbt, const char *path, char **value);
+
+/* Read cache.  When enabled, reads outside a transaction of paths at or
+   below a subtree passed to xenbus_cache_subtree are answered from the
+   cache, which a watch on the subtree keeps up to date.  Does nothing
+   when the cache is disabled.  Returns a malloc'd error string on
+   failure. */
+char *xenbus_cache_subtree(const char *path);
+
+struct xenbus_cache_stats {
+    unsigned long hits;             /* round trips saved */
+    unsigned long misses;
+    unsigned long invalidations;
+    unsigned long flushes;
+};
+void xenbus_cache_get_stats(struct xenbus_cache_stats *stats);
+/* prints the stats when tracing xenbus */
+void xenbus_cache_report(char *when);
+
 char *xenbus_watch_path(xenbus_transaction_t xbt, char *path, char *token);
 char* xenbus_wait_for_value(char* token, char *path, char* value);
+
+/* Returns the path of the next event for the watch, which must be given
+   back with xenbus_put_watch_event, or NULL if none arrived within
+   timeout ns.  A negative timeout waits for ever.  Events for a path
+   that is still queued are merged. */
+char *xenbus_get_watch_event(char *token, s_time_t timeout);
+void xenbus_put_watch_event(char *path);
+
+/* As xenbus_get_watch_event, but return a malloc'd copy of the path */
 char * xenbus_read_watch(char *token);
+/* returns NULL if no watch event arrived within timeout ns */
+char *xenbus_read_watch_timeout(char *token, s_time_t timeout);
 
 int xenbus_rm_watch(char *token);
 
@@ -60,6 +98,13 @@ char *xenbus_rm(xenbus_transaction_t xbt, const char *path);
    is NULL terminated.  May block. */
 char *xenbus_ls(xenbus_transaction_t xbt, const char *prefix, char ***contents);
 
+/* As xenbus_ls, but the names are copied into buf (len bytes) and
+   contents, which has room for *n pointers, is filled in and NULL
+   terminated.  *n is set to the number of names.  Fails with "E2BIG"
+   if they do not fit. */
+char *xenbus_ls_buf(xenbus_transaction_t xbt, const char *prefix, char *buf, int len,
+                    char **contents, int *n);
+
 /* Reads permissions associated with a path.  Returns a malloc'd error
    string on failure and sets *value to NULL.  On success, *value is
    set to a malloc'd copy of the value. */
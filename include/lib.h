@@ -83,6 +83,9 @@ extern "C" {
 /* printing */
 #define _p(_x) ((void *)(unsigned long)(_x))
 int vsnprintf(char *buf, size_t size, const char *fmt, va_list args);
+/* as vsnprintf, with the arguments converted to unsigned long in vals */
+int vsnprintf_vals(char *buf, size_t size, const char *fmt,
+                   const unsigned long *vals, int nvals);
 int vscnprintf(char *buf, size_t size, const char *fmt, va_list args);
 int snprintf(char * buf, size_t size, const char *fmt, ...);
 int scnprintf(char * buf, size_t size, const char *fmt, ...);
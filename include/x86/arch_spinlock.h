@@ -24,16 +24,19 @@
 #ifndef __ARCH_ASM_SPINLOCK_H
 #define __ARCH_ASM_SPINLOCK_H
 
-#define ARCH_SPIN_LOCK_UNLOCKED (spinlock_t) { 1 }
-
 /*
- * Simple spin lock operations.  There are two variants, one clears IRQ's
- * on the local processor, one does not.
- *
- * We make no fairness assumptions. They have a cost.
+ * Ticket locks: slock.tickets.owner (the low 16 bits of head_tail) holds
+ * the ticket now being served, slock.tickets.next (the high 16 bits) the
+ * next ticket to hand out.  The lock is free when the two halves are
+ * equal, and waiters are granted the lock strictly in the order they
+ * took their tickets.  Both halves are updated together through
+ * head_tail, the owner half alone through its own member.
  */
+#define ARCH_SPIN_LOCK_UNLOCKED_INIT .slock = { .head_tail = 0 }
+#define TICKET_SHIFT 16
 
-#define arch_spin_is_locked(x)	(*(volatile signed char *)(&(x)->slock) <= 0)
+#define arch_spin_is_locked(x)	({ unsigned int __s = (x)->slock.head_tail; \
+	(__s & 0xffff) != (__s >> TICKET_SHIFT); })
 #define arch_spin_can_lock(lock) (!arch_spin_is_locked(lock)) 
 
 #define cpu_relax_string    "rep;nop"
@@ -48,52 +51,50 @@ static inline void cpu_relax(void)
 #define LOCK ""
 #endif
 
-#define spin_lock_string \
-        "1:\n" \
-	LOCK \
-	"decb %0\n\t" \
-	"jns 3f\n" \
-	"2:\t" \
-    cpu_relax_string \
-	"cmpb $0,%0\n\t" \
-	"jle 2b\n\t" \
-	"jmp 1b\n" \
-	"3:\n\t"
+/* Take the next ticket, returns it */
+static inline unsigned int _raw_spin_ticket(spinlock_t *lock)
+{
+	unsigned int inc = 1 << TICKET_SHIFT;
+	__asm__ __volatile__(
+		LOCK "xaddl %0, %1\n"
+		:"+r" (inc), "+m" (lock->slock.head_tail) : : "memory");
+	return inc >> TICKET_SHIFT;
+}
+
+static inline int _raw_spin_ticket_ready(spinlock_t *lock, unsigned int ticket)
+{
+	return lock->slock.tickets.owner == (unsigned short)ticket;
+}
 
 /*
- * This works. Despite all the confusion.
- * (except on PPro SMP or if we are using OOSTORE)
- * (PPro errata 66, 92)
+ * Only the holder writes the owner half, so a plain increment of that
+ * half is enough to pass the lock on.
  */
-
-#define spin_unlock_string \
-	"xchgb %b0, %1" \
-		:"=q" (oldval), "=m" (lock->slock) \
-		:"0" (oldval) : "memory"
-
 static inline void _raw_spin_unlock(spinlock_t *lock)
 {
-	char oldval = 1;
 	__asm__ __volatile__(
-		spin_unlock_string
-	);
+		"incw %0\n"
+		:"+m" (lock->slock.tickets.owner) : : "memory");
 }
 
 static inline int _raw_spin_trylock(spinlock_t *lock)
 {
-	char oldval;
+	unsigned int old = lock->slock.head_tail, prev;
+
+	if ((old & 0xffff) != (old >> TICKET_SHIFT))
+		return 0;
 	__asm__ __volatile__(
-		"xchgb %b0,%1\n"
-		:"=q" (oldval), "=m" (lock->slock)
-		:"0" (0) : "memory");
-	return oldval > 0;
+		LOCK "cmpxchgl %2, %1\n"
+		:"=a" (prev), "+m" (lock->slock.head_tail)
+		:"r" (old + (1 << TICKET_SHIFT)), "0" (old) : "memory");
+	return prev == old;
 }
 
 static inline void _raw_spin_lock(spinlock_t *lock)
 {
-	__asm__ __volatile__(
-		spin_lock_string
-		:"=m" (lock->slock) : : "memory");
+	unsigned int ticket = _raw_spin_ticket(lock);
+	while (!_raw_spin_ticket_ready(lock, ticket))
+		cpu_relax();
 }
 
 #endif
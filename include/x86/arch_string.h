@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * String and memory kernels for lib/string.c.  Self contained, so that
+ * tools/string-bench can build them on Linux and check them against
+ * glibc.
+ *
+ * Copies and fills are dispatched on size: up to 16 bytes with two
+ * possibly overlapping moves of the widest width that fits, up to
+ * ARCH_STRING_REP_MIN with unaligned 16 byte SSE2 moves, 64 bytes per
+ * iteration and an overlapping tail, and beyond that, which includes
+ * page copies and clears, with rep movsb/stosb on CPUs with enhanced rep
+ * movsb (ERMS), or rep movsq/stosq otherwise.  SSE2 is part of the
+ * x86_64 base and its state is saved on thread switch; AVX is not used
+ * as only the legacy fxsave area is saved.
+ *
+ * memcmp compares 8 bytes and strlen scans aligned 8 byte words at a
+ * time, reads that never cross into a page the byte loop would not
+ * touch.
+ */
+#ifndef __ARCH_STRING_H__
+#define __ARCH_STRING_H__
+
+#include <stddef.h>
+
+#if defined(__x86_64__)
+
+#define ARCH_HAS_STRING
+#define ARCH_STRING_REP_MIN 1024
+
+/* -1 until the first large move, then whether the CPU has ERMS */
+extern int arch_string_erms;
+
+typedef long long arch_v2di __attribute__((vector_size(16)));
+typedef char arch_v16 __attribute__((vector_size(16), aligned(1), may_alias));
+typedef unsigned long arch_u64 __attribute__((aligned(1), may_alias));
+typedef unsigned int arch_u32 __attribute__((aligned(1), may_alias));
+typedef unsigned short arch_u16 __attribute__((aligned(1), may_alias));
+
+#define arch_ld(_t, _p)        (*(const _t *)(_p))
+#define arch_st(_t, _p, _v)    (*(_t *)(_p) = (_v))
+
+static inline int arch_has_erms(void)
+{
+    if (arch_string_erms < 0) {
+        unsigned int eax = 7, ebx, ecx = 0, edx;
+        __asm__ __volatile__("cpuid"
+                             : "+a" (eax), "=b" (ebx), "+c" (ecx), "=d" (edx));
+        arch_string_erms = (ebx >> 9) & 1;
+    }
+    return arch_string_erms;
+}
+
+static inline void arch_copy_small(char *d, const char *s, size_t n)
+{
+    if (n >= 8) {
+        arch_u64 a = arch_ld(arch_u64, s), b = arch_ld(arch_u64, s + n - 8);
+        arch_st(arch_u64, d, a);
+        arch_st(arch_u64, d + n - 8, b);
+    } else if (n >= 4) {
+        arch_u32 a = arch_ld(arch_u32, s), b = arch_ld(arch_u32, s + n - 4);
+        arch_st(arch_u32, d, a);
+        arch_st(arch_u32, d + n - 4, b);
+    } else if (n >= 2) {
+        arch_u16 a = arch_ld(arch_u16, s), b = arch_ld(arch_u16, s + n - 2);
+        arch_st(arch_u16, d, a);
+        arch_st(arch_u16, d + n - 2, b);
+    } else if (n == 1) {
+        *d = *s;
+    }
+}
+
+/* 16 < n: 16 byte moves, the last one overlapping */
+static inline void arch_copy_sse(char *d, const char *s, size_t n)
+{
+    arch_v16 tail = arch_ld(arch_v16, s + n - 16);
+    char *end = d + n - 16;
+
+    while (n > 64) {
+        arch_v16 a = arch_ld(arch_v16, s), b = arch_ld(arch_v16, s + 16);
+        arch_v16 c = arch_ld(arch_v16, s + 32), e = arch_ld(arch_v16, s + 48);
+        arch_st(arch_v16, d, a);
+        arch_st(arch_v16, d + 16, b);
+        arch_st(arch_v16, d + 32, c);
+        arch_st(arch_v16, d + 48, e);
+        d += 64; s += 64; n -= 64;
+    }
+    while (n > 16) {
+        arch_st(arch_v16, d, arch_ld(arch_v16, s));
+        d += 16; s += 16; n -= 16;
+    }
+    arch_st(arch_v16, end, tail);
+}
+
+static inline void *arch_memcpy(void *dest, const void *src, size_t n)
+{
+    char *d = dest;
+    const char *s = src;
+
+    if (n <= 16) {
+        arch_copy_small(d, s, n);
+    } else if (n < ARCH_STRING_REP_MIN) {
+        arch_copy_sse(d, s, n);
+    } else if (arch_has_erms()) {
+        __asm__ __volatile__("rep movsb"
+                             : "+D" (d), "+S" (s), "+c" (n) : : "memory");
+    } else {
+        size_t words = n >> 3;
+        __asm__ __volatile__("rep movsq"
+                             : "+D" (d), "+S" (s), "+c" (words) : : "memory");
+        arch_copy_small(d, s, n & 7);
+    }
+    return dest;
+}
+
+static inline void *arch_memset(void *dest, int c, size_t n)
+{
+    char *d = dest;
+    arch_u64 v = 0x0101010101010101UL * (unsigned char)c;
+
+    if (n <= 16) {
+        if (n >= 8) {
+            arch_st(arch_u64, d, v);
+            arch_st(arch_u64, d + n - 8, v);
+        } else if (n >= 4) {
+            arch_st(arch_u32, d, v);
+            arch_st(arch_u32, d + n - 4, v);
+        } else if (n >= 2) {
+            arch_st(arch_u16, d, v);
+            arch_st(arch_u16, d + n - 2, v);
+        } else if (n == 1) {
+            *d = c;
+        }
+    } else if (n < ARCH_STRING_REP_MIN) {
+        arch_v2di v2 = { v, v };
+        arch_v16 v16 = (arch_v16)v2;
+        char *end = d + n - 16;
+        while (n > 64) {
+            arch_st(arch_v16, d, v16);
+            arch_st(arch_v16, d + 16, v16);
+            arch_st(arch_v16, d + 32, v16);
+            arch_st(arch_v16, d + 48, v16);
+            d += 64; n -= 64;
+        }
+        while (n > 16) {
+            arch_st(arch_v16, d, v16);
+            d += 16; n -= 16;
+        }
+        arch_st(arch_v16, end, v16);
+    } else if (arch_has_erms()) {
+        __asm__ __volatile__("rep stosb"
+                             : "+D" (d), "+c" (n) : "a" (c) : "memory");
+    } else {
+        size_t words = n >> 3;
+        __asm__ __volatile__("rep stosq"
+                             : "+D" (d), "+c" (words) : "a" (v) : "memory");
+        if (n & 7)
+            arch_st(arch_u64, d + (n & 7) - 8, v);
+    }
+    return dest;
+}
+
+static inline int arch_memcmp(const void *cs, const void *ct, size_t n)
+{
+    const unsigned char *a = cs, *b = ct;
+
+    while (n >= 8) {
+        arch_u64 x = arch_ld(arch_u64, a), y = arch_ld(arch_u64, b);
+        if (x != y) {
+            /* the lowest address is the most significant byte */
+            x = __builtin_bswap64(x);
+            y = __builtin_bswap64(y);
+            return x < y ? -1 : 1;
+        }
+        a += 8; b += 8; n -= 8;
+    }
+    for (; n > 0; a++, b++, n--) {
+        if (*a != *b)
+            return *a - *b;
+    }
+    return 0;
+}
+
+static inline size_t arch_strlen(const char *s)
+{
+    const char *p = s;
+    const arch_u64 *w;
+    unsigned long x;
+
+    for (; ((unsigned long)p & 7) != 0; p++) {
+        if (*p == '\0')
+            return p - s;
+    }
+    for (w = (const arch_u64 *)p; ; w++) {
+        x = *w;
+        /* non-zero iff some byte of x is zero */
+        if ((x - 0x0101010101010101UL) & ~x & 0x8080808080808080UL)
+            break;
+    }
+    for (p = (const char *)w; *p != '\0'; p++)
+        ;
+    return p - s;
+}
+
+#undef arch_ld
+#undef arch_st
+
+#endif /* __x86_64__ */
+
+#endif /* __ARCH_STRING_H__ */
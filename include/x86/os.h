@@ -473,7 +473,8 @@ static __inline__ void clear_bit(int nr, volatile void * addr)
  */
 static __inline__ unsigned long __ffs(unsigned long word)
 {
-	__asm__("bsfq %1,%0"
+	/* tzcnt; CPUs without BMI1 execute it as bsf, same result for word != 0 */
+	__asm__("rep; bsfq %1,%0"
 		:"=r" (word)
 		:"rm" (word));
 	return word;
@@ -70,6 +70,7 @@
 #include <guk/gnttab.h>
 #include <guk/db.h>
 #include <guk/trace.h>
+#include <guk/futex.h>
 #include <xen/features.h>
 #include <xen/version.h>
 
@@ -210,10 +211,10 @@ void start_kernel(start_info_t *si)
     init_mm((char *)si->cmd_line);
 
     /* Init time and timers. */
-    init_time();
+    init_time((char *)si->cmd_line);
 
     /* Init the console driver. */
-    init_console();
+    init_console((char *)si->cmd_line);
 
     /* Init grant tables */
     init_gnttab();
@@ -221,11 +222,14 @@ void start_kernel(start_info_t *si)
     /* Init scheduler. */
     init_sched((char *)si->cmd_line);
 
+    /* Init futex wait buckets */
+    init_futex();
+
     /* Init other CPUs */
     init_smp();
 
     /* Init XenBus */
-    init_xenbus();
+    init_xenbus((char *)si->cmd_line);
 
     remove_page_atva0();
 
@@ -233,6 +237,8 @@ void start_kernel(start_info_t *si)
 
     start_services();
 
+    xenbus_cache_report("after startup");
+
     guk_set_debugging((char *)si->cmd_line);
     /* Call app_main, but only if we aren't in the debug mode */
     aargs.cmd_line = (char *)si->cmd_line;
@@ -259,6 +265,7 @@ void crash_exit_msg(char *msg) {
       crashing = 1;
       xprintk("crash_exit: %s\n", msg);
       flush_trace();
+      flush_console();
       if (guk_debugging()) {
         // force a breakpoint
         guk_crash_to_debugger();
@@ -305,6 +312,7 @@ void ok_exit(void) {
     if (trace_startup()) tprintk("Guest VM microkernel, ok exit\n");
 
     flush_trace();
+    flush_console();
     guk_db_exit_notify_and_wait();
     for( ;; ) {
         struct sched_shutdown sched_shutdown = { .reason = SHUTDOWN_poweroff };
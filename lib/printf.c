@@ -190,12 +190,53 @@ static int skip_atoi(const char **s)
 #define SPECIAL 32              /* 0x */
 #define LARGE   64              /* use 'ABCDEF' instead of 'abcdef' */
 
+static const char small_digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+static const char large_digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+static const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Puts the digits of num into tmp, least significant first, and returns
+   their number.  Decimal goes two digits per division by a constant,
+   which the compiler turns into a multiply, powers of two by shifting. */
+static int convert_digits(char *tmp, unsigned long long num, unsigned int base,
+                          const char *digits)
+{
+    int i = 0;
+
+    switch (base) {
+    case 10:
+        while (num >= 100) {
+            unsigned int r = num % 100;
+            num /= 100;
+            tmp[i++] = digit_pairs[2 * r + 1];
+            tmp[i++] = digit_pairs[2 * r];
+        }
+        if (num >= 10) {
+            tmp[i++] = digit_pairs[2 * num + 1];
+            tmp[i++] = digit_pairs[2 * num];
+        } else {
+            tmp[i++] = '0' + num;
+        }
+        break;
+    case 16:
+        do { tmp[i++] = digits[num & 15]; num >>= 4; } while (num != 0);
+        break;
+    case 8:
+        do { tmp[i++] = digits[num & 7]; num >>= 3; } while (num != 0);
+        break;
+    default:
+        do { tmp[i++] = digits[num % base]; num /= base; } while (num != 0);
+        break;
+    }
+    return i;
+}
+
 static char * number(char * buf, char * end, long long num, int base, int size, int precision, int type)
 {
     char c,sign,tmp[66];
     const char *digits;
-    const char small_digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
-    const char large_digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
     int i;
 
     digits = (type & LARGE) ? large_digits : small_digits;
@@ -224,16 +265,8 @@ static char * number(char * buf, char * end, long long num, int base, int size,
         else if (base == 8)
             size--;
     }
-    i = 0;
-    if (num == 0)
-        tmp[i++]='0';
-    else 
-    {
-        /* XXX KAF: force unsigned mod and div. */
-        unsigned long long num2=(unsigned long long)num;
-        unsigned int base2=(unsigned int)base;
-        while (num2 != 0) { tmp[i++] = digits[num2%base2]; num2 /= base2; }
-    }
+    /* XXX KAF: force unsigned mod and div. */
+    i = convert_digits(tmp, (unsigned long long)num, (unsigned int)base, digits);
     if (i > precision)
         precision = i;
     size -= precision;
@@ -288,6 +321,25 @@ static char * number(char * buf, char * end, long long num, int base, int size,
     return buf;
 }
 
+/*
+ * The arguments of a format, either a va_list or, for records formatted
+ * after the fact by the trace log, an array of values converted to
+ * unsigned long, which also holds the pointers.
+ */
+struct format_args
+{
+    va_list *ap;
+    const unsigned long *vals;
+    int nvals;
+    int next;
+};
+
+#define next_arg(_a, _type)                                               \
+    ((_a)->vals == NULL ? va_arg(*(_a)->ap, _type) :                      \
+     (_type)((_a)->next < (_a)->nvals ? (_a)->vals[(_a)->next++] : 0))
+
+static int format(char *buf, size_t size, const char *fmt, struct format_args *args);
+
 /**
 * vsnprintf - Format a string and place it in a buffer
 * @buf: The buffer to place the result into
@@ -299,6 +351,39 @@ static char * number(char * buf, char * end, long long num, int base, int size,
 * You probably want snprintf instead.
  */
 int vsnprintf(char *buf, size_t size, const char *fmt, va_list args)
+{
+    struct format_args a;
+    va_list ap;
+    int n;
+
+    va_copy(ap, args);
+    a.ap = &ap;
+    a.vals = NULL;
+    n = format(buf, size, fmt, &a);
+    va_end(ap);
+    return n;
+}
+
+/**
+ * vsnprintf_vals - as vsnprintf, with the arguments in an array
+ * @vals: The arguments, each converted to unsigned long
+ * @nvals: The number of arguments, missing ones read as zero
+ *
+ * %n is not supported.
+ */
+int vsnprintf_vals(char *buf, size_t size, const char *fmt,
+                   const unsigned long *vals, int nvals)
+{
+    struct format_args a;
+
+    a.ap = NULL;
+    a.vals = vals;
+    a.nvals = nvals;
+    a.next = 0;
+    return format(buf, size, fmt, &a);
+}
+
+static int format(char *buf, size_t size, const char *fmt, struct format_args *args)
 {
     int len;
     unsigned long long num;
@@ -325,9 +410,17 @@ int vsnprintf(char *buf, size_t size, const char *fmt, va_list args)
 
     for (; *fmt ; ++fmt) {
         if (*fmt != '%') {
-            if (str <= end)
-                *str = *fmt;
-            ++str;
+            /* copy the run of plain characters in one go */
+            s = fmt;
+            while (*fmt != '%' && *fmt != '\0')
+                ++fmt;
+            len = fmt - s;
+            if (str + len - 1 <= end)
+                memcpy(str, s, len);
+            else if (str <= end)
+                memcpy(str, s, end - str + 1);
+            str += len;
+            --fmt;
             continue;
         }
 
@@ -350,7 +443,7 @@ int vsnprintf(char *buf, size_t size, const char *fmt, va_list args)
         else if (*fmt == '*') {
             ++fmt;
             /* it's the next argument */
-            field_width = va_arg(args, int);
+            field_width = next_arg(args, int);
             if (field_width < 0) {
                 field_width = -field_width;
                 flags |= LEFT;
@@ -366,7 +459,7 @@ int vsnprintf(char *buf, size_t size, const char *fmt, va_list args)
             else if (*fmt == '*') {
                 ++fmt;
                           /* it's the next argument */
-                precision = va_arg(args, int);
+                precision = next_arg(args, int);
             }
             if (precision < 0)
                 precision = 0;
@@ -399,7 +492,7 @@ int vsnprintf(char *buf, size_t size, const char *fmt, va_list args)
                     ++str;
                 }
             }
-            c = (unsigned char) va_arg(args, int);
+            c = (unsigned char) next_arg(args, int);
             if (str <= end)
                 *str = c;
             ++str;
@@ -411,7 +504,7 @@ int vsnprintf(char *buf, size_t size, const char *fmt, va_list args)
             continue;
 
         case 's':
-            s = va_arg(args, char *);
+            s = next_arg(args, char *);
             if (!s)
                 s = "<NULL>";
 
@@ -424,11 +517,13 @@ int vsnprintf(char *buf, size_t size, const char *fmt, va_list args)
                     ++str;
                 }
             }
-            for (i = 0; i < len; ++i) {
-                if (str <= end)
-                    *str = *s;
-                ++str; ++s;
+            if (str + len - 1 <= end) {
+                memcpy(str, s, len);
+            } else {
+                for (i = 0; i < len && str + i <= end; ++i)
+                    str[i] = s[i];
             }
+            str += len;
             while (len < field_width--) {
                 if (str <= end)
                     *str = ' ';
@@ -442,7 +537,7 @@ int vsnprintf(char *buf, size_t size, const char *fmt, va_list args)
                 flags |= ZEROPAD;
             }
             str = number(str, end,
-                         (unsigned long) va_arg(args, void *),
+                         (unsigned long) next_arg(args, void *),
                          16, field_width, precision, flags);
             continue;
 
@@ -450,14 +545,16 @@ int vsnprintf(char *buf, size_t size, const char *fmt, va_list args)
         case 'n':
             /* FIXME:
              * What does C99 say about the overflow case here? */
-            if (qualifier == 'l') {
-                long * ip = va_arg(args, long *);
+            if (args->vals != NULL) {
+                /* nowhere to store it */
+            } else if (qualifier == 'l') {
+                long * ip = va_arg(*args->ap, long *);
                 *ip = (str - buf);
             } else if (qualifier == 'Z') {
-                size_t * ip = va_arg(args, size_t *);
+                size_t * ip = va_arg(*args->ap, size_t *);
                 *ip = (str - buf);
             } else {
-                int * ip = va_arg(args, int *);
+                int * ip = va_arg(*args->ap, int *);
                 *ip = (str - buf);
             }
             continue;
@@ -499,19 +596,19 @@ int vsnprintf(char *buf, size_t size, const char *fmt, va_list args)
             continue;
         }
         if (qualifier == 'L')
-            num = va_arg(args, long long);
+            num = next_arg(args, long long);
         else if (qualifier == 'l') {
-            num = va_arg(args, unsigned long);
+            num = next_arg(args, unsigned long);
             if (flags & SIGN)
                 num = (signed long) num;
         } else if (qualifier == 'Z') {
-            num = va_arg(args, size_t);
+            num = next_arg(args, size_t);
         } else if (qualifier == 'h') {
-            num = (unsigned short) va_arg(args, int);
+            num = (unsigned short) next_arg(args, int);
             if (flags & SIGN)
                 num = (signed short) num;
         } else {
-            num = va_arg(args, unsigned int);
+            num = next_arg(args, unsigned int);
             if (flags & SIGN)
                 num = (signed int) num;
         }
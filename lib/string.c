@@ -39,11 +39,41 @@
 
 #if !defined HAVE_LIBC
 
+/* keep gcc from turning the copy loops below into calls to themselves */
+#pragma GCC optimize ("no-tree-loop-distribute-patterns")
+
 #include <guk/os.h>
 #include <guk/xmalloc.h>
 
 #include <lib.h>
 #include <types.h>
+#include <guk/arch_string.h>
+
+#ifdef ARCH_HAS_STRING
+
+int arch_string_erms = -1;
+
+int memcmp(const void * cs,const void * ct,size_t count)
+{
+	return arch_memcmp(cs, ct, count);
+}
+
+void * memcpy(void * dest,const void *src,size_t count)
+{
+	return arch_memcpy(dest, src, count);
+}
+
+void * memset(void * s,int c,size_t count)
+{
+	return arch_memset(s, c, count);
+}
+
+size_t strlen(const char * s)
+{
+	return arch_strlen(s);
+}
+
+#else
 
 int memcmp(const void * cs,const void * ct,size_t count)
 {
@@ -67,6 +97,27 @@ void * memcpy(void * dest,const void *src,size_t count)
 	return dest;
 }
 
+void * memset(void * s,int c,size_t count)
+{
+        char *xs = (char *) s;
+
+        while (count--)
+                *xs++ = c;
+
+        return s;
+}
+
+size_t strlen(const char * s)
+{
+	const char *sc;
+
+	for (sc = s; *sc != '\0'; ++sc)
+		/* nothing */;
+	return sc - s;
+}
+
+#endif /* ARCH_HAS_STRING */
+
 int strncmp(const char * cs,const char * ct,size_t count)
 {
 	register signed char __res = 0;
@@ -111,16 +162,6 @@ char * strncpy(char * dest,const char *src,size_t count)
         return tmp;
 }
 
-void * memset(void * s,int c,size_t count)
-{
-        char *xs = (char *) s;
-
-        while (count--)
-                *xs++ = c;
-
-        return s;
-}
-
 size_t strnlen(const char * s, size_t count)
 {
         const char *sc;
@@ -143,15 +184,6 @@ char * strcat(char * dest, const char * src)
     return tmp;
 }
 
-size_t strlen(const char * s)
-{
-	const char *sc;
-
-	for (sc = s; *sc != '\0'; ++sc)
-		/* nothing */;
-	return sc - s;
-}
-
 char * strchr(const char * s, int c)
 {
         for(; *s != (char) c; ++s)
@@ -278,6 +278,133 @@ void *guk_machine_page_pool_bitmap(void) {
 
 #endif /*MACHINE_ALLOC*/
 
+/*
+ * HUGE PAGES
+ * Large HEAP_VM allocations are placed on 2MB boundaries where possible and each
+ * 2MB region of the allocation that is backed by 2MB aligned, contiguous machine
+ * memory is then mapped by a single 2MB entry. The rest stays on 4K pages, as does
+ * everything if the domain may not use superpages. huge_l1 records the L1 table
+ * displaced from each 2MB region, so that it can be put back on deallocation, or
+ * before a single page of the region is remapped, e.g., for a watchpoint.
+ * huge_lock protects huge_l1 and the switch to huge_pages_enabled = 0, which the
+ * allocator reads without the lock as a hint.
+ * The MACHINE_ALLOC allocator is no help here, as the pages it returns need
+ * not be contiguous in the 1-1 virtual address space.
+ */
+#define PAGES_PER_2MB 512
+#define HUGE_PAGES_OPTION "-XX:GUKHP"
+
+static int huge_pages_enabled = 1;
+static unsigned long *huge_l1;
+static unsigned long huge_l1_entries;
+static DEFINE_SPINLOCK(huge_lock);
+static struct heap_page_stats heap_stats;
+
+/* n HEAP_VM pages changed from being mapped by 2MB entries to 4K entries */
+static void heap_stats_split(long n) {
+  __sync_sub_and_fetch(&heap_stats.huge_pages, n);
+  __sync_add_and_fetch(&heap_stats.small_pages, n);
+}
+
+void guk_heap_page_stats(struct heap_page_stats *stats) {
+  *stats = heap_stats;
+}
+
+/* Is the 2MB region starting at pfn backed by 2MB aligned, contiguous machine memory? */
+static int is_2mb_contiguous(unsigned long pfn) {
+  unsigned long mfn = pfn_to_mfn(pfn);
+  int i;
+  if (mfn & (PAGES_PER_2MB - 1)) {
+    return 0;
+  }
+  for (i = 1; i < PAGES_PER_2MB; i++) {
+    if (pfn_to_mfn(pfn + i) != mfn + i) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Map what we can of the n pages at pfn, which is 2MB aligned, with 2MB entries */
+static void map_huge(unsigned long pfn, int n) {
+  unsigned long p;
+  long huge = 0;
+  spin_lock(&huge_lock);
+  for (p = pfn; p + PAGES_PER_2MB <= pfn + n && huge_pages_enabled; p += PAGES_PER_2MB) {
+    unsigned long l1_mfn;
+    int ret;
+    if (!is_2mb_contiguous(p)) {
+      continue;
+    }
+    ret = arch_map_2mb(pfn_to_virtu(p), pfn_to_mfn(p), &l1_mfn);
+    if (ret < 0) {
+      if (trace_mm()) tprintk("MM: superpages not available, heap stays on 4K pages\n");
+      huge_pages_enabled = 0;
+      break;
+    }
+    if (ret > 0) {
+      /* not mapped by an L1 table, leave this region alone */
+      continue;
+    }
+    huge_l1[p / PAGES_PER_2MB] = l1_mfn;
+    huge += PAGES_PER_2MB;
+  }
+  spin_unlock(&huge_lock);
+  if (trace_mm()) {
+    ttprintk("APH %lx %d %d\n", pfn_to_virtu(pfn), n, huge);
+  }
+  __sync_add_and_fetch(&heap_stats.huge_pages, huge);
+  __sync_add_and_fetch(&heap_stats.small_pages, n - huge);
+  if (huge) {
+    __sync_add_and_fetch(&heap_stats.huge_allocations, 1);
+  } else {
+    __sync_add_and_fetch(&heap_stats.fallbacks, 1);
+  }
+}
+
+/* Put back the 4K mappings of any 2MB region that overlaps the n pages at pfn.
+ * What is left allocated of such a region is on 4K pages from now on.
+ */
+static void unmap_huge(unsigned long pfn, int n) {
+  unsigned long end = pfn + n;
+  unsigned long p = pfn & ~(PAGES_PER_2MB - 1);
+  long huge = 0, remapped = 0;
+  spin_lock(&huge_lock);
+  for (; p < end && huge_l1 != NULL; p += PAGES_PER_2MB) {
+    unsigned long overlap;
+    if (huge_l1[p / PAGES_PER_2MB] == 0) {
+      continue;
+    }
+    arch_unmap_2mb(pfn_to_virtu(p), huge_l1[p / PAGES_PER_2MB]);
+    huge_l1[p / PAGES_PER_2MB] = 0;
+    overlap = (p + PAGES_PER_2MB < end ? p + PAGES_PER_2MB : end) - (p > pfn ? p : pfn);
+    huge += overlap;
+    remapped += PAGES_PER_2MB - overlap;
+  }
+  spin_unlock(&huge_lock);
+  __sync_sub_and_fetch(&heap_stats.huge_pages, huge + remapped);
+  __sync_add_and_fetch(&heap_stats.small_pages, remapped - (n - huge));
+}
+
+void guk_split_huge_page(unsigned long va) {
+  unsigned long region = virt_to_pfn(va) / PAGES_PER_2MB;
+  int split = 0;
+  if (huge_l1 == NULL || region >= huge_l1_entries) {
+    return;
+  }
+  spin_lock(&huge_lock);
+  if (huge_l1[region] != 0) {
+    arch_unmap_2mb(pfn_to_virtu(region * PAGES_PER_2MB), huge_l1[region]);
+    huge_l1[region] = 0;
+    split = 1;
+  }
+  spin_unlock(&huge_lock);
+  if (split) {
+    if (trace_mm()) ttprintk("SPH %lx\n", va);
+    heap_stats_split(PAGES_PER_2MB);
+  }
+}
+
 
 long guk_page_pool_start(void) {
   return first_alloc_page;
@@ -585,10 +712,11 @@ long guk_decrease_page_pool(unsigned long n) {
 }
 
 /*
- * Allocate n contiguous pages. Returns a VIRTUAL/PHYSICAL address.
- * Returns 0 if failure.
+ * Allocate n contiguous pages, starting on a multiple of align pages.
+ * Returns a VIRTUAL/PHYSICAL address. Returns 0 if failure.
+ * An aligned allocation does not try to increase memory.
  */
-static unsigned long _allocate_pages(int n, int type)
+static unsigned long _allocate_pages(int n, int type, int align)
 {
     unsigned long page;
     unsigned long result = 0;
@@ -605,7 +733,7 @@ static unsigned long _allocate_pages(int n, int type)
       unsigned long end_page = is_bulk_alloc ? end_alloc_page : first_bulk_page;
       page = is_bulk_alloc ? first_free_bulk_page : first_free_page;
       while (page < end_page) {
-        if (!allocated_in_map(alloc_bitmap, page)) {
+        if ((page & (align - 1)) == 0 && !allocated_in_map(alloc_bitmap, page)) {
 	  int nn = n;
 	  unsigned long npage = page + 1;
 	  while (nn > 1 && (npage < end_page)) {
@@ -645,6 +773,9 @@ static unsigned long _allocate_pages(int n, int type)
 	if (!is_bulk_alloc) {
 	  /* Out of small pages, try the bulk area */
 	  is_bulk_alloc = 1;
+	} else if (align > 1) {
+	  /* Leave it to the caller to fall back to an unaligned allocation */
+	  break;
 	} else {
 	  /* Out of bulk pages, try to increase */
 	  if (!increase_memory_holding_lock(n)) break;
@@ -668,13 +799,26 @@ static unsigned long _allocate_pages(int n, int type)
 
 /* Alloc 2^order pages, first fit. Returns a VIRTUAL address. */
 unsigned long alloc_pages(int order) {
-    return _allocate_pages(1 << order, DATA_VM);
+    return _allocate_pages(1 << order, DATA_VM, 1);
 }
 
 /* Allocate n contiguous pages. Returns a VIRTUAL address.
 */
 unsigned long guk_allocate_pages(int n, int type) {
-	return _allocate_pages(n, type);
+	unsigned long result;
+	if (type == HEAP_VM && n >= PAGES_PER_2MB && huge_pages_enabled) {
+		result = _allocate_pages(n, type, PAGES_PER_2MB);
+		if (result) {
+			map_huge(virt_to_pfn(result), n);
+			return result;
+		}
+		__sync_add_and_fetch(&heap_stats.fallbacks, 1);
+	}
+	result = _allocate_pages(n, type, 1);
+	if (result && type == HEAP_VM) {
+		__sync_add_and_fetch(&heap_stats.small_pages, n);
+	}
+	return result;
 }
 
 unsigned long guk_extend_allocate_pages(void *pointer, int n, int type) {
@@ -686,6 +830,10 @@ void guk_deallocate_pages(void *pointer, int n, int type) {
     if (trace_mm()) {
       ttprintk("FPE %lx %d\n", pointer, n);
     }
+    if (type == HEAP_VM) {
+      /* before the pages can be reused, e.g., as page table frames */
+      unmap_huge(virt_to_pfn(pointer), n);
+    }
     spin_lock(&bitmap_lock);
     unsigned long page = virt_to_pfn(pointer);
     if (is_bulk(n)) {
@@ -872,7 +1020,7 @@ extern int num_option(char *cmd_line, char *option);
  */
 static void init_page_allocator(char *cmd_line, unsigned long min, unsigned long max)
 {
-    unsigned long bitmap_pages;
+    unsigned long bitmap_pages, huge_l1_pages;
     int small_pct;
 
     /* Allocate space for the allocation bitmap.
@@ -909,6 +1057,16 @@ static void init_page_allocator(char *cmd_line, unsigned long min, unsigned long
 #ifdef MACHINE_ALLOC
     analyze_machine_memory();
 #endif
+    if (num_option(cmd_line, HUGE_PAGES_OPTION) == 0) huge_pages_enabled = 0;
+    huge_l1_entries = max_end_alloc_page / PAGES_PER_2MB + 1;
+    huge_l1_pages = PFN_UP(huge_l1_entries * sizeof(unsigned long));
+    huge_l1 = (unsigned long *)_allocate_pages(huge_l1_pages, DATA_VM, 1);
+    if (huge_l1 == NULL) {
+      if (trace_mm()) tprintk("MM: no memory for the huge page table, heap stays on 4K pages\n");
+      huge_pages_enabled = 0;
+    } else {
+      memset(huge_l1, 0, huge_l1_pages * PAGE_SIZE);
+    }
     // static_dump_page_pool_state(xprintk);
 }
 
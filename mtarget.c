@@ -56,8 +56,9 @@ long guk_watch_memory_target(void) {
       initialized = 1;
     }
     do {
-      path = xenbus_read_watch(WATCH_TOKEN);
+      path = xenbus_get_watch_event(WATCH_TOKEN, -1);
       new_target = xenbus_read_integer(path);
+      xenbus_put_watch_event(path);
     } while (new_target == target);
     target = new_target;
     //xprintk("mtarget: new target %d MB\n", new_target / 1024);
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+
+/* Sleeping mutex, see include/guk/mutex.h */
+
+#include <guk/os.h>
+#include <guk/sched.h>
+#include <guk/arch_sched.h>
+#include <guk/xmalloc.h>
+#include <guk/mutex.h>
+
+/* upper bound of the optimistic spin while the owner runs */
+#define MUTEX_SPIN_MAX 10000
+
+static inline void mutex_set_flags(struct mutex *m, unsigned long flags)
+{
+    __asm__ __volatile__(LOCK "orq %1, %0"
+            : "+m" (m->owner) : "r" (flags) : "memory");
+}
+
+static inline void mutex_clear_flags(struct mutex *m, unsigned long flags)
+{
+    __asm__ __volatile__(LOCK "andq %1, %0"
+            : "+m" (m->owner) : "r" (~flags) : "memory");
+}
+
+/*
+ * Take the mutex if it has no owner. A pending handoff reserves it for
+ * the first waiter, everybody else has to keep off.
+ */
+static inline int mutex_try_acquire(struct mutex *m, int first_waiter)
+{
+    unsigned long owner = m->owner;
+
+    if (owner & ~MUTEX_FLAGS)
+        return 0;
+    if ((owner & MUTEX_FLAG_HANDOFF) && !first_waiter)
+        return 0;
+    return cmpxchg(&m->owner, owner,
+            (unsigned long)current | (owner & MUTEX_FLAG_WAITERS)) == owner;
+}
+
+/* spin while the owner is running on another cpu */
+static int mutex_spin(struct mutex *m)
+{
+    struct thread *owner;
+    int spins;
+
+    for (spins = 0; spins < MUTEX_SPIN_MAX; spins++) {
+        if (mutex_try_acquire(m, 0))
+            return 1;
+        owner = mutex_owner(m);
+        if (owner != NULL && !is_running(owner))
+            break;
+        cpu_relax();
+    }
+    return 0;
+}
+
+int guk_mutex_trylock(struct mutex *m)
+{
+    return mutex_try_acquire(m, 0);
+}
+
+void guk_mutex_lock(struct mutex *m)
+{
+    unsigned long flags;
+    int woken = 0;
+    DEFINE_WAIT(wait);
+
+    BUG_ON(in_irq());
+    if (likely(cmpxchg(&m->owner, 0, (unsigned long)current) == 0))
+        return;
+    if (mutex_spin(m))
+        return;
+
+    spin_lock_irqsave(&m->wait.lock, flags);
+    add_wait_queue(&m->wait, &wait);
+    mutex_set_flags(m, MUTEX_FLAG_WAITERS);
+    for (;;) {
+        int first = m->wait.thread_list.next == &wait.thread_list;
+
+        /* handed over by the unlocker */
+        if (mutex_owner(m) == current)
+            break;
+        if (mutex_try_acquire(m, first))
+            break;
+        /* woken, but a spinner was faster: ask for a handoff next time */
+        if (woken && first)
+            mutex_set_flags(m, MUTEX_FLAG_HANDOFF);
+        block(current);
+        spin_unlock_irqrestore(&m->wait.lock, flags);
+        schedule();
+        spin_lock_irqsave(&m->wait.lock, flags);
+        woken = 1;
+    }
+    remove_wait_queue(&wait);
+    if (list_empty(&m->wait.thread_list))
+        mutex_clear_flags(m, MUTEX_FLAG_WAITERS | MUTEX_FLAG_HANDOFF);
+    spin_unlock_irqrestore(&m->wait.lock, flags);
+}
+
+void guk_mutex_unlock(struct mutex *m)
+{
+    unsigned long flags, owner, new;
+    struct wait_queue *first = NULL;
+
+    BUG_ON(mutex_owner(m) != current);
+    if (likely(cmpxchg(&m->owner, (unsigned long)current, 0) ==
+               (unsigned long)current))
+        return;
+
+    spin_lock_irqsave(&m->wait.lock, flags);
+    if (!list_empty(&m->wait.thread_list))
+        first = list_entry(m->wait.thread_list.next, struct wait_queue,
+                           thread_list);
+    do {
+        owner = m->owner;
+        if ((owner & MUTEX_FLAG_HANDOFF) && first != NULL)
+            new = (unsigned long)first->thread | MUTEX_FLAG_WAITERS;
+        else
+            new = owner & MUTEX_FLAG_WAITERS;
+    } while (cmpxchg(&m->owner, owner, new) != owner);
+    if (first != NULL)
+        wake(first->thread);
+    spin_unlock_irqrestore(&m->wait.lock, flags);
+}
+
+struct mutex *guk_create_mutex(void)
+{
+    struct mutex *m = (struct mutex *)xmalloc(struct mutex);
+    mutex_init(m);
+    return m;
+}
+
+void guk_delete_mutex(struct mutex *m)
+{
+    BUG_ON(mutex_is_locked(m));
+    free(m);
+}
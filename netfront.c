@@ -24,7 +24,7 @@
  * Copyright (c) 2006-2007 Jacob Gorm Hansen, University of Copenhagen.
  * Based on netfront.c from Xen Linux.
  *
- * Does not handle fragments or extras.
+ * Handles multi-slot packets on transmit, but no extras.
  *
  * Modified: Grzegorz Milos
              Harald Roeck
@@ -43,6 +43,7 @@
 #include <guk/smp.h>
 #include <guk/trace.h>
 #include <guk/spinlock.h>
+#include <guk/netfront.h>
 
 #include <xen/io/netif.h>
 #include <errno.h>
@@ -54,6 +55,7 @@ static struct net_info {
     int rx_ring_ref;
     unsigned int evtchn, local_port;
     int rings;
+    int tx_avail; /* free tx slots, protected by net_info_lock */
     int device_id;
     int state;
 #define ST_UNKNOWN      0
@@ -74,7 +76,6 @@ static DEFINE_SPINLOCK(net_info_lock);
 
 #define WATCH_TOKEN "net-front"
 
-static unsigned short rx_freelist[NET_RX_RING_SIZE];
 static unsigned short tx_freelist[NET_TX_RING_SIZE];
 
 struct net_buffer {
@@ -83,9 +84,31 @@ struct net_buffer {
 };
 
 static DEFINE_SPINLOCK(freelist_lock);
-static struct net_buffer rx_buffers[NET_RX_RING_SIZE];
 static struct net_buffer tx_buffers[NET_TX_RING_SIZE];
 
+/*
+ * Receive buffers come from a pool of pages, each with a grant ref of
+ * its own that is allocated when the device connects. A buffer is
+ * granted to the backend while it is posted on the ring, and the grant
+ * is revoked before the stack sees the data, so that the backend cannot
+ * change a packet that is being read. Neither needs a grant table
+ * allocation. A received buffer is handed to the stack as it is and
+ * comes back to the pool through guk_netbuf_free, so the ring is
+ * refilled without copying. The pool is larger than the ring to leave
+ * room for buffers the stack holds on to; if it runs dry the ring is
+ * refilled as buffers come back.
+ */
+#define NETBUF_POOL_SIZE (2 * NET_RX_RING_SIZE)
+static struct netbuf netbufs[NETBUF_POOL_SIZE];
+static struct netbuf *netbuf_freelist;        /* protected by freelist_lock */
+static struct netbuf *rx_slots[NET_RX_RING_SIZE]; /* buffers posted on the rx ring */
+static int rx_starved;          /* pool could not fill the ring, protected by net_info_lock */
+static struct thread *rx_thread; /* handing a batch to the stack with net_info_lock held */
+/* received while the backend still had them mapped, protected by net_info_lock */
+static struct netbuf *netbuf_pending;
+
+static void network_rx_refill(void);
+
 static inline void add_id_to_freelist(unsigned int id, unsigned short* freelist)
 {
     long flags;
@@ -106,6 +129,31 @@ static inline unsigned short get_id_from_freelist(unsigned short* freelist)
     return id;
 }
 
+static void netbuf_put(struct netbuf *nb)
+{
+    long flags;
+    spin_lock_irqsave(&freelist_lock, flags);
+    nb->next = netbuf_freelist;
+    netbuf_freelist = nb;
+    spin_unlock_irqrestore(&freelist_lock, flags);
+}
+
+void guk_netbuf_free(struct netbuf *nb)
+{
+    long flags;
+
+    netbuf_put(nb);
+    /* post it if the ring is short; the interrupt receive path, which may
+       be our caller, refills by itself.  Only we can have set rx_thread
+       to ourselves, so a stale value is never mistaken for our own. */
+    if (rx_starved && rx_thread != current) {
+	spin_lock_irqsave(&net_info_lock, flags);
+	if (rx_starved && net_info.state == ST_READY)
+	    network_rx_refill();
+	spin_unlock_irqrestore(&net_info_lock, flags);
+    }
+}
+
 __attribute__((weak)) void guk_netif_rx(unsigned char* data,int len)
 {
     struct thread *thread = current;
@@ -120,87 +168,294 @@ static inline int xennet_rxidx(RING_IDX idx)
     return idx & (NET_RX_RING_SIZE - 1);
 }
 
-static void network_rx(void)
-{
-    struct net_info *np = &net_info;
-    RING_IDX rp,cons;
-    struct netif_rx_response *rx;
-
-    if (net_info.state != ST_READY)
-	return;
-
-moretodo:
-    rp = np->rx.sring->rsp_prod;
-    rmb(); /* Ensure we see queued responses up to 'rp'. */
-    cons = np->rx.rsp_cons;
+/*
+ * Received packets are handed to the stack in batches of up to RX_BATCH.
+ */
+#define RX_BATCH 32
 
-    int nr_consumed=0;
-    while ((cons != rp))
-    {
-        struct net_buffer* buf;
-        unsigned char* page;
+struct rx_batch {
+    struct netbuf *bufs[RX_BATCH];
+    int n;
+};
 
-        rx = RING_GET_RESPONSE(&np->rx, cons);
+__attribute__((weak)) void guk_netif_rx_batch(unsigned char **data, int *len, int n)
+{
+    int i;
+    for (i = 0; i < n; i++)
+	guk_netif_rx(data[i], len[i]);
+}
 
-        if (rx->flags & NETRXF_extra_info)
-        {
-            printk("+++++++++++++++++++++ we have extras!\n");
-            continue;
-        }
+/*
+ * zero-copy receive hook; the stack owns the buffers and returns them with
+ * guk_netbuf_free. The default passes the data on to guk_netif_rx_batch,
+ * which has to copy it, and returns the buffers right away.
+ */
+__attribute__((weak)) void guk_netif_rx_netbufs(struct netbuf **bufs, int n)
+{
+    unsigned char *data[RX_BATCH];
+    int len[RX_BATCH];
+    int i;
 
+    BUG_ON(n > RX_BATCH);
+    for (i = 0; i < n; i++) {
+	data[i] = bufs[i]->data;
+	len[i] = bufs[i]->len;
+    }
+    guk_netif_rx_batch(data, len, n);
+    for (i = 0; i < n; i++)
+	guk_netbuf_free(bufs[i]);
+}
 
-        if (rx->status == NETIF_RSP_NULL) continue;
+/*
+ * Polled receive: selected with -XX:GUKNetPoll=budget. The event handler
+ * only wakes the poll thread and leaves rsp_event alone, so the backend
+ * stops notifying us about rx until the poll thread has drained the ring
+ * and re-armed it. The poll thread hands at most budget packets to the
+ * stack before it yields the CPU.
+ */
+#define NET_POLL_OPTION "-XX:GUKNetPoll"
+static int rx_budget;           /* > 0 iff polled receive */
+static int rx_polling;          /* poll thread owns the ring, protected by net_info_lock */
+static struct thread *rx_poll_thread;
 
-        int id = rx->id;
+/*
+ * Offloads. Checksum offload on receive is only turned on with
+ * -XX:GUKNetRxCsum=1, since the stack then has to honour the netbuf flags
+ * (packets from local domains arrive without a checksum); the plain
+ * guk_netif_rx hooks cannot see them. Transmit offloads are used as the
+ * backend advertises them. We do not ask for GSO on receive, which would
+ * need multi-slot receive.
+ */
+#define NET_RX_CSUM_OPTION "-XX:GUKNetRxCsum"
+static int rx_csum;             /* backend may send NETRXF_csum_blank */
+static int net_features;        /* NETFRONT_F_xxx, fixed while ST_READY */
 
-        buf = &rx_buffers[id];
-        page = (unsigned char*)buf->page;
-        gnttab_end_access(buf->gref);
+/*
+ * consume the extra info slots that follow a response with
+ * NETRXF_extra_info; returns the index of the last one, or rp if
+ * the backend has not produced them all.
+ */
+static RING_IDX network_rx_extras(RING_IDX cons, RING_IDX rp, struct netbuf *nb)
+{
+    struct net_info *np = &net_info;
+    struct netif_extra_info *extra;
+    int id;
 
-        if(rx->status > 0) {
-            guk_netif_rx(page+rx->offset,rx->status);
-        }
+    do {
+	if (++cons == rp)
+	    return rp;
+	extra = (struct netif_extra_info *)RING_GET_RESPONSE(&np->rx, cons);
+	if (extra->type == XEN_NETIF_EXTRA_TYPE_GSO)
+	    nb->gso_size = extra->u.gso.size;
+	else if (trace_net())
+	    tprintk("netfront: unknown extra info type %d\n", extra->type);
+
+	/* the extra took a ring slot, and its buffer */
+	id = xennet_rxidx(cons);
+	netbuf_put(rx_slots[id]);
+	rx_slots[id] = NULL;
+    } while (extra->flags & XEN_NETIF_EXTRA_FLAG_MORE);
+    return cons;
+}
 
-        add_id_to_freelist(id,rx_freelist);
+/*
+ * consume up to limit packets from the rx ring into batch;
+ * called with net_info_lock held. Returns the number of packets
+ * consumed, including dropped ones.
+ */
+static int network_rx_collect(struct rx_batch *batch, int limit)
+{
+    struct net_info *np = &net_info;
+    struct netif_rx_response *rx;
+    struct netbuf *nb;
+    RING_IDX rp, cons;
+    int consumed = 0;
+    int ok;
 
-        nr_consumed++;
+    batch->n = 0;
+    rp = np->rx.sring->rsp_prod;
+    rmb(); /* Ensure we see queued responses up to 'rp'. */
 
-        ++cons;
+    for (cons = np->rx.rsp_cons; cons != rp && consumed < limit; cons++) {
+	rx = RING_GET_RESPONSE(&np->rx, cons);
+	consumed++;
+
+	nb = rx_slots[rx->id];
+	rx_slots[rx->id] = NULL;
+	BUG_ON(nb == NULL);
+	nb->flags = 0;
+	nb->gso_size = 0;
+	ok = rx->status > 0 && rx->status != NETIF_RSP_NULL;
+
+	if (rx->flags & NETRXF_extra_info) {
+	    cons = network_rx_extras(cons, rp, nb);
+	    if (cons == rp) {
+		/* cannot happen with a sane backend, it pushes whole packets */
+		netbuf_put(nb);
+		break;
+	    }
+	}
+	/* we did not ask for scatter-gather, drop any continuation */
+	if (rx->flags & NETRXF_more_data) {
+	    if (trace_net())
+		tprintk("netfront: dropping multi-slot packet\n");
+	    ok = 0;
+	    do {
+		if (cons + 1 == rp)
+		    break;
+		rx = RING_GET_RESPONSE(&np->rx, ++cons);
+		netbuf_put(rx_slots[rx->id]);
+		rx_slots[rx->id] = NULL;
+	    } while (rx->flags & NETRXF_more_data);
+	}
+
+	if (ok && !gnttab_end_access_ref(nb->gref)) {
+	    /* the backend still has it; it cannot go to the stack, nor
+	       back to the pool until the next refill manages to revoke it */
+	    if (trace_net())
+		tprintk("netfront: rx buffer %d still in use\n", (int)(nb - netbufs));
+	    nb->next = netbuf_pending;
+	    netbuf_pending = nb;
+	    continue;
+	}
+	if (ok) {
+	    nb->data = (unsigned char *)nb->page + rx->offset;
+	    nb->len = rx->status;
+	    if (rx->flags & NETRXF_csum_blank)
+		nb->flags |= NETBUF_CSUM_BLANK;
+	    if (rx->flags & NETRXF_data_validated)
+		nb->flags |= NETBUF_DATA_VALIDATED;
+	    batch->bufs[batch->n++] = nb;
+	} else
+	    netbuf_put(nb);
     }
-    np->rx.rsp_cons=rp;
-
-    int more;
-    RING_FINAL_CHECK_FOR_RESPONSES(&np->rx,more);
-    if(more)
-	goto moretodo;
+    np->rx.rsp_cons = cons;
+    return consumed;
+}
 
+/*
+ * top up the rx ring from the buffer pool with a single push;
+ * called with net_info_lock held
+ */
+static void network_rx_refill(void)
+{
+    struct net_info *np = &net_info;
     RING_IDX req_prod = np->rx.req_prod_pvt;
-
-    int i;
     netif_rx_request_t *req;
+    struct netbuf *nb;
+    struct netbuf **pp;
+    long flags;
+    int notify;
+    int n, i;
 
-    for(i=0; i<nr_consumed; i++)
-    {
-        int id = xennet_rxidx(req_prod + i);
-        req = RING_GET_REQUEST(&np->rx, req_prod + i);
-        struct net_buffer* buf = &rx_buffers[id];
-        void* page = buf->page;
+    n = NET_RX_RING_SIZE - (req_prod - np->rx.rsp_cons);
+    spin_lock_irqsave(&freelist_lock, flags);
+    for (pp = &netbuf_pending; *pp != NULL; ) {
+	nb = *pp;
+	if (gnttab_end_access_ref(nb->gref)) {
+	    *pp = nb->next;
+	    nb->next = netbuf_freelist;
+	    netbuf_freelist = nb;
+	} else
+	    pp = &nb->next;
+    }
+    for (i = 0; i < n && netbuf_freelist != NULL; i++) {
+	int id = xennet_rxidx(req_prod + i);
 
-        buf->gref = req->gref =
-            gnttab_grant_access(0,virt_to_mfn(page),0);
+	nb = netbuf_freelist;
+	netbuf_freelist = nb->next;
+	rx_slots[id] = nb;
 
-        req->id = id;
+	gnttab_grant_access_ref(nb->gref, 0, virt_to_mfn(nb->page), 0);
+	req = RING_GET_REQUEST(&np->rx, req_prod + i);
+	req->gref = nb->gref;
+	req->id = id;
     }
+    spin_unlock_irqrestore(&freelist_lock, flags);
+    rx_starved = i < n;
 
-    wmb();
+    if (i == 0)
+	return;
 
+    wmb();
     np->rx.req_prod_pvt = req_prod + i;
 
-    int notify;
     RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&np->rx, notify);
     if (notify)
         notify_remote_via_evtchn(np->evtchn);
+}
+
+/* interrupt mode receive; called from the event handler with net_info_lock held */
+static void network_rx(void)
+{
+    struct net_info *np = &net_info;
+    struct rx_batch batch;
+    int consumed, more;
+
+    if (net_info.state != ST_READY)
+	return;
 
+    do {
+	do {
+	    consumed = network_rx_collect(&batch, RX_BATCH);
+	    if (batch.n > 0) {
+		rx_thread = current;
+		guk_netif_rx_netbufs(batch.bufs, batch.n);
+		rx_thread = NULL;
+	    }
+	    network_rx_refill();
+	} while (consumed == RX_BATCH);
+	RING_FINAL_CHECK_FOR_RESPONSES(&np->rx, more);
+    } while (more);
+}
+
+static void netfront_poll(void *p)
+{
+    struct net_info *np = &net_info;
+    struct rx_batch batch;
+    int consumed, more, done;
+    long flags;
+
+    for (;;) {
+	spin_lock_irqsave(&net_info_lock, flags);
+	while (!rx_polling) {
+	    block(current);
+	    spin_unlock_irqrestore(&net_info_lock, flags);
+	    schedule();
+	    spin_lock_irqsave(&net_info_lock, flags);
+	}
+
+	for (done = 0; done < rx_budget; done += consumed) {
+	    if (np->state != ST_READY) {
+		rx_polling = 0;
+		break;
+	    }
+	    consumed = network_rx_collect(&batch,
+		    rx_budget - done < RX_BATCH ? rx_budget - done : RX_BATCH);
+	    if (consumed == 0) {
+		/* drained; post any buffers the stack has given back since,
+		   then re-arm the notification and check for a race */
+		network_rx_refill();
+		RING_FINAL_CHECK_FOR_RESPONSES(&np->rx, more);
+		if (!more) {
+		    rx_polling = 0;
+		    break;
+		}
+		continue;
+	    }
+	    spin_unlock_irqrestore(&net_info_lock, flags);
+	    if (batch.n > 0)
+		guk_netif_rx_netbufs(batch.bufs, batch.n);
+	    spin_lock_irqsave(&net_info_lock, flags);
+	    if (np->state == ST_READY)
+		network_rx_refill();
+	}
+	spin_unlock_irqrestore(&net_info_lock, flags);
+
+	/* budget used up, let other threads run before polling again */
+	if (done >= rx_budget)
+	    schedule();
+    }
 }
 
 static void network_tx_buf_gc(void)
@@ -230,6 +485,7 @@ static void network_tx_buf_gc(void)
             buf->gref=GRANT_INVALID_REF;
 
             add_id_to_freelist(id,tx_freelist);
+            np->tx_avail++;
         }
 
         np->tx.rsp_cons = prod;
@@ -253,26 +509,46 @@ static void netfront_handler(evtchn_port_t port, void *data)
     spin_lock(&net_info_lock);
 
     network_tx_buf_gc();
-    network_rx();
+    if (rx_budget > 0) {
+	if (!rx_polling && net_info.state == ST_READY) {
+	    rx_polling = 1;
+	    wake(rx_poll_thread);
+	}
+    } else
+	network_rx();
 
     spin_unlock(&net_info_lock);
 }
 
 static char* backend;
 
+extern int num_option(char *cmd_line, char *option);
+
 static void alloc_buffers(void)
 {
+    grant_ref_t ref;
     int i;
+    /* id 0 is the list head, so it is never handed out */
+    tx_freelist[0] = 0;
+    net_info.tx_avail = NET_TX_RING_SIZE - 1;
     for(i=0;i<NET_TX_RING_SIZE;i++) {
         add_id_to_freelist(i,tx_freelist);
 	if (tx_buffers[i].page == NULL)
 	    tx_buffers[i].page = (char*)alloc_page();
     }
 
-    for(i=0;i<NET_RX_RING_SIZE;i++) {
-        add_id_to_freelist(i,rx_freelist);
-	if (rx_buffers[i].page == NULL)
-	    rx_buffers[i].page = (char*)alloc_page();
+    /* the pool is built once; on resume the buffers get new refs,
+       including those still held by the stack.  The refs are granted
+       when the buffers are posted. */
+    for(i=0;i<NETBUF_POOL_SIZE;i++) {
+	if (netbufs[i].page == NULL) {
+	    netbufs[i].page = (char*)alloc_page();
+	    netbuf_put(&netbufs[i]);
+	}
+	if (netbufs[i].gref != GRANT_INVALID_REF)
+	    gnttab_end_access(netbufs[i].gref);
+	gnttab_alloc_refs(&ref, 1);
+	netbufs[i].gref = ref;
     }
 
 }
@@ -314,6 +590,8 @@ static inline int alloc_evtchn(struct net_info *info)
     clear_evtchn(op.port);        /* Without, handler gets invoked now! */
     info->local_port = bind_evtchn(op.port, ANY_CPU, netfront_handler, NULL);
     info->evtchn = op.port;
+    /* the handler drains both rings */
+    evtchn_set_batch(op.port, 1);
 
     return retval;
 }
@@ -322,11 +600,25 @@ USED static void netfront_unmap_rx_buffers(void)
 {
     int i, notify;
     struct net_info *np = &net_info;
-    for (i = 0; i < NET_RX_RING_SIZE; i++)
-    {
-        struct net_buffer* buf = &rx_buffers[i];
-	gnttab_end_transfer(buf->gref);
-	gnttab_end_access(buf->gref);
+    RING_IDX cons;
+
+    /* buffers still posted on the ring go back to the pool */
+    for (cons = np->rx.rsp_cons; cons != np->rx.req_prod_pvt; cons++) {
+	int id = xennet_rxidx(cons);
+	if (rx_slots[id] != NULL) {
+	    netbuf_put(rx_slots[id]);
+	    rx_slots[id] = NULL;
+	}
+    }
+    /* the backend is gone, so are its mappings */
+    while (netbuf_pending != NULL) {
+	struct netbuf *nb = netbuf_pending;
+	netbuf_pending = nb->next;
+	netbuf_put(nb);
+    }
+    for (i = 0; i < NETBUF_POOL_SIZE; i++) {
+	gnttab_end_access(netbufs[i].gref);
+	netbufs[i].gref = GRANT_INVALID_REF;
     }
 
     np->rx.req_prod_pvt = 0;
@@ -343,32 +635,11 @@ USED static void netfront_unmap_rx_buffers(void)
 static void init_rx_buffers(void)
 {
     struct net_info* np = &net_info;
-    int i, requeue_idx;
-    netif_rx_request_t *req;
-    int notify;
 
-    /* Rebuild the RX buffer freelist and the RX ring itself. */
+    /* Fill the RX ring from the buffer pool. */
     if (trace_net())
 	tprintk("netfront map %d pages\n", NET_RX_RING_SIZE);
-    for (requeue_idx = 0, i = 0; i < NET_RX_RING_SIZE; i++)
-    {
-        struct net_buffer* buf = &rx_buffers[requeue_idx];
-        req = RING_GET_REQUEST(&np->rx, requeue_idx);
-
-        buf->gref = req->gref =
-            gnttab_grant_access(0,virt_to_mfn(buf->page),0);
-
-        req->id = requeue_idx;
-
-        requeue_idx++;
-    }
-
-    np->rx.req_prod_pvt = requeue_idx;
-
-    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&np->rx, notify);
-
-    if (notify)
-        notify_remote_via_evtchn(np->evtchn);
+    network_rx_refill();
 
     np->rx.sring->rsp_event = np->rx.rsp_cons + 1;
 }
@@ -398,6 +669,25 @@ static char *nf_explore(void)
     return first;
 }
 
+/* returns 1 if the backend sets feature name to a non-zero value */
+static int backend_feature(char *name)
+{
+    char nodename[MAX_PATH];
+    char *value;
+    char *msg;
+    int result;
+
+    snprintf(nodename, MAX_PATH, "%s/%s", backend, name);
+    msg = xenbus_read(XBT_NIL, nodename, &value);
+    if (msg) {
+	free(msg);
+	return 0;
+    }
+    result = simple_strtol(value, NULL, 10) != 0;
+    free(value);
+    return result;
+}
+
 static void init_netfront(void)
 {
     xenbus_transaction_t xbt;
@@ -421,6 +711,11 @@ static void init_netfront(void)
 	goto out_err;
     }
 
+    rx_budget = num_option((char *)start_info.cmd_line, NET_POLL_OPTION);
+    rx_csum = num_option((char *)start_info.cmd_line, NET_RX_CSUM_OPTION) > 0;
+    if (rx_budget > 0 && rx_poll_thread == NULL)
+	rx_poll_thread = create_thread("netfront-poll", netfront_poll, UKERNEL_FLAG, NULL);
+
     info->device_id = (int)simple_strtol(device, NULL, 10);
     snprintf(nodename, MAX_PATH, "%s/%s", DEVICE_STRING, device);
 
@@ -466,6 +761,13 @@ again:
         goto abort_transaction;
     }
 
+    err = xenbus_printf(xbt, nodename, "feature-no-csum-offload", "%u", !rx_csum);
+    if (err) {
+	free(err);
+        message = "writing feature-no-csum-offload";
+        goto abort_transaction;
+    }
+
     err = xenbus_printf(xbt, nodename, "state", "%u", 4); /* connected */
     if(err) {
 	free(err);
@@ -497,6 +799,9 @@ done:
 	free(msg);
 	goto out_err_free;
     }
+    msg = xenbus_cache_subtree(backend);
+    if (msg)
+	free(msg);
 
     snprintf(nodename, MAX_PATH, "%s/%s/mac", DEVICE_STRING, device);
     msg = xenbus_read(XBT_NIL, nodename, &mac);
@@ -543,6 +848,15 @@ done:
 
     init_rx_buffers();
 
+    net_features = NETFRONT_F_CSUM;
+    if (backend_feature("feature-sg")) {
+	net_features |= NETFRONT_F_SG;
+	if (backend_feature("feature-gso-tcpv4"))
+	    net_features |= NETFRONT_F_GSO_TCPV4;
+    }
+    if (trace_net())
+	tprintk("netfront features %x, rx checksum offload %d\n", net_features, rx_csum);
+
     unsigned char rawmac[6];
         /* Special conversion specifier 'hh' needed for __ia64__. Without
            this kernel panics with 'Unaligned reference'. */
@@ -557,6 +871,8 @@ done:
     spin_lock(&net_info_lock);
     info->state = ST_READY;
     spin_unlock(&net_info_lock);
+    if (trace_net() && rx_budget > 0)
+	tprintk("netfront polled receive, budget %d\n", rx_budget);
 
     if (trace_net())
 	tprintk("** call guk_net_app_main **\n");
@@ -572,46 +888,189 @@ out_err:
     return;
 }
 
-void guk_netfront_xmit(unsigned char* data,int len)
+/* the size field of a tx request is 16 bits */
+#define MAX_TX_PACKET 0xFFFF
+
+/*
+ * put one packet on the tx ring, using one slot (and one tx page) per page
+ * of data, plus a slot for the GSO descriptor; the first request carries
+ * the size of the whole packet.
+ * Called with net_info_lock held, so the grant refs come from refs, taken
+ * before the lock. Returns 1 if the packet was queued or dropped because it
+ * is invalid, 0 if there are not enough free slots or refs.
+ */
+struct tx_refs {
+    int n;
+    int used;
+    grant_ref_t refs[NET_TX_RING_SIZE];
+};
+
+static int network_tx_queue(unsigned char *data, int len, int flags, int gso_size,
+	struct tx_refs *refs)
 {
-    int flags;
-    struct net_info* info = &net_info;
+    struct net_info *info = &net_info;
     struct netif_tx_request *tx;
+    struct netif_extra_info *gso;
+    struct net_buffer *buf;
+    int slots, extras, offset, chunk, id;
     RING_IDX i;
+
+    if (len <= 0 || len > MAX_TX_PACKET ||
+	    (len > PAGE_SIZE && !(net_features & NETFRONT_F_SG)) ||
+	    ((flags & NETFRONT_TX_GSO_TCPV4) &&
+		(!(net_features & NETFRONT_F_GSO_TCPV4) || gso_size <= 0))) {
+	if (trace_net())
+	    tprintk("netfront: dropping packet of %d bytes, flags %x\n", len, flags);
+	return 1;
+    }
+
+    slots = PFN_UP(len);
+    extras = flags & NETFRONT_TX_GSO_TCPV4 ? 1 : 0;
+    if (slots > refs->n - refs->used)
+	return 0;
+    if (slots > info->tx_avail || slots + extras > RING_FREE_REQUESTS(&info->tx)) {
+	/* reclaim completed slots inline rather than waiting for the event */
+	network_tx_buf_gc();
+	if (slots > info->tx_avail || slots + extras > RING_FREE_REQUESTS(&info->tx))
+	    return 0;
+    }
+
+    i = info->tx.req_prod_pvt;
+    for (offset = 0; offset < len; offset += chunk) {
+	chunk = len - offset > PAGE_SIZE ? PAGE_SIZE : len - offset;
+	id = get_id_from_freelist(tx_freelist);
+	buf = &tx_buffers[id];
+	memcpy(buf->page, data + offset, chunk);
+
+	tx = RING_GET_REQUEST(&info->tx, i++);
+	buf->gref = tx->gref = refs->refs[refs->used++];
+	gnttab_grant_access_ref(buf->gref, 0, virt_to_mfn(buf->page), 0);
+	tx->offset = 0;
+	tx->size = offset == 0 ? len : chunk;
+	tx->flags = offset + chunk < len ? NETTXF_more_data : 0;
+	tx->id = id;
+	info->tx_avail--;
+
+	if (offset == 0 && (flags & (NETFRONT_TX_CSUM_BLANK | NETFRONT_TX_GSO_TCPV4)))
+	    tx->flags |= NETTXF_csum_blank | NETTXF_data_validated;
+	if (offset == 0 && extras) {
+	    /* the descriptor goes in the slot after the first request */
+	    tx->flags |= NETTXF_extra_info;
+	    gso = (struct netif_extra_info *)RING_GET_REQUEST(&info->tx, i++);
+	    gso->type = XEN_NETIF_EXTRA_TYPE_GSO;
+	    gso->flags = 0;
+	    gso->u.gso.size = gso_size;
+	    gso->u.gso.type = XEN_NETIF_GSO_TYPE_TCPV4;
+	    gso->u.gso.pad = 0;
+	    gso->u.gso.features = 0;
+	}
+    }
+    info->tx.req_prod_pvt = i;
+    return 1;
+}
+
+static void network_tx_push(void)
+{
+    struct net_info *info = &net_info;
     int notify;
-    int id = get_id_from_freelist(tx_freelist);
-    struct net_buffer* buf = &tx_buffers[id];
-    void* page = buf->page;
 
+    wmb();
+    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&info->tx, notify);
+    if (notify)
+	notify_remote_via_evtchn(info->evtchn);
+}
+
+/* take a grant ref for every page of the n packets of lengths len, ring permitting */
+static void tx_refs_alloc(struct tx_refs *refs, int *len, int n)
+{
+    int i;
+
+    refs->n = refs->used = 0;
+    for (i = 0; i < n && refs->n < NET_TX_RING_SIZE; i++)
+	refs->n += len[i] > 0 ? PFN_UP(len[i]) : 0;
+    if (refs->n > NET_TX_RING_SIZE)
+	refs->n = NET_TX_RING_SIZE;
+    gnttab_alloc_refs(refs->refs, refs->n);
+}
+
+static void tx_refs_free(struct tx_refs *refs)
+{
+    gnttab_free_refs(refs->refs + refs->used, refs->n - refs->used);
+}
+
+/*
+ * transmit up to n packets with a single push and at most one notification;
+ * returns the number of packets consumed, which is less than n if the ring
+ * filled up
+ */
+int guk_netfront_xmit_batch(unsigned char **data, int *len, int n)
+{
+    struct tx_refs refs;
+    long flags;
+    int i;
+
+    tx_refs_alloc(&refs, len, n);
     spin_lock_irqsave(&net_info_lock, flags);
     if (net_info.state != ST_READY) {
 	spin_unlock_irqrestore(&net_info_lock, flags);
-	return;
+	tx_refs_free(&refs);
+	return 0;
     }
 
-    i  = info->tx.req_prod_pvt;
-    tx = RING_GET_REQUEST(&info->tx, i);
+    network_tx_buf_gc();
+    for (i = 0; i < n; i++) {
+	if (!network_tx_queue(data[i], len[i], 0, 0, &refs))
+	    break;
+    }
+    if (i > 0)
+	network_tx_push();
 
-    memcpy(page,data,len);
+    spin_unlock_irqrestore(&net_info_lock, flags);
+    tx_refs_free(&refs);
+    return i;
+}
 
-    buf->gref =
-        tx->gref = gnttab_grant_access(0,virt_to_mfn(page),0);
+/* as guk_netfront_xmit_batch, with offloads */
+int guk_netfront_xmit_packets(struct netfront_packet *pkts, int n)
+{
+    struct tx_refs refs;
+    int len[NET_TX_RING_SIZE];
+    long flags;
+    int i;
 
-    tx->offset=0;
-    tx->size = len;
-    tx->flags=0;
-    tx->id = id;
-    info->tx.req_prod_pvt = i + 1;
+    if (n > NET_TX_RING_SIZE)
+	n = NET_TX_RING_SIZE;
+    for (i = 0; i < n; i++)
+	len[i] = pkts[i].len;
+    tx_refs_alloc(&refs, len, n);
+    spin_lock_irqsave(&net_info_lock, flags);
+    if (net_info.state != ST_READY) {
+	spin_unlock_irqrestore(&net_info_lock, flags);
+	tx_refs_free(&refs);
+	return 0;
+    }
 
-    wmb();
-    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&info->tx, notify);
+    network_tx_buf_gc();
+    for (i = 0; i < n; i++) {
+	if (!network_tx_queue(pkts[i].data, pkts[i].len, pkts[i].flags, pkts[i].gso_size, &refs))
+	    break;
+    }
+    if (i > 0)
+	network_tx_push();
 
-    if(notify) 
-	notify_remote_via_evtchn(info->evtchn);
+    spin_unlock_irqrestore(&net_info_lock, flags);
+    tx_refs_free(&refs);
+    return i;
+}
 
-    //network_tx_buf_gc();
+int guk_netfront_features(void)
+{
+    return net_info.state == ST_READY ? net_features : 0;
+}
 
-    spin_unlock_irqrestore(&net_info_lock, flags);
+void guk_netfront_xmit(unsigned char* data,int len)
+{
+    guk_netfront_xmit_batch(&data, &len, 1);
 }
 
 static int netfront_shutdown(void)
@@ -697,7 +1156,7 @@ static struct service nf_service = {
 USED static int init_func(void)
 {
     memset(&net_info, 0, sizeof(net_info));
-    memset(rx_buffers, 0, sizeof(rx_buffers));
+    memset(netbufs, 0, sizeof(netbufs));
     memset(tx_buffers, 0, sizeof(tx_buffers));
     register_service(&nf_service);
     return 0;
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+
+#include <guk/rwlock.h>
+#include <guk/os.h>
+#include <guk/sched.h>
+#include <guk/arch_sched.h>
+
+/*
+ * Like spinlocks, rwlocks keep preemption disabled while held and while
+ * waiting, and account in current->lock_count.
+ */
+
+static inline void rw_reader_enter(rwlock_t *lock)
+{
+    unsigned int cnt;
+
+    for (;;) {
+        cnt = lock->cnt;
+        if (!(cnt & RW_WRITER) && cmpxchg(&lock->cnt, cnt, cnt + 1) == cnt)
+            break;
+        cpu_relax();
+    }
+}
+
+static inline void rw_reader_exit(rwlock_t *lock)
+{
+    __asm__ __volatile__(LOCK "decl %0" : "+m" (lock->cnt) : : "memory");
+}
+
+static inline void rw_writer_enter(rwlock_t *lock)
+{
+    __asm__ __volatile__(LOCK "orl %1, %0"
+            : "+m" (lock->cnt) : "ir" (RW_WRITER) : "memory");
+    while (lock->cnt != RW_WRITER)
+        cpu_relax();
+}
+
+static inline void rw_writer_exit(rwlock_t *lock)
+{
+    __asm__ __volatile__(LOCK "andl %1, %0"
+            : "+m" (lock->cnt) : "ir" (~RW_WRITER) : "memory");
+}
+
+void guk_read_lock(rwlock_t *lock)
+{
+    preempt_disable();
+    rw_reader_enter(lock);
+    current->lock_count++;
+}
+
+void guk_read_unlock(rwlock_t *lock)
+{
+    current->lock_count--;
+    rw_reader_exit(lock);
+    preempt_enable();
+}
+
+unsigned long guk_read_lock_irqsave(rwlock_t *lock)
+{
+    unsigned long flags;
+
+    preempt_disable();
+    local_irq_save(flags);
+    rw_reader_enter(lock);
+    current->lock_count++;
+    return flags;
+}
+
+void guk_read_unlock_irqrestore(rwlock_t *lock, unsigned long flags)
+{
+    current->lock_count--;
+    rw_reader_exit(lock);
+    local_irq_restore(flags);
+    preempt_enable();
+}
+
+void guk_write_lock(rwlock_t *lock)
+{
+    spin_lock(&lock->wlock);
+    rw_writer_enter(lock);
+}
+
+void guk_write_unlock(rwlock_t *lock)
+{
+    rw_writer_exit(lock);
+    spin_unlock(&lock->wlock);
+}
+
+unsigned long guk_write_lock_irqsave(rwlock_t *lock)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&lock->wlock, flags);
+    rw_writer_enter(lock);
+    return flags;
+}
+
+void guk_write_unlock_irqrestore(rwlock_t *lock, unsigned long flags)
+{
+    rw_writer_exit(lock);
+    spin_unlock_irqrestore(&lock->wlock, flags);
+}
@@ -175,7 +175,7 @@ static DEFINE_SPINLOCK(zombie_lock);
 /*
  * keep all threads regardless of their state in this list
  */
-DEFINE_SPINLOCK(thread_list_lock);
+DEFINE_RWLOCK(thread_list_lock);
 LIST_HEAD(thread_list);
 
 struct thread *get_thread_by_id(uint16_t id)
@@ -183,31 +183,31 @@ struct thread *get_thread_by_id(uint16_t id)
     struct thread *thread;
     struct list_head *list_head;
 
-    spin_lock(&thread_list_lock);
+    read_lock(&thread_list_lock);
     list_for_each(list_head, &thread_list) {
         thread = list_entry(list_head, struct thread, thread_list);
         if(thread->id == id) {
-            spin_unlock(&thread_list_lock);
+            read_unlock(&thread_list_lock);
             return thread;
         }
     }
-    spin_unlock(&thread_list_lock);
+    read_unlock(&thread_list_lock);
 
     return NULL;
 }
 
 static void add_thread_list(struct thread *thread)
 {
-    spin_lock(&thread_list_lock);
+    write_lock(&thread_list_lock);
     list_add_tail(&thread->thread_list, &thread_list);
-    spin_unlock(&thread_list_lock);
+    write_unlock(&thread_list_lock);
 }
 
 static void del_thread_list(struct thread *thread)
 {
-    spin_lock(&thread_list_lock);
+    write_lock(&thread_list_lock);
     list_del_init(&thread->thread_list);
-    spin_unlock(&thread_list_lock);
+    write_unlock(&thread_list_lock);
 }
 
 void print_runqueue_specific(int all, printk_function_ptr printk_function)
@@ -237,7 +237,7 @@ void print_runqueue_specific(int all, printk_function_ptr printk_function)
 
     printk_function("all threads in the system:\n");
     i = 0;
-    spin_lock(&thread_list_lock);
+    read_lock(&thread_list_lock);
     list_for_each(it, &thread_list)
     {
 	th = list_entry(it, struct thread, thread_list);
@@ -246,7 +246,7 @@ void print_runqueue_specific(int all, printk_function_ptr printk_function)
 		    ++i, th->name, th->id, th->flags, th->preempt_count, th->cpu);
 	}
     }
-    spin_unlock(&thread_list_lock);
+    read_unlock(&thread_list_lock);
 }
 
 void print_sleep_queue_specific(int ukernel, printk_function_ptr printk_function) {
@@ -353,10 +353,13 @@ s_time_t blocking_time(int cpu)
 
     /* sleep queue needs to be protected */
     spin_lock_irqsave(&sleep_lock, flags);
-    if (!list_empty(&sleep_queue)) {
-	sq = list_entry(sleep_queue.next, struct sleep_queue, list);
+    /* the queue is ordered by wake up time, so the first sleeper that can
+     * run on this CPU holds the earliest deadline */
+    list_for_each_entry(sq, &sleep_queue, list) {
 	if (is_ukernel(sq->thread) || sq->thread->cpu == cpu) {
-	  wakeup_time = sq->wakeup_time;
+	    if (sq->wakeup_time < wakeup_time)
+		wakeup_time = sq->wakeup_time;
+	    break;
 	}
     }
     spin_unlock_irqrestore(&sleep_lock, flags);
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+
+/* Counting semaphore, see include/guk/semaphore.h */
+
+#include <guk/os.h>
+#include <guk/sched.h>
+#include <guk/arch_sched.h>
+#include <guk/xmalloc.h>
+#include <guk/semaphore.h>
+
+struct sem_waiter {
+    struct wait_queue wait;
+    int granted;
+};
+
+void guk_down(struct semaphore *sem)
+{
+    unsigned long flags;
+    struct sem_waiter waiter = {
+        .wait = {
+            .thread = current,
+            .thread_list = LIST_HEAD_INIT(waiter.wait.thread_list),
+        },
+        .granted = 0,
+    };
+
+    BUG_ON(in_irq());
+    spin_lock_irqsave(&sem->wait.lock, flags);
+    if (likely(sem->count > 0)) {
+        sem->count--;
+        spin_unlock_irqrestore(&sem->wait.lock, flags);
+        return;
+    }
+    add_wait_queue(&sem->wait, &waiter.wait);
+    do {
+        block(current);
+        spin_unlock_irqrestore(&sem->wait.lock, flags);
+        schedule();
+        spin_lock_irqsave(&sem->wait.lock, flags);
+    } while (!waiter.granted);
+    /* guk_up has dequeued us */
+    spin_unlock_irqrestore(&sem->wait.lock, flags);
+}
+
+int guk_down_trylock(struct semaphore *sem)
+{
+    unsigned long flags;
+    int ret = 0;
+
+    spin_lock_irqsave(&sem->wait.lock, flags);
+    if (sem->count > 0) {
+        sem->count--;
+        ret = 1;
+    }
+    spin_unlock_irqrestore(&sem->wait.lock, flags);
+    return ret;
+}
+
+void guk_up(struct semaphore *sem)
+{
+    unsigned long flags;
+    struct sem_waiter *waiter;
+
+    spin_lock_irqsave(&sem->wait.lock, flags);
+    if (list_empty(&sem->wait.thread_list)) {
+        sem->count++;
+    } else {
+        waiter = list_entry(sem->wait.thread_list.next, struct sem_waiter,
+                            wait.thread_list);
+        remove_wait_queue(&waiter->wait);
+        waiter->granted = 1;
+        wake(waiter->wait.thread);
+    }
+    spin_unlock_irqrestore(&sem->wait.lock, flags);
+}
+
+struct semaphore *guk_create_semaphore(unsigned int n)
+{
+    struct semaphore *sem = (struct semaphore *)xmalloc(struct semaphore);
+    sema_init(sem, n);
+    return sem;
+}
+
+void guk_delete_semaphore(struct semaphore *sem)
+{
+    free(sem);
+}
@@ -28,89 +28,206 @@
 #include <guk/xmalloc.h>
 
 /*
- * This could be a long-held lock. We both prepare to spin for a long
- * time (making _this_ CPU preemptable if possible), and we also signal
- * towards that other CPU that it should break the lock ASAP.
- *
- * (We do this in a function because inlining it would be excessive.)
+ * Ticket locks are fair, so a waiter keeps preemption (and in the
+ * irqsave case interrupts) disabled while queued: giving up the CPU
+ * with a ticket in hand would stall every waiter behind it.  The spin
+ * count is only used to detect stuck locks.
  */
 
 #define SPIN_LOCK_MAX 100000000
 
-#define BUILD_LOCK_OPS(op, locktype)					\
-void guk_##op##_lock(locktype##_t *lock)			                \
-{									\
-	for (;;) {							\
-		preempt_disable();					\
-		if (likely(_raw_##op##_trylock(lock)))			\
-			break;						\
-		preempt_enable();					\
-									\
-		if (!(lock)->break_lock)				\
-			(lock)->break_lock = 1;				\
-		while (!op##_can_lock(lock) && (lock)->break_lock)	\
-                {                                                       \
-                        (lock)->spin_count++;                           \
-                        if ((lock)->spin_count > SPIN_LOCK_MAX) {       \
-                          struct thread *t = current;                   \
-                          xprintk("stuck spinlock %lx, thread %d\n", (lock), t->id); \
-                          crash_exit_backtrace();                                    \
-                        }                                               \
-			cpu_relax();					\
-                }                                                       \
-	}								\
-	(lock)->break_lock = 0;						\
-        (lock)->spin_count = 0;                                         \
-        current->lock_count++;                                      \
-}									\
-									\
-									\
-unsigned long guk_##op##_lock_irqsave(locktype##_t *lock)	\
-{									\
-	unsigned long flags;						\
-									\
-	for (;;) {							\
-		preempt_disable();					\
-		local_irq_save(flags);					\
-		if (likely(_raw_##op##_trylock(lock)))			\
-			break;						\
-		local_irq_restore(flags);				\
-		preempt_enable();					\
-									\
-		if (!(lock)->break_lock)				\
-			(lock)->break_lock = 1;				\
-		while (!op##_can_lock(lock) && (lock)->break_lock)	\
-                {                                                       \
-                        (lock)->spin_count++;                           \
-                        if ((lock)->spin_count > SPIN_LOCK_MAX) {       \
-                          struct thread *t = current;                   \
-                          xprintk("stuck spinlock %ld, %lx, thread %d, owner %d\n", NOW(), (lock), t->id, (lock)->owner->id); \
-                          xprintk("owner stack %lx\n", (lock)->owner->sp); \
-			  dump_sp((unsigned long *)(lock)->owner->sp, xprintk); \
-                          crash_exit_backtrace();                                    \
-                        }                                               \
-			cpu_relax();					\
-                }                                                       \
-	}								\
-	(lock)->break_lock = 0;						\
-        (lock)->spin_count = 0;                                         \
-        (lock)->owner = current;                                       \
-        current->lock_count++;                                          \
-	return flags;							\
-}									\
+#ifdef CONFIG_LOCK_STAT
+/* every lock that has been taken at least once */
+static spinlock_t *stat_locks;
+static spinlock_t stat_locks_lock = SPIN_LOCK_UNLOCKED;
 
-/*
- * Build preemption-friendly versions of the following
- * lock-spinning functions:
- *
- *         _[spin]_lock()
- *         _[spin]_lock_irqsave()
- */
-BUILD_LOCK_OPS(spin, spinlock);
+static void stat_list_lock(void)
+{
+    _raw_spin_lock(&stat_locks_lock);
+}
+
+static void stat_list_unlock(void)
+{
+    _raw_spin_unlock(&stat_locks_lock);
+}
+
+/* called with the lock held */
+static void stat_acquired(spinlock_t *lock, unsigned long long wait_start)
+{
+    unsigned long long now;
+
+    rdtscll(now);
+    if (unlikely(!lock->stat_registered)) {
+        unsigned long flags;
+
+        lock->stat_registered = 1;
+        local_irq_save(flags);
+        stat_list_lock();
+        lock->stat_next = stat_locks;
+        stat_locks = lock;
+        stat_list_unlock();
+        local_irq_restore(flags);
+    }
+    lock->acquisitions++;
+    if (wait_start) {
+        lock->contended++;
+        lock->wait_cycles += now - wait_start;
+    }
+    lock->hold_start = now;
+}
+
+static void stat_released(spinlock_t *lock)
+{
+    unsigned long long now;
+
+    rdtscll(now);
+    if (now - lock->hold_start > lock->max_hold_cycles)
+        lock->max_hold_cycles = now - lock->hold_start;
+}
+
+static void stat_unregister(spinlock_t *lock)
+{
+    spinlock_t **l;
+    unsigned long flags;
+
+    if (!lock->stat_registered)
+        return;
+    local_irq_save(flags);
+    stat_list_lock();
+    for (l = &stat_locks; *l != NULL; l = &(*l)->stat_next) {
+        if (*l == lock) {
+            *l = lock->stat_next;
+            break;
+        }
+    }
+    stat_list_unlock();
+    local_irq_restore(flags);
+}
+
+void guk_spin_lock_stat_dump(void)
+{
+    spinlock_t *lock;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    stat_list_lock();
+    xprintk("%-24s %12s %12s %16s %14s\n", "lock", "acquired",
+            "contended", "avg wait (cyc)", "max hold (cyc)");
+    for (lock = stat_locks; lock != NULL; lock = lock->stat_next) {
+        if (lock->name != NULL)
+            xprintk("%-24s ", lock->name);
+        else
+            xprintk("%-24lx ", lock);
+        xprintk("%12ld %12ld %16ld %14ld\n", lock->acquisitions,
+                lock->contended,
+                lock->contended ? lock->wait_cycles / lock->contended : 0,
+                lock->max_hold_cycles);
+    }
+    stat_list_unlock();
+    local_irq_restore(flags);
+}
+
+void guk_spin_lock_stat_reset(void)
+{
+    spinlock_t *lock;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    stat_list_lock();
+    for (lock = stat_locks; lock != NULL; lock = lock->stat_next) {
+        lock->acquisitions = 0;
+        lock->contended = 0;
+        lock->wait_cycles = 0;
+        lock->max_hold_cycles = 0;
+    }
+    stat_list_unlock();
+    local_irq_restore(flags);
+}
+#else
+#define stat_acquired(lock, wait_start)  ((void)(wait_start))
+#define stat_released(lock)
+#define stat_unregister(lock)
+
+void guk_spin_lock_stat_dump(void)
+{
+    xprintk("lock statistics not configured (CONFIG_LOCK_STAT)\n");
+}
+
+void guk_spin_lock_stat_reset(void)
+{
+}
+#endif
+
+static inline unsigned long long stat_now(void)
+{
+#ifdef CONFIG_LOCK_STAT
+    unsigned long long now;
+    rdtscll(now);
+    return now;
+#else
+    return 1;
+#endif
+}
+
+static void spin_wait(spinlock_t *lock, unsigned int ticket, int irqsave)
+{
+    unsigned long spin_count = 0;
+
+    while (!_raw_spin_ticket_ready(lock, ticket)) {
+        if (++spin_count > SPIN_LOCK_MAX) {
+            struct thread *t = current;
+            struct thread *owner = lock->owner;
+            xprintk("stuck spinlock %ld, %lx, thread %d, owner %d\n",
+                    NOW(), lock, t->id, owner != NULL ? owner->id : -1);
+            if (irqsave && owner != NULL) {
+                xprintk("owner stack %lx\n", owner->sp);
+                dump_sp((unsigned long *)owner->sp, xprintk);
+            }
+            crash_exit_backtrace();
+        }
+        cpu_relax();
+    }
+}
+
+void guk_spin_lock(spinlock_t *lock)
+{
+    unsigned int ticket;
+    unsigned long long wait_start = 0;
+
+    preempt_disable();
+    ticket = _raw_spin_ticket(lock);
+    if (unlikely(!_raw_spin_ticket_ready(lock, ticket))) {
+        wait_start = stat_now();
+        spin_wait(lock, ticket, 0);
+    }
+    stat_acquired(lock, wait_start);
+    lock->owner = current;
+    current->lock_count++;
+}
+
+unsigned long guk_spin_lock_irqsave(spinlock_t *lock)
+{
+    unsigned int ticket;
+    unsigned long flags;
+    unsigned long long wait_start = 0;
+
+    preempt_disable();
+    local_irq_save(flags);
+    ticket = _raw_spin_ticket(lock);
+    if (unlikely(!_raw_spin_ticket_ready(lock, ticket))) {
+        wait_start = stat_now();
+        spin_wait(lock, ticket, 1);
+    }
+    stat_acquired(lock, wait_start);
+    lock->owner = current;
+    current->lock_count++;
+    return flags;
+}
 
 void guk_spin_unlock(spinlock_t *lock)
 {
     current->lock_count--;
+    stat_released(lock);
     _raw_spin_unlock(lock);
 #ifdef DEBUG_LOCKS
     if (current->lock_count < 0) {
@@ -124,6 +241,7 @@ void guk_spin_unlock(spinlock_t *lock)
 void guk_spin_unlock_irqrestore(spinlock_t *lock, unsigned long flags)
 {
     current->lock_count--;
+    stat_released(lock);
     _raw_spin_unlock(lock);
     local_irq_restore(flags);
 #ifdef DEBUG_LOCKS
@@ -142,6 +260,7 @@ spinlock_t *guk_create_spin_lock(void) {
 }
 
 void guk_delete_spin_lock(spinlock_t *lock) {
+    stat_unregister(lock);
     free(lock);
 }
 
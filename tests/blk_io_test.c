@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Block I/O throughput for page aligned, unaligned (bounced) and
+ * scatter-gather buffers. Needs a block device attached to the domain,
+ * whose first TEST_SIZE bytes are overwritten.
+ */
+#include <guk/os.h>
+#include <guk/sched.h>
+#include <guk/time.h>
+#include <guk/xmalloc.h>
+#include <guk/blk_front.h>
+
+#define TEST_SIZE  (44 * PAGE_SIZE) /* four full ring requests */
+#define ITERATIONS 100
+
+static uint8_t *aligned_buf;
+static uint8_t *unaligned_buf;
+static void *page_vec[TEST_SIZE / PAGE_SIZE];
+
+static void fill(uint8_t *buf, int seed)
+{
+    int i;
+    for (i = 0; i < TEST_SIZE; i++)
+        buf[i] = (uint8_t)(i * 7 + seed);
+}
+
+static int check(uint8_t *buf, int seed)
+{
+    int i;
+    for (i = 0; i < TEST_SIZE; i++)
+        if (buf[i] != (uint8_t)(i * 7 + seed))
+            return 0;
+    return 1;
+}
+
+static void report(char *name, s_time_t start, s_time_t end)
+{
+    u64 bytes = (u64)TEST_SIZE * ITERATIONS * 2;
+    u64 usecs = (end - start) / 1000;
+    printk("%s: %ld bytes in %ld us, %ld KB/s\n", name, bytes, usecs,
+            usecs ? (bytes * 1000000 / 1024) / usecs : 0);
+}
+
+static void blk_io_tester(void *p)
+{
+    struct blk_stats before, after;
+    s_time_t start;
+    int i, j;
+
+    if (blk_get_devices() == 0) {
+        printk("FAILED: no block device\n");
+        ok_exit();
+    }
+
+    aligned_buf = blk_alloc_buf(TEST_SIZE);
+    unaligned_buf = (uint8_t *)malloc(TEST_SIZE + 8) + 8;
+    for (i = 0; i < TEST_SIZE / PAGE_SIZE; i++)
+        page_vec[i] = blk_alloc_buf(PAGE_SIZE);
+
+    blk_get_stats(&before);
+    start = NOW();
+    for (i = 0; i < ITERATIONS; i++) {
+        fill(aligned_buf, i);
+        if (blk_write(0, 0, aligned_buf, TEST_SIZE) < 0
+                || blk_read(0, 0, aligned_buf, TEST_SIZE) < 0
+                || !check(aligned_buf, i)) {
+            printk("FAILED: aligned I/O, iteration %d\n", i);
+            ok_exit();
+        }
+    }
+    report("aligned", start, NOW());
+
+    start = NOW();
+    for (i = 0; i < ITERATIONS; i++) {
+        fill(unaligned_buf, i);
+        if (blk_write(0, 0, unaligned_buf, TEST_SIZE) < 0
+                || blk_read(0, 0, unaligned_buf, TEST_SIZE) < 0
+                || !check(unaligned_buf, i)) {
+            printk("FAILED: unaligned I/O, iteration %d\n", i);
+            ok_exit();
+        }
+    }
+    report("unaligned", start, NOW());
+
+    start = NOW();
+    for (i = 0; i < ITERATIONS; i++) {
+        for (j = 0; j < TEST_SIZE / PAGE_SIZE; j++)
+            memset(page_vec[j], i + j, PAGE_SIZE);
+        if (blk_write_pages(0, 0, page_vec, TEST_SIZE) < 0
+                || blk_read_pages(0, 0, page_vec, TEST_SIZE) < 0) {
+            printk("FAILED: scatter-gather I/O, iteration %d\n", i);
+            ok_exit();
+        }
+        for (j = 0; j < TEST_SIZE / PAGE_SIZE; j++) {
+            if (((uint8_t *)page_vec[j])[PAGE_SIZE - 1] != (uint8_t)(i + j)) {
+                printk("FAILED: scatter-gather data, iteration %d\n", i);
+                ok_exit();
+            }
+        }
+    }
+    report("scatter-gather", start, NOW());
+
+    blk_get_stats(&after);
+    printk("direct bytes %ld, bounced bytes %ld\n",
+            after.direct_bytes - before.direct_bytes,
+            after.bounced_bytes - before.bounced_bytes);
+    printk("ALL SUCCESSFUL\n");
+    ok_exit();
+}
+
+int guk_app_main(void *args)
+{
+    printk("Private appmain.\n");
+    create_thread("blk_io_tester", blk_io_tester, UKERNEL_FLAG, NULL);
+
+    return 0;
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Logging throughput: threads on every CPU print short lines as fast as
+ * they can.  Run once as is and once with -XX:GUKACON=0 (drop when full)
+ * or -XX:GUKACON=1 (block) to compare direct and asynchronous output.
+ */
+#include <guk/os.h>
+#include <guk/sched.h>
+#include <guk/arch_sched.h>
+#include <guk/smp.h>
+#include <guk/time.h>
+#include <guk/completion.h>
+#include <guk/console.h>
+
+#define THREADS_PER_CPU 2
+#define LINES           5000
+
+static DECLARE_COMPLETION(loggers_done);
+static int loggers_left;
+
+static void logger(void *p)
+{
+    long id = (long)p;
+    int i;
+
+    for (i = 0; i < LINES; i++)
+        printk("logger %ld line %d of %d\n", id, i, LINES);
+    if (__sync_sub_and_fetch(&loggers_left, 1) == 0)
+        complete(&loggers_done);
+}
+
+static void tester(void *p)
+{
+    struct console_stats stats;
+    s_time_t start, logged, flushed;
+    int ncpus = smp_num_active(), n = ncpus * THREADS_PER_CPU;
+    long i;
+
+    loggers_left = n;
+    start = NOW();
+    for (i = 0; i < n; i++)
+        create_thread("logger", logger, UKERNEL_FLAG, (void *)i);
+    wait_for_completion(&loggers_done);
+    logged = NOW() - start;
+    flush_console();
+    flushed = NOW() - start;
+
+    guk_console_stats(&stats);
+    printk("%d threads on %d cpus, %d lines: logged in %ld ms (%ld lines/s), written in %ld ms\n",
+           n, ncpus, n * LINES, logged / 1000000,
+           (long)n * LINES * 1000 / (logged / 1000000 + 1), flushed / 1000000);
+    printk("async: %lu messages, %lu bytes, %lu dropped, %lu notifications\n",
+           stats.messages, stats.bytes, stats.dropped, stats.notifications);
+    printk("ALL SUCCESSFUL\n");
+    ok_exit();
+}
+
+int guk_app_main(void *args)
+{
+    printk("Private appmain.\n");
+    create_thread("tester", tester, UKERNEL_FLAG, NULL);
+    return 0;
+}
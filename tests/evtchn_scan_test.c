@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Event channel demux: runs evtchn_scan over a fake shared_info bitmap,
+ * checks that exactly the unmasked pending ports are reported and cleared,
+ * and measures the cost per scan against a scan with 32 bit words.
+ */
+#include <guk/os.h>
+#include <guk/sched.h>
+#include <guk/time.h>
+#include <guk/events.h>
+
+extern u32 rand_int(void);
+extern void seed(u32 s);
+
+#define WORD_BITS   (sizeof(unsigned long) * 8)
+#define NR_PORTS    (WORD_BITS * WORD_BITS)
+#define ITERATIONS  100000
+
+static unsigned long pending[WORD_BITS];
+static unsigned long mask[WORD_BITS];
+static unsigned long expected[WORD_BITS];
+static int seen[NR_PORTS];
+static int found;
+
+static void count_port(evtchn_port_t port)
+{
+    seen[port]++;
+    found++;
+}
+
+/* fill density out of 256 of the ports, and mask a quarter of those */
+static unsigned long fill(int density)
+{
+    unsigned long sel = 0;
+    int port;
+
+    memset(pending, 0, sizeof(pending));
+    memset(mask, 0, sizeof(mask));
+    memset(expected, 0, sizeof(expected));
+    for (port = 0; port < NR_PORTS; port++) {
+        if ((rand_int() & 0xff) >= density)
+            continue;
+        pending[port / WORD_BITS] |= 1UL << (port % WORD_BITS);
+        sel |= 1UL << (port / WORD_BITS);
+        if ((rand_int() & 3) == 0)
+            mask[port / WORD_BITS] |= 1UL << (port % WORD_BITS);
+        else
+            expected[port / WORD_BITS] |= 1UL << (port % WORD_BITS);
+    }
+    return sel;
+}
+
+/* the old demux, a bit at a time over 32 bit words */
+static int scan32(u32 sel, u32 *pend, u32 *msk)
+{
+    u32 l1, l2;
+    unsigned int l1i, l2i;
+    int count = 0;
+
+    l1 = sel;
+    while (l1 != 0) {
+        l1i = __ffs(l1);
+        l1 &= ~(1 << l1i);
+        while ((l2 = pend[l1i] & ~msk[l1i]) != 0) {
+            l2i = __ffs(l2);
+            pend[l1i] &= ~(1 << l2i);
+            count_port((l1i << 5) + l2i);
+            count++;
+        }
+    }
+    return count;
+}
+
+static int check(void)
+{
+    int port, want;
+
+    for (port = 0; port < NR_PORTS; port++) {
+        want = (expected[port / WORD_BITS] >> (port % WORD_BITS)) & 1;
+        if (seen[port] != want) {
+            printk("FAILED: port %d seen %d times, expected %d\n",
+                    port, seen[port], want);
+            return 0;
+        }
+        if (want && (pending[port / WORD_BITS] >> (port % WORD_BITS)) & 1) {
+            printk("FAILED: port %d still pending\n", port);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void scan_tester(void *p)
+{
+    static int densities[] = { 1, 16, 128, 256 };
+    unsigned long sel, save[WORD_BITS];
+    s_time_t start, t64, t32;
+    u32 sel32;
+    int d, i;
+
+    seed((u32)NOW());
+    for (d = 0; d < sizeof(densities) / sizeof(densities[0]); d++) {
+        sel = fill(densities[d]);
+        memcpy(save, pending, sizeof(pending));
+
+        memset(seen, 0, sizeof(seen));
+        evtchn_scan(sel, pending, mask, count_port);
+        if (!check())
+            ok_exit();
+
+        /* a 32 bit selector covers the first 1024 ports */
+        sel32 = 0;
+        for (i = 0; i < 32; i++)
+            if (((u32 *)save)[i] != 0)
+                sel32 |= 1U << i;
+
+        start = NOW();
+        for (i = 0; i < ITERATIONS; i++) {
+            memcpy(pending, save, sizeof(pending));
+            evtchn_scan(sel & ((1UL << (1024 / WORD_BITS)) - 1), pending, mask, count_port);
+        }
+        t64 = NOW() - start;
+
+        start = NOW();
+        for (i = 0; i < ITERATIONS; i++) {
+            memcpy(pending, save, sizeof(pending));
+            scan32(sel32, (u32 *)pending, (u32 *)mask);
+        }
+        t32 = NOW() - start;
+
+        printk("density %d/256: %ld ns per scan, %ld ns with 32 bit words\n",
+                densities[d], t64 / ITERATIONS, t32 / ITERATIONS);
+    }
+    printk("ALL SUCCESSFUL\n");
+    ok_exit();
+}
+
+int guk_app_main(void *args)
+{
+    printk("Private appmain.\n");
+    create_thread("scan_tester", scan_tester, UKERNEL_FLAG, NULL);
+    return 0;
+}
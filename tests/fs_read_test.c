@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Latency of small reads through the first fs import. Run it against
+ * fs-backend started normally (grant copy) and with "map" as its third
+ * argument to compare the two ways the backend reaches our pages.
+ */
+#include <guk/os.h>
+#include <guk/sched.h>
+#include <guk/time.h>
+#include <guk/fs.h>
+#include <guk/xmalloc.h>
+#include <fcntl.h>
+
+#define ITERATIONS 10000
+#define FILE_NAME  "fs_read_test.dat"
+
+static int sizes[] = { 16, 256, 1024, 4096 };
+static char buf[4096];
+
+static void fs_read_tester(void *p)
+{
+    struct list_head *imports = guk_fs_get_imports();
+    struct fs_import *import;
+    char path[256];
+    s_time_t start, t, max;
+    int fd, i, s;
+
+    if (imports == NULL || list_empty(imports)) {
+        printk("FAILED: no fs imports\n");
+        ok_exit();
+    }
+    import = list_entry(imports->next, struct fs_import, list);
+    sprintf(path, "%s/%s", guk_fs_import_path(import), FILE_NAME);
+
+    guk_fs_create(import, path, 0, 0644);
+    fd = guk_fs_open(import, path, O_RDWR);
+    if (fd < 0) {
+        printk("FAILED: cannot open %s: %d\n", path, fd);
+        ok_exit();
+    }
+    memset(buf, 0x5a, sizeof(buf));
+    if (guk_fs_write(import, fd, buf, sizeof(buf), 0) != sizeof(buf)) {
+        printk("FAILED: write\n");
+        ok_exit();
+    }
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        max = 0;
+        start = NOW();
+        for (i = 0; i < ITERATIONS; i++) {
+            t = NOW();
+            if (guk_fs_read(import, fd, buf, sizes[s], 0) != sizes[s]) {
+                printk("FAILED: read of %d bytes\n", sizes[s]);
+                ok_exit();
+            }
+            t = NOW() - t;
+            if (t > max)
+                max = t;
+        }
+        t = NOW() - start;
+        printk("read %d bytes: %ld ns average, %ld ns max\n",
+                sizes[s], t / ITERATIONS, max);
+    }
+
+    guk_fs_close(import, fd);
+    guk_fs_remove(import, path);
+    printk("ALL SUCCESSFUL\n");
+    ok_exit();
+}
+
+int guk_app_main(void *args)
+{
+    printk("Private appmain.\n");
+    create_thread("fs_read_tester", fs_read_tester, UKERNEL_FLAG, NULL);
+    return 0;
+}
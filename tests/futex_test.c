@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Futex wait/wake: checks the -EWOULDBLOCK, -ETIMEDOUT and -EINTR
+ * returns, then benchmarks a futex based lock (0 free, 1 locked,
+ * 2 locked with waiters) against a spinlock with two threads per cpu.
+ */
+#include <guk/os.h>
+#include <guk/sched.h>
+#include <guk/time.h>
+#include <guk/spinlock.h>
+#include <guk/semaphore.h>
+#include <guk/futex.h>
+#include <guk/xmalloc.h>
+
+#include <errno.h>
+
+#define ITERATIONS  100000
+
+static volatile int futex_lock_word;
+static volatile int wait_word;
+static DEFINE_SPINLOCK(test_spinlock);
+static DEFINE_SEMAPHORE(workers_done, 0);
+static int use_futex;
+static unsigned long shared_count;
+
+static void futex_lock(volatile int *l)
+{
+    int c = cmpxchg(l, 0, 1);
+
+    if (c == 0)
+        return;
+    if (c != 2)
+        c = xchg(l, 2);
+    while (c != 0) {
+        futex_wait(l, 2, 0);
+        c = xchg(l, 2);
+    }
+}
+
+static void futex_unlock(volatile int *l)
+{
+    if (xchg(l, 0) == 2)
+        futex_wake(l, 1);
+}
+
+static void worker(void *p)
+{
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        if (use_futex) {
+            futex_lock(&futex_lock_word);
+            shared_count++;
+            futex_unlock(&futex_lock_word);
+        } else {
+            spin_lock(&test_spinlock);
+            shared_count++;
+            spin_unlock(&test_spinlock);
+        }
+    }
+    up(&workers_done);
+}
+
+static void sleeper(void *p)
+{
+    int ret = futex_wait(&wait_word, 0, 0);
+
+    if (ret != -EINTR) {
+        printk("FAILED: interrupted wait returned %d\n", ret);
+        ok_exit();
+    }
+    up(&workers_done);
+}
+
+static void check_returns(void)
+{
+    struct thread *t;
+    s_time_t start;
+    int ret;
+
+    ret = futex_wait(&wait_word, 1, 0);
+    if (ret != -EWOULDBLOCK) {
+        printk("FAILED: wait on changed value returned %d\n", ret);
+        ok_exit();
+    }
+
+    start = NOW();
+    ret = futex_wait(&wait_word, 0, MILLISECS(10));
+    if (ret != -ETIMEDOUT || NOW() - start < MILLISECS(10)) {
+        printk("FAILED: timed wait returned %d after %ld ns\n",
+                ret, NOW() - start);
+        ok_exit();
+    }
+
+    t = create_thread("sleeper", sleeper, UKERNEL_FLAG, NULL);
+    sleep(10);
+    guk_interrupt(t);
+    down(&workers_done);
+
+    if (futex_wake(&wait_word, 1) != 0) {
+        printk("FAILED: woke a thread that is not waiting\n");
+        ok_exit();
+    }
+}
+
+static void driver(void *p)
+{
+    char name[32];
+    int nthreads = 2 * guk_sched_num_cpus();
+    int i;
+
+    check_returns();
+
+    for (use_futex = 0; use_futex <= 1; use_futex++) {
+        s_time_t start = NOW();
+        u64 usecs;
+
+        shared_count = 0;
+        for (i = 0; i < nthreads; i++) {
+            sprintf(name, "worker_%d", i);
+            create_thread(strdup(name), worker, UKERNEL_FLAG, NULL);
+        }
+        for (i = 0; i < nthreads; i++)
+            down(&workers_done);
+        usecs = (NOW() - start) / 1000;
+        if (shared_count != (unsigned long)nthreads * ITERATIONS) {
+            printk("FAILED: count %ld, expected %ld\n", shared_count,
+                    (unsigned long)nthreads * ITERATIONS);
+            ok_exit();
+        }
+        printk("%s: %d threads, %ld lock/unlock pairs in %ld us, %ld per second\n",
+                use_futex ? "futex lock" : "spinlock", nthreads, shared_count,
+                usecs, usecs ? shared_count * 1000000 / usecs : 0);
+    }
+
+    printk("ALL SUCCESSFUL\n");
+    ok_exit();
+}
+
+int guk_app_main(void *args)
+{
+    printk("Private appmain.\n");
+    create_thread("driver", driver, UKERNEL_FLAG, NULL);
+    return 0;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * gettimeofday throughput: one thread per cpu calls gettimeofday for a
+ * fixed time and checks that the time it sees never goes backwards.
+ * Reports the calls per second summed over all cpus.
+ */
+#include <guk/os.h>
+#include <guk/sched.h>
+#include <guk/time.h>
+#include <guk/spinlock.h>
+#include <guk/xmalloc.h>
+
+#define RUN_MS  2000
+
+static DEFINE_SPINLOCK(count_lock);
+static int nthreads;
+static int remaining;
+static u64 total_calls;
+static s_time_t end;
+
+static void tod_thread(void *p)
+{
+    struct timeval tv;
+    u64 calls = 0, now, last = 0;
+
+    while (NOW() < end) {
+        gettimeofday(&tv);
+        now = SECONDS(tv.tv_sec) + MICROSECS(tv.tv_usec);
+        if (now < last) {
+            printk("FAILED: time went backwards on cpu %d: %lx < %lx\n",
+                    smp_processor_id(), now, last);
+            ok_exit();
+        }
+        last = now;
+        calls++;
+    }
+
+    spin_lock(&count_lock);
+    total_calls += calls;
+    if (--remaining == 0) {
+        spin_unlock(&count_lock);
+        printk("%d threads: %ld gettimeofday calls in %d ms, %ld per second\n",
+                nthreads, total_calls, RUN_MS, total_calls * 1000 / RUN_MS);
+        printk("ALL SUCCESSFUL\n");
+        ok_exit();
+        return;
+    }
+    spin_unlock(&count_lock);
+}
+
+int guk_app_main(void *args)
+{
+    char name[32];
+    int i;
+
+    printk("Private appmain.\n");
+    nthreads = remaining = guk_sched_num_cpus();
+    end = NOW() + MILLISECS(RUN_MS);
+    for (i = 0; i < nthreads; i++) {
+        sprintf(name, "tod_%d", i);
+        create_thread(strdup(name), tod_thread, UKERNEL_FLAG, NULL);
+    }
+    return 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Grant reference allocator: grant/end access throughput with one thread
+ * per cpu, then holds more refs than the initial table has to make it grow.
+ * The grants are to dom0 for a page that is never mapped by it.
+ */
+#include <guk/os.h>
+#include <guk/sched.h>
+#include <guk/time.h>
+#include <guk/spinlock.h>
+#include <guk/gnttab.h>
+#include <guk/xmalloc.h>
+
+#define ITERATIONS   1000000
+#define HELD_REFS    8192     /* more than the 2048 of the initial table */
+
+static DEFINE_SPINLOCK(count_lock);
+static int remaining;
+static s_time_t start;
+static unsigned long frame;
+
+static void grow_tester(void *p);
+
+static void grant_thread(void *p)
+{
+    grant_ref_t ref;
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        ref = gnttab_grant_access(0, frame, 1);
+        if (!gnttab_end_access(ref)) {
+            printk("FAILED: end access of %d\n", ref);
+            ok_exit();
+        }
+    }
+
+    spin_lock(&count_lock);
+    if (--remaining == 0) {
+        u64 usecs = (NOW() - start) / 1000;
+        int cpus = guk_sched_num_cpus();
+        printk("%d cpus: %d grant/end pairs in %ld us, %ld per second\n",
+                cpus, cpus * ITERATIONS, usecs,
+                usecs ? (u64)cpus * ITERATIONS * 1000000 / usecs : 0);
+        spin_unlock(&count_lock);
+        create_thread("grow_tester", grow_tester, UKERNEL_FLAG, NULL);
+        return;
+    }
+    spin_unlock(&count_lock);
+}
+
+static void grow_tester(void *p)
+{
+    grant_ref_t *refs = xmalloc_array(grant_ref_t, HELD_REFS);
+    int i, j;
+
+    for (i = 0; i < HELD_REFS; i++) {
+        refs[i] = gnttab_grant_access(0, frame, 1);
+        for (j = 0; j < i; j += 97) {
+            if (refs[j] == refs[i]) {
+                printk("FAILED: ref %d handed out twice\n", refs[i]);
+                ok_exit();
+            }
+        }
+    }
+    printk("holding %d grant refs\n", HELD_REFS);
+    for (i = 0; i < HELD_REFS; i++)
+        gnttab_end_access(refs[i]);
+    free(refs);
+
+    printk("ALL SUCCESSFUL\n");
+    ok_exit();
+}
+
+int guk_app_main(void *args)
+{
+    char name[32];
+    int i;
+
+    printk("Private appmain.\n");
+    frame = virt_to_mfn(alloc_page());
+    remaining = guk_sched_num_cpus();
+    start = NOW();
+    for (i = 0; i < remaining; i++) {
+        sprintf(name, "grant_%d", i);
+        create_thread(strdup(name), grant_thread, UKERNEL_FLAG, NULL);
+    }
+    return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Sleep jitter: nanosleeps of 50us, 100us and 500us, reporting how late
+ * the sleeper woke up (min/avg/max).  Run with -XX:GUKHRT to get below
+ * the default 1ms timer floor; a busy thread per cpu checks that the
+ * sleeper is still woken on time while the cpus are loaded.
+ */
+#include <guk/os.h>
+#include <guk/sched.h>
+#include <guk/time.h>
+#include <guk/xmalloc.h>
+
+#define ROUNDS 200
+
+static s_time_t periods[] = { MICROSECS(50), MICROSECS(100), MICROSECS(500) };
+static volatile int finished;
+
+static void busy(void *p)
+{
+    while (!finished)
+        cpu_relax();
+}
+
+static void sleeper(void *p)
+{
+    s_time_t start, late, min, max, total;
+    int i, j;
+
+    for (i = 0; i < sizeof(periods) / sizeof(periods[0]); i++) {
+        min = Time_Max;
+        max = total = 0;
+        for (j = 0; j < ROUNDS; j++) {
+            start = NOW();
+            nanosleep(periods[i]);
+            late = NOW() - start - periods[i];
+            if (late < 0) {
+                printk("FAILED: %ld ns sleep returned %ld ns early\n",
+                        periods[i], -late);
+                ok_exit();
+            }
+            if (late < min)
+                min = late;
+            if (late > max)
+                max = late;
+            total += late;
+        }
+        printk("%4ld us sleep: late by min %ld us, avg %ld us, max %ld us\n",
+                periods[i] / 1000, min / 1000, total / ROUNDS / 1000, max / 1000);
+    }
+    finished = 1;
+    printk("ALL SUCCESSFUL\n");
+    ok_exit();
+}
+
+int guk_app_main(void *args)
+{
+    char name[32];
+    int i;
+
+    printk("Private appmain.\n");
+    for (i = 0; i < guk_sched_num_cpus(); i++) {
+        sprintf(name, "busy_%d", i);
+        create_thread(strdup(name), busy, UKERNEL_FLAG, NULL);
+    }
+    create_thread("sleeper", sleeper, UKERNEL_FLAG, NULL);
+    return 0;
+}
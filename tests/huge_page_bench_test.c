@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * TLB heavy benchmark for 2MB heap pages. A HEAP_VM and a DATA_VM region of
+ * the same size are each walked by a pointer chase that visits every page once
+ * in random order, so nearly every access misses the TLB. The HEAP_VM region is
+ * on 2MB pages as far as machine memory allows; DATA_VM is always on 4K pages.
+ */
+#include <guk/os.h>
+#include <guk/sched.h>
+#include <guk/time.h>
+#include <guk/mm.h>
+
+#define REGION_PAGES (64 * 256)   /* 64MB */
+#define ROUNDS       16
+
+extern void seed(u32 s);
+extern u32 rand_int(void);
+
+static unsigned long order[REGION_PAGES];
+static void * volatile sink;   /* keeps the chase from being optimized away */
+
+/* Link every page of the region into one random cycle, at varying offsets */
+static void **build_chase(unsigned long region)
+{
+    unsigned long i;
+    for (i = 0; i < REGION_PAGES; i++)
+        order[i] = i;
+    for (i = REGION_PAGES - 1; i > 0; i--) {
+        unsigned long j = rand_int() % (i + 1);
+        unsigned long t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+    for (i = 0; i < REGION_PAGES; i++) {
+        unsigned long next = order[(i + 1) % REGION_PAGES];
+        *(void **)(region + order[i] * PAGE_SIZE + (order[i] % 64) * 64) =
+            (void *)(region + next * PAGE_SIZE + (next % 64) * 64);
+    }
+    return (void **)(region + order[0] * PAGE_SIZE + (order[0] % 64) * 64);
+}
+
+static void chase(char *name, unsigned long region)
+{
+    void **p = build_chase(region);
+    unsigned long i, n = (unsigned long)REGION_PAGES * ROUNDS;
+    s_time_t start = NOW();
+    for (i = 0; i < n; i++)
+        p = (void **)*p;
+    s_time_t end = NOW();
+    sink = p;
+    printk("%s: %ld accesses in %ld us, %ld ns per access\n", name, n,
+           (end - start) / 1000, (end - start) / n);
+}
+
+static void report(char *when, struct heap_page_stats *s)
+{
+    printk("%s: huge pages %ld, small pages %ld, huge allocations %ld, fallbacks %ld\n",
+           when, s->huge_pages, s->small_pages, s->huge_allocations, s->fallbacks);
+}
+
+static void huge_page_tester(void *p)
+{
+    struct heap_page_stats before, during, after;
+    unsigned long heap, data, pte;
+    long pfn;
+
+    seed((u32)NOW());
+    guk_heap_page_stats(&before);
+    heap = allocate_pages(REGION_PAGES, HEAP_VM);
+    data = allocate_pages(REGION_PAGES, DATA_VM);
+    if (heap == 0 || data == 0) {
+        printk("FAILED: could not allocate %d pages\n", REGION_PAGES);
+        ok_exit();
+    }
+    guk_heap_page_stats(&during);
+    report("allocated", &during);
+    if (during.huge_pages + during.small_pages
+            != before.huge_pages + before.small_pages + REGION_PAGES) {
+        printk("FAILED: coverage does not add up\n");
+        ok_exit();
+    }
+
+    /* whatever the mapping, the 1-1 translation must hold */
+    pfn = guk_not11_virt_to_pfn(heap + REGION_PAGES / 2 * PAGE_SIZE + 8, &pte);
+    if (pfn != virt_to_pfn(heap) + REGION_PAGES / 2) {
+        printk("FAILED: heap translates to pfn %ld, pte %lx\n", pfn, pte);
+        ok_exit();
+    }
+
+    chase("heap (HEAP_VM)", heap);
+    chase("data (DATA_VM)", data);
+
+    deallocate_pages((void *)heap, REGION_PAGES, HEAP_VM);
+    deallocate_pages((void *)data, REGION_PAGES, DATA_VM);
+    guk_heap_page_stats(&after);
+    report("deallocated", &after);
+    if (after.huge_pages != before.huge_pages || after.small_pages != before.small_pages) {
+        printk("FAILED: coverage not released\n");
+        ok_exit();
+    }
+
+    printk("ALL SUCCESSFUL\n");
+    ok_exit();
+}
+
+int guk_app_main(void *args)
+{
+    printk("Private appmain.\n");
+    create_thread("huge_page_tester", huge_page_tester, UKERNEL_FLAG, NULL);
+
+    return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Mutex and semaphore against spinlocks with long hold times: two
+ * threads per cpu take the same lock repeatedly and hold it for
+ * HOLD_US busy microseconds.  One bystander thread per cpu counts loop
+ * iterations, showing how much cpu time the waiters leave to others.
+ * The worker completions are counted with a semaphore that is mostly
+ * signalled before it is waited on, which checks no up() is lost.
+ */
+#include <guk/os.h>
+#include <guk/sched.h>
+#include <guk/time.h>
+#include <guk/spinlock.h>
+#include <guk/mutex.h>
+#include <guk/semaphore.h>
+#include <guk/xmalloc.h>
+
+#define ITERATIONS  200
+#define HOLD_US     200
+
+enum { SPINLOCK, MUTEX, SEMAPHORE };
+static char *lock_names[] = { "spinlock", "mutex", "semaphore" };
+
+static DEFINE_SPINLOCK(test_spinlock);
+static DEFINE_MUTEX(test_mutex);
+static DEFINE_SEMAPHORE(test_sem, 1);
+static DEFINE_SEMAPHORE(workers_done, 0);
+
+static int lock_kind;
+static int in_section;
+static unsigned long shared_count;
+static volatile unsigned long bystander_count;
+static volatile int finished;
+
+static void hold(void)
+{
+    s_time_t end = NOW() + MICROSECS(HOLD_US);
+
+    if (in_section++ != 0) {
+        printk("FAILED: two holders of the %s\n", lock_names[lock_kind]);
+        ok_exit();
+    }
+    while (NOW() < end)
+        cpu_relax();
+    shared_count++;
+    in_section--;
+}
+
+static void worker(void *p)
+{
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        switch (lock_kind) {
+        case SPINLOCK:
+            spin_lock(&test_spinlock);
+            hold();
+            spin_unlock(&test_spinlock);
+            break;
+        case MUTEX:
+            mutex_lock(&test_mutex);
+            hold();
+            mutex_unlock(&test_mutex);
+            break;
+        case SEMAPHORE:
+            down(&test_sem);
+            hold();
+            up(&test_sem);
+            break;
+        }
+    }
+    up(&workers_done);
+}
+
+static void bystander(void *p)
+{
+    while (!finished)
+        bystander_count++;
+}
+
+static void driver(void *p)
+{
+    char name[32];
+    int nthreads = 2 * guk_sched_num_cpus();
+    int i;
+
+    for (i = 0; i < guk_sched_num_cpus(); i++) {
+        sprintf(name, "bystander_%d", i);
+        create_thread(strdup(name), bystander, UKERNEL_FLAG, NULL);
+    }
+
+    for (lock_kind = SPINLOCK; lock_kind <= SEMAPHORE; lock_kind++) {
+        s_time_t start = NOW();
+        unsigned long bystander_start = bystander_count;
+
+        shared_count = 0;
+        for (i = 0; i < nthreads; i++) {
+            sprintf(name, "%s_%d", lock_names[lock_kind], i);
+            create_thread(strdup(name), worker, UKERNEL_FLAG, NULL);
+        }
+        for (i = 0; i < nthreads; i++)
+            down(&workers_done);
+        if (shared_count != (unsigned long)nthreads * ITERATIONS) {
+            printk("FAILED: %s count %ld, expected %ld\n", lock_names[lock_kind],
+                    shared_count, (unsigned long)nthreads * ITERATIONS);
+            ok_exit();
+        }
+        printk("%-9s %d threads x %d holds of %d us: %ld us, bystander %ld\n",
+                lock_names[lock_kind], nthreads, ITERATIONS, HOLD_US,
+                (NOW() - start) / 1000, bystander_count - bystander_start);
+    }
+    finished = 1;
+
+    if (down_trylock(&workers_done)) {
+        printk("FAILED: semaphore count too high\n");
+        ok_exit();
+    }
+    printk("ALL SUCCESSFUL\n");
+    ok_exit();
+}
+
+int guk_app_main(void *args)
+{
+    printk("Private appmain.\n");
+    create_thread("driver", driver, UKERNEL_FLAG, NULL);
+    return 0;
+}
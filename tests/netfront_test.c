@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Netfront transmit rate, one packet per call versus batches, followed by
+ * the receive rate and scheduler latency while the domain is flooded
+ * (e.g. ping -f from dom0). Run with -XX:GUKNetPoll=64 to compare polled
+ * with interrupt mode receive.
+ * Needs a vif attached to the domain; the frames are broadcast
+ * with an unused ethertype.
+ * The bulk phase sends TCP data to a TEST-NET address as MTU sized frames
+ * checksummed here, then as 60k GSO segments if the backend supports it.
+ */
+#include <guk/os.h>
+#include <guk/sched.h>
+#include <guk/time.h>
+#include <guk/netfront.h>
+
+#define NUM_PACKETS  100000
+#define BATCH        32
+#define PACKET_SIZE  64
+#define LARGE_SIZE   (3 * PAGE_SIZE)
+#define RX_SECONDS   10
+#define MTU          1500
+#define GSO_SIZE     (60 * 1024)
+#define BULK_BYTES   (1024 * 1024 * 1024)
+
+static long rx_packets;
+static s_time_t max_latency;
+static int rx_done;
+
+static unsigned char packet[LARGE_SIZE];
+static unsigned char tcp_packet[14 + GSO_SIZE];
+static unsigned char mac_addr[6];
+
+static void build_packet(int len)
+{
+    memset(packet, 0xff, 6);                /* broadcast */
+    memcpy(packet + 6, mac_addr, 6);
+    packet[12] = 0x88;                      /* local experimental ethertype */
+    packet[13] = 0xb5;
+    memset(packet + 14, 0x5a, len - 14);
+}
+
+static u32 csum_add(u32 sum, unsigned char *p, int len)
+{
+    int i;
+    for (i = 0; i + 1 < len; i += 2)
+        sum += (p[i] << 8) | p[i + 1];
+    if (len & 1)
+        sum += p[len - 1] << 8;
+    return sum;
+}
+
+static u16 csum_fold(u32 sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+/*
+ * ethernet + IPv4 + TCP segment of len bytes to 192.0.2.1; the TCP checksum
+ * is complete, or just the pseudo-header sum for the backend to finish
+ */
+static void build_tcp_packet(int len, int partial)
+{
+    unsigned char *ip = tcp_packet + 14;
+    unsigned char *tcp = ip + 20;
+    int ip_len = len - 14;
+    int tcp_len = ip_len - 20;
+    u32 sum;
+
+    memset(tcp_packet, 0, len);
+    memset(tcp_packet, 0xff, 6);
+    memcpy(tcp_packet + 6, mac_addr, 6);
+    tcp_packet[12] = 0x08;                  /* IPv4 */
+    ip[0] = 0x45;
+    ip[2] = ip_len >> 8;
+    ip[3] = ip_len;
+    ip[8] = 64;                             /* ttl */
+    ip[9] = 6;                              /* TCP */
+    ip[12] = 192; ip[13] = 0; ip[14] = 2; ip[15] = 2;
+    ip[16] = 192; ip[17] = 0; ip[18] = 2; ip[19] = 1;
+    sum = csum_fold(csum_add(0, ip, 20));
+    ip[10] = ~sum >> 8;
+    ip[11] = ~sum;
+
+    tcp[0] = 0x80; tcp[1] = 0x00;           /* ports 32768 -> 9 (discard) */
+    tcp[3] = 9;
+    tcp[12] = 5 << 4;
+    tcp[13] = 0x18;                         /* PSH ACK */
+    tcp[14] = 0xff; tcp[15] = 0xff;
+    memset(tcp + 20, 0x5a, tcp_len - 20);
+
+    /* pseudo header */
+    sum = csum_add(0, ip + 12, 8) + 6 + tcp_len;
+    if (!partial) {
+        sum = ~csum_fold(csum_add(sum, tcp, tcp_len));
+    } else
+        sum = csum_fold(sum);
+    tcp[16] = sum >> 8;
+    tcp[17] = sum;
+}
+
+static void report_bulk(char *name, long bytes, s_time_t start, s_time_t end)
+{
+    u64 usecs = (end - start) / 1000;
+    printk("%s: %ld bytes in %ld us, %ld Mbit/s\n", name, bytes, usecs,
+            usecs ? (u64)bytes * 8 / usecs : 0);
+}
+
+static void bulk_send(char *name, int len, int flags)
+{
+    struct netfront_packet pkts[BATCH];
+    s_time_t start;
+    long sent;
+    int i, n;
+
+    for (i = 0; i < BATCH; i++) {
+        pkts[i].data = tcp_packet;
+        pkts[i].len = len;
+        pkts[i].flags = flags;
+        pkts[i].gso_size = MTU - 40;
+    }
+    sent = 0;
+    start = NOW();
+    while (sent < BULK_BYTES) {
+        if (flags == 0) {
+            /* software checksum, as a stack without offload does per frame */
+            for (i = 0; i < BATCH; i++)
+                build_tcp_packet(len, 0);
+        }
+        n = netfront_xmit_packets(pkts, BATCH);
+        if (n == 0)
+            schedule();
+        sent += (long)n * (len - 14 - 40);
+    }
+    report_bulk(name, sent, start, NOW());
+}
+
+static void report(char *name, long packets, s_time_t start, s_time_t end)
+{
+    u64 usecs = (end - start) / 1000;
+    printk("%s: %ld packets in %ld us, %ld packets/s\n", name, packets, usecs,
+            usecs ? (u64)packets * 1000000 / usecs : 0);
+}
+
+static void netfront_tester(void *p)
+{
+    unsigned char *data[BATCH];
+    int len[BATCH];
+    s_time_t start;
+    long sent;
+    int i, n;
+
+    build_packet(PACKET_SIZE);
+    start = NOW();
+    for (i = 0; i < NUM_PACKETS; i++)
+        netfront_xmit(packet, PACKET_SIZE);
+    report("single", NUM_PACKETS, start, NOW());
+
+    for (i = 0; i < BATCH; i++) {
+        data[i] = packet;
+        len[i] = PACKET_SIZE;
+    }
+    sent = 0;
+    start = NOW();
+    while (sent < NUM_PACKETS) {
+        n = netfront_xmit_batch(data, len, BATCH);
+        if (n == 0)
+            schedule();
+        sent += n;
+    }
+    report("batched", sent, start, NOW());
+
+    /* multi-slot packets */
+    if (!(netfront_features() & NETFRONT_F_SG)) {
+        printk("FAILED: backend does not support scatter-gather\n");
+        ok_exit();
+    }
+    build_packet(LARGE_SIZE);
+    for (i = 0; i < BATCH; i++)
+        len[i] = LARGE_SIZE;
+    sent = 0;
+    start = NOW();
+    while (sent < NUM_PACKETS / 10) {
+        n = netfront_xmit_batch(data, len, BATCH);
+        if (n == 0)
+            schedule();
+        sent += n;
+    }
+    report("multi-slot", sent, start, NOW());
+
+    bulk_send("bulk mtu", 14 + MTU, 0);
+    if (netfront_features() & NETFRONT_F_GSO_TCPV4) {
+        build_tcp_packet(14 + GSO_SIZE, 1);
+        bulk_send("bulk gso", 14 + GSO_SIZE, NETFRONT_TX_GSO_TCPV4);
+    } else
+        printk("backend does not support GSO\n");
+
+    printk("receiving for %d seconds\n", RX_SECONDS);
+    rx_packets = 0;
+    max_latency = 0;
+    start = NOW();
+    sleep(RX_SECONDS * 1000);
+    rx_done = 1;
+    report("received", rx_packets, start, NOW());
+    printk("max scheduler latency %ld us\n", max_latency / 1000);
+
+    printk("ALL SUCCESSFUL\n");
+    ok_exit();
+}
+
+/* how late a 1ms sleeper wakes up while packets are received */
+static void latency_thread(void *p)
+{
+    s_time_t start, late;
+
+    while (!rx_done) {
+        start = NOW();
+        sleep(1);
+        late = NOW() - start - MILLISECS(1);
+        if (late > max_latency)
+            max_latency = late;
+    }
+}
+
+void guk_netif_rx(unsigned char *data, int len)
+{
+    rx_packets++;
+}
+
+void guk_net_app_main(unsigned char *mac, char *nic)
+{
+    if (mac == NULL) {
+        printk("FAILED: no network device\n");
+        ok_exit();
+    }
+    memcpy(mac_addr, mac, 6);
+    create_thread("netfront_tester", netfront_tester, UKERNEL_FLAG, NULL);
+    create_thread("latency", latency_thread, UKERNEL_FLAG, NULL);
+}
+
+int guk_app_main(void *args)
+{
+    printk("Private appmain.\n");
+    return 0;
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Cost of building the page tables for 1GB of 4K pages, in hypercalls and
+ * time. Every virtual page maps the same scratch page so that no memory
+ * other than the page table frames is needed. The range is built twice, the
+ * second time over the frames left behind by demolish_pagetable.
+ */
+#include <guk/os.h>
+#include <guk/sched.h>
+#include <guk/time.h>
+#include <guk/mm.h>
+
+#define MAP_SIZE   (1UL << 30)
+
+static long scratch_alloc(pfn_alloc_env_t *env, unsigned long addr)
+{
+    return env->pfn;
+}
+
+static void report(char *name, struct pagetable_stats *before,
+                   struct pagetable_stats *after, s_time_t start, s_time_t end)
+{
+    unsigned long frames = after->frames - before->frames;
+    unsigned long updates = after->updates - before->updates;
+    printk("%s: %ld hypercalls, %ld frames, %ld updates, %ld us\n", name,
+           after->hypercalls - before->hypercalls, frames, updates,
+           (end - start) / 1000);
+    /* one hypercall per L1 table's worth of entries plus three per new frame */
+    printk("%s: unbatched would have been %ld hypercalls\n", name,
+           3 * frames + (updates - frames + L1_PAGETABLE_ENTRIES - 1) / L1_PAGETABLE_ENTRIES);
+}
+
+static int map(char *name, unsigned long va, unsigned long scratch)
+{
+    struct pfn_alloc_env map_env = {
+        .pfn_alloc = scratch_alloc
+    };
+    struct pfn_alloc_env frame_env = {
+        .pfn_alloc = pfn_alloc_alloc
+    };
+    struct pagetable_stats before, after;
+    s_time_t start, end;
+    int ok;
+
+    map_env.pfn = pfn_to_mfn(virt_to_pfn(scratch));
+    guk_pagetable_stats(&before);
+    start = NOW();
+    ok = build_pagetable(va, va + MAP_SIZE, &map_env, &frame_env);
+    end = NOW();
+    guk_pagetable_stats(&after);
+    report(name, &before, &after, start, end);
+    return ok;
+}
+
+static void pagetable_tester(void *p)
+{
+    unsigned long scratch = allocate_pages(1, DATA_VM);
+    /* well clear of the 1-1 area and the grant table that follows it */
+    unsigned long va = (pfn_to_virtu(maximum_ram_page()) + 2 * MAP_SIZE - 1) & ~(MAP_SIZE - 1);
+    int i;
+
+    if (scratch == 0) {
+        printk("FAILED: no scratch page\n");
+        ok_exit();
+    }
+    memset((void *)scratch, 0, PAGE_SIZE);
+
+    for (i = 0; i < 2; i++) {
+        if (!map(i == 0 ? "cold" : "warm", va, scratch)) {
+            printk("FAILED: out of memory for page table frames\n");
+            ok_exit();
+        }
+        *(volatile int *)(va + MAP_SIZE - PAGE_SIZE + 8 * i) = i + 1;
+        if (((int *)scratch)[2 * i] != i + 1) {
+            printk("FAILED: mapping does not reach the scratch page\n");
+            ok_exit();
+        }
+        demolish_pagetable(va, va + MAP_SIZE);
+        if (validate(va)) {
+            printk("FAILED: range still mapped after demolish\n");
+            ok_exit();
+        }
+    }
+
+    printk("ALL SUCCESSFUL\n");
+    ok_exit();
+}
+
+int guk_app_main(void *args)
+{
+    printk("Private appmain.\n");
+    create_thread("pagetable_tester", pagetable_tester, UKERNEL_FLAG, NULL);
+
+    return 0;
+}
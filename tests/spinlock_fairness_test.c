@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Spinlock fairness and throughput: one thread per cpu hammers a single
+ * lock for a fixed time with a short critical section.  Reports the
+ * acquisitions per second and the spread of per-thread acquisition
+ * counts; a thread that never got the lock fails the test.
+ */
+#include <guk/os.h>
+#include <guk/sched.h>
+#include <guk/time.h>
+#include <guk/spinlock.h>
+#include <guk/xmalloc.h>
+
+#define RUN_MS        2000
+#define HOLD_SPINS    50
+#define MAX_THREADS   64
+
+static DEFINE_SPINLOCK(test_lock);
+static DEFINE_SPINLOCK(count_lock);
+static unsigned long shared_count;
+static unsigned long acquired[MAX_THREADS];
+static int nthreads;
+static int remaining;
+static s_time_t end;
+
+static void report(void)
+{
+    unsigned long total = 0, min = ~0UL, max = 0;
+    int i;
+
+    for (i = 0; i < nthreads; i++) {
+        printk("thread %d: %ld acquisitions\n", i, acquired[i]);
+        total += acquired[i];
+        if (acquired[i] < min)
+            min = acquired[i];
+        if (acquired[i] > max)
+            max = acquired[i];
+    }
+    printk("%d threads: %ld acquisitions in %d ms, %ld per second\n",
+            nthreads, total, RUN_MS, total * 1000 / RUN_MS);
+    printk("fairness: min %ld, max %ld, max/min %ld.%02ld\n", min, max,
+            min ? max / min : 0, min ? (max * 100 / min) % 100 : 0);
+    spin_lock_stat_dump();
+
+    if (total != shared_count) {
+        printk("FAILED: %ld acquisitions but shared count %ld\n",
+                total, shared_count);
+        ok_exit();
+    }
+    if (min == 0) {
+        printk("FAILED: a thread never acquired the lock\n");
+        ok_exit();
+    }
+    printk("ALL SUCCESSFUL\n");
+    ok_exit();
+}
+
+static void lock_thread(void *p)
+{
+    int id = (int)(u64)p;
+    unsigned long count = 0;
+    int i;
+
+    while (NOW() < end) {
+        spin_lock(&test_lock);
+        shared_count++;
+        for (i = 0; i < HOLD_SPINS; i++)
+            cpu_relax();
+        spin_unlock(&test_lock);
+        count++;
+    }
+    acquired[id] = count;
+
+    spin_lock(&count_lock);
+    if (--remaining == 0) {
+        spin_unlock(&count_lock);
+        report();
+        return;
+    }
+    spin_unlock(&count_lock);
+}
+
+int guk_app_main(void *args)
+{
+    char name[32];
+    int i;
+
+    printk("Private appmain.\n");
+    nthreads = guk_sched_num_cpus();
+    if (nthreads < 2)
+        nthreads = 2;
+    if (nthreads > MAX_THREADS)
+        nthreads = MAX_THREADS;
+    remaining = nthreads;
+    end = NOW() + MILLISECS(RUN_MS);
+    for (i = 0; i < nthreads; i++) {
+        sprintf(name, "lock_%d", i);
+        create_thread(strdup(name), lock_thread, UKERNEL_FLAG, (void *)(u64)i);
+    }
+    return 0;
+}
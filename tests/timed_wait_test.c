@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Timed waits: checks that wait_for_completion_timeout and
+ * wait_event_timeout time out when nothing happens, and measures how
+ * long it takes a waiter to notice a signal, compared with polling the
+ * condition every 10 ms with sleep().
+ */
+#include <guk/os.h>
+#include <guk/sched.h>
+#include <guk/arch_sched.h>
+#include <guk/time.h>
+#include <guk/completion.h>
+#include <guk/wait.h>
+#include <guk/xmalloc.h>
+
+#define ROUNDS      20
+#define POLL_MS     10
+
+static DECLARE_COMPLETION(comp);
+static DECLARE_WAIT_QUEUE_HEAD(wq);
+static volatile int flag;
+static volatile s_time_t signal_time;
+
+static void signaller(void *p)
+{
+    int how = (int)(u64)p;
+
+    sleep(3);
+    signal_time = NOW();
+    if (how == 0) {
+        complete(&comp);
+    } else {
+        flag = 1;
+        wake_up(&wq);
+    }
+}
+
+static s_time_t latency(int how)
+{
+    s_time_t total = 0;
+    int i;
+
+    for (i = 0; i < ROUNDS; i++) {
+        flag = 0;
+        create_thread("signaller", signaller, UKERNEL_FLAG, (void *)(u64)how);
+        switch (how) {
+        case 0:
+            if (!wait_for_completion_timeout(&comp, SECONDS(1))) {
+                printk("FAILED: completion timed out\n");
+                ok_exit();
+            }
+            break;
+        case 1:
+            if (!wait_event_timeout(wq, flag, SECONDS(1))) {
+                printk("FAILED: wait_event timed out\n");
+                ok_exit();
+            }
+            break;
+        case 2:
+            while (!flag)
+                sleep(POLL_MS);
+            break;
+        }
+        total += NOW() - signal_time;
+        sleep(5);
+    }
+    return total / ROUNDS;
+}
+
+static void tester(void *p)
+{
+    s_time_t start, waited;
+
+    start = NOW();
+    if (wait_for_completion_timeout(&comp, MILLISECS(20)) != 0) {
+        printk("FAILED: completion did not time out\n");
+        ok_exit();
+    }
+    waited = NOW() - start;
+    if (waited < MILLISECS(20)) {
+        printk("FAILED: completion timed out after %ld ns\n", waited);
+        ok_exit();
+    }
+
+    flag = 0;
+    start = NOW();
+    if (wait_event_timeout(wq, flag, MILLISECS(20)) != 0) {
+        printk("FAILED: wait_event did not time out\n");
+        ok_exit();
+    }
+    waited = NOW() - start;
+    if (waited < MILLISECS(20)) {
+        printk("FAILED: wait_event timed out after %ld ns\n", waited);
+        ok_exit();
+    }
+
+    printk("wake latency: completion %ld us, wait_event %ld us, "
+           "sleep(%d) polling %ld us\n", latency(0) / 1000, latency(1) / 1000,
+           POLL_MS, latency(2) / 1000);
+    printk("ALL SUCCESSFUL\n");
+    ok_exit();
+}
+
+int guk_app_main(void *args)
+{
+    printk("Private appmain.\n");
+    create_thread("tester", tester, UKERNEL_FLAG, NULL);
+    return 0;
+}
@@ -45,6 +45,33 @@ static DEFINE_SPINLOCK(time_lock);
 u64 last_time_val = 0;
 int last_cpu = 0;
 u64 total_time_tests = 0;
+s_time_t last_fast_val = 0;
+int last_fast_cpu = 0;
+
+#define BENCH_CALLS 1000000
+
+/* average cost of the clock functions, in ns per call */
+static void clock_bench(void)
+{
+    struct timeval tv;
+    s_time_t start;
+    int i;
+
+    start = NOW();
+    for (i = 0; i < BENCH_CALLS; i++)
+        fast_now();
+    printk("fast_now:     %ld ns per call\n", (NOW() - start) / BENCH_CALLS);
+
+    start = NOW();
+    for (i = 0; i < BENCH_CALLS; i++)
+        (void)NOW();
+    printk("NOW:          %ld ns per call\n", (NOW() - start) / BENCH_CALLS);
+
+    start = NOW();
+    for (i = 0; i < BENCH_CALLS; i++)
+        gettimeofday(&tv);
+    printk("gettimeofday: %ld ns per call\n", (NOW() - start) / BENCH_CALLS);
+}
 
 
 void thread_fn(void *pickled_id)
@@ -53,6 +80,7 @@ void thread_fn(void *pickled_id)
     u32 ms = rand_int() & 0xFFF;
     int id = (int)(u64)pickled_id;
     u64 current_time;
+    s_time_t fast_time;
     
     gettimeofday(&timeval_start);
     gettimeofday(&timeval_end);
@@ -74,6 +102,19 @@ void thread_fn(void *pickled_id)
         }
         last_time_val = current_time;
         last_cpu = smp_processor_id();
+
+        fast_time = fast_now();
+        if(fast_time < last_fast_val)
+        {
+            printk("Fast clock went backwards: last_fast_val=%lx (CPU=%d), "
+                    "fast_time=%lx (CPU=%d), difference: %lldns\n",
+                    last_fast_val, last_fast_cpu,
+                    fast_time, smp_processor_id(),
+                    (last_fast_val - fast_time));
+            ok_exit();
+        }
+        last_fast_val = fast_time;
+        last_fast_cpu = smp_processor_id();
         total_time_tests++;
         spin_unlock(&time_lock);
     }
@@ -83,6 +124,7 @@ void thread_fn(void *pickled_id)
     if(remaining_threads_count == 0)
     {
         spin_unlock(&thread_count_lock); 
+        clock_bench();
         printk("ALL SUCCESSFUL\n"); 
         printk("Total time tests done: %lld\n", total_time_tests);
         ok_exit();
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Xenstore read cache: needs -XX:GUKXSC on the command line.  Caches a
+ * subtree of the domain's data directory, times repeated reads, and
+ * checks that our own writes, removes, transactions and writes seen
+ * only through the watch are never hidden by a stale entry.
+ */
+#include <guk/os.h>
+#include <guk/sched.h>
+#include <guk/arch_sched.h>
+#include <guk/time.h>
+#include <guk/xenbus.h>
+#include <guk/xmalloc.h>
+
+#define READS   1000
+#define SUBTREE "data/xscache"
+#define KEY     SUBTREE "/key"
+
+static void check_value(char *what, char *expected)
+{
+    char buf[32], *err;
+
+    err = xenbus_read_buf(XBT_NIL, KEY, buf, sizeof(buf));
+    if (expected == NULL) {
+        if (err == NULL) {
+            printk("FAILED: %s: read %s, expected ENOENT\n", what, buf);
+            ok_exit();
+        }
+        free(err);
+        return;
+    }
+    if (err) {
+        printk("FAILED: %s: %s\n", what, err);
+        ok_exit();
+    }
+    if (strcmp(buf, expected) != 0) {
+        printk("FAILED: %s: read %s, expected %s\n", what, buf, expected);
+        ok_exit();
+    }
+}
+
+static void tester(void *p)
+{
+    struct xenbus_cache_stats stats;
+    xenbus_transaction_t xbt;
+    s_time_t start, t_cached, t_uncached;
+    char *err, *value;
+    int i, retry;
+
+    err = xenbus_write(XBT_NIL, KEY, "1");
+    if (err) {
+        printk("FAILED: write: %s\n", err);
+        ok_exit();
+    }
+    err = xenbus_cache_subtree(SUBTREE);
+    if (err) {
+        printk("FAILED: xenbus_cache_subtree: %s\n", err);
+        ok_exit();
+    }
+
+    start = NOW();
+    for (i = 0; i < READS; i++)
+        check_value("cached read", "1");
+    t_cached = NOW() - start;
+
+    start = NOW();
+    for (i = 0; i < READS; i++) {
+        err = xenbus_read_uncached(XBT_NIL, KEY, &value);
+        if (err) {
+            printk("FAILED: uncached read: %s\n", err);
+            ok_exit();
+        }
+        free(value);
+    }
+    t_uncached = NOW() - start;
+
+    xenbus_write(XBT_NIL, KEY, "2");
+    check_value("after write", "2");
+
+    xenbus_rm(XBT_NIL, KEY);
+    check_value("after rm", NULL);
+    check_value("cached ENOENT", NULL);
+
+    do {
+        err = xenbus_transaction_start(&xbt);
+        if (err) {
+            printk("FAILED: transaction start: %s\n", err);
+            ok_exit();
+        }
+        err = xenbus_write(xbt, KEY, "3");
+        if (err)
+            free(err);
+        err = xenbus_transaction_end(xbt, 0, &retry);
+        if (err)
+            free(err);
+    } while (retry);
+    check_value("after commit", "3");
+
+    xenbus_cache_get_stats(&stats);
+    if (stats.hits == 0)
+        printk("cache disabled, run with -XX:GUKXSC\n");
+    printk("%d reads: cached %ld us/read, uncached %ld us/read\n",
+           READS, t_cached / READS / 1000, t_uncached / READS / 1000);
+    printk("%lu round trips saved, %lu misses, %lu invalidations, %lu flushes\n",
+           stats.hits, stats.misses, stats.invalidations, stats.flushes);
+    xenbus_rm(XBT_NIL, SUBTREE);
+    printk("ALL SUCCESSFUL\n");
+    ok_exit();
+}
+
+int guk_app_main(void *args)
+{
+    printk("Private appmain.\n");
+    create_thread("tester", tester, UKERNEL_FLAG, NULL);
+    return 0;
+}
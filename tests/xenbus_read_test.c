@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Xenstore reads: times a burst of small reads, as issued when probing
+ * devices at boot, with xenbus_read and with a caller supplied buffer,
+ * then runs more concurrent readers than the initial request table
+ * holds to check that it grows instead of blocking.
+ */
+#include <guk/os.h>
+#include <guk/sched.h>
+#include <guk/arch_sched.h>
+#include <guk/time.h>
+#include <guk/xenbus.h>
+#include <guk/completion.h>
+#include <guk/xmalloc.h>
+
+#define READS       1000
+#define READERS     64
+#define READER_READS 50
+
+static DECLARE_COMPLETION(readers_done);
+static int readers_left;
+static int failures;
+
+static void reader(void *p)
+{
+    char buf[16];
+    char *err;
+    int i;
+
+    for (i = 0; i < READER_READS; i++) {
+        err = xenbus_read_buf(XBT_NIL, "domid", buf, sizeof(buf));
+        if (err) {
+            free(err);
+            __sync_fetch_and_add(&failures, 1);
+        }
+    }
+    if (__sync_sub_and_fetch(&readers_left, 1) == 0)
+        complete(&readers_done);
+}
+
+static void tester(void *p)
+{
+    char buf[16], *value, *err;
+    s_time_t start, t_alloc, t_buf;
+    int i;
+
+    start = NOW();
+    for (i = 0; i < READS; i++) {
+        err = xenbus_read(XBT_NIL, "domid", &value);
+        if (err) {
+            printk("FAILED: xenbus_read: %s\n", err);
+            ok_exit();
+        }
+        free(value);
+    }
+    t_alloc = NOW() - start;
+
+    start = NOW();
+    for (i = 0; i < READS; i++) {
+        err = xenbus_read_buf(XBT_NIL, "domid", buf, sizeof(buf));
+        if (err) {
+            printk("FAILED: xenbus_read_buf: %s\n", err);
+            ok_exit();
+        }
+    }
+    t_buf = NOW() - start;
+
+    err = xenbus_read_buf(XBT_NIL, "name", buf, 2);
+    if (err == NULL) {
+        printk("FAILED: short buffer accepted\n");
+        ok_exit();
+    }
+    free(err);
+
+    readers_left = READERS;
+    start = NOW();
+    for (i = 0; i < READERS; i++)
+        create_thread("reader", reader, UKERNEL_FLAG, NULL);
+    wait_for_completion(&readers_done);
+    if (failures) {
+        printk("FAILED: %d concurrent reads failed\n", failures);
+        ok_exit();
+    }
+
+    printk("%d reads: xenbus_read %ld us/read, xenbus_read_buf %ld us/read\n",
+           READS, t_alloc / READS / 1000, t_buf / READS / 1000);
+    printk("%d readers x %d reads: %ld us\n", READERS, READER_READS,
+           (NOW() - start) / 1000);
+    printk("ALL SUCCESSFUL\n");
+    ok_exit();
+}
+
+int guk_app_main(void *args)
+{
+    printk("Private appmain.\n");
+    create_thread("tester", tester, UKERNEL_FLAG, NULL);
+    return 0;
+}
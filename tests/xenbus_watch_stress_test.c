@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Watch event queue: a writer thread stands in for a busy backend and
+ * rewrites more keys under a watched directory than a watch queues
+ * before holding xenstored back, while the reader starts late.  Checks
+ * that the domain survives the burst and that an event for every key is
+ * delivered, and reports how many events were left after merging.
+ */
+#include <guk/os.h>
+#include <guk/sched.h>
+#include <guk/arch_sched.h>
+#include <guk/time.h>
+#include <guk/xenbus.h>
+#include <guk/completion.h>
+#include <guk/xmalloc.h>
+
+#define DIR         "data/watchstress"
+#define TOKEN       "watch-stress"
+#define KEYS        256
+#define REPEATS     8
+#define READ_DELAY  200         /* ms */
+#define DRAIN_TIME  SECONDS(10)
+
+static DECLARE_COMPLETION(writer_done);
+static int seen[KEYS];
+
+static void writer(void *p)
+{
+    char path[64], value[16];
+    char *err;
+    int i, k;
+
+    for (i = 0; i < REPEATS; i++) {
+        for (k = 0; k < KEYS; k++) {
+            sprintf(path, "%s/k%d", DIR, k);
+            sprintf(value, "%d", i);
+            err = xenbus_write(XBT_NIL, path, value);
+            if (err) {
+                printk("FAILED: write %s: %s\n", path, err);
+                ok_exit();
+            }
+        }
+    }
+    complete(&writer_done);
+}
+
+static void tester(void *p)
+{
+    s_time_t start, deadline;
+    char *path, *key;
+    int events = 0, missing = KEYS, k;
+
+    xenbus_rm(XBT_NIL, DIR);
+    if (xenbus_watch_path(XBT_NIL, DIR, TOKEN) != NULL) {
+        printk("FAILED: xenbus_watch_path\n");
+        ok_exit();
+    }
+
+    start = NOW();
+    create_thread("writer", writer, UKERNEL_FLAG, NULL);
+    sleep(READ_DELAY);
+
+    deadline = NOW() + DRAIN_TIME;
+    while (missing > 0) {
+        path = xenbus_get_watch_event(TOKEN, deadline - NOW());
+        if (path == NULL) {
+            printk("FAILED: events for %d keys missing\n", missing);
+            ok_exit();
+        }
+        events++;
+        key = strstr(path, "/k");
+        if (key != NULL) {
+            k = simple_strtol(key + 2, NULL, 10);
+            if (k >= 0 && k < KEYS && !seen[k]) {
+                seen[k] = 1;
+                missing--;
+            }
+        }
+        xenbus_put_watch_event(path);
+    }
+    wait_for_completion(&writer_done);
+    xenbus_rm_watch(TOKEN);
+    xenbus_rm(XBT_NIL, DIR);
+
+    printk("%d writes, %d events delivered in %ld ms\n",
+           KEYS * REPEATS, events, (NOW() - start) / 1000000);
+    printk("ALL SUCCESSFUL\n");
+    ok_exit();
+}
+
+int guk_app_main(void *args)
+{
+    printk("Private appmain.\n");
+    create_thread("tester", tester, UKERNEL_FLAG, NULL);
+    return 0;
+}
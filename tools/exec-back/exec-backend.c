@@ -36,7 +36,7 @@
 #include <fcntl.h>
 #include <wait.h>
 #include <xenctrl.h>
-#include <sys/select.h>
+#include <sys/mman.h>
 #include <xen/io/ring.h>
 #include "exec-backend.h"
 
@@ -44,23 +44,12 @@ struct xs_handle *xsh = NULL;
 static int export_id = 0;
 int trace_level = 1;
 
-#ifndef STDIN_FILENO
-#define STDIN_FILENO 0
-#endif
-
-#ifndef STDOUT_FILENO
-#define STDOUT_FILENO 1
-#endif
-
-#ifndef STDERR_FILENO
-#define STDERR_FILENO 2
-#endif
-
-#define FAIL_FILENO (STDERR_FILENO + 1)
 #define MAX_ACTIVE_REQUESTS 16
 
 struct request *active_requests[MAX_ACTIVE_REQUESTS];
 static int active_request_index = 0;
+/* protects active_requests, which the pool threads share */
+static pthread_mutex_t requests_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* read/close request encode the fd in the request id */
 static int exec_request_id(int request_id) {
@@ -73,23 +62,32 @@ static int fd_from_request_id(int request_id) {
 
 static struct request *find_request(int dom_id, int request_id) {
   int i;
+  pthread_mutex_lock(&requests_lock);
   for (i = 0; i < MAX_ACTIVE_REQUESTS; i++) {
     struct request *r = active_requests[i];
     if (r != NULL && r->dom_id == dom_id && r->request_id == request_id) {
+      pthread_mutex_unlock(&requests_lock);
       return r;
     }
   }
+  pthread_mutex_unlock(&requests_lock);
   return NULL;
 }
 
 static void reap_requests(void) {
   char node[1024];
   int i;
+  pthread_mutex_lock(&requests_lock);
   for (i = 0; i < MAX_ACTIVE_REQUESTS; i++) {
     struct request *r = active_requests[i];
     if (r != NULL) {
+      int done;
       /* reap any request for which the process has exited and all streams are closed */
-      if (r->pid == -1 && r->stdio[0] == -1 && r->stdio[1] == -1 && r->stdio[2] == -1) {
+      pthread_mutex_lock(&r->lock);
+      done = !r->setup && r->pid == -1 && r->stdio[0] == -1 && r->stdio[1] == -1 &&
+	r->stdio[2] == -1 && r->ring == NULL;
+      pthread_mutex_unlock(&r->lock);
+      if (done) {
 	sprintf(node, REQUEST_NODE, r->dom_id, r->request_id);
 	if (trace_level >= TRACE_OPS) {
 	  printf("Reaping request %s\n", node);
@@ -101,65 +99,26 @@ static void reap_requests(void) {
       }
     }
   }
+  pthread_mutex_unlock(&requests_lock);
 }
 
-static int get_request_slot(void) {
+/* claims a free slot for request, returns -1 if there is none */
+static int get_request_slot(struct request *request) {
   int i;
+  pthread_mutex_lock(&requests_lock);
   for (i = 0; i < MAX_ACTIVE_REQUESTS; i++) {
     struct request *r = active_requests[i];
     if (r == NULL) {
+      active_requests[i] = request;
+      pthread_mutex_unlock(&requests_lock);
       return i;
     }
   }
+  pthread_mutex_unlock(&requests_lock);
   return -1;
   
 }
 
-static void move_fd(int from_fd, int to_fd) {
-  if (from_fd != to_fd) {
-    dup2(from_fd, to_fd);
-    close(from_fd);
-  }
-}
-
-static int safe_close(int fd) {
-  if (fd != -1) {
-    return close(fd);
-  }
-  return 0;
-}
-
-/*
- * Reads nbyte bytes from file descriptor fd into buf,
- * The read operation is retried in case of EINTR or partial reads.
- *
- * Returns number of bytes read (normally nbyte, but may be less in
- * case of EOF).  In case of read errors, returns -1 and sets errno.
- */
-static ssize_t
-read_fully(int fd, void *buf, size_t nbyte)
-{
-    ssize_t remaining = nbyte;
-    for (;;) {
-        ssize_t n = read(fd, buf, remaining);
-        if (n == 0) {
-            return nbyte - remaining;
-        } else if (n > 0) {
-            remaining -= n;
-            if (remaining <= 0)
-                return nbyte;
-            /* We were interrupted in the middle of reading the bytes.
-             * Unlikely, but possible. */
-            buf = (void *) (((char *)buf) + n);
-        } else if (errno == EINTR) {
-            /* Strange signals like SIGJVM1 are possible at any time.
-             * See http://www.dreamsongs.com/WorseIsBetter.html */
-        } else {
-            return -1;
-        }
-    }
-}
-
 void write_status_id(struct request *request, char *kind, int request_id) {
   char node[1024];
   char kindstatus[32];
@@ -172,102 +131,105 @@ void write_status(struct request *request, char *kind) {
   write_status_id(request, kind, request->request_id);
 }
 
-void do_exec_request(struct request *request, int argc, char **argv, char *wdir) {
-    int errnum;
-    int pid = -1;
-    int in[2], out[2], err[2], fail[2];
-    
-    in[0] = in[1] = out[0] = out[1] = err[0] = err[1] = fail[0] = fail[1] = -1;
-
-    if ((pipe(in)   < 0) ||
-	(pipe(out)  < 0) ||
-	(pipe(err)  < 0) ||
-	(pipe(fail) < 0)) {
-	printf("pipe calls failed");
-	goto fail;
-    }
+/* Xen side of a data channel: the mapped frontend pages and our end of the
+   event channel. */
+struct xen_ring {
+    struct exec_ring ring;
+    int evth;
+    int gnth;
+    evtchn_port_t local_port;
+};
+
+static void xen_ring_notify(struct exec_ring *ring) {
+    struct xen_ring *xr = (struct xen_ring *)ring->priv;
+    xc_evtchn_notify(xr->evth, xr->local_port);
+}
 
-    pid = fork();
-    if (pid < 0) {
-      /* fork failed */
-      errnum = errno;
-      printf("Fork failed\n");
-      goto fail;
+static void xen_ring_ack(struct exec_ring *ring) {
+    struct xen_ring *xr = (struct xen_ring *)ring->priv;
+    evtchn_port_t port = xc_evtchn_pending(xr->evth);
+    if (port != -1) {
+      xc_evtchn_unmask(xr->evth, port);
     }
+}
 
-    if (pid == 0) {
-      /* child */
-      close(in[1]);
-      move_fd(in[0], STDIN_FILENO);
-      close(out[0]);
-      move_fd(out[1], STDOUT_FILENO);
-      close(err[0]);
-      move_fd(err[1], STDERR_FILENO);
-      close(fail[0]);
-      move_fd(fail[1], FAIL_FILENO);
-      
-
-      if (wdir != NULL && chdir(wdir) < 0) {
-	errnum = errno;
-	printf("Failed to chdir to %s\n", wdir);
-	goto execfail;
+static void disconnect_data_ring(struct request *request) {
+    struct xen_ring *xr = (struct xen_ring *)request->ring->priv;
+    int i;
+    for (i = 0; i < EXECIF_STREAMS; i++) {
+      if (xr->ring.data[i] != NULL) {
+	xc_gnttab_munmap(xr->gnth, xr->ring.data[i], 1);
       }
+    }
+    xc_gnttab_munmap(xr->gnth, xr->ring.ctrl, 1);
+    xc_gnttab_close(xr->gnth);
+    xc_evtchn_unbind(xr->evth, xr->local_port);
+    xc_evtchn_close(xr->evth);
+    free(xr);
+    request->ring = NULL;
+}
 
-      if (fcntl(FAIL_FILENO, F_SETFD, FD_CLOEXEC) == -1)
-	goto execfail;
+/* Maps the data channel offered by the frontend, if any.
+   Returns 0 when there is none, 1 when connected, -1 on failure. */
+static int connect_data_ring(struct request *request, char *frontend_node) {
+    char node[1024];
+    char *value;
+    grant_ref_t gref;
+    evtchn_port_t remote_port;
+    struct xen_ring *xr;
+    int i;
 
-      execvp(argv[0], argv);
-    execfail:
-      errnum = errno;
-      write(FAIL_FILENO, &errnum, sizeof(errnum));
-      close(FAIL_FILENO);
-      _exit(-1);
+    sprintf(node, "%s/ring-ref", frontend_node);
+    value = xs_read(xsh, XBT_NULL, node, NULL);
+    if (value == NULL) {
+      return 0;
     }
-
-    /* Parent process */
-    request->pid = pid;
-    close(fail[1]); fail[1] = -1;
-  
-    switch (read_fully(fail[0], &errnum, sizeof(errnum))) {
-        case 0: break; /* Exec succeeded */
-        case sizeof(errnum):
-	    waitpid(pid, NULL, 0);
-	    printf("Exec failed\n");
-	    goto fail;
-        default:
-	    errnum = errno;
-	    printf("Read failed\n");
-	    goto fail;
+    gref = atoi(value);
+    free(value);
+    sprintf(node, "%s/event-channel", frontend_node);
+    value = xs_read(xsh, XBT_NULL, node, NULL);
+    if (value == NULL) {
+      return -1;
     }
-
-    request->status = 0;
-    request->stdio[0] = in[1];
-    request->stdio[1] = out[0];
-    request->stdio[2] = err[0];
-    if (trace_level >= TRACE_OPS) {
-      printf("Exec fds: %u, %u, %u\n", request->stdio[0],  request->stdio[1], request->stdio[2]);
+    remote_port = atoi(value);
+    free(value);
+
+    xr = (struct xen_ring *)calloc(1, sizeof(struct xen_ring));
+    xr->ring.priv = xr;
+    xr->ring.notify = xen_ring_notify;
+    xr->ring.ack = xen_ring_ack;
+    xr->evth = xc_evtchn_open();
+    assert(xr->evth != -1);
+    xr->local_port = xc_evtchn_bind_interdomain(xr->evth, request->dom_id, remote_port);
+    assert(xr->local_port != -1);
+    xr->ring.event_fd = xc_evtchn_fd(xr->evth);
+    xr->gnth = xc_gnttab_open();
+    assert(xr->gnth != -1);
+    xr->ring.ctrl = xc_gnttab_map_grant_ref(xr->gnth, request->dom_id, gref,
+					    PROT_READ | PROT_WRITE);
+    request->ring = &xr->ring;
+    if (xr->ring.ctrl == NULL) {
+      printf("Failed to map data channel of %d:%d\n", request->dom_id, request->request_id);
+      xc_gnttab_close(xr->gnth);
+      xc_evtchn_unbind(xr->evth, xr->local_port);
+      xc_evtchn_close(xr->evth);
+      free(xr);
+      request->ring = NULL;
+      return -1;
     }
-    
-finally:    
-    /* Always clean up the child's side of the pipes */
-    safe_close(in [0]);
-    safe_close(out[1]);
-    safe_close(err[1]);
-
-    /* Always clean up fail descriptors */
-    safe_close(fail[0]);
-    safe_close(fail[1]);
-
-    return;
-
-fail:
-    /* Clean up the parent's side of the pipes in case of failure only */
-    safe_close(in [1]);
-    safe_close(out[0]);
-    safe_close(err[0]);
-    request->status = -errnum;
-    goto finally;
-
+    for (i = 0; i < EXECIF_STREAMS; i++) {
+      xr->ring.fd[i] = -1;
+      xr->ring.data[i] = xc_gnttab_map_grant_ref(xr->gnth, request->dom_id,
+						 xr->ring.ctrl->data_ref[i],
+						 PROT_READ | PROT_WRITE);
+      if (xr->ring.data[i] == NULL) {
+	printf("Failed to map stream %d of %d:%d\n", i, request->dom_id, request->request_id);
+	exec_ring_disconnect(&xr->ring);
+	disconnect_data_ring(request);
+	return -1;
+      }
+    }
+    return 1;
 }
 
 void *handle_exec_request(void *data) {
@@ -308,7 +270,16 @@ void *handle_exec_request(void *data) {
       }
       
     }
-    do_exec_request(request, argc, argv, wdir);
+    if (connect_data_ring(request, frontend_node) < 0) {
+      request->status = -EIO;
+      write_status(request, "exec");
+      return NULL;
+    }
+    supervisor_exec(request, argc, argv, wdir);
+    if (request->status != 0 && request->ring != NULL) {
+      exec_ring_disconnect(request->ring);
+      disconnect_data_ring(request);
+    }
     /* communicate exec status to frontend */
     write_status(request, "exec");
 
@@ -327,107 +298,65 @@ int wait_for_process_exit(struct request *request) {
 	default: return -1;
 	}
     }
-
-    if (WIFEXITED(status)) {
-        /*
-         * The child exited normally; get its exit code.
-         */
-        return WEXITSTATUS(status);
-    } else if (WIFSIGNALED(status)) {
-        /* The child exited because of a signal.
-	 * The best value to return is 0x80 + signal number,
-	 * because that is what all Unix shells do, and because
-	 * it allows callers to distinguish between process exit and
-	 * process death by signal.
-         */
-	return 0x80 + WTERMSIG(status);
-    } else {
-        /*
-         * Unknown exit code; pass it through.
-         */
-	return status;
-    }
-}
-
-static void *handle_wait_request_in_thread(void *data) {
-    struct request *request = (struct request *)data;
-    request->status = wait_for_process_exit(request);
-    /* communicate wait status to frontend */
-    write_status(request, "wait");
-    /* mark exited */
-    request->pid = -1;
-    return NULL;
-}
-
-static void handle_wait_request(struct request *request) {
-    pthread_t handling_thread;
-    pthread_create(&handling_thread, NULL, &handle_wait_request_in_thread, request);
+    return exit_code(status);
 }
 
 static void handle_read_request(struct request *request, int request_id) {
     char node[1024];
     char *read_info;
-    int fd, rfd, length, file_offset;
-    char buffer[81];
-    int result;
+    int fd, length, file_offset;
 
     /* the request_id encodes the exec_id and the fd */
     sprintf(node, READ_REQUEST_NODE, request->dom_id, request_id);
     read_info = xs_read(xsh, XBT_NULL, node, NULL);
     sscanf(read_info, "%u,%u", &length, &file_offset);
+    free(read_info);
     fd = fd_from_request_id(request_id);
-    rfd = request->stdio[fd];
-    printf("Read %u[%u],%u,%u\n", fd, rfd, length, file_offset);
-    /* we limit reads to max(length, 80) */
-    if (length > 80) length = 80;
-    result = read_fully(rfd, buffer, length);
-    request->status = result < 0 ? -errno : 0;
-    if (result >= 0) {
-      buffer[result] = '\0';
-      sprintf(node, FRONTEND_NODE, request->dom_id, request_id);
-      xenbus_printf(xsh, XBT_NULL, node, "readbytes", "%s", buffer);
+    if (trace_level >= TRACE_OPS_NOISY) {
+      printf("Read %u[%u],%u,%u\n", fd, request->stdio[fd], length, file_offset);
     }
-    write_status_id(request, "read", request_id);
-    
+    /* completes when the pipe has data, without holding up other requests */
+    supervisor_read(request, request_id, fd, length);
+}
+
+static void write_read_data(struct request *request, int request_id, char *data, int length) {
+    char node[1024];
+    char buffer[EXEC_READ_MAX + 1];
+    memcpy(buffer, data, length);
+    buffer[length] = '\0';
+    sprintf(node, FRONTEND_NODE, request->dom_id, request_id);
+    xenbus_printf(xsh, XBT_NULL, node, "readbytes", "%s", buffer);
 }
 
 static void handle_write_request(struct request *request, int request_id) {
     char node[1024];
     char *write_info;
     char data[1024];
-    int fd, rfd, length, file_offset;
-    int result;
+    int fd, length, file_offset;
 
     fd = fd_from_request_id(request_id);
     /* the request_id encodes the exec_id and the fd */
     sprintf(node, WRITE_REQUEST_NODE, request->dom_id, request_id);
     write_info = xs_read(xsh, XBT_NULL, node, NULL);
     sscanf(write_info, "%u,%u,%s", &length, &file_offset, &data[0]);
-    rfd = request->stdio[fd];
-    printf("Write %u[%u],%u,%u\n", fd, rfd, length, file_offset);
-    result = write(rfd, data, length);
-    request->status = result < 0 ? -errno : 0;
-    write_status_id(request, "write", request_id);
+    free(write_info);
+    if (trace_level >= TRACE_OPS_NOISY) {
+      printf("Write %u[%u],%u,%u\n", fd, request->stdio[fd], length, file_offset);
+    }
+    supervisor_write(request, request_id, fd, data, length);
 }
 
 static void handle_close_request(struct request *request, int request_id) {
-    char *close_info;
-    int fd, rfd, result;
-    fd = fd_from_request_id(request_id);
-    rfd = request->stdio[fd];
-    printf("Close %u[%u]\n", fd, rfd);
-    result = safe_close(rfd);
-    request->stdio[fd] = -1;
-    request->status = result < 0 ? -errno : 0;
-    write_status_id(request, "close", request_id);
+    int fd = fd_from_request_id(request_id);
+    if (trace_level >= TRACE_OPS_NOISY) {
+      printf("Close %u[%u]\n", fd, request->stdio[fd]);
+    }
+    supervisor_close(request, request_id, fd);
 }
 
 static void handle_destroy_request(struct request *request) {
-    char node[1024];
-    int result;
     printf("Destroy %u\n", request->pid);
-    kill(request->pid, SIGTERM);
-    request->status = 0;
+    supervisor_kill(request);
     write_status(request, "close");
 }
 
@@ -454,25 +383,30 @@ static struct request *check_find_request(int dom_id, int request_id, char *rkin
 static void handle_connection(int dom_id, int request_id, char *rkind)
 {
     struct request *request;
-    pthread_t handling_thread;
 
     if (trace_level >= TRACE_OPS) printf("Handling '%s' request from dom_id=%d, request_id %d\n", rkind, dom_id, request_id);
 
 
     if (strcmp(rkind, "exec") == 0) {
       request = (struct request*)malloc(sizeof(struct request));
+      supervisor_init_request(request);
       request->dom_id = dom_id;
       request->request_id = request_id;
-      request->slot = get_request_slot();
+      /* published before the exec so that requests can find it, but a
+         concurrent reap must leave it alone until its status is written */
+      request->setup = 1;
+      request->slot = get_request_slot(request);
       if ( request->slot < 0) {
 	printf("Too many outstanding requests\n");
 	request->status = -EAGAIN;
 	write_status(request, "exec");
+	free(request);
 	return;
       }
-      active_requests[request->slot] = request;
-      // pthread_create(&handling_thread, NULL, &handle_exec_request, request);
       handle_exec_request(request);
+      pthread_mutex_lock(&request->lock);
+      request->setup = 0;
+      pthread_mutex_unlock(&request->lock);
     } else if (strcmp(rkind, "wait") == 0) {
       request = check_find_request(dom_id, request_id, rkind);
       if (request == NULL) {
@@ -481,8 +415,9 @@ static void handle_connection(int dom_id, int request_id, char *rkind)
       /* cant free yet, frontend calls wait immediately in a reaper thread,
        * which also means we must handle wait asynchronously in case the frontend 
        * writes after the wait (in a different thread), which would block forever.
+       * The supervisor answers it when the child's exit shows up.
        */
-      handle_wait_request(request);
+      supervisor_wait(request);
 
     } else if (strcmp(rkind, "read") == 0) {
       request = check_find_request(dom_id, exec_request_id(request_id), rkind);
@@ -513,74 +448,100 @@ static void handle_connection(int dom_id, int request_id, char *rkind)
     }
 }
 
-static void await_connections(void)
+/* Runs on a pool thread whenever the watch fires; other threads pick up
+   further watch events while this one handles the request. */
+static void handle_watch(struct supervisor_source *src)
 {
-    int fd, ret, dom_id, request_id; 
-    fd_set fds;
+    int dom_id, request_id; 
     char **watch_paths;
     char rkind[16];
     unsigned int len;
 
-    assert(xsh != NULL);
-    fd = xenbus_get_watch_fd(); 
-    FD_ZERO(&fds);
-    FD_SET(fd, &fds);
-    /* Infinite watch loop */
-    do {
-        ret = select(fd+1, &fds, NULL, NULL, NULL);
-        assert(ret == 1);
-        watch_paths = xs_read_watch(xsh, &len);
-        assert(len == 2);
-        printf("watch_paths: [0] %s, [1] %s\n",  watch_paths[0],  watch_paths[1]);
-        assert(strcmp(watch_paths[1], "conn-watch") == 0);
-        if(strcmp(watch_paths[0], WATCH_NODE) == 0)
-            goto next_select;
+    watch_paths = xs_read_watch(xsh, &len);
+    supervisor_rearm(src);
+    if (watch_paths == NULL) {
+        return;
+    }
+    assert(len == 2);
+    if (trace_level >= TRACE_OPS_NOISY) printf("watch_paths: [0] %s, [1] %s\n",  watch_paths[0],  watch_paths[1]);
+    assert(strcmp(watch_paths[1], "conn-watch") == 0);
+    if(strcmp(watch_paths[0], WATCH_NODE) != 0) {
         dom_id = -1;
         if (trace_level >= TRACE_RING) printf("Path changed %s\n", watch_paths[0]);
         sscanf(watch_paths[0], REQUEST_NODE_TM, &dom_id, &request_id, &rkind[0]);
         if(dom_id >= 0) handle_connection(dom_id, request_id, rkind);
-	reap_requests();
-next_select:        
-        printf("Awaiting next connection.\n");
-        /* TODO - we need to figure out what to free */
-        //free(watch_paths[0]);
-        //free(watch_paths[1]);
-    } while (1);
+        reap_requests();
+    }
+    /* the paths are allocated together with the vector */
+    free(watch_paths);
 }
 
+static struct supervisor_source watch_src;
+
+static void await_connections(int nthreads)
+{
+    assert(xsh != NULL);
+    supervisor_add_fd(&watch_src, xenbus_get_watch_fd(), handle_watch);
+    if (supervisor_start(nthreads) < 0) {
+        printf("Failed to start supervisor threads\n");
+        return;
+    }
+    /* the pool does all the work from now on */
+    for (;;) {
+        pause();
+    }
+}
+
+static struct supervisor_ops exec_ops = {
+    .status = write_status_id,
+    .read_data = write_read_data,
+    .ring_done = disconnect_data_ring,
+};
+
 void test_exec(void) {
   char *argv[3];
   char buffer[1024];
+  int nbytes = 0, n;
   struct request *request = (struct request*)malloc(sizeof(struct request));
 
   printf("testing exec on echo\n");
   argv[0] = "echo";
   argv[1] = "exec-back exec ok!";
   argv[2] = NULL;
+  supervisor_init_request(request);
   request->dom_id = 0;
   request->request_id = 0;
-  request->slot = get_request_slot();
-  active_requests[request->slot] = request;
-  do_exec_request(request, 2, argv, NULL);
+  supervisor_spawn(request, 2, argv, NULL);
   if (request->status == 0) {
-    int nbytes = read_fully(request->stdio[1], buffer, 1023);
+    while (nbytes < 1023 && (n = read(request->stdio[1], buffer + nbytes, 1023 - nbytes)) > 0) {
+      nbytes += n;
+    }
     buffer[nbytes] = '\0';
     printf("exec output: %s", buffer);
     wait_for_process_exit(request);
+    close(request->stdio[0]);
+    close(request->stdio[1]);
+    close(request->stdio[2]);
   }
   free(request);
-  active_requests[request->slot] = NULL;
 }
 
 extern void xenbus_register_export(void);
 int main(int argc, char*argv[])
 {
   int i;
+  int nthreads = EXEC_THREADS;
   if (argc > 1) sscanf(argv[1], "%d", &trace_level);
+  if (argc > 2) sscanf(argv[2], "%d", &nthreads);
 
   for (i = 0; i < MAX_ACTIVE_REQUESTS; i++) {
     active_requests[i] == NULL;
   }
+
+  /* before any thread exists */
+  if (supervisor_init(&exec_ops) < 0) {
+    return 1;
+  }
   
   if (trace_level >= TRACE_OPS) {
     test_exec();
@@ -592,8 +553,10 @@ int main(int argc, char*argv[])
   xs_rm(xsh, XBT_NULL, ROOT_NODE);
   /* Create watch node */
   xenbus_create_request_node();
+  /* frontends may move process I/O through a shared data channel */
+  xenbus_printf(xsh, XBT_NULL, ROOT_NODE, "feature-data-ring", "%d", 1);
     
-  await_connections();
+  await_connections(nthreads);
   /* Close the connection to XenStore when we are finished with everything */
   xs_daemon_close(xsh);
 }
@@ -35,7 +35,7 @@
 #include <xen/grant_table.h>
 #include <xen/event_channel.h>
 #include <xen/io/ring.h>
-//#include "execif.h"
+#include "exec-supervisor.h"
 
 #define ROOT_NODE           "backend/exec"
 #define WATCH_NODE          ROOT_NODE"/requests"
@@ -48,22 +48,9 @@
 #define CLOSE_REQUEST_NODE   WATCH_NODE"/%d/%d/close"
 #define FRONTEND_NODE       "/local/domain/%d/device/exec/%d"
 
-#define TRACE_OPS 1
-#define TRACE_OPS_NOISY 2
-#define TRACE_RING 3
-
 /* Handle to XenStore driver */
 extern struct xs_handle *xsh;
 
-struct request {
-    int dom_id;
-    int request_id;
-    int status;
-    int pid;
-    int slot;
-    int stdio[3];
-};
-
 bool xenbus_create_request_node(void);
 int xenbus_get_watch_fd(void);
 bool xenbus_printf(struct xs_handle *xsh,
@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Throughput of the exec data channel, run on plain Linux.
+ *
+ * A child process writes a fixed amount of data to its stdout.  The
+ * backend pump (exec-ring.c) moves it into a data channel in local memory
+ * and a thread standing in for the guest frontend consumes it with the
+ * same protocol as exec-front.c, using eventfds in place of the event
+ * channel.  For comparison, the old protocol is approximated by one
+ * request/reply round trip over a socketpair per 80 byte read, which
+ * leaves out the xenstore costs and so flatters it.
+ *
+ * Usage: exec-ring-bench [megabytes]
+ *
+ * Author: Mick Jordan
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "exec-ring.h"
+
+#define ring_mb() __sync_synchronize()
+#define OLD_READ_SIZE 80
+
+static size_t total_bytes;
+static int to_back_fd, to_front_fd;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void signal_fd(int fd) {
+    uint64_t one = 1;
+    write(fd, &one, sizeof(one));
+}
+
+static void wait_fd(int fd) {
+    uint64_t count;
+    read(fd, &count, sizeof(count));
+}
+
+static void bench_notify(struct exec_ring *ring) {
+    signal_fd(to_front_fd);
+}
+
+static void bench_ack(struct exec_ring *ring) {
+    wait_fd(to_back_fd);
+}
+
+/* forks a child that writes total_bytes to the returned pipe */
+static pid_t spawn_writer(int *out) {
+    int p[2];
+    pid_t pid;
+    if (pipe(p) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    pid = fork();
+    if (pid == 0) {
+        static char buf[65536];
+        size_t left = total_bytes;
+        close(p[0]);
+        memset(buf, 'x', sizeof(buf));
+        while (left > 0) {
+            ssize_t n = write(p[1], buf, left < sizeof(buf) ? left : sizeof(buf));
+            if (n <= 0)
+                _exit(1);
+            left -= n;
+        }
+        _exit(0);
+    }
+    close(p[1]);
+    *out = p[0];
+    return pid;
+}
+
+static void *pump_thread(void *data) {
+    exec_ring_pump((struct exec_ring *)data);
+    return NULL;
+}
+
+/* the frontend side of exec-front.c, reading stdout */
+static int front_read(struct exec_ring *ring, char *buffer, int length) {
+    struct execif_stream *s = &ring->ctrl->streams[EXECIF_STDOUT];
+    uint32_t cons, avail, idx, chunk, n;
+
+    for (;;) {
+        ring_mb();
+        if (s->prod != s->cons || s->eof)
+            break;
+        wait_fd(to_front_fd);
+    }
+    ring_mb();
+    cons = s->cons;
+    avail = s->prod - cons;
+    n = avail < (uint32_t)length ? avail : (uint32_t)length;
+    idx = EXECIF_STREAM_IDX(cons);
+    chunk = EXECIF_STREAM_SIZE - idx;
+    if (chunk > n)
+        chunk = n;
+    memcpy(buffer, ring->data[EXECIF_STDOUT] + idx, chunk);
+    memcpy(buffer + chunk, ring->data[EXECIF_STDOUT], n - chunk);
+    ring_mb();
+    s->cons = cons + n;
+    ring_mb();
+    if (s->prod - cons == EXECIF_STREAM_SIZE)
+        signal_fd(to_back_fd);
+    return n;
+}
+
+static double bench_ring(void) {
+    static struct execif_data_ctrl ctrl;
+    static char pages[EXECIF_STREAMS][EXECIF_STREAM_SIZE];
+    struct exec_ring ring;
+    char buffer[EXECIF_STREAM_SIZE];
+    pthread_t pump;
+    size_t got = 0;
+    double start;
+    pid_t pid;
+    int i, n, out;
+
+    memset(&ctrl, 0, sizeof(ctrl));
+    memset(&ring, 0, sizeof(ring));
+    to_back_fd = eventfd(0, 0);
+    to_front_fd = eventfd(0, 0);
+    ring.ctrl = &ctrl;
+    for (i = 0; i < EXECIF_STREAMS; i++) {
+        ring.data[i] = pages[i];
+        ring.fd[i] = -1;
+    }
+    ring.event_fd = to_back_fd;
+    ring.notify = bench_notify;
+    ring.ack = bench_ack;
+
+    start = now();
+    pid = spawn_writer(&out);
+    ring.fd[EXECIF_STDOUT] = out;
+    exec_ring_init(&ring);
+    pthread_create(&pump, NULL, pump_thread, &ring);
+    while ((n = front_read(&ring, buffer, sizeof(buffer))) > 0)
+        got += n;
+    waitpid(pid, NULL, 0);
+    pthread_join(pump, NULL);
+    close(to_back_fd);
+    close(to_front_fd);
+    if (got != total_bytes)
+        printf("ring: short read %zu of %zu\n", got, total_bytes);
+    return now() - start;
+}
+
+/* one request and one reply per OLD_READ_SIZE bytes, as with xenstore */
+static void *old_backend_thread(void *data) {
+    int *fds = (int *)data;
+    char buffer[OLD_READ_SIZE + sizeof(int)];
+    int req;
+    while (read(fds[0], &req, sizeof(req)) == sizeof(req)) {
+        int n = 0, r;
+        while (n < OLD_READ_SIZE && (r = read(fds[1], buffer + sizeof(int) + n, OLD_READ_SIZE - n)) > 0)
+            n += r;
+        memcpy(buffer, &n, sizeof(int));
+        write(fds[0], buffer, sizeof(int) + n);
+        if (n == 0)
+            break;
+    }
+    return NULL;
+}
+
+static double bench_old(void) {
+    char buffer[OLD_READ_SIZE + sizeof(int)];
+    int sv[2], fds[2];
+    pthread_t backend;
+    size_t got = 0;
+    double start;
+    pid_t pid;
+    int req = 0, n;
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    start = now();
+    pid = spawn_writer(&fds[1]);
+    fds[0] = sv[1];
+    pthread_create(&backend, NULL, old_backend_thread, fds);
+    for (;;) {
+        write(sv[0], &req, sizeof(req));
+        if (read(sv[0], &n, sizeof(n)) != sizeof(n) || n == 0)
+            break;
+        read(sv[0], buffer, n);
+        got += n;
+    }
+    waitpid(pid, NULL, 0);
+    pthread_join(backend, NULL);
+    close(fds[1]);
+    close(sv[0]);
+    close(sv[1]);
+    if (got != total_bytes)
+        printf("old: short read %zu of %zu\n", got, total_bytes);
+    return now() - start;
+}
+
+int main(int argc, char *argv[]) {
+    double t_ring, t_old, mb;
+    total_bytes = (argc > 1 ? atoi(argv[1]) : 64) << 20;
+    mb = total_bytes / (double)(1 << 20);
+    t_ring = bench_ring();
+    t_old = bench_old();
+    printf("data channel:        %8.1f MB/s\n", mb / t_ring);
+    printf("80 byte round trips: %8.1f MB/s (better than xenstore can do)\n", mb / t_old);
+    return 0;
+}
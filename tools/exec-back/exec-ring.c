@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Pump between the process pipes and the exec data channel (see execif.h).
+ * Used by exec-backend for a live frontend and by exec-ring-bench against
+ * a channel in local memory.
+ *
+ * Author: Mick Jordan
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include "exec-ring.h"
+
+/* the frontend may run on another cpu, order all shared accesses */
+#define ring_mb() __sync_synchronize()
+
+void exec_ring_init(struct exec_ring *ring)
+{
+    int i;
+    for (i = 0; i < EXECIF_STREAMS; i++) {
+        if (ring->fd[i] >= 0) {
+            fcntl(ring->fd[i], F_SETFL, fcntl(ring->fd[i], F_GETFL) | O_NONBLOCK);
+        }
+    }
+    /* a process closing its stdin must show up as EPIPE, not kill us */
+    signal(SIGPIPE, SIG_IGN);
+}
+
+static void finish_stream(struct exec_ring *ring, int i)
+{
+    close(ring->fd[i]);
+    ring->fd[i] = -1;
+}
+
+/* frontend stdin -> process; returns the poll events we wait for */
+static short service_stdin(struct exec_ring *ring, int *notify)
+{
+    struct execif_stream *s = &ring->ctrl->streams[EXECIF_STDIN];
+    uint32_t cons, avail, idx, chunk;
+    ssize_t n;
+
+    for (;;) {
+        ring_mb();
+        cons = s->cons;
+        avail = s->prod - cons;
+        if (avail == 0) {
+            if (s->eof) {
+                finish_stream(ring, EXECIF_STDIN);
+            }
+            return 0;           /* wait for the frontend */
+        }
+        idx = EXECIF_STREAM_IDX(cons);
+        chunk = EXECIF_STREAM_SIZE - idx;
+        if (chunk > avail)
+            chunk = avail;
+        n = write(ring->fd[EXECIF_STDIN], ring->data[EXECIF_STDIN] + idx, chunk);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                return POLLOUT;
+            /* the process no longer reads its stdin */
+            s->reader_closed = 1;
+            *notify = 1;
+            finish_stream(ring, EXECIF_STDIN);
+            return 0;
+        }
+        ring_mb();
+        s->cons = cons + n;
+        ring_mb();
+        /* the frontend only waits for space when the stream is full */
+        if (s->prod - cons == EXECIF_STREAM_SIZE)
+            *notify = 1;
+    }
+}
+
+/* process stdout/stderr -> frontend */
+static short service_output(struct exec_ring *ring, int i, int *notify)
+{
+    struct execif_stream *s = &ring->ctrl->streams[i];
+    uint32_t prod, space, idx, chunk;
+    ssize_t n;
+
+    for (;;) {
+        ring_mb();
+        if (s->reader_closed) {
+            finish_stream(ring, i);
+            return 0;
+        }
+        prod = s->prod;
+        space = EXECIF_STREAM_SIZE - (prod - s->cons);
+        if (space == 0)
+            return 0;           /* wait for the frontend to consume */
+        idx = EXECIF_STREAM_IDX(prod);
+        chunk = EXECIF_STREAM_SIZE - idx;
+        if (chunk > space)
+            chunk = space;
+        n = read(ring->fd[i], ring->data[i] + idx, chunk);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return POLLIN;
+        if (n <= 0) {
+            s->eof = 1;
+            *notify = 1;
+            finish_stream(ring, i);
+            return 0;
+        }
+        ring_mb();              /* data before index */
+        s->prod = prod + n;
+        ring_mb();
+        /* the frontend only waits for data when the stream is empty */
+        if (s->cons == prod)
+            *notify = 1;
+    }
+}
+
+int exec_ring_service(struct exec_ring *ring, struct pollfd *pfd)
+{
+    int i, live = 0, notify = 0;
+
+    for (i = 0; i < EXECIF_STREAMS; i++) {
+        short events = 0;
+        if (ring->fd[i] >= 0) {
+            events = i == EXECIF_STDIN ? service_stdin(ring, &notify)
+                                       : service_output(ring, i, &notify);
+        }
+        pfd[i].fd = events ? ring->fd[i] : -1;
+        pfd[i].events = events;
+        pfd[i].revents = 0;
+        if (ring->fd[i] >= 0)
+            live++;
+    }
+    if (notify)
+        ring->notify(ring);
+    return live;
+}
+
+void exec_ring_disconnect(struct exec_ring *ring)
+{
+    ring_mb();
+    ring->ctrl->disconnected = 1;
+    ring_mb();
+    ring->notify(ring);
+}
+
+void exec_ring_pump(struct exec_ring *ring)
+{
+    struct pollfd pfd[EXECIF_STREAMS + 1];
+
+    while (exec_ring_service(ring, pfd) > 0) {
+        pfd[EXECIF_STREAMS].fd = ring->event_fd;
+        pfd[EXECIF_STREAMS].events = POLLIN;
+        pfd[EXECIF_STREAMS].revents = 0;
+        if (poll(pfd, EXECIF_STREAMS + 1, -1) < 0 && errno != EINTR) {
+            perror("exec ring poll");
+            break;
+        }
+        if (pfd[EXECIF_STREAMS].revents & POLLIN)
+            ring->ack(ring);
+    }
+    exec_ring_disconnect(ring);
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Backend side of the exec data channel: moves bytes between the pipes of
+ * the process and the streams shared with the frontend.  Nothing here
+ * depends on Xen, the notification is supplied by the caller.
+ *
+ * Author: Mick Jordan
+ */
+
+#ifndef __EXEC_RING_H__
+#define __EXEC_RING_H__
+
+#include <stdint.h>
+#include <poll.h>
+#include <xen/xen.h>
+#include "execif.h"
+
+struct exec_ring {
+    struct execif_data_ctrl *ctrl;
+    char *data[EXECIF_STREAMS];
+    int fd[EXECIF_STREAMS];       /* process pipes, -1 once a stream is finished */
+    int event_fd;                 /* readable when the frontend has notified us */
+    void (*notify)(struct exec_ring *ring);
+    void (*ack)(struct exec_ring *ring);
+    void *priv;
+};
+
+/* Makes the pipes non-blocking, must be called before servicing. */
+void exec_ring_init(struct exec_ring *ring);
+
+/* Moves as much data as possible without blocking.  Fills pfd[0..2] with
+ * what each live stream is waiting for and returns the number of live
+ * streams. */
+int exec_ring_service(struct exec_ring *ring, struct pollfd *pfd);
+
+/* Tells the frontend we are about to let go of the pages. */
+void exec_ring_disconnect(struct exec_ring *ring);
+
+/* Services the ring until all streams are finished, then disconnects. */
+void exec_ring_pump(struct exec_ring *ring);
+
+#endif /* __EXEC_RING_H__ */
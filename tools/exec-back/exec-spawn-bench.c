@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Spawns short-lived processes through the supervisor and waits for all
+ * of them, on plain Linux.  For comparison the same processes are waited
+ * for the way exec-backend used to, with a thread blocked in waitpid per
+ * process.
+ *
+ * Usage: exec-spawn-bench [processes [threads]]
+ *
+ * Author: Mick Jordan
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <wait.h>
+#include "exec-supervisor.h"
+
+int trace_level = 0;
+
+static int nprocs = 1000;
+static int waited;
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void count_wait(void) {
+    pthread_mutex_lock(&done_lock);
+    if (++waited == nprocs)
+        pthread_cond_signal(&done_cond);
+    pthread_mutex_unlock(&done_lock);
+}
+
+static void await_all(void) {
+    pthread_mutex_lock(&done_lock);
+    while (waited < nprocs)
+        pthread_cond_wait(&done_cond, &done_lock);
+    pthread_mutex_unlock(&done_lock);
+}
+
+static void bench_status(struct request *request, char *kind, int request_id) {
+    if (strcmp(kind, "wait") == 0)
+        count_wait();
+}
+
+static void bench_read_data(struct request *request, int request_id, char *data, int length) {
+}
+
+static void bench_ring_done(struct request *request) {
+}
+
+static struct supervisor_ops bench_ops = {
+    .status = bench_status,
+    .read_data = bench_read_data,
+    .ring_done = bench_ring_done,
+};
+
+static char *true_argv[] = { "true", NULL };
+
+static double bench_supervisor(struct request *requests) {
+    double start = now();
+    int i, fd;
+    waited = 0;
+    for (i = 0; i < nprocs; i++) {
+        struct request *r = &requests[i];
+        supervisor_init_request(r);
+        r->request_id = i * 3;
+        supervisor_exec(r, 0, true_argv, NULL);
+        if (r->status != 0) {
+            printf("exec failed: %d\n", r->status);
+            exit(1);
+        }
+        for (fd = 0; fd < 3; fd++)
+            supervisor_close(r, r->request_id + fd, fd);
+        supervisor_wait(r);
+    }
+    await_all();
+    return now() - start;
+}
+
+static void *wait_in_thread(void *data) {
+    struct request *r = (struct request *)data;
+    int status;
+    waitpid(r->pid, &status, 0);
+    r->status = exit_code(status);
+    count_wait();
+    return NULL;
+}
+
+static double bench_thread_per_wait(struct request *requests) {
+    double start = now();
+    pthread_t thread;
+    int i, fd;
+    waited = 0;
+    for (i = 0; i < nprocs; i++) {
+        struct request *r = &requests[i];
+        supervisor_init_request(r);
+        supervisor_spawn(r, 0, true_argv, NULL);
+        if (r->status != 0) {
+            printf("exec failed: %d\n", r->status);
+            exit(1);
+        }
+        for (fd = 0; fd < 3; fd++)
+            close(r->stdio[fd]);
+        pthread_create(&thread, NULL, wait_in_thread, r);
+        pthread_detach(thread);
+    }
+    await_all();
+    return now() - start;
+}
+
+int main(int argc, char *argv[]) {
+    int nthreads = EXEC_THREADS;
+    struct request *requests;
+    double t_sup, t_old;
+
+    if (argc > 1) nprocs = atoi(argv[1]);
+    if (argc > 2) nthreads = atoi(argv[2]);
+    requests = calloc(nprocs, sizeof(struct request));
+    if (supervisor_init(&bench_ops) < 0 || supervisor_start(nthreads) < 0) {
+        return 1;
+    }
+    t_sup = bench_supervisor(requests);
+    t_old = bench_thread_per_wait(requests);
+    printf("%d processes\n", nprocs);
+    printf("supervisor, %d threads:    %8.3f s, %8.0f processes/s\n", nthreads, t_sup, nprocs / t_sup);
+    printf("thread per wait, %d threads: %8.3f s, %8.0f processes/s\n", nprocs, t_old, nprocs / t_old);
+    return 0;
+}
@@ -0,0 +1,652 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Event driven process supervisor for exec-backend, see exec-supervisor.h.
+ * The process creation code was taken from UNIXProcess_md.c in the Sun JDK.
+ *
+ * Author: Mick Jordan
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <wait.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include "exec-supervisor.h"
+
+#ifndef STDIN_FILENO
+#define STDIN_FILENO 0
+#endif
+
+#ifndef STDOUT_FILENO
+#define STDOUT_FILENO 1
+#endif
+
+#ifndef STDERR_FILENO
+#define STDERR_FILENO 2
+#endif
+
+#define FAIL_FILENO (STDERR_FILENO + 1)
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+#define SRC_FD     0              /* supervisor_add_fd */
+#define SRC_CHILD  1
+#define SRC_SIGNAL 2
+#define SRC_STDIO  3
+#define SRC_RING   4
+
+extern int trace_level;
+
+static struct supervisor_ops *sops;
+static int epoll_fd = -1;
+static int use_pidfd;
+static sigset_t child_mask, saved_mask;
+static struct supervisor_source signal_src;
+/* children known to the signalfd fallback */
+static struct request *children;
+static pthread_mutex_t children_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void arm(struct supervisor_source *src, int fd, unsigned int events) {
+    struct epoll_event ev;
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = src;
+    src->fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        if (errno != ENOENT || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl");
+        }
+    }
+}
+
+void supervisor_add_fd(struct supervisor_source *src, int fd,
+                       void (*handler)(struct supervisor_source *src)) {
+    src->kind = SRC_FD;
+    src->handler = handler;
+    arm(src, fd, EPOLLIN);
+}
+
+void supervisor_rearm(struct supervisor_source *src) {
+    arm(src, src->fd, EPOLLIN);
+}
+
+static void move_fd(int from_fd, int to_fd) {
+  if (from_fd != to_fd) {
+    dup2(from_fd, to_fd);
+    close(from_fd);
+  } else {
+    fcntl(to_fd, F_SETFD, 0);
+  }
+}
+
+static int safe_close(int fd) {
+  if (fd != -1) {
+    return close(fd);
+  }
+  return 0;
+}
+
+/*
+ * Reads nbyte bytes from file descriptor fd into buf,
+ * The read operation is retried in case of EINTR or partial reads.
+ *
+ * Returns number of bytes read (normally nbyte, but may be less in
+ * case of EOF).  In case of read errors, returns -1 and sets errno.
+ */
+static ssize_t
+read_fully(int fd, void *buf, size_t nbyte)
+{
+    ssize_t remaining = nbyte;
+    for (;;) {
+        ssize_t n = read(fd, buf, remaining);
+        if (n == 0) {
+            return nbyte - remaining;
+        } else if (n > 0) {
+            remaining -= n;
+            if (remaining <= 0)
+                return nbyte;
+            /* We were interrupted in the middle of reading the bytes.
+             * Unlikely, but possible. */
+            buf = (void *) (((char *)buf) + n);
+        } else if (errno == EINTR) {
+            /* Strange signals like SIGJVM1 are possible at any time.
+             * See http://www.dreamsongs.com/WorseIsBetter.html */
+        } else {
+            return -1;
+        }
+    }
+}
+
+void supervisor_spawn(struct request *request, int argc, char **argv, char *wdir) {
+    int errnum;
+    int pid = -1;
+    int in[2], out[2], err[2], fail[2];
+    
+    in[0] = in[1] = out[0] = out[1] = err[0] = err[1] = fail[0] = fail[1] = -1;
+
+    /* close-on-exec, so that concurrently spawned children do not hold
+       each other's pipes open */
+    if ((pipe2(in, O_CLOEXEC)   < 0) ||
+	(pipe2(out, O_CLOEXEC)  < 0) ||
+	(pipe2(err, O_CLOEXEC)  < 0) ||
+	(pipe2(fail, O_CLOEXEC) < 0)) {
+	errnum = errno;
+	printf("pipe calls failed");
+	goto fail;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+      /* fork failed */
+      errnum = errno;
+      printf("Fork failed\n");
+      goto fail;
+    }
+
+    if (pid == 0) {
+      /* child */
+      sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+      signal(SIGPIPE, SIG_DFL);
+      close(in[1]);
+      move_fd(in[0], STDIN_FILENO);
+      close(out[0]);
+      move_fd(out[1], STDOUT_FILENO);
+      close(err[0]);
+      move_fd(err[1], STDERR_FILENO);
+      close(fail[0]);
+      move_fd(fail[1], FAIL_FILENO);
+      
+
+      if (wdir != NULL && chdir(wdir) < 0) {
+	errnum = errno;
+	printf("Failed to chdir to %s\n", wdir);
+	goto execfail;
+      }
+
+      if (fcntl(FAIL_FILENO, F_SETFD, FD_CLOEXEC) == -1)
+	goto execfail;
+
+      execvp(argv[0], argv);
+    execfail:
+      errnum = errno;
+      write(FAIL_FILENO, &errnum, sizeof(errnum));
+      close(FAIL_FILENO);
+      _exit(-1);
+    }
+
+    /* Parent process */
+    request->pid = pid;
+    close(fail[1]); fail[1] = -1;
+  
+    switch (read_fully(fail[0], &errnum, sizeof(errnum))) {
+        case 0: break; /* Exec succeeded */
+        case sizeof(errnum):
+	    waitpid(pid, NULL, 0);
+	    request->pid = -1;
+	    printf("Exec failed\n");
+	    goto fail;
+        default:
+	    errnum = errno;
+	    printf("Read failed\n");
+	    goto fail;
+    }
+
+    request->status = 0;
+    request->stdio[0] = in[1];
+    request->stdio[1] = out[0];
+    request->stdio[2] = err[0];
+    if (trace_level >= TRACE_OPS_NOISY) {
+      printf("Exec fds: %u, %u, %u\n", request->stdio[0],  request->stdio[1], request->stdio[2]);
+    }
+    
+finally:    
+    /* Always clean up the child's side of the pipes */
+    safe_close(in [0]);
+    safe_close(out[1]);
+    safe_close(err[1]);
+
+    /* Always clean up fail descriptors */
+    safe_close(fail[0]);
+    safe_close(fail[1]);
+
+    return;
+
+fail:
+    /* Clean up the parent's side of the pipes in case of failure only */
+    safe_close(in [1]);
+    safe_close(out[0]);
+    safe_close(err[0]);
+    request->status = -errnum;
+    goto finally;
+
+}
+
+int exit_code(int status) {
+    if (WIFEXITED(status)) {
+        /*
+         * The child exited normally; get its exit code.
+         */
+        return WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) {
+        /* The child exited because of a signal.
+	 * The best value to return is 0x80 + signal number,
+	 * because that is what all Unix shells do, and because
+	 * it allows callers to distinguish between process exit and
+	 * process death by signal.
+         */
+	return 0x80 + WTERMSIG(status);
+    } else {
+        /*
+         * Unknown exit code; pass it through.
+         */
+	return status;
+    }
+}
+
+void supervisor_init_request(struct request *request) {
+    int i;
+    pthread_mutex_init(&request->lock, NULL);
+    request->status = 0;
+    request->setup = 0;
+    request->pid = -1;
+    request->ring = NULL;
+    request->pidfd = -1;
+    request->exited = 0;
+    request->wait_pending = 0;
+    request->next_child = NULL;
+    for (i = 0; i < 3; i++) {
+        request->stdio[i] = -1;
+        request->read_id[i] = -1;
+        request->write_id[i] = -1;
+        request->write_data[i] = NULL;
+    }
+}
+
+/* request locked */
+static void complete_wait(struct request *request) {
+    request->status = request->exit_status;
+    /* communicate wait status to frontend */
+    sops->status(request, "wait", request->request_id);
+    request->wait_pending = 0;
+    /* mark exited */
+    request->pid = -1;
+}
+
+static void forget_child(struct request *request) {
+    struct request **p;
+    pthread_mutex_lock(&children_lock);
+    for (p = &children; *p != NULL; p = &(*p)->next_child) {
+        if (*p == request) {
+            *p = request->next_child;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&children_lock);
+}
+
+/* request locked; returns 1 once the child has been reaped */
+static int check_child(struct request *request) {
+    int status, ret;
+    if (request->exited || request->pid <= 0) {
+        return 1;
+    }
+    do {
+        ret = waitpid(request->pid, &status, WNOHANG);
+    } while (ret < 0 && errno == EINTR);
+    if (ret == 0) {
+        return 0;
+    }
+    request->exit_status = ret < 0 ? 0 : exit_code(status);  /* ECHILD: already gone */
+    request->exited = 1;
+    if (request->pidfd >= 0) {
+        close(request->pidfd);
+        request->pidfd = -1;
+    } else {
+        forget_child(request);
+    }
+    if (request->wait_pending) {
+        complete_wait(request);
+    }
+    return 1;
+}
+
+static void child_ready(struct request *request) {
+    pthread_mutex_lock(&request->lock);
+    if (!check_child(request)) {
+        arm(&request->src_child, request->pidfd, EPOLLIN);
+    }
+    pthread_mutex_unlock(&request->lock);
+}
+
+static void signal_ready(void) {
+    struct signalfd_siginfo info;
+    struct request *r, *next;
+    while (read(signal_src.fd, &info, sizeof(info)) == sizeof(info))
+        ;
+    /* SIGCHLD coalesces, look at every child */
+    pthread_mutex_lock(&children_lock);
+    r = children;
+    pthread_mutex_unlock(&children_lock);
+    while (r != NULL) {
+        pthread_mutex_lock(&children_lock);
+        next = r->next_child;
+        pthread_mutex_unlock(&children_lock);
+        child_ready(r);
+        r = next;
+    }
+    arm(&signal_src, signal_src.fd, EPOLLIN);
+}
+
+/* request locked */
+static void try_read(struct request *request, int fd) {
+    char buffer[EXEC_READ_MAX];
+    int request_id = request->read_id[fd];
+    ssize_t n;
+    do {
+        n = read(request->stdio[fd], buffer, request->read_length[fd]);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && errno == EAGAIN) {
+        arm(&request->src_stdio[fd], request->stdio[fd], EPOLLIN);
+        return;
+    }
+    request->read_id[fd] = -1;
+    request->status = n < 0 ? -errno : 0;
+    if (n >= 0) {
+        sops->read_data(request, request_id, buffer, n);
+    }
+    sops->status(request, "read", request_id);
+}
+
+/* request locked */
+static void try_write(struct request *request, int fd) {
+    int request_id = request->write_id[fd];
+    ssize_t n;
+    while (request->write_done[fd] < request->write_length[fd]) {
+        n = write(request->stdio[fd], request->write_data[fd] + request->write_done[fd],
+                  request->write_length[fd] - request->write_done[fd]);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN) {
+            arm(&request->src_stdio[fd], request->stdio[fd], EPOLLOUT);
+            return;
+        }
+        if (n < 0) {
+            request->status = -errno;
+            goto done;
+        }
+        request->write_done[fd] += n;
+    }
+    request->status = 0;
+done:
+    free(request->write_data[fd]);
+    request->write_data[fd] = NULL;
+    request->write_id[fd] = -1;
+    sops->status(request, "write", request_id);
+}
+
+static void stdio_ready(struct request *request, int fd) {
+    pthread_mutex_lock(&request->lock);
+    if (request->stdio[fd] >= 0) {
+        if (request->read_id[fd] >= 0) {
+            try_read(request, fd);
+        } else if (request->write_id[fd] >= 0) {
+            try_write(request, fd);
+        }
+    }
+    pthread_mutex_unlock(&request->lock);
+}
+
+/* request locked */
+static void service_ring(struct request *request, int event) {
+    struct pollfd pfd[EXECIF_STREAMS];
+    int i;
+    if (request->ring == NULL) {
+        return;
+    }
+    if (event) {
+        request->ring->ack(request->ring);
+    }
+    if (exec_ring_service(request->ring, pfd) == 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, request->ring->event_fd, NULL);
+        exec_ring_disconnect(request->ring);
+        sops->ring_done(request);
+        /* the ring closed our ends of the pipes */
+        request->stdio[0] = request->stdio[1] = request->stdio[2] = -1;
+        return;
+    }
+    for (i = 0; i < EXECIF_STREAMS; i++) {
+        if (pfd[i].events) {
+            arm(&request->src_ring[i], pfd[i].fd, pfd[i].events);
+        }
+    }
+    if (event) {
+        arm(&request->src_ring[EXECIF_STREAMS], request->ring->event_fd, EPOLLIN);
+    }
+}
+
+static void ring_ready(struct request *request, int index) {
+    pthread_mutex_lock(&request->lock);
+    service_ring(request, index == EXECIF_STREAMS);
+    pthread_mutex_unlock(&request->lock);
+}
+
+static void init_source(struct supervisor_source *src, int kind, int index, struct request *request) {
+    src->kind = kind;
+    src->index = index;
+    src->fd = -1;
+    src->request = request;
+    src->handler = NULL;
+}
+
+void supervisor_exec(struct request *request, int argc, char **argv, char *wdir) {
+    int i;
+    pthread_mutex_lock(&request->lock);
+    supervisor_spawn(request, argc, argv, wdir);
+    if (request->status != 0) {
+        pthread_mutex_unlock(&request->lock);
+        return;
+    }
+    init_source(&request->src_child, SRC_CHILD, 0, request);
+    for (i = 0; i < 3; i++) {
+        fcntl(request->stdio[i], F_SETFL, fcntl(request->stdio[i], F_GETFL) | O_NONBLOCK);
+        init_source(&request->src_stdio[i], SRC_STDIO, i, request);
+    }
+    if (use_pidfd) {
+        request->pidfd = syscall(SYS_pidfd_open, request->pid, 0);
+    }
+    if (request->pidfd >= 0) {
+        arm(&request->src_child, request->pidfd, EPOLLIN);
+    } else {
+        pthread_mutex_lock(&children_lock);
+        request->next_child = children;
+        children = request;
+        pthread_mutex_unlock(&children_lock);
+        /* it may have exited before it was on the list */
+        check_child(request);
+    }
+    if (request->ring != NULL) {
+        for (i = 0; i <= EXECIF_STREAMS; i++) {
+            init_source(&request->src_ring[i], SRC_RING, i, request);
+        }
+        for (i = 0; i < EXECIF_STREAMS; i++) {
+            request->ring->fd[i] = request->stdio[i];
+        }
+        exec_ring_init(request->ring);
+        arm(&request->src_ring[EXECIF_STREAMS], request->ring->event_fd, EPOLLIN);
+        service_ring(request, 0);
+    }
+    pthread_mutex_unlock(&request->lock);
+}
+
+void supervisor_wait(struct request *request) {
+    pthread_mutex_lock(&request->lock);
+    if (request->exited) {
+        complete_wait(request);
+    } else {
+        request->wait_pending = 1;
+    }
+    pthread_mutex_unlock(&request->lock);
+}
+
+void supervisor_read(struct request *request, int request_id, int fd, int length) {
+    pthread_mutex_lock(&request->lock);
+    if (request->stdio[fd] < 0 || request->read_id[fd] >= 0) {
+        request->status = -EBADF;
+        sops->status(request, "read", request_id);
+    } else {
+        request->read_id[fd] = request_id;
+        request->read_length[fd] = length > EXEC_READ_MAX ? EXEC_READ_MAX : length;
+        try_read(request, fd);
+    }
+    pthread_mutex_unlock(&request->lock);
+}
+
+void supervisor_write(struct request *request, int request_id, int fd, char *data, int length) {
+    pthread_mutex_lock(&request->lock);
+    if (request->stdio[fd] < 0 || request->write_id[fd] >= 0) {
+        request->status = -EBADF;
+        sops->status(request, "write", request_id);
+    } else {
+        request->write_id[fd] = request_id;
+        request->write_data[fd] = malloc(length);
+        memcpy(request->write_data[fd], data, length);
+        request->write_length[fd] = length;
+        request->write_done[fd] = 0;
+        try_write(request, fd);
+    }
+    pthread_mutex_unlock(&request->lock);
+}
+
+void supervisor_close(struct request *request, int request_id, int fd) {
+    int result;
+    pthread_mutex_lock(&request->lock);
+    /* closing the pipe also takes it out of the epoll set */
+    result = safe_close(request->stdio[fd]);
+    request->stdio[fd] = -1;
+    request->read_id[fd] = -1;
+    request->write_id[fd] = -1;
+    free(request->write_data[fd]);
+    request->write_data[fd] = NULL;
+    request->status = result < 0 ? -errno : 0;
+    sops->status(request, "close", request_id);
+    pthread_mutex_unlock(&request->lock);
+}
+
+void supervisor_kill(struct request *request) {
+    pthread_mutex_lock(&request->lock);
+    if (!request->exited && request->pid > 0) {
+        kill(request->pid, SIGTERM);
+    }
+    request->status = 0;
+    pthread_mutex_unlock(&request->lock);
+}
+
+static void *supervisor_thread(void *arg) {
+    struct epoll_event ev;
+    struct supervisor_source *src;
+    int n;
+    for (;;) {
+        n = epoll_wait(epoll_fd, &ev, 1, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+        if (n == 0)
+            continue;
+        src = (struct supervisor_source *)ev.data.ptr;
+        switch (src->kind) {
+        case SRC_FD:
+            src->handler(src);
+            break;
+        case SRC_CHILD:
+            child_ready(src->request);
+            break;
+        case SRC_SIGNAL:
+            signal_ready();
+            break;
+        case SRC_STDIO:
+            stdio_ready(src->request, src->index);
+            break;
+        case SRC_RING:
+            ring_ready(src->request, src->index);
+            break;
+        }
+    }
+    return NULL;
+}
+
+int supervisor_init(struct supervisor_ops *ops) {
+    int fd;
+    sops = ops;
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    /* a process closing its stdin must show up as EPIPE, not kill us */
+    signal(SIGPIPE, SIG_IGN);
+    /* SIGCHLD is only ever consumed through the signalfd, block it before
+       any thread exists so that they all inherit the mask */
+    sigemptyset(&child_mask);
+    sigaddset(&child_mask, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &child_mask, &saved_mask);
+
+    fd = syscall(SYS_pidfd_open, getpid(), 0);
+    use_pidfd = fd >= 0;
+    if (use_pidfd) {
+        close(fd);
+    }
+    /* needed with pidfds too, for a child whose pidfd_open fails */
+    fd = signalfd(-1, &child_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0) {
+        perror("signalfd");
+        return -1;
+    }
+    init_source(&signal_src, SRC_SIGNAL, 0, NULL);
+    arm(&signal_src, fd, EPOLLIN);
+    if (trace_level >= TRACE_OPS) {
+        printf("Supervising children with %s\n", use_pidfd ? "pidfd" : "signalfd");
+    }
+    return 0;
+}
+
+int supervisor_start(int nthreads) {
+    pthread_t thread;
+    int i;
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&thread, NULL, supervisor_thread, NULL) != 0) {
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Event driven process supervisor for exec-backend.  One epoll instance
+ * serves the xenstore watch, every child (pidfd, or signalfd when pidfds
+ * are not available), the pipes of pending xenstore reads and writes and
+ * the data channels, from a small pool of threads.  Every source is armed
+ * one-shot so that only one thread handles it at a time; the state of a
+ * request is protected by its lock.
+ *
+ * Nothing here talks to xenstore, results go back through the ops.
+ *
+ * Author: Mick Jordan
+ */
+
+#ifndef __EXEC_SUPERVISOR_H__
+#define __EXEC_SUPERVISOR_H__
+
+#include <pthread.h>
+#include "exec-ring.h"
+
+#define TRACE_OPS 1
+#define TRACE_OPS_NOISY 2
+#define TRACE_RING 3
+
+#define EXEC_THREADS 4            /* default size of the thread pool */
+#define EXEC_READ_MAX 80          /* per xenstore read request */
+
+struct request;
+
+struct supervisor_source {
+    int kind;
+    int index;                    /* stream, or EXECIF_STREAMS for the event channel */
+    int fd;
+    struct request *request;
+    void (*handler)(struct supervisor_source *src);
+};
+
+struct request {
+    int dom_id;
+    int request_id;
+    int status;
+    int pid;
+    int slot;
+    int setup;                  /* not yet answered, must not be reaped */
+    int stdio[3];
+    struct exec_ring *ring;     /* data channel, NULL for xenstore I/O */
+
+    /* supervisor state, protected by lock */
+    pthread_mutex_t lock;
+    int pidfd;
+    int exited;
+    int exit_status;
+    int wait_pending;
+    int read_id[3];             /* pending xenstore read, -1 if none */
+    int read_length[3];
+    int write_id[3];            /* pending xenstore write, -1 if none */
+    char *write_data[3];
+    int write_length[3];
+    int write_done[3];
+    struct request *next_child; /* for the signalfd fallback */
+    struct supervisor_source src_child;
+    struct supervisor_source src_stdio[3];
+    struct supervisor_source src_ring[EXECIF_STREAMS + 1];
+};
+
+struct supervisor_ops {
+    /* an operation of kind ("exec", "wait", ...) completed with request->status */
+    void (*status)(struct request *request, char *kind, int request_id);
+    /* data for a completed xenstore read, called before its status */
+    void (*read_data)(struct request *request, int request_id, char *data, int length);
+    /* the data channel is finished with, unmap it */
+    void (*ring_done)(struct request *request);
+};
+
+int supervisor_init(struct supervisor_ops *ops);
+int supervisor_start(int nthreads);
+
+/* watches fd; handler runs on a pool thread and must call supervisor_rearm
+   when it is ready for the next event */
+void supervisor_add_fd(struct supervisor_source *src, int fd,
+                       void (*handler)(struct supervisor_source *src));
+void supervisor_rearm(struct supervisor_source *src);
+
+void supervisor_init_request(struct request *request);
+
+/* fork/exec only, sets request->status, pid and stdio */
+void supervisor_spawn(struct request *request, int argc, char **argv, char *wdir);
+/* spawn and supervise the child and, if present, its data channel */
+void supervisor_exec(struct request *request, int argc, char **argv, char *wdir);
+void supervisor_wait(struct request *request);
+void supervisor_read(struct request *request, int request_id, int fd, int length);
+void supervisor_write(struct request *request, int request_id, int fd, char *data, int length);
+void supervisor_close(struct request *request, int request_id, int fd);
+void supervisor_kill(struct request *request);
+
+int exit_code(int status);
+
+#endif /* __EXEC_SUPERVISOR_H__ */
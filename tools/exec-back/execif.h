@@ -23,8 +23,8 @@
 /******************************************************************************
  * 
  * This would define the packets that traverse the ring between the exec frontend and backend.
- * Currently, everything is done by xenstore, but bulk/binary I/O certainly would benefit from
- * ring-based communication.
+ * Requests and status are done by xenstore; the stdin/stdout/stderr data of a request
+ * goes through the shared data channel defined below.
  * 
  * Author:  Mick Jordan
  * 
@@ -64,6 +64,46 @@ typedef struct execif_response execif_response_t;
 
 DEFINE_RING_TYPES(execif, struct execif_request, struct execif_response);
 
+/*
+ * Data channel of an exec request.
+ *
+ * The frontend grants a control page and one data page per stream, and
+ * writes the control page ref and an unbound event channel as "ring-ref"
+ * and "event-channel" into the request node before submitting the exec
+ * request.  The backend advertises support with "feature-data-ring" in
+ * its root node.
+ *
+ * Each stream is a byte ring with free running indices: its writer
+ * advances prod, its reader advances cons.  Stdin is written by the
+ * frontend, stdout and stderr by the backend.  A writer sets eof after
+ * its last prod update; a reader that is no longer interested sets
+ * reader_closed, and the writer then drops any further data.  Either
+ * side notifies the other through the event channel when it makes data
+ * or space available that the other may be waiting for.  The backend
+ * sets disconnected, and notifies, when it is about to unmap the pages.
+ */
+#define EXECIF_STDIN         0
+#define EXECIF_STDOUT        1
+#define EXECIF_STDERR        2
+#define EXECIF_STREAMS       3
+
+#define EXECIF_STREAM_SIZE   4096            /* one page, a power of two */
+#define EXECIF_STREAM_IDX(_i) ((_i) & (EXECIF_STREAM_SIZE - 1))
+
+struct execif_stream {
+    uint32_t prod;
+    uint32_t cons;
+    uint8_t  eof;
+    uint8_t  reader_closed;
+    uint8_t  pad[54];                        /* one cache line per stream */
+};
+
+struct execif_data_ctrl {
+    struct execif_stream streams[EXECIF_STREAMS];
+    grant_ref_t data_ref[EXECIF_STREAMS];
+    uint8_t disconnected;
+};
+
 #define STATE_INITIALISED     "init"
 #define STATE_READY           "ready"
 
@@ -27,6 +27,7 @@
  *         Mick Jordan
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <malloc.h>
@@ -110,9 +111,15 @@ wait_again:
             if(request_ids[i] >= 0)
                 dispatch_response(mount, request_ids[i]);
             else
+            {
+                /* Completed slots are back on the freelist, so their
+                   copies must go before new requests can reuse them */
+                fs_gcopy_flush(mount);
                 goto read_event_channel;
+            }
         }
  
+    fs_gcopy_flush(mount);
     RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&mount->ring, notify);
     if (trace_level >= TRACE_RING) printf("Pushed responses and notify=%d\n", notify);
     if(notify)
@@ -139,6 +146,8 @@ void allocate_request_array(struct mount *mount)
     for(i=0; i< nr_entries; i++)
     {
         requests[i].active = 0; 
+        if (mount->grant_copy)
+            assert(posix_memalign(&requests[i].buf, PAGE_SIZE, PAGE_SIZE) == 0);
         add_id_to_freelist(i, freelist);
     }
     mount->requests = requests;
@@ -199,6 +208,7 @@ moretodo:
         RING_FINAL_CHECK_FOR_REQUESTS(&mount->ring, more);
         if(more) goto moretodo;
 
+        fs_gcopy_flush(mount);
         RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&mount->ring, notify);
         if (trace_level >= TRACE_RING) printf("Pushed responces and notify=%d\n", notify);
         if(notify)
@@ -258,6 +268,7 @@ static void handle_connection(int frontend_dom_id, int export_id)
                                     PROT_READ | PROT_WRITE);
     BACK_RING_INIT(&mount->ring, sring, PAGE_SIZE);
     mount->nr_entries = mount->ring.nr_ents; 
+    fs_gcopy_init(mount, mount->grant_copy);
     xenbus_write_backend_ready(mount);
 
     pthread_create(&handling_thread, NULL, &handle_mount, mount);
@@ -325,6 +336,8 @@ int main(int argc, char*argv[])
 
     if (argc > 1) sscanf(argv[1], "%d", &trace_level);
     if (argc > 2) export_name = argv[2];
+    /* "map" turns grant copy off, to compare with the map path */
+    if (argc > 3 && strcmp(argv[3], "map") == 0) grant_copy_enabled = 0;
 
     /* Open the connection to XenStore first */
     xsh = xs_domain_open();
@@ -59,6 +59,7 @@ struct fs_request
 {
     int active;
     void *page;                         /* Pointer to mapped grant */
+    void *buf;                          /* Local copy of the grant, in grant-copy mode */
     struct fsif_request req_shadow;
     struct aiocb aiocb; 
 };
@@ -79,6 +80,9 @@ struct mount
     int nr_entries;
     struct fs_request *requests;
     unsigned short *freelist;
+    int grant_copy;                   /* Copy data rather than map grants */
+    void *sync_buf;                   /* Grant-copy buffer for synchronous ops */
+    struct gcopy_batch *gcopy;        /* Deferred copies to the frontend */
 };
 
 
@@ -92,6 +96,23 @@ void xenbus_read_mount_request(struct mount *mount);
 void xenbus_write_backend_node(struct mount *mount);
 void xenbus_write_backend_ready(struct mount *mount);
 
+/*
+ * Access to the frontend's granted pages, implemented in fs-gcopy.c.
+ * By default a page is mapped for the duration of a request. If the
+ * frontend sets feature-grant-copy and gntdev supports it, data is
+ * copied instead: get_grant_page copies len bytes into buf and returns
+ * it, put_grant_page copies len bytes back, either at once or, with
+ * defer, in a batch flushed before responses are pushed.
+ * get_grant_page returns NULL, and put_grant_page -1, if the frontend's
+ * grant could not be accessed. A deferred copy that fails turns the
+ * response written after it into -EFAULT.
+ */
+extern int grant_copy_enabled;
+void fs_gcopy_init(struct mount *mount, int requested);
+void *get_grant_page(struct mount *mount, grant_ref_t gref, int prot, void *buf, int len);
+int put_grant_page(struct mount *mount, grant_ref_t gref, void *page, int len, int defer);
+void fs_gcopy_flush(struct mount *mount);
+
 /* File operations, implemented in fs-ops.c */
 struct fs_op
 {
@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/******************************************************************************
+ *
+ * Grant access for the backend of FS split device driver: map the
+ * frontend's pages, or copy to and from them with GNTTABOP_copy through
+ * the gntdev device, which saves a map, unmap and TLB flush per request.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <xenctrl.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include "fs-backend.h"
+
+/* From the Linux gntdev interface, for kernel headers that predate it. */
+#ifndef IOCTL_GNTDEV_GRANT_COPY
+struct gntdev_grant_copy_segment {
+    union {
+        void *virt;
+        struct {
+            grant_ref_t ref;
+            uint16_t offset;
+            domid_t domid;
+        } foreign;
+    } source, dest;
+    uint16_t len;
+    uint16_t flags;             /* GNTCOPY_* */
+    int16_t status;             /* GNTST_* */
+};
+
+struct ioctl_gntdev_grant_copy {
+    unsigned int count;
+    struct gntdev_grant_copy_segment *segments;
+};
+
+#define IOCTL_GNTDEV_GRANT_COPY \
+    _IOC(_IOC_NONE, 'G', 8, sizeof(struct ioctl_gntdev_grant_copy))
+#endif
+
+#define GCOPY_BATCH 64
+
+struct gcopy_batch
+{
+    int count;
+    struct gntdev_grant_copy_segment segs[GCOPY_BATCH];
+    RING_IDX rsp_idx[GCOPY_BATCH];    /* response to fail if the copy does */
+};
+
+extern int trace_level;
+
+/* cleared with the "map" command line argument */
+int grant_copy_enabled = 1;
+
+/*
+ * mount->gnth is the gntdev file descriptor. Returns -1 if the ioctl itself
+ * failed, otherwise the number of segments that failed, whose status says so.
+ */
+static int grant_copy(struct mount *mount, struct gntdev_grant_copy_segment *segs, int count)
+{
+    struct ioctl_gntdev_grant_copy copy;
+    int i, failed = 0;
+
+    copy.count = count;
+    copy.segments = segs;
+    if (ioctl(mount->gnth, IOCTL_GNTDEV_GRANT_COPY, &copy) < 0)
+    {
+        printf("Grant copy failed, errno %d\n", errno);
+        return -1;
+    }
+    for (i = 0; i < count; i++)
+        if (segs[i].status != GNTST_okay)
+        {
+            printf("Grant copy of gref %d failed, status %d\n",
+                   segs[i].flags & GNTCOPY_dest_gref ? segs[i].dest.foreign.ref
+                                                     : segs[i].source.foreign.ref,
+                   segs[i].status);
+            failed++;
+        }
+    return failed;
+}
+
+static void *alloc_buf(void)
+{
+    void *buf;
+
+    assert(posix_memalign(&buf, PAGE_SIZE, PAGE_SIZE) == 0);
+    return buf;
+}
+
+/*
+ * Use grant-copy for this mount if the frontend asked for it and gntdev
+ * can do it; an empty copy tells us the latter.
+ */
+void fs_gcopy_init(struct mount *mount, int requested)
+{
+    struct ioctl_gntdev_grant_copy copy = { 0, NULL };
+
+    mount->grant_copy = 0;
+    mount->sync_buf = NULL;
+    mount->gcopy = NULL;
+    if (!requested || !grant_copy_enabled)
+        return;
+    if (ioctl(mount->gnth, IOCTL_GNTDEV_GRANT_COPY, &copy) < 0)
+    {
+        printf("gntdev has no grant copy, mapping grants\n");
+        return;
+    }
+    mount->grant_copy = 1;
+    mount->sync_buf = alloc_buf();
+    mount->gcopy = malloc(sizeof(struct gcopy_batch));
+    mount->gcopy->count = 0;
+    if (trace_level >= TRACE_OPS) printf("Using grant copy for mount %d\n", mount->mount_id);
+}
+
+void *get_grant_page(struct mount *mount, grant_ref_t gref, int prot, void *buf, int len)
+{
+    struct gntdev_grant_copy_segment seg;
+
+    if (!mount->grant_copy)
+        return xc_gnttab_map_grant_ref(mount->gnth, mount->dom_id, gref, prot);
+
+    /* len comes from the frontend */
+    if (len < 0 || len > PAGE_SIZE)
+        return NULL;
+    if (len > 0)
+    {
+        seg.source.foreign.ref = gref;
+        seg.source.foreign.offset = 0;
+        seg.source.foreign.domid = mount->dom_id;
+        seg.dest.virt = buf;
+        seg.len = len;
+        seg.flags = GNTCOPY_source_gref;
+        if (grant_copy(mount, &seg, 1) != 0)
+            return NULL;
+    }
+    return buf;
+}
+
+void fs_gcopy_flush(struct mount *mount)
+{
+    struct gcopy_batch *batch = mount->gcopy;
+    fsif_response_t *rsp;
+    int i, failed;
+
+    if (batch == NULL || batch->count == 0)
+        return;
+    if (trace_level >= TRACE_RING) printf("Flushing %d grant copies\n", batch->count);
+    failed = grant_copy(mount, batch->segs, batch->count);
+    /* The responses have not been pushed yet, so a request whose data did
+       not get back can still be failed */
+    for (i = 0; failed != 0 && i < batch->count; i++)
+        if (failed < 0 || batch->segs[i].status != GNTST_okay)
+        {
+            rsp = RING_GET_RESPONSE(&mount->ring, batch->rsp_idx[i]);
+            rsp->ret_val = (uint64_t)-EFAULT;
+        }
+    batch->count = 0;
+}
+
+int put_grant_page(struct mount *mount, grant_ref_t gref, void *page, int len, int defer)
+{
+    struct gcopy_batch *batch = mount->gcopy;
+    struct gntdev_grant_copy_segment seg;
+
+    if (!mount->grant_copy)
+    {
+        assert(xc_gnttab_munmap(mount->gnth, page, 1) == 0);
+        return 0;
+    }
+    if (len <= 0)
+        return 0;
+
+    seg.source.virt = page;
+    seg.dest.foreign.ref = gref;
+    seg.dest.foreign.offset = 0;
+    seg.dest.foreign.domid = mount->dom_id;
+    seg.len = len;
+    seg.flags = GNTCOPY_dest_gref;
+    if (!defer)
+        return grant_copy(mount, &seg, 1) == 0 ? 0 : -1;
+
+    if (batch->count == GCOPY_BATCH)
+        fs_gcopy_flush(mount);
+    /* the caller writes its response next */
+    batch->rsp_idx[batch->count] = mount->ring.rsp_prod_pvt;
+    batch->segs[batch->count++] = seg;
+    return 0;
+}
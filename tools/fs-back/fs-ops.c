@@ -89,6 +89,24 @@ unsigned short get_request(struct mount *mount, struct fsif_request *req)
 }
 
 
+/*
+ * The frontend's grant could not be accessed, or its request does not fit
+ * in one page: consume the request and fail it at once.
+ */
+static void grant_error(struct mount *mount, struct fsif_request *req)
+{
+    RING_IDX rsp_idx;
+    fsif_response_t *rsp;
+    uint16_t req_id = req->id;
+
+    printf("Request %d: cannot access gref\n", req_id);
+    mount->ring.req_cons++;
+    rsp_idx = mount->ring.rsp_prod_pvt++;
+    rsp = RING_GET_RESPONSE(&mount->ring, rsp_idx);
+    rsp->id = req_id;
+    rsp->ret_val = (uint64_t)-EFAULT;
+}
+
 void dispatch_file_open(struct mount *mount, struct fsif_request *req)
 {
     char *file_name;
@@ -101,10 +119,13 @@ void dispatch_file_open(struct mount *mount, struct fsif_request *req)
 
     if (trace_level >= TRACE_OPS_NOISY) printf("Dispatching file open operation (gref=%d).\n", req->u.fopen.gref);
     /* Read the request, and open file */
-    file_name = xc_gnttab_map_grant_ref(mount->gnth,
-                                        mount->dom_id,
-                                        req->u.fopen.gref,
-                                        PROT_READ);
+    file_name = get_grant_page(mount, req->u.fopen.gref, PROT_READ,
+                               mount->sync_buf, PAGE_SIZE);
+    if (file_name == NULL)
+    {
+        grant_error(mount, req);
+        return;
+    }
     flags = req->u.fopen.flags;
    
     req_id = req->id;
@@ -117,7 +138,7 @@ void dispatch_file_open(struct mount *mount, struct fsif_request *req)
     } else {
 		printf("mount missmatch\n");	
 	}
-    assert(xc_gnttab_munmap(mount->gnth, file_name, 1) == 0);
+    put_grant_page(mount, req->u.fopen.gref, file_name, 0, 0);
     /* We can advance the request consumer index, from here on, the request
      * should not be used (it may be overrinden by a response) */
     mount->ring.req_cons++;
@@ -164,19 +185,28 @@ void dispatch_file_read(struct mount *mount, struct fsif_request *req)
     unsigned short priv_id;
     struct fs_request *priv_req;
 
-    /* Read the request */
-    buf = xc_gnttab_map_grant_ref(mount->gnth,
-                                  mount->dom_id,
-                                  req->u.fread.gref,
-                                  PROT_WRITE);
-   
     req_id = req->id;
     if (trace_level >= TRACE_OPS) printf("File read issued for FD=%d (len=%ld, offset=%ld)\n", 
             req->u.fread.fd, req->u.fread.len, req->u.fread.offset); 
    
+    if (req->u.fread.len > PAGE_SIZE)
+    {
+        grant_error(mount, req);
+        return;
+    }
     priv_id = get_request(mount, req);
     if (trace_level >= TRACE_OPS_NOISY) printf("Private id is: %d\n", priv_id);
     priv_req = &mount->requests[priv_id];
+
+    /* Read the request; nothing to copy in */
+    buf = get_grant_page(mount, req->u.fread.gref, PROT_WRITE, priv_req->buf, 0);
+    if (buf == NULL)
+    {
+        priv_req->active = 0;
+        add_id_to_freelist(priv_id, mount->freelist);
+        grant_error(mount, req);
+        return;
+    }
     priv_req->page = buf;
 
     /* Dispatch AIO read request */
@@ -200,8 +230,12 @@ void end_file_read(struct mount *mount, struct fs_request *priv_req)
     uint16_t req_id;
     int ret;
 
-    /* Release the grant */
-    assert(xc_gnttab_munmap(mount->gnth, priv_req->page, 1) == 0);
+    ret = aio_return(&priv_req->aiocb);
+    if (ret < 0) ret = -errno;
+
+    /* Release the grant; in grant-copy mode only the bytes read go back,
+       batched with other completions */
+    put_grant_page(mount, priv_req->req_shadow.u.fread.gref, priv_req->page, ret, 1);
 
     /* Get a response from the ring */
     rsp_idx = mount->ring.rsp_prod_pvt++;
@@ -209,8 +243,6 @@ void end_file_read(struct mount *mount, struct fs_request *priv_req)
     if (trace_level >= TRACE_OPS_NOISY) printf("Writing response at: idx=%d, id=%d\n", rsp_idx, req_id);
     rsp = RING_GET_RESPONSE(&mount->ring, rsp_idx);
     rsp->id = req_id;
-    ret = aio_return(&priv_req->aiocb);
-    if (ret < 0) ret = -errno;
     rsp->ret_val = (uint64_t)ret;
 }
 
@@ -222,19 +254,29 @@ void dispatch_file_write(struct mount *mount, struct fsif_request *req)
     unsigned short priv_id;
     struct fs_request *priv_req;
 
-    /* Read the request */
-    buf = xc_gnttab_map_grant_ref(mount->gnth,
-                                  mount->dom_id,
-                                  req->u.fwrite.gref,
-                                  PROT_READ);
-   
     req_id = req->id;
     if (trace_level >= TRACE_OPS) printf("File write issued for FD=%d (len=%ld, offest=%ld)\n", 
             req->u.fwrite.fd, req->u.fwrite.len, req->u.fwrite.offset); 
    
+    if (req->u.fwrite.len > PAGE_SIZE)
+    {
+        grant_error(mount, req);
+        return;
+    }
     priv_id = get_request(mount, req);
     if (trace_level >= TRACE_OPS_NOISY) printf("Private id is: %d\n", priv_id);
     priv_req = &mount->requests[priv_id];
+
+    /* Read the request */
+    buf = get_grant_page(mount, req->u.fwrite.gref, PROT_READ, priv_req->buf,
+                         req->u.fwrite.len);
+    if (buf == NULL)
+    {
+        priv_req->active = 0;
+        add_id_to_freelist(priv_id, mount->freelist);
+        grant_error(mount, req);
+        return;
+    }
     priv_req->page = buf;
 
     /* Dispatch AIO write request */
@@ -259,7 +301,7 @@ void end_file_write(struct mount *mount, struct fs_request *priv_req)
     int ret;
 
     /* Release the grant */
-    assert(xc_gnttab_munmap(mount->gnth, priv_req->page, 1) == 0);
+    put_grant_page(mount, priv_req->req_shadow.u.fwrite.gref, priv_req->page, 0, 1);
     
     /* Get a response from the ring */
     rsp_idx = mount->ring.rsp_prod_pvt++;
@@ -282,12 +324,17 @@ void dispatch_stat(struct mount *mount, struct fsif_request *req)
     RING_IDX rsp_idx;
     fsif_response_t *rsp;
     char *file_name = NULL;
+    grant_ref_t gref;
 
     /* Read the request */
-    buf = xc_gnttab_map_grant_ref(mount->gnth,
-                                  mount->dom_id,
-                                  req->u.fstat.gref,
-                                  PROT_READ | PROT_WRITE);
+    gref = req->u.fstat.gref;
+    buf = get_grant_page(mount, gref, PROT_READ | PROT_WRITE, mount->sync_buf,
+                         req->type == REQ_FSTAT ? 0 : PAGE_SIZE);
+    if (buf == NULL)
+    {
+        grant_error(mount, req);
+        return;
+    }
    
     type = req->type;
     req_id = req->id;
@@ -326,7 +373,8 @@ void dispatch_stat(struct mount *mount, struct fsif_request *req)
     }
 
     /* Release the grant */
-    assert(xc_gnttab_munmap(mount->gnth, buf, 1) == 0);
+    if (put_grant_page(mount, gref, buf, ret >= 0 ? sizeof(struct fsif_stat) : 0, 0) < 0)
+        ret = -EFAULT;
     
     /* Get a response from the ring */
     rsp_idx = mount->ring.rsp_prod_pvt++;
@@ -375,10 +423,13 @@ void dispatch_remove(struct mount *mount, struct fsif_request *req)
 
     if (trace_level >= TRACE_OPS_NOISY) printf("Dispatching remove operation (gref=%d).\n", req->u.fremove.gref);
     /* Read the request, and open file */
-    file_name = xc_gnttab_map_grant_ref(mount->gnth,
-                                        mount->dom_id,
-                                        req->u.fremove.gref,
-                                        PROT_READ);
+    file_name = get_grant_page(mount, req->u.fremove.gref, PROT_READ,
+                               mount->sync_buf, PAGE_SIZE);
+    if (file_name == NULL)
+    {
+        grant_error(mount, req);
+        return;
+    }
    
     req_id = req->id;
     if (trace_level >= TRACE_OPS) printf("File remove issued for %s\n", file_name); 
@@ -389,7 +440,7 @@ void dispatch_remove(struct mount *mount, struct fsif_request *req)
     }
     /* We can advance the request consumer index, from here on, the request
      * should not be used (it may be overrinden by a response) */
-    assert(xc_gnttab_munmap(mount->gnth, file_name, 1) == 0);
+    put_grant_page(mount, req->u.fremove.gref, file_name, 0, 0);
     mount->ring.req_cons++;
 
 
@@ -412,10 +463,13 @@ void dispatch_rename(struct mount *mount, struct fsif_request *req)
 
     if (trace_level >= TRACE_OPS_NOISY) printf("Dispatching rename operation (gref=%d).\n", req->u.fremove.gref);
     /* Read the request, and open file */
-    buf = xc_gnttab_map_grant_ref(mount->gnth,
-                                  mount->dom_id,
-                                  req->u.frename.gref,
-                                  PROT_READ);
+    buf = get_grant_page(mount, req->u.frename.gref, PROT_READ,
+                         mount->sync_buf, PAGE_SIZE);
+    if (buf == NULL)
+    {
+        grant_error(mount, req);
+        return;
+    }
    
     req_id = req->id;
     old_file_name = buf + req->u.frename.old_name_offset;
@@ -430,7 +484,7 @@ void dispatch_rename(struct mount *mount, struct fsif_request *req)
     }
     /* We can advance the request consumer index, from here on, the request
      * should not be used (it may be overrinden by a response) */
-    assert(xc_gnttab_munmap(mount->gnth, buf, 1) == 0);
+    put_grant_page(mount, req->u.frename.gref, buf, 0, 0);
     mount->ring.req_cons++;
 
 
@@ -449,6 +503,7 @@ void dispatch_create(struct mount *mount, struct fsif_request *req)
     int ret = -1;
     int8_t directory;
     int32_t mode;
+    grant_ref_t gref;
     RING_IDX rsp_idx;
     fsif_response_t *rsp;
     uint16_t req_id;
@@ -457,10 +512,13 @@ void dispatch_create(struct mount *mount, struct fsif_request *req)
     /* Read the request, and create file/directory */
     mode = req->u.fcreate.mode;
     directory = req->u.fcreate.directory;
-    file_name = xc_gnttab_map_grant_ref(mount->gnth,
-                                        mount->dom_id,
-                                        req->u.fcreate.gref,
-                                        PROT_READ);
+    gref = req->u.fcreate.gref;
+    file_name = get_grant_page(mount, gref, PROT_READ, mount->sync_buf, PAGE_SIZE);
+    if (file_name == NULL)
+    {
+        grant_error(mount, req);
+        return;
+    }
    
     req_id = req->id;
     if (trace_level >= TRACE_OPS) printf("File create issued for %s\n", file_name); 
@@ -489,7 +547,7 @@ void dispatch_create(struct mount *mount, struct fsif_request *req)
         }
         if (trace_level >= TRACE_OPS_NOISY) printf("Got ret %d (errno=%d)\n", ret, errno);
     }
-    assert(xc_gnttab_munmap(mount->gnth, file_name, 1) == 0);
+    put_grant_page(mount, gref, file_name, 0, 0);
 
     /* Get a response from the ring */
     rsp_idx = mount->ring.rsp_prod_pvt++;
@@ -509,14 +567,19 @@ void dispatch_list(struct mount *mount, struct fsif_request *req)
     uint16_t req_id;
     DIR *dir;
     struct dirent *dirent = NULL;
+    grant_ref_t gref;
 
     if (trace_level >= TRACE_OPS_NOISY) printf("Dispatching list operation (gref=%d).\n", req->u.flist.gref);
     /* Read the request, and list directory */
     offset = req->u.flist.offset;
-    buf = file_name = xc_gnttab_map_grant_ref(mount->gnth,
-                                        mount->dom_id,
-                                        req->u.flist.gref,
-                                        PROT_READ | PROT_WRITE);
+    gref = req->u.flist.gref;
+    buf = file_name = get_grant_page(mount, gref, PROT_READ | PROT_WRITE,
+                                     mount->sync_buf, PAGE_SIZE);
+    if (buf == NULL)
+    {
+        grant_error(mount, req);
+        return;
+    }
    
     req_id = req->id;
     if (trace_level >= TRACE_OPS) printf("Dir list issued for %s, offset %d\n", file_name, offset); 
@@ -557,7 +620,9 @@ error_out:
                   ((error_code << ERROR_SHIFT) & ERROR_MASK) | 
                   (dirent != NULL ? HAS_MORE_FLAG : 0);
     }
-    assert(xc_gnttab_munmap(mount->gnth, file_name, 1) == 0);
+    /* the names were written over the path, from the start of the page */
+    if (put_grant_page(mount, gref, file_name, buf - file_name, 0) < 0)
+        ret_val = ((uint64_t)EFAULT << ERROR_SHIFT) & ERROR_MASK;
     
     /* Get a response from the ring */
     rsp_idx = mount->ring.rsp_prod_pvt++;
@@ -606,10 +671,13 @@ void dispatch_fs_space(struct mount *mount, struct fsif_request *req)
 
     if (trace_level >= TRACE_OPS_NOISY) printf("Dispatching fs space operation (gref=%d).\n", req->u.fspace.gref);
     /* Read the request, and open file */
-    file_name = xc_gnttab_map_grant_ref(mount->gnth,
-                                        mount->dom_id,
-                                        req->u.fspace.gref,
-                                        PROT_READ);
+    file_name = get_grant_page(mount, req->u.fspace.gref, PROT_READ,
+                               mount->sync_buf, PAGE_SIZE);
+    if (file_name == NULL)
+    {
+        grant_error(mount, req);
+        return;
+    }
    
     req_id = req->id;
     if (trace_level >= TRACE_OPS) printf("Fs space issued for %s\n", file_name); 
@@ -620,7 +688,7 @@ void dispatch_fs_space(struct mount *mount, struct fsif_request *req)
             ret = stat.f_bsize * stat.f_bfree;
     }
 
-    assert(xc_gnttab_munmap(mount->gnth, file_name, 1) == 0);
+    put_grant_page(mount, req->u.fspace.gref, file_name, 0, 0);
     /* We can advance the request consumer index, from here on, the request
      * should not be used (it may be overrinden by a response) */
     mount->ring.req_cons++;
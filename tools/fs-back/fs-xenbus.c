@@ -144,7 +144,7 @@ int xenbus_get_watch_fd(void)
 
 void xenbus_read_mount_request(struct mount *mount)
 {
-    char *frontend, node[1024];
+    char *frontend, *value, node[1024];
 
     sprintf(node, WATCH_NODE"/%d/%d/frontend", 
                            mount->dom_id, mount->export->export_id);
@@ -157,6 +157,11 @@ void xenbus_read_mount_request(struct mount *mount)
     mount->gref = atoi(xs_read(xsh, XBT_NULL, node, NULL));
     sprintf(node, "%s/event-channel", frontend);
     mount->remote_evtchn = atoi(xs_read(xsh, XBT_NULL, node, NULL));
+    /* optional; the mode is settled by fs_gcopy_init */
+    sprintf(node, "%s/feature-grant-copy", frontend);
+    value = xs_read(xsh, XBT_NULL, node, NULL);
+    mount->grant_copy = value != NULL && atoi(value) != 0;
+    free(value);
 }
 
 /* Small utility function to figure out our domain id */
@@ -197,6 +202,8 @@ void xenbus_write_backend_ready(struct mount *mount)
 
     assert(xsh != NULL);
     self_id = get_self_id();
+    sprintf(node, ROOT_NODE"/%d/grant-copy", mount->mount_id);
+    xs_write(xsh, XBT_NULL, node, mount->grant_copy ? "1" : "0", 1);
     sprintf(node, ROOT_NODE"/%d/state", mount->mount_id);
     printf("backend ready: set %s to %s\n", node, STATE_READY);
     xs_write(xsh, XBT_NULL, node, STATE_READY, strlen(STATE_READY));
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Formatting rate of lib/printf.c, run on plain Linux.
+ *
+ * lib/printf.c is built against the stand-in headers in shim/, with its
+ * entry points renamed guk_*.  Its output is first compared with glibc's
+ * for random values over the conversions the kernel uses, then calls per
+ * second are measured for both, and for vsnprintf_vals as used when a
+ * tlog record is flushed.  The last rate is for a copy of the argument
+ * handling of guk_tlog only; the real one also reads the clock, the CPU
+ * and the thread and claims the record with an atomic add, so it is
+ * slower.
+ *
+ * Usage: printf-bench [million calls]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+
+int guk_snprintf(char *buf, size_t size, const char *fmt, ...);
+int vsnprintf_vals(char *buf, size_t size, const char *fmt,
+                   const unsigned long *vals, int nvals);
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long rand_long(void)
+{
+    long v = ((long)rand() << 33) ^ ((long)rand() << 2) ^ rand();
+    /* a spread of magnitudes */
+    return v >> (rand() % 64);
+}
+
+static void compare(const char *fmt, const char *a, const char *b)
+{
+    if (strcmp(a, b) != 0) {
+        printf("FAILED: %s: guk \"%s\" glibc \"%s\"\n", fmt, a, b);
+        exit(1);
+    }
+}
+
+#define CHECK(_f, _a...) do { \
+    guk_snprintf(g, sizeof(g), _f, ## _a); \
+    snprintf(l, sizeof(l), _f, ## _a); \
+    compare(_f, g, l); \
+} while (0)
+
+static void check(void)
+{
+    char g[128], l[128];
+    int i;
+
+    for (i = 0; i < 200000; i++) {
+        long v = rand_long();
+        int w = rand() % 24;
+        CHECK("%d", (int)v);
+        CHECK("%u", (unsigned int)v);
+        CHECK("%ld", v);
+        CHECK("%lu", (unsigned long)v);
+        CHECK("%lx", (unsigned long)v);
+        CHECK("%lX", (unsigned long)v);
+        CHECK("%lo", (unsigned long)v);
+        if (v != 0)     /* the kernel prints 0x0 for 0 */
+            CHECK("%#lx", (unsigned long)v);
+        CHECK("%*ld|%-*d|%0*lx", w, v, w, (int)v, w, (unsigned long)v);
+        CHECK("%.*d %+d % d", w + 1, (int)v, (int)v, (int)v);
+        CHECK("%hd %hu", (short)v, (unsigned short)v);
+        CHECK("%lld", (long long)v);
+        CHECK("[%10s][%-10s][%.3s]", "abc", "abcdefghijklm", "abcdef");
+        CHECK("%c%c%%", 'x', 'y');
+    }
+    /* truncation */
+    for (i = 0; i < 40; i++) {
+        char a[40], b[40];
+        memset(a, 'z', sizeof(a));
+        memset(b, 'z', sizeof(b));
+        guk_snprintf(a, i, "%s %ld %s", "hello", 1234567890L, "world");
+        snprintf(b, i, "%s %ld %s", "hello", 1234567890L, "world");
+        if (memcmp(a, b, sizeof(a)) != 0) {
+            printf("FAILED: truncation to %d\n", i);
+            exit(1);
+        }
+    }
+    printf("output matches glibc\n");
+}
+
+/* copy of what guk_tlog does with the arguments when the trace is buffered */
+struct record {
+    const void *site;
+    unsigned long args[8];
+    char strings[96];
+};
+
+static void __attribute__((noinline)) record(struct record *r, const void *site,
+                                             int nargs, const unsigned long *args,
+                                             int str_mask)
+{
+    char *strings = r->strings;
+    int i, left = sizeof(r->strings);
+
+    for (i = 0; i < nargs; i++) {
+        r->args[i] = args[i];
+        if ((str_mask & (1 << i)) && left <= 1) {
+            r->args[i] = (unsigned long)"<trunc>";
+        } else if (str_mask & (1 << i)) {
+            int len = strnlen((char *)args[i], left - 1);
+            memcpy(strings, (char *)args[i], len);
+            strings[len] = 0;
+            r->args[i] = (unsigned long)strings;
+            strings += len + 1;
+            left -= len + 1;
+        }
+    }
+    __asm__ __volatile__("" : : "r" (r) : "memory");
+    r->site = site;
+}
+
+#define TTFMT "%ld %d %d FS %s %d\n"
+#define PATH  "/maxine/classes/java/lang/Object.class"
+
+static void bench(long calls)
+{
+    int (*volatile libc_snprintf)(char *, size_t, const char *, ...) = snprintf;
+    char buf[256];
+    static struct record r;
+    double start, t;
+    long i;
+    unsigned long args[5];
+
+#define RATE(_name, _stmt) do { \
+    start = now(); \
+    for (i = 0; i < calls; i++) \
+        _stmt; \
+    t = now() - start; \
+    printf("%-36s %8.1f M calls/s\n", _name, calls / t / 1e6); \
+} while (0)
+
+    RATE("guk   snprintf %d", guk_snprintf(buf, sizeof(buf), "%d", (int)i));
+    RATE("glibc snprintf %d", libc_snprintf(buf, sizeof(buf), "%d", (int)i));
+    RATE("guk   snprintf %lx", guk_snprintf(buf, sizeof(buf), "%lx", i * 0x9e3779b97f4a7c15UL));
+    RATE("glibc snprintf %lx", libc_snprintf(buf, sizeof(buf), "%lx", i * 0x9e3779b97f4a7c15UL));
+    RATE("guk   snprintf %s (fs-front path)", guk_snprintf(buf, sizeof(buf), "%s", PATH));
+    RATE("glibc snprintf %s (fs-front path)", libc_snprintf(buf, sizeof(buf), "%s", PATH));
+    RATE("guk   snprintf ttprintk line", guk_snprintf(buf, sizeof(buf), TTFMT, 1234567890123L + i, 3, 42, PATH, (int)i));
+    RATE("glibc snprintf ttprintk line", libc_snprintf(buf, sizeof(buf), TTFMT, 1234567890123L + i, 3, 42, PATH, (int)i));
+    args[0] = 1234567890123L; args[1] = 3; args[2] = 42; args[3] = (unsigned long)PATH; args[4] = 7;
+    RATE("guk   vsnprintf_vals ttprintk line", vsnprintf_vals(buf, sizeof(buf), TTFMT, args, 5));
+    RATE("tlog argument copy ttprintk line", record(&r, TTFMT, 5, args, 1 << 3));
+}
+
+int main(int argc, char **argv)
+{
+    long millions = argc > 1 ? atol(argv[1]) : 5;
+
+    check();
+    bench(millions * 1000000);
+    return 0;
+}
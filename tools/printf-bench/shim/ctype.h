@@ -0,0 +1,2 @@
+/* stand-in for the guest ctype.h */
+#include_next <ctype.h>
@@ -0,0 +1 @@
+/* stand-in for the guest header, nothing needed */
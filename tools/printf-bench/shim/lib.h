@@ -0,0 +1,11 @@
+/* stand-in for the guest lib.h, for building lib/printf.c on Linux */
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+
+#define unlikely(_x) __builtin_expect(!!(_x), 0)
+
+int vsnprintf(char *buf, size_t size, const char *fmt, va_list args);
+int vsnprintf_vals(char *buf, size_t size, const char *fmt,
+                   const unsigned long *vals, int nvals);
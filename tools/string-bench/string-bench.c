@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2009, 2011, Oracle and/or its affiliates. All rights reserved.
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This code is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This code is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * version 2 for more details (a copy is included in the LICENSE file that
+ * accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version
+ * 2 along with this work; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Please contact Oracle, 500 Oracle Parkway, Redwood Shores, CA 94065 USA
+ * or visit www.oracle.com if you need additional information or have any
+ * questions.
+ */
+/*
+ * Checks and times the string kernels of lib/string.c on plain Linux.
+ *
+ * "fuzz" compares memcpy, memset, memcmp and strlen from
+ * include/x86/arch_string.h with byte at a time references on random
+ * sizes and alignments, checks that nothing outside the destination is
+ * written and that strlen does not read into an unmapped page.
+ * "bench" times them against glibc and the byte loops they replace.
+ *
+ * Usage: string-bench fuzz [iterations] | bench [megabytes]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "x86/arch_string.h"
+
+int arch_string_erms = -1;
+
+#define MAX_SIZE    9000
+#define GUARD       64
+#define BUF_SIZE    (MAX_SIZE + 2 * GUARD + 64)
+
+/* the old lib/string.c versions, kept out of line */
+static __attribute__((noinline)) void *byte_memcpy(void *dest, const void *src, size_t n)
+{
+    char *d = dest;
+    const char *s = src;
+    while (n--)
+        *d++ = *s++;
+    return dest;
+}
+
+static __attribute__((noinline)) void *byte_memset(void *dest, int c, size_t n)
+{
+    char *d = dest;
+    while (n--)
+        *d++ = c;
+    return dest;
+}
+
+static __attribute__((noinline)) int byte_memcmp(const void *cs, const void *ct, size_t n)
+{
+    const unsigned char *a = cs, *b = ct;
+    for (; n > 0; a++, b++, n--) {
+        if (*a != *b)
+            return *a - *b;
+    }
+    return 0;
+}
+
+static __attribute__((noinline)) size_t byte_strlen(const char *s)
+{
+    const char *p = s;
+    while (*p)
+        p++;
+    return p - s;
+}
+
+static __attribute__((noinline)) void *guk_memcpy(void *d, const void *s, size_t n) { return arch_memcpy(d, s, n); }
+static __attribute__((noinline)) void *guk_memset(void *d, int c, size_t n) { return arch_memset(d, c, n); }
+static __attribute__((noinline)) int guk_memcmp(const void *a, const void *b, size_t n) { return arch_memcmp(a, b, n); }
+static __attribute__((noinline)) size_t guk_strlen(const char *s) { return arch_strlen(s); }
+
+static int sign(int x)
+{
+    return x < 0 ? -1 : x > 0;
+}
+
+static void fail(const char *what, size_t n, int off1, int off2)
+{
+    printf("FAILED: %s size %zu offsets %d %d\n", what, n, off1, off2);
+    exit(1);
+}
+
+static size_t random_size(void)
+{
+    /* mostly small, as in the kernel */
+    switch (rand() % 4) {
+    case 0:  return rand() % 17;
+    case 1:  return rand() % 129;
+    case 2:  return rand() % 2049;
+    default: return rand() % (MAX_SIZE + 1);
+    }
+}
+
+static void fuzz(long iterations)
+{
+    static unsigned char src[BUF_SIZE], dst[BUF_SIZE], ref[BUF_SIZE];
+    long page = sysconf(_SC_PAGESIZE);
+    char *pages;
+    long i;
+    size_t k;
+
+    pages = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pages == MAP_FAILED || mprotect(pages + page, page, PROT_NONE) != 0) {
+        perror("mmap");
+        exit(1);
+    }
+
+    for (i = 0; i < iterations; i++) {
+        size_t n = random_size();
+        int so = rand() % 64, doff = rand() % 64, c = rand() & 0xff;
+
+        for (k = 0; k < BUF_SIZE; k++) {
+            src[k] = rand();
+            dst[k] = ref[k] = rand();
+        }
+
+        guk_memcpy(dst + GUARD + doff, src + so, n);
+        byte_memcpy(ref + GUARD + doff, src + so, n);
+        if (memcmp(dst, ref, BUF_SIZE) != 0)
+            fail("memcpy", n, so, doff);
+
+        guk_memset(dst + GUARD + doff, c, n);
+        byte_memset(ref + GUARD + doff, c, n);
+        if (memcmp(dst, ref, BUF_SIZE) != 0)
+            fail("memset", n, c, doff);
+
+        /* equal, then differing at a random place */
+        byte_memcpy(dst + doff, src + so, n);
+        if (guk_memcmp(dst + doff, src + so, n) != 0)
+            fail("memcmp equal", n, so, doff);
+        if (n > 0) {
+            k = rand() % n;
+            dst[doff + k] = rand();
+            if (sign(guk_memcmp(dst + doff, src + so, n)) !=
+                sign(byte_memcmp(dst + doff, src + so, n)))
+                fail("memcmp", n, so, doff);
+        }
+
+        /* strings ending at the end of a mapped page */
+        k = rand() % page;
+        memset(pages, 'x', page);
+        pages[page - 1] = '\0';
+        if (guk_strlen(pages + k) != page - 1 - k)
+            fail("strlen at page end", page - 1 - k, k, 0);
+        k = rand() % (page - 1);
+        pages[k] = '\0';
+        so = rand() % (k + 1);
+        if (guk_strlen(pages + so) != byte_strlen(pages + so))
+            fail("strlen", k - so, so, 0);
+    }
+    printf("fuzz: %ld iterations passed (erms %d)\n", iterations, arch_string_erms);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* keep the compiler from calling glibc directly or dropping the calls */
+static void *(*volatile libc_memcpy)(void *, const void *, size_t) = memcpy;
+static void *(*volatile libc_memset)(void *, int, size_t) = memset;
+static int (*volatile libc_memcmp)(const void *, const void *, size_t) = memcmp;
+static size_t (*volatile libc_strlen)(const char *) = strlen;
+
+struct impl {
+    const char *name;
+    void *(*memcpy)(void *, const void *, size_t);
+    void *(*memset)(void *, int, size_t);
+    int (*memcmp)(const void *, const void *, size_t);
+    size_t (*strlen)(const char *);
+};
+
+static void bench(long megabytes)
+{
+    static const size_t sizes[] = { 8, 32, 80, 256, 1024, 4096, 65536 };
+    struct impl impls[] = {
+        { "byte",  byte_memcpy, byte_memset, byte_memcmp, byte_strlen },
+        { "guk",   guk_memcpy,  guk_memset,  guk_memcmp,  guk_strlen },
+        { "glibc", libc_memcpy, libc_memset, libc_memcmp, libc_strlen },
+    };
+    char *a = aligned_alloc(4096, 65536 + 64), *b = aligned_alloc(4096, 65536 + 64);
+    unsigned int si, ii;
+    volatile long sink = 0;
+
+    memset(a, 'a', 65536 + 64);
+    memset(b, 'a', 65536 + 64);
+    printf("%8s %6s %12s %12s %12s %12s   (MB/s)\n", "size", "impl", "memcpy", "memset", "memcmp", "strlen");
+    for (si = 0; si < sizeof(sizes) / sizeof(sizes[0]); si++) {
+        size_t n = sizes[si];
+        long calls = megabytes * 1024 * 1024 / n, c;
+
+        a[n] = '\0';
+        for (ii = 0; ii < sizeof(impls) / sizeof(impls[0]); ii++) {
+            struct impl *im = &impls[ii];
+            double t[4], start;
+
+            start = now();
+            for (c = 0; c < calls; c++)
+                im->memcpy(b, a, n);
+            t[0] = now() - start;
+            start = now();
+            for (c = 0; c < calls; c++)
+                im->memset(b, 'a', n);
+            t[1] = now() - start;
+            start = now();
+            for (c = 0; c < calls; c++)
+                sink += im->memcmp(a, b, n);
+            t[2] = now() - start;
+            start = now();
+            for (c = 0; c < calls; c++)
+                sink += im->strlen(a);
+            t[3] = now() - start;
+            printf("%8zu %6s %12.0f %12.0f %12.0f %12.0f\n", n, im->name,
+                   megabytes / t[0], megabytes / t[1], megabytes / t[2], megabytes / t[3]);
+        }
+        a[n] = 'a';
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc >= 2 && strcmp(argv[1], "fuzz") == 0) {
+        long iterations = argc > 2 ? atol(argv[2]) : 200000;
+        /* the rep movsq/stosq path, then whatever the CPU supports */
+        arch_string_erms = 0;
+        fuzz(iterations);
+        arch_string_erms = -1;
+        fuzz(iterations);
+    } else if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+        bench(argc > 2 ? atol(argv[2]) : 256);
+    } else {
+        fprintf(stderr, "usage: %s fuzz [iterations] | bench [megabytes]\n", argv[0]);
+        return 1;
+    }
+    return 0;
+}
@@ -141,13 +141,122 @@ void guk_tprintk(const char *fmt, ...) {
   va_end(args);
 }
 
+/*
+ * tlog records, claimed round robin like the text segments above.  A
+ * record's site is cleared while it is being written and set last, so
+ * that a flush skips records that are incomplete.
+ */
+#define TLOG_RECORDS 2048
+#define TLOG_STRINGS 96
+
+struct tlog_record {
+  struct trace_site *site;
+  s_time_t time;
+  short cpu;
+  short nargs;
+  int thread;
+  unsigned long args[TLOG_MAX_ARGS];
+  char strings[TLOG_STRINGS];
+};
+
+static struct tlog_record tlog_buffer[TLOG_RECORDS];
+static unsigned long tlog_next = 0;
+
+/* Returns the mask of the %s arguments of fmt */
+static int tlog_parse(const char *fmt) {
+  int mask = 0, arg = 0;
+  while ((fmt = strchr(fmt, '%')) != NULL) {
+    fmt++;
+    if (*fmt == '%') {
+      fmt++;
+      continue;
+    }
+    while (*fmt != 0 && strchr("-+ #0123456789.*hlLqZ", *fmt) != NULL) {
+      if (*fmt == '*') arg++;
+      fmt++;
+    }
+    if (*fmt == 0) break;
+    if (*fmt == 's' && arg < TLOG_MAX_ARGS) mask |= 1 << arg;
+    arg++;
+    fmt++;
+  }
+  return mask;
+}
+
+/* Prefix of ttprintk followed by the formatted record */
+static int tlog_format(char *buf, int size, struct trace_site *site, s_time_t time,
+                       int cpu, int thread, const unsigned long *args, int nargs) {
+  int n = snprintf(buf, size, "%ld %d %d ", time, cpu, thread);
+  if (n < size)
+    n += vsnprintf_vals(buf + n, size - n, site->fmt, args, nargs);
+  return n < size ? n : size - 1;
+}
+
+void guk_tlog(struct trace_site *site, int nargs, const unsigned long *args) {
+  if (!tracing || flushing) return;
+  if (nargs > TLOG_MAX_ARGS) nargs = TLOG_MAX_ARGS;
+  if (site->str_mask < 0) site->str_mask = tlog_parse(site->fmt);
+  if (trace_buffering) {
+    unsigned long idx = __sync_fetch_and_add(&tlog_next, 1);
+    struct tlog_record *r = &tlog_buffer[idx % TLOG_RECORDS];
+    char *strings = r->strings;
+    int i, left = TLOG_STRINGS;
+
+    r->site = NULL;
+    wmb();
+    r->time = NOW();
+    r->cpu = smp_processor_id();
+    r->thread = guk_current_id();
+    r->nargs = nargs;
+    for (i = 0; i < nargs; i++) {
+      r->args[i] = args[i];
+      /* the caller's string may be gone by the time the record is
+         flushed, so never keep a pointer to it */
+      if ((site->str_mask & (1 << i)) && args[i] != 0 && left <= 1) {
+        r->args[i] = (unsigned long)"<trunc>";
+      } else if ((site->str_mask & (1 << i)) && args[i] != 0) {
+        int len = strnlen((char *)args[i], left - 1);
+        memcpy(strings, (char *)args[i], len);
+        strings[len] = 0;
+        r->args[i] = (unsigned long)strings;
+        strings += len + 1;
+        left -= len + 1;
+      }
+    }
+    wmb();
+    r->site = site;
+  } else {
+    char line[256];
+    tlog_format(line, sizeof(line), site, NOW(), smp_processor_id(), guk_current_id(),
+                args, nargs);
+    tprintk("%s", line);
+  }
+}
+
+static void flush_tlog(void) {
+  unsigned long idx = tlog_next > TLOG_RECORDS ? tlog_next - TLOG_RECORDS : 0;
+  char line[256];
+  for (; idx < tlog_next; idx++) {
+    struct tlog_record *r = &tlog_buffer[idx % TLOG_RECORDS];
+    int len;
+    if (r->site == NULL) continue;
+    len = tlog_format(line, sizeof(line), r->site, r->time, r->cpu, r->thread,
+                      r->args, r->nargs);
+    if (trace_destination == TRACE_RING_CONSOLE) {
+      printbytes_direct(line, len);
+    } else {
+      (void)HYPERVISOR_console_io(CONSOLEIO_write, len, line);
+    }
+  }
+}
+
 void flush_trace_buffer(void) {
   char *p = &trace_buffer[0];
   flushing = 1;
   while (p < trace_buffer_ptr) {
     int len = *p;
     if (trace_destination == TRACE_RING_CONSOLE) {
-      printbytes(p + 1, len);
+      printbytes_direct(p + 1, len);
     } else {
       (void)HYPERVISOR_console_io(CONSOLEIO_write, len, p + 1);
     }
@@ -155,11 +264,15 @@ void flush_trace_buffer(void) {
   }
 }
 
+/* The dump can be far larger than the asynchronous console buffers, so
+   it is written directly, after what was logged before it. */
 void flush_trace(void) {
   if (trace_buffering) {
-    tprintk("Trace: wrap count %d, truncate count %d, buffer used %d\n", wrap_count,
-	    truncate_count, trace_buffer_ptr - &trace_buffer[0]);
+    flush_console();
+    tprintk("Trace: wrap count %d, truncate count %d, buffer used %d, tlog records %lu\n",
+	    wrap_count, truncate_count, trace_buffer_ptr - &trace_buffer[0], tlog_next);
     flush_trace_buffer();
+    flush_tlog();
   }
 }
 
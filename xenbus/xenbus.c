@@ -82,29 +82,247 @@ static struct thread *xenbus_thread;
 
 struct xenbus_req_info
 {
+    int id;
     int in_use;
+    int next_free;
     struct wait_queue_head waitq;
     void *reply;
 };
 
+/*
+ * The request table starts with NR_REQS entries and doubles whenever
+ * they are all in use, up to XENBUS_MAX_REQS.  Entries are allocated
+ * individually and never move, only the table of pointers is replaced,
+ * under xb_lock so that xenbus_thread_func always sees a valid table.
+ */
 #define NR_REQS 32
-static struct xenbus_req_info req_info[NR_REQS];
+#define XENBUS_MAX_REQS 1024
+static struct xenbus_req_info **req_info;
+static int nr_reqs;
+static int req_free = -1;           /* first free id, chained by next_free */
+
+/*
+ * Replies are copied off the ring into buffers that callers give back
+ * with put_reply.  Buffers for replies of up to XENBUS_REPLY_SMALL bytes
+ * are recycled, as nearly all replies are that small.
+ */
+#define XENBUS_REPLY_SMALL 256
+#define XENBUS_REPLY_POOL_MAX 64    /* spare buffers kept */
+
+struct xenbus_reply
+{
+    struct xenbus_reply *next;
+    int pooled;
+    struct xsd_sockmsg msg;         /* followed by the payload */
+};
+
+#define reply_of(_msg) \
+    ((struct xenbus_reply *)((char *)(_msg) - (unsigned long)&((struct xenbus_reply *)0)->msg))
+
+static struct xenbus_reply *reply_pool;
+static int reply_pool_size;
+static DEFINE_SPINLOCK(reply_pool_lock);
+
+static struct xsd_sockmsg *get_reply(int len)
+{
+    struct xenbus_reply *reply = NULL;
+    unsigned long flags;
+
+    if (len > XENBUS_REPLY_SMALL) {
+        reply = malloc(sizeof(struct xenbus_reply) + len);
+        reply->pooled = 0;
+        return &reply->msg;
+    }
+    spin_lock_irqsave(&reply_pool_lock, flags);
+    if (reply_pool != NULL) {
+        reply = reply_pool;
+        reply_pool = reply->next;
+        reply_pool_size--;
+    }
+    spin_unlock_irqrestore(&reply_pool_lock, flags);
+    if (reply == NULL) {
+        reply = malloc(sizeof(struct xenbus_reply) + XENBUS_REPLY_SMALL);
+        reply->pooled = 1;
+    }
+    return &reply->msg;
+}
+
+static void put_reply(struct xsd_sockmsg *msg)
+{
+    struct xenbus_reply *reply = reply_of(msg);
+    unsigned long flags;
+
+    if (reply->pooled) {
+        spin_lock_irqsave(&reply_pool_lock, flags);
+        if (reply_pool_size < XENBUS_REPLY_POOL_MAX) {
+            reply->next = reply_pool;
+            reply_pool = reply;
+            reply_pool_size++;
+            reply = NULL;
+        }
+        spin_unlock_irqrestore(&reply_pool_lock, flags);
+    }
+    if (reply != NULL)
+        free(reply);
+}
+
+/*
+ * Optional read cache, enabled with -XX:GUKXSC.  Reads outside a
+ * transaction of paths below a subtree registered with
+ * xenbus_cache_subtree are answered from the cache, including ENOENT.
+ * Entries are invalidated by a watch on each subtree and by any other
+ * watch event for a path, by our own writes and removes, and flushed on
+ * transaction commit and resume.  A read that misses and races with an
+ * invalidation does not fill the cache (xscache_gen).
+ */
+#define XSCACHE_OPTION      "-XX:GUKXSC"
+#define XSCACHE_TOKEN       "xscache:"
+#define XSCACHE_BUCKETS     64
+#define XSCACHE_MAX_ENTRIES 512
+
+struct xscache_entry
+{
+    struct xscache_entry *next;
+    unsigned int hash;
+    int len;                        /* -1 for ENOENT */
+    char *value;
+    char path[0];
+};
+
+struct xscache_subtree
+{
+    struct list_head list;
+    char *token;
+    char path[0];
+};
+
+static int xscache_enabled;
+static struct xscache_entry *xscache[XSCACHE_BUCKETS];
+static int xscache_entries;
+static unsigned long xscache_gen;
+static LIST_HEAD(xscache_subtrees);
+static DEFINE_SPINLOCK(xscache_lock);
+static struct xenbus_cache_stats xscache_stats;
+
+static unsigned int xscache_hash(const char *path)
+{
+    unsigned int h = 5381;
+    while (*path)
+        h = h * 33 + *path++;
+    return h;
+}
+
+/* path is parent or equal to sub-path child */
+static int path_covers(const char *parent, const char *child)
+{
+    int len = strlen(parent);
+    return strncmp(parent, child, len) == 0 &&
+        (child[len] == '\0' || child[len] == '/');
+}
+
+static void xscache_free_entry(struct xscache_entry *e)
+{
+    if (e->value)
+        free(e->value);
+    free(e);
+}
+
+/* Drops the entries for path and everything below it.  Called with
+   xscache_lock held. */
+static void __xscache_invalidate(const char *path)
+{
+    struct xscache_entry **pe, *e;
+    int i;
+
+    xscache_gen++;
+    xscache_stats.invalidations++;
+    for (i = 0; i < XSCACHE_BUCKETS; i++) {
+        pe = &xscache[i];
+        while ((e = *pe) != NULL) {
+            if (path_covers(path, e->path)) {
+                *pe = e->next;
+                xscache_entries--;
+                xscache_free_entry(e);
+            } else {
+                pe = &e->next;
+            }
+        }
+    }
+}
+
+static void xscache_invalidate(const char *path)
+{
+    if (!xscache_enabled)
+        return;
+    spin_lock(&xscache_lock);
+    __xscache_invalidate(path);
+    spin_unlock(&xscache_lock);
+}
+
+static void xscache_flush(void)
+{
+    if (!xscache_enabled)
+        return;
+    spin_lock(&xscache_lock);
+    __xscache_invalidate("");
+    xscache_stats.flushes++;
+    spin_unlock(&xscache_lock);
+}
+
+static int xscache_covered(const char *path)
+{
+    struct xscache_subtree *sub;
+    int covered = 0;
+
+    spin_lock(&xscache_lock);
+    list_for_each_entry(sub, &xscache_subtrees, list) {
+        if (path_covers(sub->path, path)) {
+            covered = 1;
+            break;
+        }
+    }
+    spin_unlock(&xscache_lock);
+    return covered;
+}
 
 static LIST_HEAD(watch_list);
 static DEFINE_SPINLOCK(watch_list_lock);
 
+/*
+ * Watch events are queued on their watch in the buffer they were copied
+ * into off the ring (a pooled reply buffer, chained by its next field),
+ * and handed to the reader as a pointer to the path inside it.  An event
+ * for a path that is already queued is dropped, as the reader has yet to
+ * look at that path anyway.  Once XENBUS_WATCH_MAX_EVENTS distinct paths
+ * are queued on a watch, xenbus_thread_func holds further events for it
+ * back, in arrival order, and offers them again as the reader catches up.
+ * It goes on taking replies off the ring meanwhile, which the reader may
+ * be waiting for.  A reader that does not catch up within
+ * XENBUS_WATCH_STALL is assumed to be gone and the queue of its watch is
+ * allowed to grow until it is emptied.
+ */
+#define XENBUS_WATCH_MAX_EVENTS 128
+#define XENBUS_WATCH_STALL      SECONDS(1)
+
 struct xenbus_watch
 {
     char *token;
     char *path;
-#define MAX_PATHS   10
-    int path_prod_idx;
-    int path_cons_idx;
-    char *paths[MAX_PATHS];
+    struct xenbus_reply *events;    /* oldest first */
+    struct xenbus_reply **events_tail;
+    int nr_events;
+    s_time_t full_since;            /* queue reached the limit, else 0 */
+    int unbounded;                  /* reader did not keep up */
     struct thread *thread;
     struct list_head list;
 };
 
+static unsigned long watch_drained;     /* bumped when a full queue shrinks */
+static unsigned long watch_coalesced;
+/* events held back for full queues, oldest first; xenbus thread only */
+static struct xenbus_reply *held_events;
+static struct xenbus_reply **held_tail = &held_events;
+
 static struct xenbus_watch* find_watch(char *token)
 {
     struct list_head *list_element;
@@ -120,6 +338,102 @@ static struct xenbus_watch* find_watch(char *token)
     return NULL;
 }
 
+#define event_path(_msg) ((char *)((_msg) + 1))
+
+/* Queues event on watch, called with watch_list_lock held.  Returns 0 if
+   the event was queued or dropped as a duplicate, in which case it has
+   been consumed, or -1 if the queue is full. */
+static int queue_watch_event(struct xenbus_watch *watch, struct xsd_sockmsg *event)
+{
+    struct xenbus_reply *ev;
+    char *path = event_path(event);
+
+    for (ev = watch->events; ev != NULL; ev = ev->next) {
+        if (strcmp(event_path(&ev->msg), path) == 0) {
+            watch_coalesced++;
+            put_reply(event);
+            return 0;
+        }
+    }
+    if (watch->nr_events >= XENBUS_WATCH_MAX_EVENTS && !watch->unbounded) {
+        if (watch->full_since == 0)
+            watch->full_since = NOW();
+        if (NOW() - watch->full_since < XENBUS_WATCH_STALL)
+            return -1;
+        printk("xenbus: watch %s is not being read, queueing without limit\n",
+               watch->token);
+        watch->unbounded = 1;
+    }
+    ev = reply_of(event);
+    ev->next = NULL;
+    *watch->events_tail = ev;
+    watch->events_tail = &ev->next;
+    watch->nr_events++;
+    if (watch->thread)
+        wake(watch->thread);
+    return 0;
+}
+
+/* Takes the oldest event off watch, called with watch_list_lock held. */
+static char *dequeue_watch_event(struct xenbus_watch *watch)
+{
+    struct xenbus_reply *ev = watch->events;
+
+    if (ev == NULL)
+        return NULL;
+    watch->events = ev->next;
+    if (watch->events == NULL) {
+        watch->events_tail = &watch->events;
+        watch->unbounded = 0;
+    }
+    if (watch->nr_events-- == XENBUS_WATCH_MAX_EVENTS) {
+        watch->full_since = 0;
+        watch_drained++;
+        wake_up(&xb_waitq);
+    }
+    return event_path(&ev->msg);
+}
+
+static void hold_watch_event(struct xsd_sockmsg *event)
+{
+    struct xenbus_reply *ev = reply_of(event);
+
+    ev->next = NULL;
+    *held_tail = ev;
+    held_tail = &ev->next;
+}
+
+/* Offers the held events to their watches again, oldest first, called
+   with watch_list_lock held.  The lock keeps the queues from draining
+   during the pass, so an event never overtakes an older one for the same
+   watch. */
+static void requeue_held_events(void)
+{
+    struct xenbus_reply *ev = held_events, *next;
+    struct xenbus_watch *watch;
+    char *path;
+
+    held_events = NULL;
+    held_tail = &held_events;
+    for (; ev != NULL; ev = next) {
+        next = ev->next;
+        path = event_path(&ev->msg);
+        watch = find_watch(path + strlen(path) + 1);
+        if (watch == NULL)
+            put_reply(&ev->msg);        /* unregistered meanwhile */
+        else if (queue_watch_event(watch, &ev->msg) < 0)
+            hold_watch_event(&ev->msg);
+    }
+}
+
+static void free_watch_events(struct xenbus_watch *watch)
+{
+    char *path;
+
+    while ((path = dequeue_watch_event(watch)) != NULL)
+        xenbus_put_watch_event(path);
+}
+
 static void memcpy_from_ring(const void *Ring,
         void *Dest,
         int off,
@@ -140,15 +454,22 @@ static void xenbus_thread_func(void *ign)
 {
     struct xsd_sockmsg msg;
     unsigned prod = 0;
+    unsigned long drained = 0;
 
     for (;;)
     {
-        wait_event(xb_waitq, (prod != xenstore_buf->rsp_prod) || suspend);
+        if (held_events == NULL)
+            wait_event(xb_waitq, (prod != xenstore_buf->rsp_prod) || suspend);
+        else
+            /* also look again when a reader made room, or to give up on it */
+            wait_event_timeout(xb_waitq, (prod != xenstore_buf->rsp_prod) || suspend ||
+                               watch_drained != drained, XENBUS_WATCH_STALL);
 	if(suspend) {
 	    complete_all(&suspend_comp);
 	    wait_for_completion(&resume_comp);
 	    BUG_ON(suspend);
 	}
+	drained = watch_drained;
 	while (1) {
 	    long flags;
 	    spin_lock_irqsave(&xb_lock, flags);
@@ -177,50 +498,61 @@ static void xenbus_thread_func(void *ign)
 	    DEBUG("Message is good.\n");
 
 	    if(msg.type == XS_WATCH_EVENT) {
-		char* payload = (char*)malloc(sizeof(msg) + msg.len);
+		struct xsd_sockmsg *event = get_reply(msg.len);
 		char *path,*token;
 		struct xenbus_watch *watch;
 
 		memcpy_from_ring(xenstore_buf->rsp,
-			payload,
+			event,
 			MASK_XENSTORE_IDX(xenstore_buf->rsp_cons),
 			msg.len + sizeof(msg));
+		xenstore_buf->rsp_cons += msg.len + sizeof(msg);
 
-		path = payload + sizeof(msg);
+		path = event_path(event);
 		token = path + strlen(path) + 1;
 		DEBUG("watch event %s %s\n", path, token);
+		/* whoever is told about the change must not read a stale value */
+		xscache_invalidate(path);
 		spin_lock(&watch_list_lock);
-		watch = find_watch(token);
-		if(watch == NULL)
-		{
-		    printk("Spurious watch event for token: %s\n", token);
-		    goto free_watch_msg;
-		}
-		/* Check if we haven't run out of space on our circural buf */
-		BUG_ON(watch->path_prod_idx - watch->path_cons_idx > MAX_PATHS);
-		watch->paths[watch->path_prod_idx++ % MAX_PATHS] = strdup(path);
-		if(watch->thread) {
-		    wake(watch->thread);
+		if (strncmp(token, XSCACHE_TOKEN, sizeof(XSCACHE_TOKEN) - 1) == 0) {
+		    put_reply(event);
+		} else if (held_events != NULL) {
+		    /* behind the ones already held */
+		    hold_watch_event(event);
+		} else {
+		    watch = find_watch(token);
+		    if(watch == NULL) {
+			printk("Spurious watch event for token: %s\n", token);
+			put_reply(event);
+		    } else if (queue_watch_event(watch, event) < 0) {
+			if (trace_xenbus()) tprintk("xenbus: watch queue %s full\n", token);
+			hold_watch_event(event);
+		    }
 		}
-
-free_watch_msg:
-		spin_unlock(&watch_list_lock); 
-		xenstore_buf->rsp_cons += msg.len + sizeof(msg);
-		free(payload);
+		spin_unlock(&watch_list_lock);
 	    } else {
-		DEBUG("NO watch event, msg id %d in use %d\n", msg.req_id, req_info[msg.req_id].in_use);
-		BUG_ON(!req_info[msg.req_id].in_use);
-		req_info[msg.req_id].reply = malloc(sizeof(msg) + msg.len);
+		struct xenbus_req_info *info;
+
+		BUG_ON(msg.req_id >= nr_reqs);
+		info = req_info[msg.req_id];
+		DEBUG("NO watch event, msg id %d in use %d\n", msg.req_id, info->in_use);
+		BUG_ON(!info->in_use);
+		info->reply = get_reply(msg.len);
 		memcpy_from_ring(xenstore_buf->rsp,
-			req_info[msg.req_id].reply,
+			info->reply,
 			MASK_XENSTORE_IDX(xenstore_buf->rsp_cons),
 			msg.len + sizeof(msg));
 		xenstore_buf->rsp_cons += msg.len + sizeof(msg);
 
-		wake_up(&req_info[msg.req_id].waitq);
+		wake_up(&info->waitq);
 	    }
 	    spin_unlock_irqrestore(&xb_lock, flags);
 	}
+	if (held_events != NULL) {
+	    spin_lock(&watch_list_lock);
+	    requeue_held_events();
+	    spin_unlock(&watch_list_lock);
+	}
     }
 }
 
@@ -230,52 +562,97 @@ static void xenbus_evtchn_handler(evtchn_port_t port, void *ign)
 }
 
 static int nr_live_reqs;
-static spinlock_t req_lock = SPIN_LOCK_UNLOCKED;
+static DEFINE_SPINLOCK(req_lock);
 static DECLARE_WAIT_QUEUE_HEAD(req_wq);
 
 /* Release a xenbus identifier */
-static void release_xenbus_id(int id)
+static void release_xenbus_id(struct xenbus_req_info *info)
 {
-    BUG_ON(!req_info[id].in_use);
+    int was_full;
+
+    BUG_ON(!info->in_use);
     spin_lock(&req_lock);
+    was_full = req_free < 0;
     nr_live_reqs--;
-    req_info[id].in_use = 0;
-    if (nr_live_reqs == NR_REQS - 1 || nr_live_reqs == 0)
+    info->in_use = 0;
+    info->next_free = req_free;
+    req_free = info->id;
+    if (was_full || nr_live_reqs == 0)
         wake_up(&req_wq);
     spin_unlock(&req_lock);
 }
 
-/* Allocate an identifier for a xenbus request.  Blocks if none are
-   available. */
-static int allocate_xenbus_id(void)
+/* Doubles the request table, unless someone else already did. */
+static void grow_req_table(int old_nr)
+{
+    struct xenbus_req_info **table, **old_table;
+    struct xenbus_req_info *entries;
+    int new_nr = old_nr ? old_nr * 2 : NR_REQS;
+    unsigned long flags;
+    int i;
+
+    table = malloc(new_nr * sizeof(struct xenbus_req_info *));
+    entries = malloc((new_nr - old_nr) * sizeof(struct xenbus_req_info));
+    BUG_ON(table == NULL || entries == NULL);
+
+    spin_lock(&req_lock);
+    if (nr_reqs != old_nr) {
+        spin_unlock(&req_lock);
+        free(table);
+        free(entries);
+        return;
+    }
+    if (old_nr)
+        memcpy(table, req_info, old_nr * sizeof(struct xenbus_req_info *));
+    for (i = new_nr - 1; i >= old_nr; i--) {
+        struct xenbus_req_info *info = &entries[i - old_nr];
+        info->id = i;
+        info->in_use = 0;
+        info->reply = NULL;
+        init_waitqueue_head(&info->waitq);
+        info->next_free = req_free;
+        req_free = i;
+        table[i] = info;
+    }
+    spin_lock_irqsave(&xb_lock, flags);
+    old_table = req_info;
+    req_info = table;
+    nr_reqs = new_nr;
+    spin_unlock_irqrestore(&xb_lock, flags);
+    spin_unlock(&req_lock);
+    if (old_table)
+        free(old_table);
+    if (trace_xenbus()) tprintk("xenbus request table grown to %d\n", new_nr);
+}
+
+/* Allocate an identifier for a xenbus request, growing the table if all
+   are in use.  Blocks only if the table is at its maximum size. */
+static struct xenbus_req_info *allocate_xenbus_id(void)
 {
-    static int probe;
-    int o_probe;
+    struct xenbus_req_info *info;
+    int nr;
 
     while (1) 
     {
         spin_lock(&req_lock);
-        if (nr_live_reqs < NR_REQS)
+        if (req_free >= 0)
             break;
+        nr = nr_reqs;
         spin_unlock(&req_lock);
-        wait_event(req_wq, (nr_live_reqs < NR_REQS) && !suspend);
+        if (nr < XENBUS_MAX_REQS)
+            grow_req_table(nr);
+        else
+            wait_event(req_wq, (req_free >= 0) && !suspend);
     }
 
-    o_probe = probe;
-    for (;;) 
-    {
-        if (!req_info[o_probe].in_use)
-            break;
-        o_probe = (o_probe + 1) % NR_REQS;
-        BUG_ON(o_probe == probe);
-    }
+    info = req_info[req_free];
+    req_free = info->next_free;
     nr_live_reqs++;
-    req_info[o_probe].in_use = 1;
-    probe = (o_probe + 1) % NR_REQS;
+    info->in_use = 1;
     spin_unlock(&req_lock);
-    init_waitqueue_head(&req_info[o_probe].waitq);
+    init_waitqueue_head(&info->waitq);
 
-    return o_probe;
+    return info;
 }
 
 char* xenbus_printf(xenbus_transaction_t xbt,
@@ -399,30 +776,30 @@ static void xb_write(int type, int req_id, xenbus_transaction_t trans_id,
 }
 
 /* Send a mesasge to xenbus, in the same fashion as xb_write, and
-   block waiting for a reply.  The reply is malloced and should be
-   freed by the caller. */
+   block waiting for a reply.  The reply must be given back by the
+   caller with put_reply. */
 static struct xsd_sockmsg *
 xenbus_msg_reply(int type,
 		 xenbus_transaction_t trans,
 		 struct write_req *io,
-		 int nr_reqs)
+		 int nr_io)
 {
-    int id;
+    struct xenbus_req_info *info;
     DEFINE_WAIT(w);
     struct xsd_sockmsg *rep;
-    id = allocate_xenbus_id();
+    info = allocate_xenbus_id();
 
     preempt_disable();
-    add_waiter(w, req_info[id].waitq);
+    add_waiter(w, info->waitq);
 
-    xb_write(type, id, trans, io, nr_reqs);
+    xb_write(type, info->id, trans, io, nr_io);
 
     preempt_enable();
     schedule();
 
-    rep = req_info[id].reply;
-    BUG_ON(rep->req_id != id);
-    release_xenbus_id(id);
+    rep = info->reply;
+    BUG_ON(rep->req_id != info->id);
+    release_xenbus_id(info);
 
     return rep;
 }
@@ -438,7 +815,7 @@ static char *errmsg(struct xsd_sockmsg *rep)
     char *res = malloc(rep->len + 1);
     memcpy(res, rep + 1, rep->len);
     res[rep->len] = 0;
-    free(rep);
+    put_reply(rep);
     return res;
 }
 
@@ -455,6 +832,7 @@ static void xenbus_debug_msg(const char *msg)
     reply = xenbus_msg_reply(XS_DEBUG, 0, req, ARRAY_SIZE(req));
     DEBUG("Got a reply, type %d, id %d, len %d.\n",
             reply->type, reply->req_id, reply->len);
+    put_reply(reply);
 }
 
 /* List the contents of a directory.  Returns a malloc()ed array of
@@ -484,30 +862,235 @@ char *xenbus_ls(xenbus_transaction_t xbt, const char *pre, char ***contents)
         x += l + 1;
     }
     res[i] = NULL;
-    free(repmsg);
+    put_reply(repmsg);
     *contents = res;
     return NULL;
 }
 
-char *guk_xenbus_read(xenbus_transaction_t xbt, const char *path, char **value)
+char *xenbus_ls_buf(xenbus_transaction_t xbt, const char *pre, char *buf, int len,
+                    char **contents, int *n)
+{
+    struct xsd_sockmsg *repmsg;
+    struct write_req req[] = { { pre, strlen(pre)+1 } };
+    int x, i;
+    char *names;
+
+    repmsg = xenbus_msg_reply(XS_DIRECTORY, xbt, req, ARRAY_SIZE(req));
+    char *msg = errmsg(repmsg);
+    if (msg) {
+	contents[0] = NULL;
+	*n = 0;
+	return msg;
+    }
+    names = (char *)(repmsg + 1);
+    if (repmsg->len > len) {
+	put_reply(repmsg);
+	contents[0] = NULL;
+	*n = 0;
+	return strdup("E2BIG");
+    }
+    memcpy(buf, names, repmsg->len);
+    for (x = i = 0; x < repmsg->len; i++) {
+	if (i + 1 >= *n) {
+	    put_reply(repmsg);
+	    contents[0] = NULL;
+	    *n = 0;
+	    return strdup("E2BIG");
+	}
+	contents[i] = buf + x;
+	x += strlen(buf + x) + 1;
+    }
+    contents[i] = NULL;
+    *n = i;
+    put_reply(repmsg);
+    return NULL;
+}
+
+/* Looks path up in the cache.  On a hit, returns 1 and sets *err for a
+   cached ENOENT, or copies the value to buf (len bytes), or if buf is
+   NULL to a malloc'd *value. */
+static int xscache_lookup(const char *path, char **err, char *buf, int len, char **value)
+{
+    unsigned int hash = xscache_hash(path);
+    struct xscache_entry *e;
+
+    spin_lock(&xscache_lock);
+    for (e = xscache[hash % XSCACHE_BUCKETS]; e != NULL; e = e->next) {
+        if (e->hash == hash && strcmp(e->path, path) == 0)
+            break;
+    }
+    if (e == NULL) {
+        xscache_stats.misses++;
+        spin_unlock(&xscache_lock);
+        return 0;
+    }
+    xscache_stats.hits++;
+    *err = NULL;
+    if (e->len < 0) {
+        spin_unlock(&xscache_lock);
+        *err = strdup("ENOENT");
+    } else if (buf == NULL) {
+        char *res = malloc(e->len + 1);
+        memcpy(res, e->value, e->len + 1);
+        spin_unlock(&xscache_lock);
+        *value = res;
+    } else if (e->len + 1 > len) {
+        spin_unlock(&xscache_lock);
+        *err = strdup("E2BIG");
+    } else {
+        memcpy(buf, e->value, e->len + 1);
+        spin_unlock(&xscache_lock);
+    }
+    return 1;
+}
+
+/* Caches the reply to a read of path, unless something was invalidated
+   since gen. */
+static void xscache_insert(const char *path, struct xsd_sockmsg *rep, unsigned long gen)
+{
+    unsigned int hash = xscache_hash(path);
+    struct xscache_entry *e;
+
+    if (rep->type == XS_ERROR && strcmp((char *)(rep + 1), "ENOENT") != 0)
+        return;
+    e = malloc(sizeof(struct xscache_entry) + strlen(path) + 1);
+    strcpy(e->path, path);
+    e->hash = hash;
+    e->value = NULL;
+    if (rep->type == XS_ERROR) {
+        e->len = -1;
+    } else {
+        e->len = rep->len;
+        e->value = malloc(rep->len + 1);
+        memcpy(e->value, rep + 1, rep->len);
+        e->value[rep->len] = 0;
+    }
+
+    spin_lock(&xscache_lock);
+    if (gen != xscache_gen) {
+        spin_unlock(&xscache_lock);
+        xscache_free_entry(e);
+        return;
+    }
+    if (xscache_entries >= XSCACHE_MAX_ENTRIES) {
+        __xscache_invalidate("");
+        xscache_stats.flushes++;
+    }
+    e->next = xscache[hash % XSCACHE_BUCKETS];
+    xscache[hash % XSCACHE_BUCKETS] = e;
+    xscache_entries++;
+    spin_unlock(&xscache_lock);
+}
+
+/* Common to the read functions: the value goes to buf, or if buf is NULL
+   to a malloc'd *value. */
+static char *do_read(xenbus_transaction_t xbt, const char *path, char *buf, int len,
+                     char **value, int use_cache)
 {
     struct write_req req[] = { {path, strlen(path) + 1} };
     struct xsd_sockmsg *rep;
+    unsigned long gen = 0;
     char *res;
+
+    use_cache = use_cache && xscache_enabled && xbt == XBT_NIL && xscache_covered(path);
+    if (use_cache) {
+        char *err;
+        if (xscache_lookup(path, &err, buf, len, value))
+            return err;
+        gen = xscache_gen;
+    }
     rep = xenbus_msg_reply(XS_READ, xbt, req, ARRAY_SIZE(req));
+    if (use_cache)
+        xscache_insert(path, rep, gen);
     char *msg = errmsg(rep);
     if (msg) {
-	*value = NULL;
+	if (buf == NULL)
+	    *value = NULL;
 	return msg;
     }
-    res = malloc(rep->len + 1);
-    memcpy(res, rep + 1, rep->len);
-    res[rep->len] = 0;
-    free(rep);
-    *value = res;
+    if (buf == NULL) {
+	res = malloc(rep->len + 1);
+	memcpy(res, rep + 1, rep->len);
+	res[rep->len] = 0;
+	*value = res;
+    } else if (rep->len + 1 > len) {
+	put_reply(rep);
+	return strdup("E2BIG");
+    } else {
+	memcpy(buf, rep + 1, rep->len);
+	buf[rep->len] = 0;
+    }
+    put_reply(rep);
+    return NULL;
+}
+
+char *guk_xenbus_read(xenbus_transaction_t xbt, const char *path, char **value)
+{
+    return do_read(xbt, path, NULL, 0, value, 1);
+}
+
+char *xenbus_read_buf(xenbus_transaction_t xbt, const char *path, char *buf, int len)
+{
+    return do_read(xbt, path, buf, len, NULL, 1);
+}
+
+char *xenbus_read_uncached(xenbus_transaction_t xbt, const char *path, char **value)
+{
+    return do_read(xbt, path, NULL, 0, value, 0);
+}
+
+char *xenbus_cache_subtree(const char *path)
+{
+    struct xscache_subtree *sub;
+    struct xsd_sockmsg *rep;
+    char *msg;
+
+    if (!xscache_enabled)
+        return NULL;
+    if (xscache_covered(path))
+        return NULL;
+    sub = malloc(sizeof(struct xscache_subtree) + strlen(path) + 1);
+    strcpy(sub->path, path);
+    sub->token = malloc(sizeof(XSCACHE_TOKEN) + strlen(path));
+    sprintf(sub->token, "%s%s", XSCACHE_TOKEN, path);
+    {
+        struct write_req req[] = {
+            {sub->path,  strlen(sub->path)  + 1},
+            {sub->token, strlen(sub->token) + 1},
+        };
+        rep = xenbus_msg_reply(XS_WATCH, XBT_NIL, req, ARRAY_SIZE(req));
+    }
+    msg = errmsg(rep);
+    if (msg) {
+        free(sub->token);
+        free(sub);
+        return msg;
+    }
+    put_reply(rep);
+    spin_lock(&xscache_lock);
+    list_add(&sub->list, &xscache_subtrees);
+    spin_unlock(&xscache_lock);
+    if (trace_xenbus()) tprintk("xenstore cache: caching %s\n", path);
     return NULL;
 }
 
+void xenbus_cache_get_stats(struct xenbus_cache_stats *stats)
+{
+    spin_lock(&xscache_lock);
+    *stats = xscache_stats;
+    spin_unlock(&xscache_lock);
+}
+
+void xenbus_cache_report(char *when)
+{
+    struct xenbus_cache_stats stats;
+    if (!xscache_enabled || !trace_xenbus())
+        return;
+    xenbus_cache_get_stats(&stats);
+    tprintk("xenstore cache %s: %lu round trips saved, %lu misses, %lu invalidations\n",
+            when, stats.hits, stats.misses, stats.invalidations);
+}
+
 char *xenbus_write(xenbus_transaction_t xbt, const char *path, const char *value)
 {
     struct write_req req[] = { 
@@ -516,9 +1099,10 @@ char *xenbus_write(xenbus_transaction_t xbt, const char *path, const char *value
     };
     struct xsd_sockmsg *rep;
     rep = xenbus_msg_reply(XS_WRITE, xbt, req, ARRAY_SIZE(req));
+    xscache_invalidate(path);
     char *msg = errmsg(rep);
     if (msg) return msg;
-    free(rep);
+    put_reply(rep);
     return NULL;
 }
 
@@ -541,19 +1125,25 @@ char* xenbus_watch_path(xenbus_transaction_t xbt,
     watch->path = path;
     watch->token = token;
     watch->thread = NULL;
-    watch->path_prod_idx = 0;
-    watch->path_cons_idx = 0;
+    watch->events = NULL;
+    watch->events_tail = &watch->events;
+    watch->nr_events = 0;
+    watch->full_since = 0;
+    watch->unbounded = 0;
     INIT_LIST_HEAD(&watch->list);
     list_add(&watch->list, &watch_list);
     spin_unlock(&watch_list_lock);
 
     rep = xenbus_msg_reply(XS_WATCH, xbt, req, ARRAY_SIZE(req));
     msg = errmsg(rep);
-    if(msg != NULL)
+    if(msg == NULL)
+    {
+        /* errmsg only gives back error replies */
+        put_reply(rep);
+    }
+    else
     {
         spin_lock(&watch_list_lock);
-        /* If msg is NULL we need to free rep, as errmsg didn't do it */
-        free(rep);
         watch = find_watch(token);
         BUG_ON(watch == NULL);
         list_del(&watch->list);
@@ -580,8 +1170,13 @@ int xenbus_rm_watch(char *token)
 	spin_unlock(&watch_list_lock);
 
 	rep = xenbus_msg_reply(XS_UNWATCH, XBT_NIL, req, ARRAY_SIZE(req));
+	put_reply(rep);
 	spin_lock(&watch_list_lock);
 	list_del(&watch->list);
+	/* also lets xenbus_thread_func drop the events it holds for it */
+	free_watch_events(watch);
+	watch_drained++;
+	wake_up(&xb_waitq);
 	free(watch);
     }
     spin_unlock(&watch_list_lock);
@@ -589,32 +1184,66 @@ int xenbus_rm_watch(char *token)
     return 1;
 }
 
-char *xenbus_read_watch(char *token)
+char *xenbus_get_watch_event(char *token, s_time_t timeout)
 {
     struct xenbus_watch *watch;
-    char *path;
+    char *path = NULL;
+    int armed = 0;
+    DEFINE_SLEEP_QUEUE(sq);
 
     spin_lock(&watch_list_lock);
     watch = find_watch(token);
-again:
-    if (trace_xenbus()) tprintk("xenbus_read_watch: again %s %d %d\n", current->name, watch->path_cons_idx, watch->path_prod_idx);
-    if(watch->path_cons_idx < watch->path_prod_idx)
-    /* There are some paths to consume, no need to block */
-    {
-        path = watch->paths[watch->path_cons_idx++ % MAX_PATHS];
-        watch->thread = NULL;
+    for (;;) {
+        path = dequeue_watch_event(watch);
+        if (path != NULL)
+            break;
+        if (trace_xenbus()) tprintk("xenbus_get_watch_event: blocking %s %s\n", current->name, token);
+        watch->thread = current;
+        block(current);
+        /* arm and check the timer only after blocking, otherwise the
+         * timer wake up could be lost */
+        if (timeout < 0) {
+            /* no timer */
+        } else if (!armed) {
+            sq.wakeup_time = NOW() + timeout;
+            guk_sleep_queue_add(&sq);
+            armed = 1;
+        } else if (is_expired(&sq)) {
+            wake(current);
+            break;
+        }
         spin_unlock(&watch_list_lock);
-        return path;
+        schedule();
+        spin_lock(&watch_list_lock);
     }
-
-    if (trace_xenbus()) tprintk("xenbus_read_watch: blocking %s %d %d\n", current->name, watch->path_cons_idx, watch->path_prod_idx);
-    /* Othewise block current */
-    watch->thread = current;
-    block(current);
+    watch->thread = NULL;
     spin_unlock(&watch_list_lock);
-    schedule();
-    spin_lock(&watch_list_lock);
-    goto again;
+    if (armed)
+        guk_sleep_queue_del(&sq);
+
+    return path;
+}
+
+void xenbus_put_watch_event(char *path)
+{
+    put_reply((struct xsd_sockmsg *)path - 1);
+}
+
+char *xenbus_read_watch(char *token)
+{
+    return xenbus_read_watch_timeout(token, -1);
+}
+
+char *xenbus_read_watch_timeout(char *token, s_time_t timeout)
+{
+    char *event, *path;
+
+    event = xenbus_get_watch_event(token, timeout);
+    if (event == NULL)
+        return NULL;
+    path = strdup(event);
+    xenbus_put_watch_event(event);
+    return path;
 }
 
 char* xenbus_wait_for_value(char* token, char *path, char* value)
@@ -622,27 +1251,21 @@ char* xenbus_wait_for_value(char* token, char *path, char* value)
     for(;;)
     {
         char *changed_path, *msg, *res;
+        int changed;
 
-        changed_path = xenbus_read_watch(token);
-        if(strcmp(changed_path, path) == 0)
+        changed_path = xenbus_get_watch_event(token, -1);
+        changed = strcmp(changed_path, path) == 0;
+        xenbus_put_watch_event(changed_path);
+        if(changed)
         {
-            free(changed_path);
             msg = xenbus_read(XBT_NIL, path, &res);
             if(msg) return msg;
-            if(strcmp(value, res) == 0)
-            {
-                free(res);
+            changed = strcmp(value, res) == 0;
+            free(res);
+            if(changed)
                 return NULL;
-            }
-            else
-                free(res);
         }
-        else
-            free(changed_path);
     }
-    /* We should never get here */
-    BUG();
-    return NULL;
 }
 
 
@@ -651,10 +1274,11 @@ char *xenbus_rm(xenbus_transaction_t xbt, const char *path)
     struct write_req req[] = { {path, strlen(path) + 1} };
     struct xsd_sockmsg *rep;
     rep = xenbus_msg_reply(XS_RM, xbt, req, ARRAY_SIZE(req));
+    xscache_invalidate(path);
     char *msg = errmsg(rep);
     if (msg)
 	return msg;
-    free(rep);
+    put_reply(rep);
     return NULL;
 }
 
@@ -672,7 +1296,7 @@ char *xenbus_get_perms(xenbus_transaction_t xbt, const char *path, char **value)
     res = malloc(rep->len + 1);
     memcpy(res, rep + 1, rep->len);
     res[rep->len] = 0;
-    free(rep);
+    put_reply(rep);
     *value = res;
     return NULL;
 }
@@ -691,7 +1315,7 @@ char *xenbus_set_perms(xenbus_transaction_t xbt, const char *path, domid_t dom,
     char *msg = errmsg(rep);
     if (msg)
 	return msg;
-    free(rep);
+    put_reply(rep);
     return NULL;
 }
 
@@ -708,7 +1332,7 @@ char *xenbus_transaction_start(xenbus_transaction_t *xbt)
     if (err)
 	return err;
     sscanf((char *)(rep + 1), "%u", xbt);
-    free(rep);
+    put_reply(rep);
     return NULL;
 }
 
@@ -724,6 +1348,9 @@ xenbus_transaction_end(xenbus_transaction_t t, int abort, int *retry)
     req.data = abort ? "F" : "T";
     req.len = 2;
     rep = xenbus_msg_reply(XS_TRANSACTION_END, t, &req, 1);
+    /* the watch events for the committed writes arrive later */
+    if (!abort)
+	xscache_flush();
     err = errmsg(rep);
     if (err) {
 	if (!strcmp(err, "EAGAIN")) {
@@ -734,23 +1361,22 @@ xenbus_transaction_end(xenbus_transaction_t t, int abort, int *retry)
 	    return err;
 	}
     }
-    free(rep);
+    put_reply(rep);
     return NULL;
 }
 
 int xenbus_read_integer(char *path)
 {
-    char *res, *buf;
+    char *res, buf[32];
     int t;
 
-    res = xenbus_read(XBT_NIL, path, &buf);
+    res = xenbus_read_buf(XBT_NIL, path, buf, sizeof(buf));
     if (res) {
 	DEBUG("%s %d ERROR reading xenbus: %s\n", __FILE__, __LINE__, res);
 	free(res);
 	return -1;
     }
     sscanf(buf, "%d", &t);
-    free(buf);
     return t;
 }
 
@@ -840,12 +1466,14 @@ void test_xenbus(void)
 }
 
 /* Initialise xenbus. */
-void init_xenbus(void)
+void init_xenbus(char *cmd_line)
 {
     int err;
     if (trace_xenbus()) tprintk("Initialising xenbus\n");
     DEBUG("init_xenbus called.\n");
 
+    xscache_enabled = strstr(cmd_line, XSCACHE_OPTION) != NULL;
+
     suspend = 0;
     xenstore_buf = map_xenstore_page(start_info.store_mfn);
     xenbus_thread = create_thread("xenstore", xenbus_thread_func, UKERNEL_FLAG, NULL);
@@ -859,6 +1487,7 @@ void init_xenbus(void)
 
 void xenbus_suspend(void)
 {
+    xenbus_cache_report("before suspend");
     suspend = 1;
     /* check for live requests */
     spin_lock(&req_lock);
@@ -867,17 +1496,17 @@ void xenbus_suspend(void)
 #if 0
 	int i;
 	struct list_head *tmp;
-	for (i = 0; i < NR_REQS; ++i) {
-	    if(req_info[i].in_use) {
-		spin_lock(&req_info[i].waitq.lock);
-		list_for_each(tmp, &req_info[i].waitq.thread_list) {
+	for (i = 0; i < nr_reqs; ++i) {
+	    if(req_info[i]->in_use) {
+		spin_lock(&req_info[i]->waitq.lock);
+		list_for_each(tmp, &req_info[i]->waitq.thread_list) {
 		    struct wait_queue *curr;
 
 		    curr = list_entry(tmp, struct wait_queue, thread_list);
 		    xprintk("%d thread %d %s waiting\n", i, curr->thread->id, curr->thread->name);
 
 		}
-		spin_unlock(&req_info[i].waitq.lock);
+		spin_unlock(&req_info[i]->waitq.lock);
 	    }
 	}
 #endif
@@ -926,14 +1555,41 @@ void xenbus_resume(void)
 
 	msg = errmsg(rep);
 	if (msg != NULL) {
-	    free(rep);
 	    xprintk("error on XS_WATCH: %s\n", msg);
+	    free(msg);
+	} else {
+	    put_reply(rep);
 	}
 
 	spin_lock(&watch_list_lock);
     }
     spin_unlock(&watch_list_lock);
 
+    /* the store may have changed while we were away */
+    if (xscache_enabled) {
+        struct xscache_subtree *sub;
+
+        xscache_flush();
+        spin_lock(&xscache_lock);
+        list_for_each_entry(sub, &xscache_subtrees, list) {
+            req[0].data = sub->path; req[0].len = strlen(sub->path) + 1;
+            req[1].data = sub->token; req[1].len = strlen(sub->token) + 1;
+            /* subtrees are only ever added, so the entry stays valid */
+            spin_unlock(&xscache_lock);
+            rep = xenbus_msg_reply(XS_WATCH, XBT_NIL, req, ARRAY_SIZE(req));
+            msg = errmsg(rep);
+            if (msg != NULL) {
+                xprintk("error on XS_WATCH: %s\n", msg);
+                free(msg);
+            } else {
+                put_reply(rep);
+            }
+            spin_lock(&xscache_lock);
+        }
+        spin_unlock(&xscache_lock);
+        xenbus_cache_report("after resume");
+    }
+
     notify_remote_via_evtchn(start_info.store_evtchn);
 
     wake_up(&req_wq);
@@ -941,11 +1597,11 @@ void xenbus_resume(void)
 
 domid_t xenbus_get_self_id(void)
 {
-    char *dom_id;
+    char dom_id[16];
     domid_t ret;
 
-    BUG_ON(xenbus_read(XBT_NIL, "domid", &dom_id));
-    sscanf(dom_id, "%d", &ret);
+    BUG_ON(xenbus_read_buf(XBT_NIL, "domid", dom_id, sizeof(dom_id)));
+    sscanf(dom_id, "%hu", &ret);
 
     return ret;
 }